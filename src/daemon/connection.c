@@ -28,6 +28,7 @@
 #include "internal.h"
 #include <limits.h>
 #include "connection.h"
+#include "connection_http2.h"
 #include "memorypool.h"
 #include "response.h"
 #include "reason_phrase.h"
@@ -37,6 +38,11 @@
 #include <netinet/tcp.h>
 #endif
 
+#if HAVE_ZEROCOPY
+/* for MSG_ZEROCOPY completions */
+#include <linux/errqueue.h>
+#endif
+
 /**
  * Message to transmit when http 1.1 request is received
  */
@@ -226,6 +232,133 @@ MHD_lookup_connection_value (struct MHD_Connection *connection,
 }
 
 
+/**
+ * Check if an 'If-None-Match' header lists an entity tag matching
+ * the given entity tag, using the weak comparison function of
+ * RFC 2616, section 13.3.3.
+ *
+ * @param list value of the 'If-None-Match' header
+ * @param etag entity tag of the response, may be NULL
+ * @return MHD_YES if the list matches
+ */
+static int
+etag_list_matches (const char *list,
+		   const char *etag)
+{
+  const char *pos;
+  const char *end;
+  size_t len;
+
+  if ( (etag != NULL) &&
+       (0 == strncmp (etag, "W/", 2)) )
+    etag += 2;
+  len = (etag != NULL) ? strlen (etag) : 0;
+  pos = list;
+  while (1)
+    {
+      while ((*pos == ' ') || (*pos == '\t') || (*pos == ','))
+	pos++;
+      if (*pos == '\0')
+	return MHD_NO;
+      if (*pos == '*')
+	return MHD_YES;
+      if (0 == strncmp (pos, "W/", 2))
+	pos += 2;
+      if (*pos != '"')
+	return MHD_NO;          /* malformed */
+      end = strchr (&pos[1], '"');
+      if (end == NULL)
+	return MHD_NO;          /* malformed */
+      if ( (len == (size_t) (end - pos + 1)) &&
+	   (0 == strncmp (pos, etag, len)) )
+	return MHD_YES;
+      pos = &end[1];
+    }
+}
+
+
+/**
+ * Check if the conditional headers of the request allow us to
+ * answer with "304 Not Modified" instead of the given response.
+ *
+ * @param connection the connection identifying the client
+ * @param response response the application queued
+ * @return the "304 Not Modified" response to send (the caller
+ *         must destroy it), NULL to send 'response'
+ */
+static struct MHD_Response *
+check_not_modified (struct MHD_Connection *connection,
+		    struct MHD_Response *response)
+{
+  const char *inm;
+  const char *ims;
+  const char *etag;
+  time_t last_modified;
+  time_t since;
+
+  inm = MHD_lookup_connection_value (connection,
+				     MHD_HEADER_KIND,
+				     MHD_HTTP_HEADER_IF_NONE_MATCH);
+  ims = MHD_lookup_connection_value (connection,
+				     MHD_HEADER_KIND,
+				     MHD_HTTP_HEADER_IF_MODIFIED_SINCE);
+  if ( (inm == NULL) &&
+       (ims == NULL) )
+    return NULL;
+  MHD_response_get_validators (response, &etag, &last_modified);
+  if (inm != NULL)
+    {
+      /* 'If-Modified-Since' is ignored if 'If-None-Match' is present */
+      if (MHD_YES != etag_list_matches (inm, etag))
+	return NULL;
+    }
+  else
+    {
+      if ( (last_modified == (time_t) -1) ||
+	   (MHD_YES != MHD_parse_http_date (ims, &since)) ||
+	   (last_modified > since) )
+	return NULL;
+    }
+  return MHD_response_get_not_modified (response);
+}
+
+
+/**
+ * Check if the 'If-Range' precondition of the request (if any)
+ * allows us to answer a 'Range' request with parts of the response.
+ *
+ * @param connection the connection identifying the client
+ * @param response response the application queued
+ * @return MHD_YES if ranges may be served, MHD_NO if the
+ *         full response must be sent
+ */
+static int
+check_if_range (struct MHD_Connection *connection,
+		struct MHD_Response *response)
+{
+  const char *cond;
+  const char *have;
+
+  cond = MHD_lookup_connection_value (connection,
+				      MHD_HEADER_KIND,
+				      MHD_HTTP_HEADER_IF_RANGE);
+  if (cond == NULL)
+    return MHD_YES;
+  if ( (cond[0] == '"') ||
+       (0 == strncmp (cond, "W/", 2)) )
+    {
+      /* entity tag; only strong validators may be used here */
+      have = MHD_get_response_header (response, MHD_HTTP_HEADER_ETAG);
+      return ( (have != NULL) &&
+	       (cond[0] == '"') &&
+	       (0 == strcmp (have, cond)) ) ? MHD_YES : MHD_NO;
+    }
+  have = MHD_get_response_header (response, MHD_HTTP_HEADER_LAST_MODIFIED);
+  return ( (have != NULL) &&
+	   (0 == strcmp (have, cond)) ) ? MHD_YES : MHD_NO;
+}
+
+
 /**
  * Queue a response to be transmitted to the client (as soon as
  * possible but after MHD_AccessHandlerCallback returns).
@@ -240,13 +373,45 @@ int
 MHD_queue_response (struct MHD_Connection *connection,
                     unsigned int status_code, struct MHD_Response *response)
 {
+  struct MHD_Response *partial;
+  struct MHD_Response *not_modified;
+  const char *range;
+
   if ((connection == NULL) ||
       (response == NULL) ||
       (connection->response != NULL) ||
       ((connection->state != MHD_CONNECTION_HEADERS_PROCESSED) &&
        (connection->state != MHD_CONNECTION_FOOTERS_RECEIVED)))
     return MHD_NO;
+  partial = NULL;
+  if ( (0 != (connection->daemon->options & MHD_USE_CONDITIONAL_REQUESTS)) &&
+       (status_code == MHD_HTTP_OK) &&
+       (connection->method != NULL) &&
+       ( (0 == strcasecmp (connection->method, MHD_HTTP_METHOD_GET)) ||
+	 (0 == strcasecmp (connection->method, MHD_HTTP_METHOD_HEAD)) ) &&
+       (NULL != (not_modified = check_not_modified (connection, response))) )
+    {
+      partial = not_modified;
+      response = not_modified;
+      status_code = MHD_HTTP_NOT_MODIFIED;
+    }
+  if ( (0 != (connection->daemon->options & MHD_USE_RANGE_REQUESTS)) &&
+       (status_code == MHD_HTTP_OK) &&
+       (connection->method != NULL) &&
+       (0 == strcasecmp (connection->method, MHD_HTTP_METHOD_GET)) &&
+       (NULL != (range = MHD_lookup_connection_value (connection,
+						      MHD_HEADER_KIND,
+						      MHD_HTTP_HEADER_RANGE))) &&
+       (MHD_YES == check_if_range (connection, response)) )
+    {
+      partial = MHD_create_range_response (response, range, connection,
+					   &status_code);
+      if (partial != NULL)
+	response = partial;
+    }
   MHD_increment_response_rc (response);
+  if (partial != NULL)
+    MHD_destroy_response (partial); /* connection holds the only reference */
   connection->response = response;
   connection->responseCode = status_code;
   if ((connection->method != NULL) &&
@@ -311,6 +476,8 @@ MHD_connection_close (struct MHD_Connection *connection,
   SHUTDOWN (connection->socket_fd, 
 	    (connection->read_closed == MHD_YES) ? SHUT_WR : SHUT_RDWR);
   connection->state = MHD_CONNECTION_CLOSED;
+  if (NULL != connection->http2)
+    MHD_http2_close_streams_ (connection, termination_code);
   if ( (NULL != daemon->notify_completed) &&
        (MHD_YES == connection->client_aware) )
     daemon->notify_completed (daemon->notify_completed_cls, 
@@ -321,6 +488,55 @@ MHD_connection_close (struct MHD_Connection *connection,
 }
 
 
+#if HAVE_ZEROCOPY
+/**
+ * Process the 'MSG_ZEROCOPY' completions the kernel queued for this
+ * connection (without blocking) and release the response once the
+ * kernel no longer needs any of its data.
+ *
+ * @param connection connection to process completions for
+ */
+void
+MHD_connection_reap_zerocopy (struct MHD_Connection *connection)
+{
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct sock_extended_err *serr;
+  char control[128];
+  uint32_t done;
+
+  while (connection->zerocopy_pending > 0)
+    {
+      memset (&msg, 0, sizeof (struct msghdr));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof (control);
+      if (-1 == recvmsg (connection->socket_fd, &msg, MSG_ERRQUEUE))
+	break; /* nothing (more) completed */
+      for (cm = CMSG_FIRSTHDR (&msg); NULL != cm; cm = CMSG_NXTHDR (&msg, cm))
+	{
+	  /* we do not enable IP_RECVERR, so the error queue only
+	     holds zero-copy notifications */
+	  serr = (struct sock_extended_err *) CMSG_DATA (cm);
+	  if ( (0 != serr->ee_errno) ||
+	       (SO_EE_ORIGIN_ZEROCOPY != serr->ee_origin) )
+	    continue;
+	  /* completions cover the inclusive range [ee_info, ee_data] */
+	  done = serr->ee_data - serr->ee_info + 1;
+	  if (done > connection->zerocopy_pending)
+	    done = connection->zerocopy_pending;
+	  connection->zerocopy_pending -= done;
+	}
+    }
+  if ( (0 == connection->zerocopy_pending) &&
+       (NULL != connection->zerocopy_response) )
+    {
+      MHD_destroy_response (connection->zerocopy_response);
+      connection->zerocopy_response = NULL;
+    }
+}
+#endif
+
+
 /**
  * A serious error occured, close the
  * connection (and notify the application).
@@ -351,6 +567,23 @@ connection_close_error (struct MHD_Connection *connection,
 #endif
 
 
+/**
+ * Account for data sent to the client in the counters of the
+ * worker process (see MHD_OPTION_PROCESS_POOL_SIZE).
+ *
+ * @param connection connection the data was sent on
+ * @param ret result of the send operation
+ */
+static void
+count_bytes_sent (struct MHD_Connection *connection,
+		  ssize_t ret)
+{
+  if ( (NULL != connection->daemon->counters) &&
+       (ret > 0) )
+    connection->daemon->counters->bytes_sent += ret;
+}
+
+
 /**
  * Prepare the response buffer of this connection for
  * sending.  Assumes that the response mutex is
@@ -374,11 +607,35 @@ try_ready_normal_body (struct MHD_Connection *connection)
        (response->data_size + response->data_start >
 	connection->response_write_position) )
     return MHD_YES; /* response already ready */
+#if HAVE_SPLICE
+  if ( (response->splice_pipe[0] != -1) &&
+       (! MHD_TLS_IN_USERSPACE (connection)) )
+    {
+      /* will use splice, make sure the pipe has data for it */
+      ret = MHD_response_fill_splice_pipe (response);
+      if (ret > 0)
+	return MHD_YES;
+      if (ret == 0)
+	{
+	  /* no data yet, wait for the pipe to become readable */
+	  connection->state = MHD_CONNECTION_NORMAL_BODY_UNREADY;
+	  return MHD_NO;
+	}
+      /* either error or http 1.0 transfer, close socket! */
+      response->total_size = connection->response_write_position;
+      CONNECTION_CLOSE_ERROR (connection,
+			      (ret == MHD_CONTENT_READER_END_OF_STREAM)
+			      ? "Closing connection (end of response)\n"
+			      : "Closing connection (stream error)\n");
+      return MHD_NO;
+    }
+#endif
 #if LINUX
-  if ( (response->fd != -1) &&
-       (0 == (connection->daemon->options & MHD_USE_SSL)) )
+  if ( ( (response->fd != -1) ||
+	 (response->data_iov != NULL) ) &&
+       (! MHD_TLS_IN_USERSPACE (connection)) )
     {
-      /* will use sendfile, no need to bother response crc */
+      /* will use sendfile/writev, no need to bother response crc */
       return MHD_YES; 
     }
 #endif
@@ -390,6 +647,7 @@ try_ready_normal_body (struct MHD_Connection *connection)
                                 response->total_size -
                                 connection->response_write_position));
   if ((ret == 0) &&
+      (response->pipe_fd == -1) &&
       (0 != (connection->daemon->options & MHD_USE_SELECT_INTERNALLY)))
     mhd_panic (mhd_panic_cls, __FILE__, __LINE__, 
 #if HAVE_MESSAGES
@@ -420,6 +678,91 @@ try_ready_normal_body (struct MHD_Connection *connection)
 }
 
 
+#if HAVE_SPLICE
+/**
+ * Prepare the next chunk of a pipe response whose data is moved to
+ * the socket with 'splice': only the chunk header is placed in the
+ * write buffer, the data follows directly from the splice pipe.
+ *
+ * @param connection the connection
+ * @return MHD_NO if readying the response failed
+ */
+static int
+try_ready_spliced_chunk (struct MHD_Connection *connection)
+{
+  struct MHD_Response *response;
+  ssize_t ret;
+
+  response = connection->response;
+  ret = MHD_response_fill_splice_pipe (response);
+  if (ret == MHD_CONTENT_READER_END_WITH_ERROR)
+    {
+      /* error, close socket! */
+      response->total_size = connection->response_write_position;
+      CONNECTION_CLOSE_ERROR (connection,
+			      "Closing connection (error generating response)\n");
+      return MHD_NO;
+    }
+  if (ret == 0)
+    {
+      /* no data yet, wait for the pipe to become readable */
+      connection->state = MHD_CONNECTION_CHUNKED_BODY_UNREADY;
+      return MHD_NO;
+    }
+  connection->write_buffer_send_offset = 0;
+  if (ret == MHD_CONTENT_READER_END_OF_STREAM)
+    {
+      /* end of message, signal other side! */
+      strcpy (connection->write_buffer, "0\r\n");
+      connection->write_buffer_append_offset = 3;
+      response->total_size = connection->response_write_position;
+      return MHD_YES;
+    }
+  connection->write_buffer_append_offset =
+    SPRINTF (connection->write_buffer, "%X\r\n", (unsigned int) ret);
+  connection->splice_left = ret;
+  connection->response_write_position += ret;
+  return MHD_YES;
+}
+
+
+/**
+ * Move data of the current chunk of a pipe response from the
+ * splice pipe to the socket.  Once the chunk is complete, the
+ * write buffer is set up to terminate it.
+ *
+ * @param connection the connection
+ */
+static void
+splice_chunk (struct MHD_Connection *connection)
+{
+  ssize_t ret;
+
+  ret = MHD_response_splice_to (connection->response,
+				connection->socket_fd,
+				connection->splice_left);
+  if (ret < 0)
+    {
+      if ((errno == EINTR) || (errno == EAGAIN))
+	return;
+#if HAVE_MESSAGES
+      MHD_DLOG (connection->daemon,
+		"Failed to send data: %s\n", STRERROR (errno));
+#endif
+      CONNECTION_CLOSE_ERROR (connection, NULL);
+      return;
+    }
+  count_bytes_sent (connection, ret);
+  connection->splice_left -= ret;
+  if (connection->splice_left > 0)
+    return;
+  memcpy (connection->write_buffer, "\r\n", 2);
+  connection->write_buffer_send_offset = 0;
+  connection->write_buffer_append_offset = 2;
+}
+#endif
+
+
 /**
  * Prepare the response buffer of this connection for sending.
  * Assumes that the response mutex is already held.  If the
@@ -458,6 +801,11 @@ try_ready_chunked_body (struct MHD_Connection *connection)
       connection->write_buffer_size = size;
       connection->write_buffer = buf;
     }
+#if HAVE_SPLICE
+  if ( (response->splice_pipe[0] != -1) &&
+       (! MHD_TLS_IN_USERSPACE (connection)) )
+    return try_ready_spliced_chunk (connection);
+#endif
 
   if ( (response->data_start <=
 	connection->response_write_position) &&
@@ -552,8 +900,9 @@ add_extra_headers (struct MHD_Connection *connection)
             }
         }
     }
-  else if (NULL == MHD_get_response_header (connection->response,
-                                            MHD_HTTP_HEADER_CONTENT_LENGTH))
+  else if ( (connection->responseCode != MHD_HTTP_NOT_MODIFIED) && /* never has a body */
+	    (NULL == MHD_get_response_header (connection->response,
+					      MHD_HTTP_HEADER_CONTENT_LENGTH)) )
     {
       SPRINTF (buf,
                "%" MHD_LONG_LONG_PRINTF "u",
@@ -561,6 +910,13 @@ add_extra_headers (struct MHD_Connection *connection)
       MHD_add_response_header (connection->response,
                                MHD_HTTP_HEADER_CONTENT_LENGTH, buf);
     }
+  if ( (0 != (connection->daemon->options & MHD_USE_RANGE_REQUESTS)) &&
+       (connection->responseCode == MHD_HTTP_OK) &&
+       (MHD_YES == MHD_response_is_seekable (connection->response)) &&
+       (NULL == MHD_get_response_header (connection->response,
+					 MHD_HTTP_HEADER_ACCEPT_RANGES)) )
+    MHD_add_response_header (connection->response,
+			     MHD_HTTP_HEADER_ACCEPT_RANGES, "bytes");
 }
 
 /**
@@ -572,23 +928,10 @@ add_extra_headers (struct MHD_Connection *connection)
 static void
 get_date_string (char *date)
 {
-  static const char *days[] =
-    { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
-  static const char *mons[] =
-    { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct",
-    "Nov", "Dec"
-  };
-  struct tm now;
-  time_t t;
-
-  time (&t);
-  gmtime_r (&t, &now);
-  SPRINTF (date,
-           "Date: %3s, %02u %3s %04u %02u:%02u:%02u GMT\r\n",
-           days[now.tm_wday % 7],
-           now.tm_mday,
-           mons[now.tm_mon % 12],
-           1900 + now.tm_year, now.tm_hour, now.tm_min, now.tm_sec);
+  char now[64];
+
+  MHD_format_http_date (time (NULL), now);
+  SPRINTF (date, "Date: %s\r\n", now);
 }
 
 /**
@@ -820,6 +1163,8 @@ MHD_connection_get_fdset (struct MHD_Connection *connection,
       do_fd_set(p.fd, read_fd_set, max_fd);    
     if (0 != (p.events & MHD_POLL_ACTION_OUT)) 
       do_fd_set(p.fd, write_fd_set, max_fd);    
+    if (p.source_fd >= 0)
+      do_fd_set(p.source_fd, read_fd_set, max_fd);
   }
   return ret;
 }
@@ -836,6 +1181,7 @@ MHD_connection_get_pollfd (struct MHD_Connection *connection, struct MHD_Pollfd
 {
   int fd;
 
+  p->source_fd = -1;
   if (connection->pool == NULL)
     connection->pool = MHD_pool_create (connection->daemon->pool_size);
   if (connection->pool == NULL)
@@ -864,6 +1210,9 @@ MHD_connection_get_pollfd (struct MHD_Connection *connection, struct MHD_Pollfd
 	    p->events |= MHD_POLL_ACTION_OUT;
 	  break;
 #endif
+        case MHD_CONNECTION_HTTP2:
+          MHD_http2_get_pollfd_ (connection, p);
+          break;
         case MHD_CONNECTION_INIT:
         case MHD_CONNECTION_URL_RECEIVED:
         case MHD_CONNECTION_HEADER_PART_RECEIVED:
@@ -957,14 +1306,19 @@ MHD_connection_get_pollfd (struct MHD_Connection *connection, struct MHD_Pollfd
           p->events |= MHD_POLL_ACTION_OUT;
           break;
         case MHD_CONNECTION_NORMAL_BODY_UNREADY:
-          /* not ready, no socket action */
+        case MHD_CONNECTION_CHUNKED_BODY_UNREADY:
+          /* not ready, no socket action (unless gnutls still
+             has batched records to send); pipe responses wait
+             for their pipe */
+          p->source_fd = connection->response->pipe_fd;
+#if HTTPS_SUPPORT
+          if (MHD_YES == connection->tls_corked)
+            p->events |= MHD_POLL_ACTION_OUT;
+#endif
           break;
         case MHD_CONNECTION_CHUNKED_BODY_READY:
           p->events |= MHD_POLL_ACTION_OUT;
           break;
-        case MHD_CONNECTION_CHUNKED_BODY_UNREADY:
-          /* not ready, no socket action */
-          break;
         case MHD_CONNECTION_BODY_SENT:
           EXTRA_CHECK (0);
           break;
@@ -972,6 +1326,14 @@ MHD_connection_get_pollfd (struct MHD_Connection *connection, struct MHD_Pollfd
           p->events |= MHD_POLL_ACTION_OUT;
           break;
         case MHD_CONNECTION_FOOTERS_SENT:
+#if HTTPS_SUPPORT
+          /* waiting for the batched TLS records to go out */
+          if (MHD_YES == connection->tls_corked)
+            {
+              p->events |= MHD_POLL_ACTION_OUT;
+              break;
+            }
+#endif
           EXTRA_CHECK (0);
           break;
         case MHD_CONNECTION_CLOSED:
@@ -1130,10 +1492,11 @@ parse_arguments (enum MHD_ValueKind kind,
 /**
  * Parse the cookie header (see RFC 2109).
  *
+ * @param connection connection with the request
  * @return MHD_YES for success, MHD_NO for failure (malformed, out of memory)
  */
-static int
-parse_cookie_header (struct MHD_Connection *connection)
+int
+MHD_connection_parse_cookies_ (struct MHD_Connection *connection)
 {
   const char *hdr;
   char *cpy;
@@ -1220,6 +1583,38 @@ parse_cookie_header (struct MHD_Connection *connection)
   return MHD_YES;
 }
 
+/**
+ * Parse the URI of a request: give it to the URI logger, add the
+ * arguments to the request and set the (unescaped) URL.  Used for
+ * the request line of HTTP/1.x and the ":path" of HTTP/2 requests.
+ *
+ * @param connection the connection (updated)
+ * @param uri the URI (modified)
+ */
+void
+MHD_connection_parse_uri_ (struct MHD_Connection *connection, char *uri)
+{
+  char *args;
+
+  if (connection->daemon->uri_log_callback != NULL)
+    connection->client_context
+      =
+      connection->daemon->uri_log_callback (connection->daemon->
+                                            uri_log_callback_cls, uri);
+  args = strstr (uri, "?");
+  if (NULL != args)
+    {
+      args[0] = '\0';
+      args++;
+      parse_arguments (MHD_GET_ARGUMENT_KIND, connection, args);
+    }
+  connection->daemon->unescape_callback (connection->daemon->unescape_callback_cls,
+					 connection,
+					 uri);
+  connection->url = uri;
+}
+
+
 /**
  * Parse the first line of the HTTP HEADER.
  *
@@ -1232,7 +1627,6 @@ parse_initial_message_line (struct MHD_Connection *connection, char *line)
 {
   char *uri;
   char *httpVersion;
-  char *args;
 
   uri = strstr (line, " ");
   if (uri == NULL)
@@ -1248,22 +1642,7 @@ parse_initial_message_line (struct MHD_Connection *connection, char *line)
       httpVersion[0] = '\0';
       httpVersion++;
     }
-  if (connection->daemon->uri_log_callback != NULL)
-    connection->client_context
-      =
-      connection->daemon->uri_log_callback (connection->daemon->
-                                            uri_log_callback_cls, uri);
-  args = strstr (uri, "?");
-  if (NULL != args)
-    {
-      args[0] = '\0';
-      args++;
-      parse_arguments (MHD_GET_ARGUMENT_KIND, connection, args);
-    }
-  connection->daemon->unescape_callback (connection->daemon->unescape_callback_cls,
-					 connection,
-					 uri);
-  connection->url = uri;
+  MHD_connection_parse_uri_ (connection, uri);
   if (NULL == httpVersion)
     connection->version = "";
   else
@@ -1526,6 +1905,8 @@ do_read (struct MHD_Connection *connection)
       return MHD_YES;
     }
   connection->read_buffer_offset += bytes_read;
+  if (NULL != connection->daemon->counters)
+    connection->daemon->counters->bytes_received += bytes_read;
   return MHD_YES;
 }
 
@@ -1553,7 +1934,7 @@ do_write (struct MHD_Connection *connection)
         return MHD_NO;
 #if HAVE_MESSAGES
 #if HTTPS_SUPPORT
-      if (0 != (connection->daemon->options & MHD_USE_SSL))
+      if (MHD_TLS_IN_USERSPACE (connection))
 	MHD_DLOG (connection->daemon,
 		  "Failed to send data: %s\n",
 		  gnutls_strerror (ret));
@@ -1571,6 +1952,7 @@ do_write (struct MHD_Connection *connection)
            ret,
            &connection->write_buffer[connection->write_buffer_send_offset]);
 #endif
+  count_bytes_sent (connection, ret);
   connection->write_buffer_send_offset += ret;
   return MHD_YES;
 }
@@ -1710,7 +2092,7 @@ parse_connection_headers (struct MHD_Connection *connection)
   const char *enc;
   char *end;
 
-  parse_cookie_header (connection);
+  MHD_connection_parse_cookies_ (connection);
   if ((0 != (MHD_USE_PEDANTIC_CHECKS & connection->daemon->options))
       && (NULL != connection->version)
       && (0 == strcasecmp (MHD_HTTP_VERSION_1_1, connection->version))
@@ -1789,6 +2171,13 @@ MHD_connection_handle_read (struct MHD_Connection *connection)
   connection->last_activity = time (NULL);
   if (connection->state == MHD_CONNECTION_CLOSED)
     return MHD_YES;
+#if HAVE_ZEROCOPY
+  /* completions make the socket look readable, consume them */
+  if (connection->zerocopy_pending > 0)
+    MHD_connection_reap_zerocopy (connection);
+#endif
+  if (connection->state == MHD_CONNECTION_HTTP2)
+    return MHD_http2_handle_read_ (connection);
   /* make sure "read" has a reasonable number of bytes
      in buffer to use per system call (if possible) */
   if (connection->read_buffer_offset + MHD_BUF_INC_SIZE >
@@ -1851,6 +2240,12 @@ MHD_connection_handle_write (struct MHD_Connection *connection)
   struct MHD_Response *response;
   int ret;
   connection->last_activity = time (NULL);
+#if HAVE_ZEROCOPY
+  if (connection->zerocopy_pending > 0)
+    MHD_connection_reap_zerocopy (connection);
+#endif
+  if (connection->state == MHD_CONNECTION_HTTP2)
+    return MHD_http2_handle_write_ (connection);
   while (1)
     {
 #if DEBUG_STATES
@@ -1891,6 +2286,7 @@ MHD_connection_handle_write (struct MHD_Connection *connection)
                    &HTTP_100_CONTINUE
                    [connection->continue_message_write_offset]);
 #endif
+          count_bytes_sent (connection, ret);
           connection->continue_message_write_offset += ret;
           break;
         case MHD_CONNECTION_CONTINUE_SENT:
@@ -1946,6 +2342,7 @@ MHD_connection_handle_write (struct MHD_Connection *connection)
 	      CONNECTION_CLOSE_ERROR (connection, NULL);
               return MHD_YES;
             }
+          count_bytes_sent (connection, ret);
           connection->response_write_position += ret;
           if (connection->response_write_position ==
               connection->response->total_size)
@@ -1955,9 +2352,21 @@ MHD_connection_handle_write (struct MHD_Connection *connection)
           EXTRA_CHECK (0);
           break;
         case MHD_CONNECTION_CHUNKED_BODY_READY:
+#if HAVE_SPLICE
+	  if ( (connection->splice_left > 0) &&
+	       (connection->write_buffer_send_offset ==
+		connection->write_buffer_append_offset) )
+	    {
+	      /* chunk header is out, now the data */
+	      splice_chunk (connection);
+	      break;
+	    }
+#endif
           do_write (connection);
 	  if (connection->state !=  MHD_CONNECTION_CHUNKED_BODY_READY)
 	     break;
+	  if (connection->splice_left > 0)
+	    break;
           check_write_done (connection,
                             (connection->response->total_size ==
                              connection->response_write_position) ?
@@ -2016,9 +2425,24 @@ MHD_connection_handle_idle (struct MHD_Connection *connection)
       MHD_DLOG (connection->daemon, "%s: state: %s\n",
                 __FUNCTION__, MHD_state_to_string (connection->state));
 #endif
+      if (MHD_YES == connection->suspended)
+	return MHD_YES; /* the application suspended us, wait for resume */
       switch (connection->state)
         {
         case MHD_CONNECTION_INIT:
+          if ( (MHD_YES == connection->http2_allowed) &&
+               (MHD_YES == MHD_http2_try_start_ (connection)) )
+            {
+              if (connection->state != MHD_CONNECTION_INIT)
+                continue;
+              if (connection->read_closed)
+                {
+		  CONNECTION_CLOSE_ERROR (connection, 
+					  NULL);
+                  continue;
+                }
+              break;
+            }
           line = get_next_header_line (connection);
           if (line == NULL)
             {
@@ -2095,7 +2519,9 @@ MHD_connection_handle_idle (struct MHD_Connection *connection)
           connection->state = MHD_CONNECTION_HEADERS_PROCESSED;
           continue;
         case MHD_CONNECTION_HEADERS_PROCESSED:
-          call_connection_handler (connection); /* first call */
+          if (MHD_NO == MHD_connection_offload_ (connection,
+						 &call_connection_handler))
+            continue; /* first call, running in the handler pool */
           if (connection->state == MHD_CONNECTION_CLOSED)
             continue;
           if (need_100_continue (connection))
@@ -2122,9 +2548,15 @@ MHD_connection_handle_idle (struct MHD_Connection *connection)
             }
           break;
         case MHD_CONNECTION_CONTINUE_SENT:
-          if (connection->read_buffer_offset != 0)
+          /* the pool may have consumed the whole buffer; still
+             collect its result so it is not mistaken for the
+             final call */
+          if ( (connection->read_buffer_offset != 0) ||
+               (MHD_YES == connection->offload_done) )
             {
-              process_request_body (connection);     /* loop call */
+              if (MHD_NO == MHD_connection_offload_ (connection,
+						     &process_request_body))
+                continue; /* loop call, running in the handler pool */
               if (connection->state == MHD_CONNECTION_CLOSED)
                 continue;
             }
@@ -2193,7 +2625,9 @@ MHD_connection_handle_idle (struct MHD_Connection *connection)
             }
           continue;
         case MHD_CONNECTION_FOOTERS_RECEIVED:
-          call_connection_handler (connection); /* "final" call */
+          if (MHD_NO == MHD_connection_offload_ (connection,
+						 &call_connection_handler))
+            continue; /* "final" call, running in the handler pool */
           if (connection->state == MHD_CONNECTION_CLOSED)
             continue;
           if (connection->response == NULL)
@@ -2240,7 +2674,10 @@ MHD_connection_handle_idle (struct MHD_Connection *connection)
             }
           if (connection->response->crc != NULL)
             pthread_mutex_unlock (&connection->response->mutex);
-          /* not ready, no socket action */
+#if HTTPS_SUPPORT
+          /* not ready, send what gnutls batched so far */
+          (void) MHD_tls_connection_flush_ (connection);
+#endif
           break;
         case MHD_CONNECTION_CHUNKED_BODY_READY:
           /* nothing to do here */
@@ -2257,6 +2694,9 @@ MHD_connection_handle_idle (struct MHD_Connection *connection)
             }
           if (connection->response->crc != NULL)
             pthread_mutex_unlock (&connection->response->mutex);
+#if HTTPS_SUPPORT
+          (void) MHD_tls_connection_flush_ (connection);
+#endif
           break;
         case MHD_CONNECTION_BODY_SENT:
           build_header_response (connection);
@@ -2270,6 +2710,10 @@ MHD_connection_handle_idle (struct MHD_Connection *connection)
           /* no default action */
           break;
         case MHD_CONNECTION_FOOTERS_SENT:
+#if HTTPS_SUPPORT
+          if (MHD_NO == MHD_tls_connection_flush_ (connection))
+            break;              /* batched TLS records not yet sent */
+#endif
 #if HAVE_DECL_TCP_CORK
           /* done sending, uncork */
           {
@@ -2282,6 +2726,8 @@ MHD_connection_handle_idle (struct MHD_Connection *connection)
             MHD_get_response_header (connection->response, 
 				     MHD_HTTP_HEADER_CONNECTION);
 	  rend = ( (end != NULL) && (0 == strcasecmp (end, "close")) );
+          if (NULL != connection->daemon->counters)
+            connection->daemon->counters->requests++;
           MHD_destroy_response (connection->response);
           connection->response = NULL;
           if (connection->daemon->notify_completed != NULL)
@@ -2291,6 +2737,26 @@ MHD_connection_handle_idle (struct MHD_Connection *connection)
 						  &connection->client_context,
 						  MHD_REQUEST_TERMINATED_COMPLETED_OK);	    
 	  connection->client_aware = MHD_NO;
+	  if (0 != (connection->daemon->options & MHD_USE_SUSPEND_RESUME))
+	    {
+	      /* a resume for a request that was never suspended must
+		 not end the suspension of the next request early */
+	      if (0 != pthread_mutex_lock (&connection->daemon->cleanup_connection_mutex))
+		{
+#if HAVE_MESSAGES
+		  MHD_DLOG (connection->daemon, "Failed to acquire cleanup mutex\n");
+#endif
+		  abort ();
+		}
+	      connection->resuming = MHD_NO;
+	      if (0 != pthread_mutex_unlock (&connection->daemon->cleanup_connection_mutex))
+		{
+#if HAVE_MESSAGES
+		  MHD_DLOG (connection->daemon, "Failed to release cleanup mutex\n");
+#endif
+		  abort ();
+		}
+	    }
           end =
             MHD_lookup_connection_value (connection, MHD_HEADER_KIND,
                                          MHD_HTTP_HEADER_CONNECTION);
@@ -2335,7 +2801,14 @@ MHD_connection_handle_idle (struct MHD_Connection *connection)
                                   connection->read_buffer_size);
             }
           continue;
+        case MHD_CONNECTION_HTTP2:
+          MHD_http2_handle_idle_ (connection);
+          if (connection->state == MHD_CONNECTION_CLOSED)
+            continue;
+          break;
         case MHD_CONNECTION_CLOSED:
+          MHD_http2_session_destroy_ (connection,
+                                      MHD_REQUEST_TERMINATED_WITH_ERROR);
 	  if (connection->response != NULL)
 	    {
 	      MHD_destroy_response (connection->response);
@@ -2369,6 +2842,8 @@ MHD_connection_handle_idle (struct MHD_Connection *connection)
         }
       break;
     }
+  if (MHD_YES == connection->suspended)
+    return MHD_YES; /* suspended connections do not time out */
   timeout = connection->connection_timeout;
   if ( (timeout != 0) &&
        (timeout <= (time (NULL) - connection->last_activity)) )
@@ -2419,6 +2894,10 @@ MHD_get_connection_info (struct MHD_Connection *connection,
       if (connection->tls_session == NULL)
 	return NULL;
       return (const union MHD_ConnectionInfo *) &connection->tls_session;
+    case MHD_CONNECTION_INFO_KTLS:
+      if (connection->tls_session == NULL)
+	return NULL;
+      return (const union MHD_ConnectionInfo *) &connection->ktls;
 #endif
     case MHD_CONNECTION_INFO_CLIENT_ADDRESS:
       return (const union MHD_ConnectionInfo *) &connection->addr;
@@ -63,4 +63,26 @@ int MHD_connection_handle_idle (struct MHD_Connection *connection);
 void MHD_connection_close (struct MHD_Connection *connection,
                            enum MHD_RequestTerminationCode termination_code);
 
+/**
+ * Parse the URI of a request: log it, add its arguments to the
+ * request and set the (unescaped) URL of the connection.
+ */
+void MHD_connection_parse_uri_ (struct MHD_Connection *connection,
+                                char *uri);
+
+/**
+ * Add the cookies of the "Cookie" header to the request.
+ *
+ * @return MHD_YES for success, MHD_NO for failure (malformed, out of memory)
+ */
+int MHD_connection_parse_cookies_ (struct MHD_Connection *connection);
+
+#if HAVE_ZEROCOPY
+/**
+ * Process the 'MSG_ZEROCOPY' completions the kernel queued for this
+ * connection and release the response once all of them arrived.
+ */
+void MHD_connection_reap_zerocopy (struct MHD_Connection *connection);
+#endif
+
 #endif
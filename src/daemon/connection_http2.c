@@ -0,0 +1,3226 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     This library is free software; you can redistribute it and/or
+     modify it under the terms of the GNU Lesser General Public
+     License as published by the Free Software Foundation; either
+     version 2.1 of the License, or (at your option) any later version.
+
+     This library is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Lesser General Public License for more details.
+
+     You should have received a copy of the GNU Lesser General Public
+     License along with this library; if not, write to the Free Software
+     Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/**
+ * @file connection_http2.c
+ * @brief HTTP/2 framing (RFC 7540) and header compression (RFC 7541).
+ *
+ * Once a connection received the HTTP/2 connection preface, its
+ * socket carries frames of many requests ("streams") at once.  Each
+ * stream gets a 'struct MHD_Connection' of its own (with its own
+ * memory pool, but without a socket) which is what the application
+ * sees in its handler; the state of that connection follows the
+ * usual HTTP/1.x states so that MHD_queue_response and friends work
+ * unchanged.  The HTTP/2 connection reads, parses and writes frames
+ * and runs the handlers of its streams from its idle handler.
+ *
+ * Header blocks are compressed with HPACK; we decode everything the
+ * peer may use but only send literal header fields (never indexed
+ * into our dynamic table and without Huffman coding), which keeps
+ * the encoder stateless.
+ * @author Christian Grothoff
+ */
+
+#include "internal.h"
+#include "connection.h"
+#include "connection_http2.h"
+#include "memorypool.h"
+#include "response.h"
+#include <ctype.h>
+
+/**
+ * Connection preface every HTTP/2 client starts with.
+ */
+#define MHD_HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+/**
+ * Length of MHD_HTTP2_PREFACE.
+ */
+#define MHD_HTTP2_PREFACE_LEN 24
+
+/**
+ * Size of a frame header.
+ */
+#define MHD_HTTP2_FRAME_HEADER 9
+
+/**
+ * Largest frame payload we accept (the default of
+ * SETTINGS_MAX_FRAME_SIZE, which we do not change).
+ */
+#define MHD_HTTP2_MAX_FRAME 16384
+
+/**
+ * Largest frame payload a peer may ask us to use.
+ */
+#define MHD_HTTP2_MAX_FRAME_LIMIT 16777215
+
+/**
+ * How many streams may be open at the same time
+ * (SETTINGS_MAX_CONCURRENT_STREAMS).
+ */
+#define MHD_HTTP2_MAX_STREAMS 32
+
+/**
+ * Initial window of every flow-controlled entity unless SETTINGS
+ * say otherwise.
+ */
+#define MHD_HTTP2_DEFAULT_WINDOW 65535
+
+/**
+ * Largest window allowed.
+ */
+#define MHD_HTTP2_MAX_WINDOW 2147483647
+
+/**
+ * Window we grant the peer for the whole connection.
+ */
+#define MHD_HTTP2_CONNECTION_WINDOW (256 * 1024)
+
+/**
+ * Largest (compressed) header block we accept.
+ */
+#define MHD_HTTP2_MAX_HEADER_BLOCK (64 * 1024)
+
+/**
+ * Once this many bytes wait to be written, we stop parsing input
+ * and producing DATA frames until the peer read some of them.
+ */
+#define MHD_HTTP2_OUT_HIGH (64 * 1024)
+
+/**
+ * Size of the HPACK dynamic table of the decoder
+ * (SETTINGS_HEADER_TABLE_SIZE, which we do not change).
+ */
+#define MHD_HPACK_TABLE_SIZE 4096
+
+/**
+ * Number of entries the dynamic table can hold at most (every entry
+ * accounts for at least 32 bytes).
+ */
+#define MHD_HPACK_TABLE_ENTRIES (MHD_HPACK_TABLE_SIZE / 32)
+
+/**
+ * Number of entries in the HPACK static table.
+ */
+#define MHD_HPACK_STATIC_ENTRIES 61
+
+/**
+ * Frame types.
+ */
+enum MHD_Http2FrameType
+{
+  MHD_HTTP2_DATA = 0,
+  MHD_HTTP2_HEADERS = 1,
+  MHD_HTTP2_PRIORITY = 2,
+  MHD_HTTP2_RST_STREAM = 3,
+  MHD_HTTP2_SETTINGS = 4,
+  MHD_HTTP2_PUSH_PROMISE = 5,
+  MHD_HTTP2_PING = 6,
+  MHD_HTTP2_GOAWAY = 7,
+  MHD_HTTP2_WINDOW_UPDATE = 8,
+  MHD_HTTP2_CONTINUATION = 9
+};
+
+/**
+ * Frame flags.
+ */
+#define MHD_HTTP2_FLAG_END_STREAM 0x01
+#define MHD_HTTP2_FLAG_ACK 0x01
+#define MHD_HTTP2_FLAG_END_HEADERS 0x04
+#define MHD_HTTP2_FLAG_PADDED 0x08
+#define MHD_HTTP2_FLAG_PRIORITY 0x20
+
+/**
+ * Error codes for RST_STREAM and GOAWAY.
+ */
+enum MHD_Http2Error
+{
+  MHD_HTTP2_NO_ERROR = 0,
+  MHD_HTTP2_PROTOCOL_ERROR = 1,
+  MHD_HTTP2_INTERNAL_ERROR = 2,
+  MHD_HTTP2_FLOW_CONTROL_ERROR = 3,
+  MHD_HTTP2_STREAM_CLOSED = 5,
+  MHD_HTTP2_FRAME_SIZE_ERROR = 6,
+  MHD_HTTP2_REFUSED_STREAM = 7,
+  MHD_HTTP2_COMPRESSION_ERROR = 9,
+  MHD_HTTP2_ENHANCE_YOUR_CALM = 11
+};
+
+/**
+ * Settings identifiers.
+ */
+enum MHD_Http2Setting
+{
+  MHD_HTTP2_SETTINGS_HEADER_TABLE_SIZE = 1,
+  MHD_HTTP2_SETTINGS_ENABLE_PUSH = 2,
+  MHD_HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS = 3,
+  MHD_HTTP2_SETTINGS_INITIAL_WINDOW_SIZE = 4,
+  MHD_HTTP2_SETTINGS_MAX_FRAME_SIZE = 5,
+  MHD_HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE = 6
+};
+
+
+/**
+ * Entry of an HPACK table.
+ */
+struct MHD_HpackEntry
+{
+  /**
+   * Name of the header field (0-terminated).
+   */
+  const char *name;
+
+  /**
+   * Value of the header field (0-terminated).
+   */
+  const char *value;
+};
+
+
+/**
+ * Entry of the HPACK dynamic table.
+ */
+struct MHD_HpackDynamicEntry
+{
+  /**
+   * Name and value, each 0-terminated, in one allocation
+   * (starting with the name).
+   */
+  char *name;
+
+  /**
+   * Value (points into the allocation of 'name').
+   */
+  char *value;
+
+  /**
+   * Length of the name.
+   */
+  size_t name_len;
+
+  /**
+   * Length of the value.
+   */
+  size_t value_len;
+};
+
+
+/**
+ * A request (stream) on an HTTP/2 connection.
+ */
+struct MHD_Http2Stream
+{
+  /**
+   * Next stream of the session.
+   */
+  struct MHD_Http2Stream *next;
+
+  /**
+   * Previous stream of the session.
+   */
+  struct MHD_Http2Stream *prev;
+
+  /**
+   * What the application sees of the request.  Has no socket; its
+   * state follows the HTTP/1.x request states.
+   */
+  struct MHD_Connection connection;
+
+  /**
+   * Uploaded data the application did not consume yet.
+   */
+  char *upload;
+
+  /**
+   * Size of 'upload'.
+   */
+  size_t upload_size;
+
+  /**
+   * Number of bytes in 'upload'.
+   */
+  size_t upload_off;
+
+  /**
+   * Content-Length the client announced, MHD_SIZE_UNKNOWN if none.
+   */
+  uint64_t content_length;
+
+  /**
+   * Number of body bytes received.
+   */
+  uint64_t received;
+
+  /**
+   * How much we may still send on this stream.
+   */
+  int64_t send_window;
+
+  /**
+   * How much the peer may still send on this stream.
+   */
+  int64_t recv_window;
+
+  /**
+   * Bytes consumed since we last extended 'recv_window'.
+   */
+  uint32_t recv_credit;
+
+  /**
+   * Stream identifier.
+   */
+  uint32_t id;
+
+  /**
+   * MHD_YES once the client finished its request (END_STREAM).
+   */
+  int remote_closed;
+};
+
+
+/**
+ * HTTP/2 state of a connection.
+ */
+struct MHD_Http2Session
+{
+  /**
+   * Open streams (the one to send for next first).
+   */
+  struct MHD_Http2Stream *streams_head;
+
+  /**
+   * Tail of the stream list.
+   */
+  struct MHD_Http2Stream *streams_tail;
+
+  /**
+   * Buffer for frames received but not yet parsed.
+   */
+  unsigned char *in;
+
+  /**
+   * Size of 'in'.
+   */
+  size_t in_size;
+
+  /**
+   * Number of bytes in 'in'.
+   */
+  size_t in_off;
+
+  /**
+   * Buffer for frames to send.
+   */
+  unsigned char *out;
+
+  /**
+   * Size of 'out'.
+   */
+  size_t out_size;
+
+  /**
+   * Offset of the first byte of 'out' not yet sent.
+   */
+  size_t out_send;
+
+  /**
+   * Number of bytes in 'out'.
+   */
+  size_t out_append;
+
+  /**
+   * Header block being received (HEADERS plus CONTINUATION frames).
+   */
+  unsigned char *block;
+
+  /**
+   * Size of 'block'.
+   */
+  size_t block_size;
+
+  /**
+   * Number of bytes in 'block'.
+   */
+  size_t block_len;
+
+  /**
+   * Stream the header block belongs to, 0 if we are not receiving
+   * one.
+   */
+  uint32_t block_stream;
+
+  /**
+   * Flags of the HEADERS frame that started the block.
+   */
+  unsigned int block_flags;
+
+  /**
+   * Buffer decoded strings are written to.
+   */
+  char *scratch;
+
+  /**
+   * Size of 'scratch'.
+   */
+  size_t scratch_size;
+
+  /**
+   * HPACK dynamic table of the decoder (ring buffer).
+   */
+  struct MHD_HpackDynamicEntry table[MHD_HPACK_TABLE_ENTRIES];
+
+  /**
+   * Slot of the most recently added entry of 'table'.
+   */
+  unsigned int table_newest;
+
+  /**
+   * Number of entries in 'table'.
+   */
+  unsigned int table_count;
+
+  /**
+   * Size of the entries in 'table' (as defined by RFC 7541).
+   */
+  size_t table_size;
+
+  /**
+   * Maximum size of 'table' the peer selected.
+   */
+  size_t table_max;
+
+  /**
+   * How much we may still send on the connection.
+   */
+  int64_t send_window;
+
+  /**
+   * How much the peer may still send on the connection.
+   */
+  int64_t recv_window;
+
+  /**
+   * Bytes consumed since we last extended 'recv_window'.
+   */
+  uint32_t recv_credit;
+
+  /**
+   * Window we grant every stream.
+   */
+  uint32_t stream_window;
+
+  /**
+   * Window the peer grants new streams (SETTINGS_INITIAL_WINDOW_SIZE).
+   */
+  uint32_t peer_initial_window;
+
+  /**
+   * Largest frame payload the peer accepts (SETTINGS_MAX_FRAME_SIZE).
+   */
+  uint32_t peer_max_frame;
+
+  /**
+   * Highest stream identifier the peer used.
+   */
+  uint32_t last_stream_id;
+
+  /**
+   * Number of streams in the stream list.
+   */
+  unsigned int num_streams;
+
+  /**
+   * MHD_YES once we got the SETTINGS frame of the client preface.
+   */
+  int got_settings;
+
+  /**
+   * MHD_YES once the peer sent GOAWAY.
+   */
+  int goaway_received;
+
+  /**
+   * MHD_YES if we failed the connection (GOAWAY sent); we only
+   * send what is queued and then close.
+   */
+  int closing;
+};
+
+
+/**
+ * State of decoding a header block into a request.
+ */
+struct MHD_Http2HeaderContext
+{
+  /**
+   * Stream to add the fields to.
+   */
+  struct MHD_Http2Stream *stream;
+
+  /**
+   * Value of ":method".
+   */
+  char *method;
+
+  /**
+   * Value of ":path".
+   */
+  char *path;
+
+  /**
+   * Value of ":scheme".
+   */
+  char *scheme;
+
+  /**
+   * Value of ":authority".
+   */
+  char *authority;
+
+  /**
+   * MHD_YES if we decode trailers (no pseudo-header fields allowed).
+   */
+  int trailers;
+
+  /**
+   * MHD_YES once we saw a regular header field.
+   */
+  int regular_seen;
+
+  /**
+   * MHD_YES if the request is malformed.
+   */
+  int malformed;
+
+  /**
+   * MHD_YES if the request did not fit into the memory pool.
+   */
+  int too_big;
+};
+
+
+/**
+ * Function called with each header field of a header block.
+ *
+ * @param cls closure
+ * @param name name of the field
+ * @param name_len length of 'name'
+ * @param value value of the field
+ * @param value_len length of 'value'
+ */
+typedef void
+(*MHD_HpackFieldCallback) (void *cls,
+			   const char *name, size_t name_len,
+			   const char *value, size_t value_len);
+
+
+/**
+ * HPACK static table (RFC 7541, Appendix A).
+ */
+static const struct MHD_HpackEntry hpack_static[MHD_HPACK_STATIC_ENTRIES] = {
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" }
+};
+
+
+/**
+ * Number of Huffman codes of each length (RFC 7541, Appendix B);
+ * the code is canonical, so this and the symbols ordered by code
+ * are all we need to decode.
+ */
+static const unsigned char huffman_count[31] = {
+  0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+  0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+
+/**
+ * Symbols of the Huffman code, in the order of their codes
+ * (256 is EOS).
+ */
+static const uint16_t huffman_symbol[257] = {
+  48, 49, 50, 97, 99, 101, 105, 111, 115, 116,
+  32, 37, 45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65, 95, 98,
+  100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+  58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 80,
+  81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118, 119, 120, 121, 122,
+  38, 42, 44, 59, 88, 90,
+  33, 34, 40, 41, 63,
+  39, 43, 124,
+  35, 62,
+  0, 36, 64, 91, 93, 126,
+  94, 125,
+  60, 96, 123,
+  92, 195, 208,
+  128, 130, 131, 162, 184, 194, 224, 226,
+  153, 161, 167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230,
+  129, 132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170, 173,
+  178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232, 233,
+  1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+  158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239,
+  9, 142, 144, 145, 148, 159, 171, 206, 215, 225, 236, 237,
+  199, 207, 234, 235,
+  192, 193, 200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+  255,
+  203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248,
+  250, 251, 252, 253, 254,
+  2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20, 21, 23, 24,
+  25, 26, 27, 28, 29, 30, 31, 127, 220, 249,
+  10, 13, 22, 256
+};
+
+
+/**
+ * Decode a Huffman-coded string.
+ *
+ * @param in encoded string
+ * @param len length of 'in'
+ * @param out where to write the result (at least len * 8 / 5 bytes)
+ * @return length of the result, -1 if the encoding is invalid
+ */
+static ssize_t
+huffman_decode (const unsigned char *in,
+		size_t len,
+		char *out)
+{
+  size_t i;
+  size_t off;
+  int bit;
+  int code;
+  int first;
+  int index;
+  int count;
+  unsigned int bits;
+  int ones;
+
+  off = 0;
+  code = 0;
+  first = 0;
+  index = 0;
+  bits = 0;
+  ones = MHD_YES;
+  for (i = 0; i < len; i++)
+    {
+      for (bit = 7; bit >= 0; bit--)
+	{
+	  code |= (in[i] >> bit) & 1;
+	  if (0 == ((in[i] >> bit) & 1))
+	    ones = MHD_NO;
+	  bits++;
+	  if (bits >= sizeof (huffman_count))
+	    return -1;
+	  count = huffman_count[bits];
+	  if (code - count < first)
+	    {
+	      if (256 == huffman_symbol[index + (code - first)])
+		return -1; /* EOS must not be sent */
+	      out[off++] = (char) huffman_symbol[index + (code - first)];
+	      code = 0;
+	      first = 0;
+	      index = 0;
+	      bits = 0;
+	      ones = MHD_YES;
+	      continue;
+	    }
+	  index += count;
+	  first += count;
+	  first <<= 1;
+	  code <<= 1;
+	}
+    }
+  /* padding must be a prefix of EOS and shorter than a byte */
+  if ( (bits > 7) || (MHD_NO == ones) )
+    return -1;
+  return off;
+}
+
+
+/**
+ * Decode an integer with the given prefix length (RFC 7541, 5.1).
+ *
+ * @param pos current position, advanced past the integer
+ * @param end end of the header block
+ * @param prefix number of bits of the prefix
+ * @param value set to the integer
+ * @return MHD_YES on success, MHD_NO if the encoding is invalid
+ */
+static int
+hpack_decode_int (const unsigned char **pos,
+		  const unsigned char *end,
+		  unsigned int prefix,
+		  uint32_t *value)
+{
+  const unsigned char *p;
+  uint32_t max;
+  uint32_t v;
+  unsigned int shift;
+  unsigned char b;
+
+  p = *pos;
+  if (p == end)
+    return MHD_NO;
+  max = (1 << prefix) - 1;
+  v = *p++ & max;
+  if (v == max)
+    {
+      shift = 0;
+      do
+	{
+	  if ( (p == end) ||
+	       (shift > 21) )
+	    return MHD_NO; /* we never need values beyond 2^28 */
+	  b = *p++;
+	  v += (uint32_t) (b & 0x7f) << shift;
+	  shift += 7;
+	}
+      while (0 != (b & 0x80));
+    }
+  *pos = p;
+  *value = v;
+  return MHD_YES;
+}
+
+
+/**
+ * Decode a string literal (RFC 7541, 5.2).
+ *
+ * @param pos current position, advanced past the string
+ * @param end end of the header block
+ * @param out where to write the string (0-terminated); must have
+ *        room for (end - *pos) * 8 / 5 + 1 bytes
+ * @param out_len set to the length of the string
+ * @return MHD_YES on success, MHD_NO if the encoding is invalid
+ */
+static int
+hpack_decode_string (const unsigned char **pos,
+		     const unsigned char *end,
+		     char *out,
+		     size_t *out_len)
+{
+  const unsigned char *p;
+  uint32_t len;
+  ssize_t ret;
+  int huffman;
+
+  p = *pos;
+  if (p == end)
+    return MHD_NO;
+  huffman = (0 != (*p & 0x80));
+  if (MHD_NO == hpack_decode_int (&p, end, 7, &len))
+    return MHD_NO;
+  if (len > (size_t) (end - p))
+    return MHD_NO;
+  if (huffman)
+    {
+      ret = huffman_decode (p, len, out);
+      if (ret < 0)
+	return MHD_NO;
+      *out_len = ret;
+    }
+  else
+    {
+      memcpy (out, p, len);
+      *out_len = len;
+    }
+  out[*out_len] = '\0';
+  *pos = p + len;
+  return MHD_YES;
+}
+
+
+/**
+ * Remove entries from the dynamic table until it fits the given size.
+ *
+ * @param session session to update
+ * @param max size the table must fit into
+ */
+static void
+hpack_evict (struct MHD_Http2Session *session,
+	     size_t max)
+{
+  struct MHD_HpackDynamicEntry *oldest;
+
+  while ( (session->table_size > max) &&
+	  (session->table_count > 0) )
+    {
+      oldest = &session->table[(session->table_newest + MHD_HPACK_TABLE_ENTRIES
+				- (session->table_count - 1))
+			       % MHD_HPACK_TABLE_ENTRIES];
+      session->table_size -= oldest->name_len + oldest->value_len + 32;
+      free (oldest->name);
+      oldest->name = NULL;
+      session->table_count--;
+    }
+}
+
+
+/**
+ * Add an entry to the dynamic table.
+ *
+ * @param session session to update
+ * @param name name of the field
+ * @param name_len length of 'name'
+ * @param value value of the field
+ * @param value_len length of 'value'
+ * @return MHD_YES on success, MHD_NO if we are out of memory
+ */
+static int
+hpack_insert (struct MHD_Http2Session *session,
+	      const char *name, size_t name_len,
+	      const char *value, size_t value_len)
+{
+  struct MHD_HpackDynamicEntry *entry;
+  size_t size;
+  char *copy;
+
+  size = name_len + value_len + 32;
+  if (size > session->table_max)
+    {
+      /* too big for the table, which just ends up empty */
+      hpack_evict (session, 0);
+      return MHD_YES;
+    }
+  /* copy first: 'name' may refer to an entry we are about to evict */
+  copy = malloc (name_len + value_len + 2);
+  if (NULL == copy)
+    return MHD_NO;
+  memcpy (copy, name, name_len);
+  copy[name_len] = '\0';
+  memcpy (&copy[name_len + 1], value, value_len);
+  copy[name_len + 1 + value_len] = '\0';
+  hpack_evict (session, session->table_max - size);
+  session->table_newest = (session->table_newest + 1) % MHD_HPACK_TABLE_ENTRIES;
+  entry = &session->table[session->table_newest];
+  entry->name = copy;
+  entry->value = &copy[name_len + 1];
+  entry->name_len = name_len;
+  entry->value_len = value_len;
+  session->table_count++;
+  session->table_size += size;
+  return MHD_YES;
+}
+
+
+/**
+ * Look up an entry of the static or dynamic table.
+ *
+ * @param session session with the dynamic table
+ * @param index index of the entry (1-based)
+ * @param name set to the name of the entry
+ * @param name_len set to the length of 'name'
+ * @param value set to the value of the entry
+ * @param value_len set to the length of 'value'
+ * @return MHD_YES on success, MHD_NO if there is no such entry
+ */
+static int
+hpack_lookup (struct MHD_Http2Session *session,
+	      uint32_t index,
+	      const char **name, size_t *name_len,
+	      const char **value, size_t *value_len)
+{
+  struct MHD_HpackDynamicEntry *entry;
+
+  if (0 == index)
+    return MHD_NO;
+  if (index <= MHD_HPACK_STATIC_ENTRIES)
+    {
+      *name = hpack_static[index - 1].name;
+      *name_len = strlen (*name);
+      *value = hpack_static[index - 1].value;
+      *value_len = strlen (*value);
+      return MHD_YES;
+    }
+  index -= MHD_HPACK_STATIC_ENTRIES + 1;
+  if (index >= session->table_count)
+    return MHD_NO;
+  entry = &session->table[(session->table_newest + MHD_HPACK_TABLE_ENTRIES - index)
+			  % MHD_HPACK_TABLE_ENTRIES];
+  *name = entry->name;
+  *name_len = entry->name_len;
+  *value = entry->value;
+  *value_len = entry->value_len;
+  return MHD_YES;
+}
+
+
+/**
+ * Decode a complete header block.  Blocks must always be decoded
+ * (even for requests we refuse) to keep the dynamic table in sync
+ * with the peer.
+ *
+ * @param session session the block was received on
+ * @param block the header block
+ * @param len length of 'block'
+ * @param cb function to call with each field, NULL to discard them
+ * @param cb_cls closure for 'cb'
+ * @return MHD_YES on success, MHD_NO if the block is invalid (or we
+ *         ran out of memory), which is fatal for the connection
+ */
+static int
+hpack_decode_block (struct MHD_Http2Session *session,
+		    const unsigned char *block,
+		    size_t len,
+		    MHD_HpackFieldCallback cb,
+		    void *cb_cls)
+{
+  const unsigned char *pos;
+  const unsigned char *end;
+  const char *name;
+  const char *value;
+  size_t name_len;
+  size_t value_len;
+  size_t half;
+  uint32_t index;
+  unsigned int prefix;
+  int add;
+  int fields;
+  char *scratch;
+
+  half = len * 8 / 5 + 2;
+  if (session->scratch_size < 2 * half)
+    {
+      scratch = realloc (session->scratch, 2 * half);
+      if (NULL == scratch)
+	return MHD_NO;
+      session->scratch = scratch;
+      session->scratch_size = 2 * half;
+    }
+  pos = block;
+  end = &block[len];
+  fields = 0;
+  while (pos < end)
+    {
+      if (0 != (*pos & 0x80))
+	{
+	  /* indexed header field */
+	  if ( (MHD_NO == hpack_decode_int (&pos, end, 7, &index)) ||
+	       (MHD_NO == hpack_lookup (session, index,
+					&name, &name_len,
+					&value, &value_len)) )
+	    return MHD_NO;
+	  if (NULL != cb)
+	    cb (cb_cls, name, name_len, value, value_len);
+	  fields++;
+	  continue;
+	}
+      if (0x20 == (*pos & 0xe0))
+	{
+	  /* dynamic table size update, only allowed first */
+	  if ( (fields > 0) ||
+	       (MHD_NO == hpack_decode_int (&pos, end, 5, &index)) ||
+	       (index > MHD_HPACK_TABLE_SIZE) )
+	    return MHD_NO;
+	  session->table_max = index;
+	  hpack_evict (session, index);
+	  continue;
+	}
+      /* literal header field, with incremental indexing (01),
+	 without indexing (0000) or never indexed (0001) */
+      add = (0x40 == (*pos & 0xc0));
+      prefix = add ? 6 : 4;
+      if (MHD_NO == hpack_decode_int (&pos, end, prefix, &index))
+	return MHD_NO;
+      if (0 == index)
+	{
+	  if (MHD_NO == hpack_decode_string (&pos, end,
+					     session->scratch, &name_len))
+	    return MHD_NO;
+	  name = session->scratch;
+	}
+      else if (MHD_NO == hpack_lookup (session, index,
+				       &name, &name_len,
+				       &value, &value_len))
+	return MHD_NO;
+      if (MHD_NO == hpack_decode_string (&pos, end,
+					 &session->scratch[half], &value_len))
+	return MHD_NO;
+      value = &session->scratch[half];
+      if (NULL != cb)
+	cb (cb_cls, name, name_len, value, value_len);
+      if ( add &&
+	   (MHD_NO == hpack_insert (session,
+				    name, name_len,
+				    value, value_len)) )
+	return MHD_NO;
+      fields++;
+    }
+  return MHD_YES;
+}
+
+
+/**
+ * Encode an integer with the given prefix length (RFC 7541, 5.1).
+ *
+ * @param buf where to write the integer (at most 6 bytes)
+ * @param first bits of the first byte above the prefix
+ * @param prefix number of bits of the prefix
+ * @param value value to encode
+ * @return number of bytes written
+ */
+static size_t
+hpack_encode_int (unsigned char *buf,
+		  unsigned char first,
+		  unsigned int prefix,
+		  size_t value)
+{
+  size_t off;
+  size_t max;
+
+  max = (1 << prefix) - 1;
+  if (value < max)
+    {
+      buf[0] = first | (unsigned char) value;
+      return 1;
+    }
+  buf[0] = first | (unsigned char) max;
+  off = 1;
+  value -= max;
+  while (value >= 128)
+    {
+      buf[off++] = (unsigned char) ((value & 0x7f) | 0x80);
+      value >>= 7;
+    }
+  buf[off++] = (unsigned char) value;
+  return off;
+}
+
+
+/**
+ * Encode a string literal without Huffman coding.
+ *
+ * @param buf where to write the string
+ * @param str string to encode
+ * @param lower MHD_YES to convert the string to lower case (names)
+ * @return number of bytes written
+ */
+static size_t
+hpack_encode_string (unsigned char *buf,
+		     const char *str,
+		     int lower)
+{
+  size_t len;
+  size_t off;
+  size_t i;
+
+  len = strlen (str);
+  off = hpack_encode_int (buf, 0x00, 7, len);
+  for (i = 0; i < len; i++)
+    buf[off + i] = (MHD_YES == lower)
+      ? (unsigned char) tolower ((unsigned char) str[i])
+      : (unsigned char) str[i];
+  return off + len;
+}
+
+
+/**
+ * Encode a header field as a literal without indexing, referring to
+ * the name in the static table if it is there.
+ *
+ * @param buf where to write the field (strlen (name) + strlen (value)
+ *        + 16 bytes)
+ * @param name name of the field
+ * @param value value of the field
+ * @return number of bytes written
+ */
+static size_t
+hpack_encode_field (unsigned char *buf,
+		    const char *name,
+		    const char *value)
+{
+  unsigned int i;
+  size_t off;
+
+  for (i = 0; i < MHD_HPACK_STATIC_ENTRIES; i++)
+    if ( (':' != hpack_static[i].name[0]) &&
+	 (0 == strcasecmp (name, hpack_static[i].name)) )
+      break;
+  if (i < MHD_HPACK_STATIC_ENTRIES)
+    {
+      off = hpack_encode_int (buf, 0x00, 4, i + 1);
+    }
+  else
+    {
+      buf[0] = 0x00;
+      off = 1 + hpack_encode_string (&buf[1], name, MHD_YES);
+    }
+  return off + hpack_encode_string (&buf[off], value, MHD_NO);
+}
+
+
+/**
+ * Is this a header that is specific to HTTP/1.x connections and
+ * thus must not appear in HTTP/2 (RFC 7540, 8.1.2.2)?
+ *
+ * @param name name of the header (lower case)
+ * @return MHD_YES if so
+ */
+static int
+is_connection_specific (const char *name)
+{
+  return ( (0 == strcasecmp (name, MHD_HTTP_HEADER_CONNECTION)) ||
+	   (0 == strcasecmp (name, "Keep-Alive")) ||
+	   (0 == strcasecmp (name, "Proxy-Connection")) ||
+	   (0 == strcasecmp (name, MHD_HTTP_HEADER_TRANSFER_ENCODING)) ||
+	   (0 == strcasecmp (name, MHD_HTTP_HEADER_UPGRADE)) ) ? MHD_YES : MHD_NO;
+}
+
+
+/**
+ * Get room for 'len' more bytes at the end of the output buffer.
+ * Closes the connection if we are out of memory.
+ *
+ * @param connection HTTP/2 connection
+ * @param len number of bytes needed
+ * @return where to write them, NULL on error
+ */
+static unsigned char *
+out_reserve (struct MHD_Connection *connection,
+	     size_t len)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  unsigned char *out;
+  size_t size;
+
+  if (session->out_append + len > session->out_size)
+    {
+      if (session->out_send > 0)
+	{
+	  memmove (session->out,
+		   &session->out[session->out_send],
+		   session->out_append - session->out_send);
+	  session->out_append -= session->out_send;
+	  session->out_send = 0;
+	}
+      if (session->out_append + len > session->out_size)
+	{
+	  size = MHD_MAX (2 * session->out_size,
+			  session->out_append + len);
+	  out = realloc (session->out, size);
+	  if (NULL == out)
+	    {
+#if HAVE_MESSAGES
+	      MHD_DLOG (connection->daemon,
+			"Not enough memory to queue HTTP/2 frame!\n");
+#endif
+	      MHD_connection_close (connection,
+				    MHD_REQUEST_TERMINATED_WITH_ERROR);
+	      return NULL;
+	    }
+	  session->out = out;
+	  session->out_size = size;
+	}
+    }
+  out = &session->out[session->out_append];
+  session->out_append += len;
+  return out;
+}
+
+
+/**
+ * Write a frame header.
+ *
+ * @param buf where to write the header (9 bytes)
+ * @param len length of the payload
+ * @param type frame type
+ * @param flags frame flags
+ * @param id stream identifier
+ */
+static void
+frame_header (unsigned char *buf,
+	      size_t len,
+	      enum MHD_Http2FrameType type,
+	      unsigned int flags,
+	      uint32_t id)
+{
+  buf[0] = (unsigned char) (len >> 16);
+  buf[1] = (unsigned char) (len >> 8);
+  buf[2] = (unsigned char) len;
+  buf[3] = (unsigned char) type;
+  buf[4] = (unsigned char) flags;
+  buf[5] = (unsigned char) ((id >> 24) & 0x7f);
+  buf[6] = (unsigned char) (id >> 16);
+  buf[7] = (unsigned char) (id >> 8);
+  buf[8] = (unsigned char) id;
+}
+
+
+/**
+ * Write a 32-bit integer in network byte order.
+ *
+ * @param buf where to write
+ * @param value value to write
+ */
+static void
+put_uint32 (unsigned char *buf,
+	    uint32_t value)
+{
+  buf[0] = (unsigned char) (value >> 24);
+  buf[1] = (unsigned char) (value >> 16);
+  buf[2] = (unsigned char) (value >> 8);
+  buf[3] = (unsigned char) value;
+}
+
+
+/**
+ * Read a 32-bit integer in network byte order.
+ *
+ * @param buf where to read from
+ * @return the value
+ */
+static uint32_t
+get_uint32 (const unsigned char *buf)
+{
+  return ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16)
+    | ((uint32_t) buf[2] << 8) | (uint32_t) buf[3];
+}
+
+
+/**
+ * Queue a frame for sending.
+ *
+ * @param connection HTTP/2 connection
+ * @param type frame type
+ * @param flags frame flags
+ * @param id stream identifier
+ * @param payload payload of the frame
+ * @param len length of 'payload'
+ * @return MHD_YES on success, MHD_NO if the connection failed
+ */
+static int
+queue_frame (struct MHD_Connection *connection,
+	     enum MHD_Http2FrameType type,
+	     unsigned int flags,
+	     uint32_t id,
+	     const void *payload,
+	     size_t len)
+{
+  unsigned char *buf;
+
+  buf = out_reserve (connection, MHD_HTTP2_FRAME_HEADER + len);
+  if (NULL == buf)
+    return MHD_NO;
+  frame_header (buf, len, type, flags, id);
+  if (len > 0)
+    memcpy (&buf[MHD_HTTP2_FRAME_HEADER], payload, len);
+  return MHD_YES;
+}
+
+
+/**
+ * Queue a frame whose payload is one 32-bit integer (RST_STREAM
+ * and WINDOW_UPDATE).
+ *
+ * @param connection HTTP/2 connection
+ * @param type frame type
+ * @param id stream identifier
+ * @param value the payload
+ */
+static void
+queue_uint32_frame (struct MHD_Connection *connection,
+		    enum MHD_Http2FrameType type,
+		    uint32_t id,
+		    uint32_t value)
+{
+  unsigned char payload[4];
+
+  put_uint32 (payload, value);
+  (void) queue_frame (connection, type, 0, id, payload, sizeof (payload));
+}
+
+
+/**
+ * Fail the whole connection: send GOAWAY and close once it is out.
+ *
+ * @param connection HTTP/2 connection
+ * @param error error code to send
+ * @param reason what went wrong (for the log)
+ */
+static void
+session_fail (struct MHD_Connection *connection,
+	      enum MHD_Http2Error error,
+	      const char *reason)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  unsigned char payload[8];
+
+  if (MHD_YES == session->closing)
+    return;
+#if HAVE_MESSAGES
+  MHD_DLOG (connection->daemon,
+	    "HTTP/2 connection error: %s\n",
+	    reason);
+#endif
+  session->closing = MHD_YES;
+  put_uint32 (payload, session->last_stream_id);
+  put_uint32 (&payload[4], error);
+  (void) queue_frame (connection, MHD_HTTP2_GOAWAY, 0, 0,
+		      payload, sizeof (payload));
+}
+
+
+/**
+ * Find an open stream.
+ *
+ * @param session session to search
+ * @param id stream identifier
+ * @return NULL if the stream is not open
+ */
+static struct MHD_Http2Stream *
+stream_find (struct MHD_Http2Session *session,
+	     uint32_t id)
+{
+  struct MHD_Http2Stream *stream;
+
+  for (stream = session->streams_head; NULL != stream; stream = stream->next)
+    if (stream->id == id)
+      return stream;
+  return NULL;
+}
+
+
+/**
+ * Add a stream at the end of the stream list.
+ *
+ * @param session session to update
+ * @param stream stream to add
+ */
+static void
+stream_append (struct MHD_Http2Session *session,
+	       struct MHD_Http2Stream *stream)
+{
+  stream->next = NULL;
+  stream->prev = session->streams_tail;
+  if (NULL == session->streams_tail)
+    session->streams_head = stream;
+  else
+    session->streams_tail->next = stream;
+  session->streams_tail = stream;
+}
+
+
+/**
+ * Release a stream, telling the application that the request ended
+ * (if it knows about it).
+ *
+ * @param connection HTTP/2 connection
+ * @param stream stream to release
+ * @param termination_code reason to give to the application
+ */
+static void
+stream_close (struct MHD_Connection *connection,
+	      struct MHD_Http2Stream *stream,
+	      enum MHD_RequestTerminationCode termination_code)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  struct MHD_Daemon *daemon = connection->daemon;
+  struct MHD_Connection *c = &stream->connection;
+
+  if ( (NULL != daemon->notify_completed) &&
+       (MHD_YES == c->client_aware) )
+    daemon->notify_completed (daemon->notify_completed_cls,
+			      c,
+			      &c->client_context,
+			      termination_code);
+  c->client_aware = MHD_NO;
+  if (NULL != c->response)
+    MHD_destroy_response (c->response);
+  /* data the application will never see no longer counts
+     against the window of the connection */
+  session->recv_credit += stream->upload_off;
+  DLL_remove (session->streams_head,
+	      session->streams_tail,
+	      stream);
+  session->num_streams--;
+  MHD_pool_destroy (c->pool);
+  free (stream->upload);
+  free (stream);
+}
+
+
+/**
+ * Abort a stream (RST_STREAM) and release it.
+ *
+ * @param connection HTTP/2 connection
+ * @param stream stream to abort
+ * @param error error code to send
+ */
+static void
+stream_reset (struct MHD_Connection *connection,
+	      struct MHD_Http2Stream *stream,
+	      enum MHD_Http2Error error)
+{
+  queue_uint32_frame (connection, MHD_HTTP2_RST_STREAM, stream->id, error);
+  stream_close (connection, stream, MHD_REQUEST_TERMINATED_WITH_ERROR);
+}
+
+
+/**
+ * The response of a stream was sent completely.
+ *
+ * @param connection HTTP/2 connection
+ * @param stream stream that is done
+ */
+static void
+stream_complete (struct MHD_Connection *connection,
+		 struct MHD_Http2Stream *stream)
+{
+  if (MHD_NO == stream->remote_closed)
+    {
+      /* we answered early, the rest of the request is of no
+	 interest (RFC 7540, 8.1) */
+      queue_uint32_frame (connection, MHD_HTTP2_RST_STREAM,
+			  stream->id, MHD_HTTP2_NO_ERROR);
+    }
+  if (NULL != connection->daemon->counters)
+    connection->daemon->counters->requests++;
+  stream_close (connection, stream, MHD_REQUEST_TERMINATED_COMPLETED_OK);
+}
+
+
+/**
+ * Does the response of a stream have footers (trailers)?
+ *
+ * @param response response to check
+ * @return MHD_YES if so
+ */
+static int
+have_footers (struct MHD_Response *response)
+{
+  struct MHD_HTTP_Header *pos;
+
+  for (pos = response->first_header; NULL != pos; pos = pos->next)
+    if (MHD_FOOTER_KIND == pos->kind)
+      return MHD_YES;
+  return MHD_NO;
+}
+
+
+/**
+ * Queue a header block as HEADERS frame (plus CONTINUATION frames
+ * as needed).
+ *
+ * @param connection HTTP/2 connection
+ * @param stream stream the block belongs to
+ * @param block the header block
+ * @param len length of 'block'
+ * @param end_stream MHD_YES if this ends the response
+ */
+static void
+queue_header_block (struct MHD_Connection *connection,
+		    struct MHD_Http2Stream *stream,
+		    const unsigned char *block,
+		    size_t len,
+		    int end_stream)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  size_t off;
+  size_t chunk;
+  unsigned int flags;
+
+  off = 0;
+  do
+    {
+      chunk = MHD_MIN (len - off, session->peer_max_frame);
+      flags = (off + chunk == len) ? MHD_HTTP2_FLAG_END_HEADERS : 0;
+      if ( (0 == off) &&
+	   (MHD_YES == end_stream) )
+	flags |= MHD_HTTP2_FLAG_END_STREAM;
+      if (MHD_NO == queue_frame (connection,
+				 (0 == off) ? MHD_HTTP2_HEADERS : MHD_HTTP2_CONTINUATION,
+				 flags,
+				 stream->id,
+				 &block[off],
+				 chunk))
+	return;
+      off += chunk;
+    }
+  while (off < len);
+}
+
+
+/**
+ * Queue the header (or, with 'kind' MHD_FOOTER_KIND, the trailer)
+ * of the response of a stream.
+ *
+ * @param connection HTTP/2 connection
+ * @param stream stream to answer
+ * @param kind MHD_HEADER_KIND or MHD_FOOTER_KIND
+ * @param end_stream MHD_YES if nothing follows
+ * @return MHD_YES on success, MHD_NO if we ran out of memory
+ */
+static int
+queue_response_header (struct MHD_Connection *connection,
+		       struct MHD_Http2Stream *stream,
+		       enum MHD_ValueKind kind,
+		       int end_stream)
+{
+  struct MHD_Connection *c = &stream->connection;
+  struct MHD_Response *response = c->response;
+  struct MHD_HTTP_Header *pos;
+  unsigned char *block;
+  size_t size;
+  size_t off;
+  unsigned int rc;
+  char date[128];
+  char clen[32];
+  char status[8];
+
+  rc = c->responseCode & (~MHD_ICY_FLAG);
+  if ( (rc < 100) || (rc > 999) )
+    rc = MHD_HTTP_INTERNAL_SERVER_ERROR;
+  date[0] = '\0';
+  clen[0] = '\0';
+  if (MHD_HEADER_KIND == kind)
+    {
+      if ( (0 == (connection->daemon->options & MHD_SUPPRESS_DATE_NO_CLOCK)) &&
+	   (NULL == MHD_get_response_header (response, MHD_HTTP_HEADER_DATE)) )
+	MHD_format_http_date (time (NULL), date);
+      if ( (MHD_SIZE_UNKNOWN != response->total_size) &&
+	   (rc != MHD_HTTP_NO_CONTENT) &&
+	   (rc != MHD_HTTP_NOT_MODIFIED) &&
+	   (NULL == MHD_get_response_header (response,
+					     MHD_HTTP_HEADER_CONTENT_LENGTH)) )
+	SPRINTF (clen,
+		 "%" MHD_LONG_LONG_PRINTF "u",
+		 (unsigned MHD_LONG_LONG) response->total_size);
+    }
+  /* estimate size */
+  size = 16 + strlen (date) + 32 + strlen (clen) + 32 + 32;
+  for (pos = response->first_header; NULL != pos; pos = pos->next)
+    if (pos->kind == kind)
+      size += strlen (pos->header) + strlen (pos->value) + 16;
+  block = malloc (size);
+  if (NULL == block)
+    return MHD_NO;
+  off = 0;
+  if (MHD_HEADER_KIND == kind)
+    {
+      switch (rc)
+	{
+	case MHD_HTTP_OK:
+	  block[off++] = 0x80 | 8;
+	  break;
+	case MHD_HTTP_NO_CONTENT:
+	  block[off++] = 0x80 | 9;
+	  break;
+	case MHD_HTTP_PARTIAL_CONTENT:
+	  block[off++] = 0x80 | 10;
+	  break;
+	case MHD_HTTP_NOT_MODIFIED:
+	  block[off++] = 0x80 | 11;
+	  break;
+	case MHD_HTTP_BAD_REQUEST:
+	  block[off++] = 0x80 | 12;
+	  break;
+	case MHD_HTTP_NOT_FOUND:
+	  block[off++] = 0x80 | 13;
+	  break;
+	case MHD_HTTP_INTERNAL_SERVER_ERROR:
+	  block[off++] = 0x80 | 14;
+	  break;
+	default:
+	  SPRINTF (status, "%u", rc);
+	  off += hpack_encode_int (&block[off], 0x00, 4, 8);
+	  off += hpack_encode_string (&block[off], status, MHD_NO);
+	  break;
+	}
+      if ('\0' != date[0])
+	off += hpack_encode_field (&block[off], MHD_HTTP_HEADER_DATE, date);
+      if ('\0' != clen[0])
+	off += hpack_encode_field (&block[off],
+				   MHD_HTTP_HEADER_CONTENT_LENGTH, clen);
+      if ( (0 != (connection->daemon->options & MHD_USE_RANGE_REQUESTS)) &&
+	   (rc == MHD_HTTP_OK) &&
+	   (MHD_YES == MHD_response_is_seekable (response)) &&
+	   (NULL == MHD_get_response_header (response,
+					     MHD_HTTP_HEADER_ACCEPT_RANGES)) )
+	off += hpack_encode_field (&block[off],
+				   MHD_HTTP_HEADER_ACCEPT_RANGES, "bytes");
+    }
+  for (pos = response->first_header; NULL != pos; pos = pos->next)
+    if ( (pos->kind == kind) &&
+	 ('\0' != pos->header[0]) &&
+	 (MHD_NO == is_connection_specific (pos->header)) )
+      off += hpack_encode_field (&block[off], pos->header, pos->value);
+  queue_header_block (connection, stream, block, off, end_stream);
+  free (block);
+  return MHD_YES;
+}
+
+
+/**
+ * Start sending the response of a stream.
+ *
+ * @param connection HTTP/2 connection
+ * @param stream stream with a response
+ * @return MHD_YES (we queued frames)
+ */
+static int
+stream_send_header (struct MHD_Connection *connection,
+		    struct MHD_Http2Stream *stream)
+{
+  struct MHD_Connection *c = &stream->connection;
+  struct MHD_Response *response = c->response;
+  unsigned int rc;
+  int body;
+  int footers;
+
+  rc = c->responseCode & (~MHD_ICY_FLAG);
+  body = ( (response->total_size != c->response_write_position) &&
+	   (0 != strcasecmp (c->method, MHD_HTTP_METHOD_HEAD)) &&
+	   (rc >= 200) &&
+	   (rc != MHD_HTTP_NO_CONTENT) &&
+	   (rc != MHD_HTTP_NOT_MODIFIED) ) ? MHD_YES : MHD_NO;
+  footers = have_footers (response);
+  if (MHD_NO == queue_response_header (connection, stream, MHD_HEADER_KIND,
+				       ( (MHD_NO == body) &&
+					 (MHD_NO == footers) ) ? MHD_YES : MHD_NO))
+    {
+      stream_reset (connection, stream, MHD_HTTP2_INTERNAL_ERROR);
+      return MHD_YES;
+    }
+  if (MHD_YES == body)
+    c->state = MHD_CONNECTION_NORMAL_BODY_READY;
+  else if (MHD_YES == footers)
+    c->state = MHD_CONNECTION_BODY_SENT;
+  else
+    stream_complete (connection, stream);
+  return MHD_YES;
+}
+
+
+/**
+ * Send what follows the body of a response: the trailers, or an
+ * empty DATA frame to end the stream.
+ *
+ * @param connection HTTP/2 connection
+ * @param stream stream that sent its body
+ * @return MHD_YES (we queued frames)
+ */
+static int
+stream_send_end (struct MHD_Connection *connection,
+		 struct MHD_Http2Stream *stream)
+{
+  if (MHD_YES == have_footers (stream->connection.response))
+    {
+      if (MHD_NO == queue_response_header (connection, stream,
+					   MHD_FOOTER_KIND, MHD_YES))
+	{
+	  stream_reset (connection, stream, MHD_HTTP2_INTERNAL_ERROR);
+	  return MHD_YES;
+	}
+    }
+  else
+    {
+      (void) queue_frame (connection, MHD_HTTP2_DATA,
+			  MHD_HTTP2_FLAG_END_STREAM, stream->id,
+			  NULL, 0);
+    }
+  stream_complete (connection, stream);
+  return MHD_YES;
+}
+
+
+/**
+ * Queue the next DATA frame of the response of a stream, as far as
+ * the flow-control windows allow.
+ *
+ * @param connection HTTP/2 connection
+ * @param stream stream sending its body
+ * @return MHD_YES if we queued a frame, MHD_NO if the stream has to
+ *         wait (for a window update or the application)
+ */
+static int
+stream_send_data (struct MHD_Connection *connection,
+		  struct MHD_Http2Stream *stream)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  struct MHD_Connection *c = &stream->connection;
+  struct MHD_Response *response = c->response;
+  unsigned char *frame;
+  int64_t max;
+  ssize_t ret;
+  int end;
+
+  max = session->peer_max_frame;
+  if (session->send_window < max)
+    max = session->send_window;
+  if (stream->send_window < max)
+    max = stream->send_window;
+  if ( (MHD_SIZE_UNKNOWN != response->total_size) &&
+       (response->total_size - c->response_write_position < (uint64_t) max) )
+    max = response->total_size - c->response_write_position;
+  if (max <= 0)
+    return MHD_NO;
+  frame = out_reserve (connection, MHD_HTTP2_FRAME_HEADER + max);
+  if (NULL == frame)
+    return MHD_NO;
+  if (NULL == response->crc)
+    {
+      memcpy (&frame[MHD_HTTP2_FRAME_HEADER],
+	      &response->data[c->response_write_position - response->data_start],
+	      max);
+      ret = max;
+    }
+  else
+    {
+      pthread_mutex_lock (&response->mutex);
+      ret = response->crc (response->crc_cls,
+			   c->response_write_position,
+			   (char *) &frame[MHD_HTTP2_FRAME_HEADER],
+			   max);
+      pthread_mutex_unlock (&response->mutex);
+    }
+  if (ret <= 0)
+    session->out_append -= MHD_HTTP2_FRAME_HEADER + max;
+  if ( (0 == ret) &&
+       (-1 == response->pipe_fd) &&
+       (0 != (connection->daemon->options & MHD_USE_SELECT_INTERNALLY)) )
+    mhd_panic (mhd_panic_cls, __FILE__, __LINE__,
+#if HAVE_MESSAGES
+	       "API violation"
+#else
+	       NULL
+#endif
+	       );
+  if (0 == ret)
+    {
+      /* the application has nothing yet, try again later */
+      c->state = MHD_CONNECTION_NORMAL_BODY_UNREADY;
+      connection->response_unready = MHD_YES;
+      return MHD_NO;
+    }
+  if ( (MHD_CONTENT_READER_END_OF_STREAM == ret) &&
+       (MHD_SIZE_UNKNOWN == response->total_size) )
+    return stream_send_end (connection, stream);
+  if (ret < 0)
+    {
+      stream_reset (connection, stream, MHD_HTTP2_INTERNAL_ERROR);
+      return MHD_YES;
+    }
+  c->state = MHD_CONNECTION_NORMAL_BODY_READY;
+  session->out_append -= max - ret;
+  c->response_write_position += ret;
+  session->send_window -= ret;
+  stream->send_window -= ret;
+  end = ( (response->total_size == c->response_write_position) &&
+	  (MHD_NO == have_footers (response)) ) ? MHD_YES : MHD_NO;
+  frame_header (frame, ret, MHD_HTTP2_DATA,
+		(MHD_YES == end) ? MHD_HTTP2_FLAG_END_STREAM : 0,
+		stream->id);
+  if (MHD_YES == end)
+    stream_complete (connection, stream);
+  else if (response->total_size == c->response_write_position)
+    c->state = MHD_CONNECTION_BODY_SENT;
+  return MHD_YES;
+}
+
+
+/**
+ * Queue the next frame of the response of a stream, if it has one.
+ *
+ * @param connection HTTP/2 connection
+ * @param stream stream to send for
+ * @return MHD_YES if we queued a frame
+ */
+static int
+stream_send (struct MHD_Connection *connection,
+	     struct MHD_Http2Stream *stream)
+{
+  struct MHD_Connection *c = &stream->connection;
+
+  switch (c->state)
+    {
+    case MHD_CONNECTION_FOOTERS_RECEIVED:
+      if (NULL == c->response)
+	return MHD_NO;
+      return stream_send_header (connection, stream);
+    case MHD_CONNECTION_NORMAL_BODY_READY:
+    case MHD_CONNECTION_NORMAL_BODY_UNREADY:
+      return stream_send_data (connection, stream);
+    case MHD_CONNECTION_BODY_SENT:
+      return stream_send_end (connection, stream);
+    default:
+      return MHD_NO;
+    }
+}
+
+
+/**
+ * Queue frames of the responses of all streams until the output
+ * buffer is full, giving each stream one frame in turn so that
+ * concurrent responses share the connection fairly.
+ *
+ * @param connection HTTP/2 connection
+ */
+static void
+fill_output (struct MHD_Connection *connection)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  struct MHD_Http2Stream *stream;
+  unsigned int n;
+  int progress;
+
+  if (MHD_YES == session->closing)
+    return;
+  do
+    {
+      progress = MHD_NO;
+      for (n = session->num_streams; n > 0; n--)
+	{
+	  if ( (MHD_CONNECTION_CLOSED == connection->state) ||
+	       (session->out_append - session->out_send >= MHD_HTTP2_OUT_HIGH) )
+	    return;
+	  /* move the stream to the end of the list before it sends,
+	     it may be gone afterwards */
+	  stream = session->streams_head;
+	  DLL_remove (session->streams_head,
+		      session->streams_tail,
+		      stream);
+	  stream_append (session, stream);
+	  if (MHD_YES == stream_send (connection, stream))
+	    progress = MHD_YES;
+	}
+    }
+  while (MHD_YES == progress);
+}
+
+
+/**
+ * Run the handler of the application for a stream as far as the
+ * request received so far allows (mirrors what the idle handler
+ * does for HTTP/1.x requests).
+ *
+ * @param connection HTTP/2 connection
+ * @param stream stream to process
+ */
+static void
+stream_process (struct MHD_Connection *connection,
+		struct MHD_Http2Stream *stream)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  struct MHD_Connection *c = &stream->connection;
+  struct MHD_Daemon *daemon = connection->daemon;
+  size_t processed;
+  size_t consumed;
+
+  switch (c->state)
+    {
+    case MHD_CONNECTION_HEADERS_PROCESSED:
+      processed = 0;
+      c->client_aware = MHD_YES;
+      if (MHD_NO == daemon->default_handler (daemon->default_handler_cls,
+					     c, c->url, c->method, c->version,
+					     NULL, &processed,
+					     &c->client_context))
+	{
+	  stream_reset (connection, stream, MHD_HTTP2_INTERNAL_ERROR);
+	  return;
+	}
+      if (NULL != c->response)
+	return; /* answered early, the body (if any) is discarded */
+      c->state = MHD_CONNECTION_CONTINUE_SENT;
+      /* fall through */
+    case MHD_CONNECTION_CONTINUE_SENT:
+      while (stream->upload_off > 0)
+	{
+	  processed = stream->upload_off;
+	  if (MHD_NO == daemon->default_handler (daemon->default_handler_cls,
+						 c, c->url, c->method, c->version,
+						 stream->upload, &processed,
+						 &c->client_context))
+	    {
+	      stream_reset (connection, stream, MHD_HTTP2_INTERNAL_ERROR);
+	      return;
+	    }
+	  if (processed > stream->upload_off)
+	    mhd_panic (mhd_panic_cls, __FILE__, __LINE__,
+#if HAVE_MESSAGES
+		       "API violation"
+#else
+		       NULL
+#endif
+		       );
+	  consumed = stream->upload_off - processed;
+	  if (0 == consumed)
+	    break; /* the application wants more data first */
+	  memmove (stream->upload, &stream->upload[consumed], processed);
+	  stream->upload_off = processed;
+	  stream->recv_credit += consumed;
+	  session->recv_credit += consumed;
+	}
+      if ( (MHD_NO == stream->remote_closed) ||
+	   (stream->upload_off > 0) )
+	return;
+      c->state = MHD_CONNECTION_FOOTERS_RECEIVED;
+      /* fall through */
+    case MHD_CONNECTION_FOOTERS_RECEIVED:
+      if (NULL != c->response)
+	return;
+      processed = 0;
+      c->client_aware = MHD_YES;
+      if (MHD_NO == daemon->default_handler (daemon->default_handler_cls,
+					     c, c->url, c->method, c->version,
+					     NULL, &processed,
+					     &c->client_context))
+	stream_reset (connection, stream, MHD_HTTP2_INTERNAL_ERROR);
+      return;
+    case MHD_CONNECTION_CLOSED:
+      /* failed in one of the HTTP/1.x helpers */
+      stream_reset (connection, stream, MHD_HTTP2_INTERNAL_ERROR);
+      return;
+    default:
+      return;
+    }
+}
+
+
+/**
+ * Duplicate a decoded string into the memory pool of a stream.
+ *
+ * @param c connection of the stream
+ * @param str string to copy
+ * @param len length of 'str'
+ * @return the copy, NULL if the pool is full
+ */
+static char *
+pool_strndup (struct MHD_Connection *c,
+	      const char *str,
+	      size_t len)
+{
+  char *copy;
+
+  copy = MHD_pool_allocate (c->pool, len + 1, MHD_YES);
+  if (NULL == copy)
+    return NULL;
+  memcpy (copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+
+/**
+ * Add a header field of a request header block (or trailer) to the
+ * request of a stream.
+ *
+ * @param cls the 'struct MHD_Http2HeaderContext'
+ * @param name name of the field
+ * @param name_len length of 'name'
+ * @param value value of the field
+ * @param value_len length of 'value'
+ */
+static void
+stream_add_field (void *cls,
+		  const char *name, size_t name_len,
+		  const char *value, size_t value_len)
+{
+  struct MHD_Http2HeaderContext *ctx = cls;
+  struct MHD_Connection *c = &ctx->stream->connection;
+  struct MHD_HTTP_Header *pos;
+  char **pseudo;
+  char *n;
+  char *v;
+  char *joined;
+  size_t i;
+
+  if ( (MHD_YES == ctx->malformed) ||
+       (MHD_YES == ctx->too_big) )
+    return;
+  if ( (0 == name_len) ||
+       (NULL != memchr (name, '\0', name_len)) ||
+       (NULL != memchr (value, '\0', value_len)) ||
+       (NULL != memchr (value, '\r', value_len)) ||
+       (NULL != memchr (value, '\n', value_len)) )
+    {
+      ctx->malformed = MHD_YES;
+      return;
+    }
+  if (':' == name[0])
+    {
+      /* pseudo-header fields only come first, and only in requests */
+      pseudo = NULL;
+      if ( (MHD_NO == ctx->trailers) &&
+	   (MHD_NO == ctx->regular_seen) )
+	{
+	  if (0 == strcmp (name, ":method"))
+	    pseudo = &ctx->method;
+	  else if (0 == strcmp (name, ":path"))
+	    pseudo = &ctx->path;
+	  else if (0 == strcmp (name, ":scheme"))
+	    pseudo = &ctx->scheme;
+	  else if (0 == strcmp (name, ":authority"))
+	    pseudo = &ctx->authority;
+	}
+      if ( (NULL == pseudo) ||
+	   (NULL != *pseudo) )
+	{
+	  ctx->malformed = MHD_YES;
+	  return;
+	}
+      *pseudo = pool_strndup (c, value, value_len);
+      if (NULL == *pseudo)
+	ctx->too_big = MHD_YES;
+      return;
+    }
+  ctx->regular_seen = MHD_YES;
+  for (i = 0; i < name_len; i++)
+    if ( (name[i] >= 'A') && (name[i] <= 'Z') )
+      {
+	ctx->malformed = MHD_YES;
+	return;
+      }
+  if ( (MHD_YES == is_connection_specific (name)) ||
+       ( (0 == strcmp (name, "te")) &&
+	 (0 != strcmp (value, "trailers")) ) )
+    {
+      ctx->malformed = MHD_YES;
+      return;
+    }
+  if ( (MHD_NO == ctx->trailers) &&
+       (0 == strcmp (name, "cookie")) )
+    {
+      /* cookies may be split into several fields (RFC 7540, 8.1.2.5) */
+      for (pos = c->headers_received; NULL != pos; pos = pos->next)
+	if ( (MHD_HEADER_KIND == pos->kind) &&
+	     (0 == strcmp (pos->header, "cookie")) )
+	  break;
+      if (NULL != pos)
+	{
+	  joined = MHD_pool_allocate (c->pool,
+				      strlen (pos->value) + 2 + value_len + 1,
+				      MHD_YES);
+	  if (NULL == joined)
+	    {
+	      ctx->too_big = MHD_YES;
+	      return;
+	    }
+	  strcpy (joined, pos->value);
+	  strcat (joined, "; ");
+	  memcpy (&joined[strlen (joined)], value, value_len);
+	  joined[strlen (pos->value) + 2 + value_len] = '\0';
+	  pos->value = joined;
+	  return;
+	}
+    }
+  n = pool_strndup (c, name, name_len);
+  v = pool_strndup (c, value, value_len);
+  if ( (NULL == n) ||
+       (NULL == v) ||
+       (MHD_NO == MHD_set_connection_value (c,
+					    (MHD_YES == ctx->trailers)
+					    ? MHD_FOOTER_KIND
+					    : MHD_HEADER_KIND,
+					    n, v)) )
+    ctx->too_big = MHD_YES;
+}
+
+
+/**
+ * Answer a request whose header does not fit into the memory pool
+ * with "413 Request Entity Too Large".
+ *
+ * @param stream stream to answer
+ */
+static void
+stream_refuse_too_big (struct MHD_Http2Stream *stream)
+{
+  struct MHD_Connection *c = &stream->connection;
+  struct MHD_Response *response;
+
+#if HAVE_MESSAGES
+  MHD_DLOG (c->daemon,
+	    "Not enough memory to allocate header record!\n");
+#endif
+  if (NULL == c->method)
+    c->method = MHD_HTTP_METHOD_GET;
+  c->state = MHD_CONNECTION_FOOTERS_RECEIVED;
+  response = MHD_create_response_from_buffer (0, NULL,
+					      MHD_RESPMEM_PERSISTENT);
+  if (NULL == response)
+    {
+      c->state = MHD_CONNECTION_CLOSED;
+      return;
+    }
+  MHD_queue_response (c, MHD_HTTP_REQUEST_ENTITY_TOO_LARGE, response);
+  MHD_destroy_response (response);
+}
+
+
+/**
+ * Start processing the request of a new stream whose header block
+ * we decoded.
+ *
+ * @param connection HTTP/2 connection
+ * @param stream the new stream
+ * @param ctx what we decoded
+ * @return MHD_YES on success, MHD_NO if the request is malformed
+ */
+static int
+stream_start (struct MHD_Connection *connection,
+	      struct MHD_Http2Stream *stream,
+	      struct MHD_Http2HeaderContext *ctx)
+{
+  struct MHD_Connection *c = &stream->connection;
+  const char *clen;
+  char *end;
+
+  if ( (MHD_YES == ctx->malformed) ||
+       (NULL == ctx->method) ||
+       (NULL == ctx->path) ||
+       (NULL == ctx->scheme) ||
+       ('\0' == ctx->path[0]) )
+    return MHD_NO;
+  if (MHD_YES == ctx->too_big)
+    {
+      c->method = ctx->method;
+      stream_refuse_too_big (stream);
+      return MHD_YES;
+    }
+  c->method = ctx->method;
+  clen = MHD_lookup_connection_value (c, MHD_HEADER_KIND,
+				      MHD_HTTP_HEADER_CONTENT_LENGTH);
+  if (NULL != clen)
+    {
+      errno = 0;
+      stream->content_length = strtoull (clen, &end, 10);
+      if ( ('\0' == clen[0]) ||
+	   ('\0' != *end) ||
+	   (ERANGE == errno) )
+	return MHD_NO;
+      if ( (MHD_YES == stream->remote_closed) &&
+	   (0 != stream->content_length) )
+	return MHD_NO;
+    }
+  if ( (NULL != ctx->authority) &&
+       (NULL == MHD_lookup_connection_value (c, MHD_HEADER_KIND,
+					     MHD_HTTP_HEADER_HOST)) &&
+       (MHD_NO == MHD_set_connection_value (c, MHD_HEADER_KIND,
+					    MHD_HTTP_HEADER_HOST,
+					    ctx->authority)) )
+    {
+      stream_refuse_too_big (stream);
+      return MHD_YES;
+    }
+  /* these answer with an error themselves if the pool is full */
+  MHD_connection_parse_uri_ (c, ctx->path);
+  if (NULL == c->response)
+    MHD_connection_parse_cookies_ (c);
+  if (NULL != c->response)
+    c->state = MHD_CONNECTION_FOOTERS_RECEIVED;
+  else if (MHD_CONNECTION_CLOSED != c->state)
+    c->state = MHD_CONNECTION_HEADERS_PROCESSED;
+  return MHD_YES;
+}
+
+
+/**
+ * Create a stream for a new request.
+ *
+ * @param connection HTTP/2 connection
+ * @param id stream identifier
+ * @return NULL if we are out of memory
+ */
+static struct MHD_Http2Stream *
+stream_create (struct MHD_Connection *connection,
+	       uint32_t id)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  struct MHD_Http2Stream *stream;
+  struct MHD_Connection *c;
+
+  stream = malloc (sizeof (struct MHD_Http2Stream));
+  if (NULL == stream)
+    return NULL;
+  memset (stream, 0, sizeof (struct MHD_Http2Stream));
+  c = &stream->connection;
+  c->pool = MHD_pool_create (connection->daemon->pool_size);
+  if (NULL == c->pool)
+    {
+      free (stream);
+      return NULL;
+    }
+  c->daemon = connection->daemon;
+  c->addr = connection->addr;
+  c->addr_len = connection->addr_len;
+  c->pid = connection->pid;
+  c->socket_fd = -1;
+  c->itc[0] = -1;
+  c->itc[1] = -1;
+  c->connection_timeout = connection->connection_timeout;
+  c->last_activity = connection->last_activity;
+  c->version = MHD_HTTP_VERSION_2_0;
+  c->state = MHD_CONNECTION_INIT;
+  c->http2_parent = connection;
+#if HTTPS_SUPPORT
+  c->tls_session = connection->tls_session;
+  c->ktls = connection->ktls;
+#endif
+  stream->id = id;
+  stream->content_length = MHD_SIZE_UNKNOWN;
+  stream->send_window = session->peer_initial_window;
+  stream->recv_window = session->stream_window;
+  stream_append (session, stream);
+  session->num_streams++;
+  return stream;
+}
+
+
+/**
+ * A header block is complete: decode it and start (or finish) the
+ * request it belongs to.
+ *
+ * @param connection HTTP/2 connection
+ */
+static void
+headers_complete (struct MHD_Connection *connection)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  struct MHD_Http2Stream *stream;
+  struct MHD_Http2HeaderContext ctx;
+  uint32_t id;
+  int end_stream;
+  int ret;
+
+  id = session->block_stream;
+  session->block_stream = 0;
+  end_stream = (0 != (session->block_flags & MHD_HTTP2_FLAG_END_STREAM));
+  memset (&ctx, 0, sizeof (ctx));
+  stream = stream_find (session, id);
+  if (NULL != stream)
+    {
+      /* trailer of the request */
+      ctx.stream = stream;
+      ctx.trailers = MHD_YES;
+      if (MHD_NO == hpack_decode_block (session, session->block,
+					session->block_len,
+					&stream_add_field, &ctx))
+	{
+	  session_fail (connection, MHD_HTTP2_COMPRESSION_ERROR,
+			"invalid header block");
+	  return;
+	}
+      if ( (MHD_YES == stream->remote_closed) ||
+	   (MHD_NO == end_stream) ||
+	   (MHD_YES == ctx.malformed) ||
+	   ( (MHD_SIZE_UNKNOWN != stream->content_length) &&
+	     (stream->received != stream->content_length) ) )
+	{
+	  stream_reset (connection, stream,
+			(MHD_YES == stream->remote_closed)
+			? MHD_HTTP2_STREAM_CLOSED
+			: MHD_HTTP2_PROTOCOL_ERROR);
+	  return;
+	}
+      stream->remote_closed = MHD_YES;
+      return;
+    }
+  if ( (id <= session->last_stream_id) ||
+       (MHD_YES == session->goaway_received) ||
+       (session->num_streams >= MHD_HTTP2_MAX_STREAMS) )
+    {
+      /* closed stream or one we refuse; decode to keep the
+	 compression state in sync */
+      if (MHD_NO == hpack_decode_block (session, session->block,
+					session->block_len,
+					NULL, NULL))
+	{
+	  session_fail (connection, MHD_HTTP2_COMPRESSION_ERROR,
+			"invalid header block");
+	  return;
+	}
+      if (id > session->last_stream_id)
+	{
+	  session->last_stream_id = id;
+	  queue_uint32_frame (connection, MHD_HTTP2_RST_STREAM,
+			      id, MHD_HTTP2_REFUSED_STREAM);
+	}
+      return;
+    }
+  session->last_stream_id = id;
+  stream = stream_create (connection, id);
+  if (NULL == stream)
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (connection->daemon,
+		"Not enough memory to accept HTTP/2 stream!\n");
+#endif
+      if (MHD_NO == hpack_decode_block (session, session->block,
+					session->block_len,
+					NULL, NULL))
+	session_fail (connection, MHD_HTTP2_COMPRESSION_ERROR,
+		      "invalid header block");
+      else
+	queue_uint32_frame (connection, MHD_HTTP2_RST_STREAM,
+			    id, MHD_HTTP2_REFUSED_STREAM);
+      return;
+    }
+  stream->remote_closed = end_stream ? MHD_YES : MHD_NO;
+  ctx.stream = stream;
+  ret = hpack_decode_block (session, session->block, session->block_len,
+			    &stream_add_field, &ctx);
+  if (MHD_NO == ret)
+    {
+      stream_close (connection, stream, MHD_REQUEST_TERMINATED_WITH_ERROR);
+      session_fail (connection, MHD_HTTP2_COMPRESSION_ERROR,
+		    "invalid header block");
+      return;
+    }
+  if (MHD_NO == stream_start (connection, stream, &ctx))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (connection->daemon,
+		"Received malformed HTTP/2 request\n");
+#endif
+      stream_reset (connection, stream, MHD_HTTP2_PROTOCOL_ERROR);
+    }
+}
+
+
+/**
+ * Add data to the header block being received.
+ *
+ * @param connection HTTP/2 connection
+ * @param data fragment of the block
+ * @param len length of 'data'
+ * @return MHD_YES on success, MHD_NO if the connection failed
+ */
+static int
+block_append (struct MHD_Connection *connection,
+	      const unsigned char *data,
+	      size_t len)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  unsigned char *block;
+  size_t size;
+
+  if (session->block_len + len > MHD_HTTP2_MAX_HEADER_BLOCK)
+    {
+      session_fail (connection, MHD_HTTP2_ENHANCE_YOUR_CALM,
+		    "header block too large");
+      return MHD_NO;
+    }
+  if (session->block_len + len > session->block_size)
+    {
+      size = MHD_MAX (2 * session->block_size, session->block_len + len);
+      block = realloc (session->block, size);
+      if (NULL == block)
+	{
+	  session_fail (connection, MHD_HTTP2_INTERNAL_ERROR,
+			"out of memory");
+	  return MHD_NO;
+	}
+      session->block = block;
+      session->block_size = size;
+    }
+  memcpy (&session->block[session->block_len], data, len);
+  session->block_len += len;
+  return MHD_YES;
+}
+
+
+/**
+ * Remove the padding of a padded frame.
+ *
+ * @param flags flags of the frame
+ * @param payload payload, advanced past the pad length
+ * @param len length of the payload, reduced by the padding
+ * @return MHD_YES on success, MHD_NO if the padding is invalid
+ */
+static int
+strip_padding (unsigned int flags,
+	       const unsigned char **payload,
+	       size_t *len)
+{
+  size_t pad;
+
+  if (0 == (flags & MHD_HTTP2_FLAG_PADDED))
+    return MHD_YES;
+  if (0 == *len)
+    return MHD_NO;
+  pad = (*payload)[0];
+  if (pad >= *len)
+    return MHD_NO;
+  (*payload)++;
+  *len -= 1 + pad;
+  return MHD_YES;
+}
+
+
+/**
+ * Handle a HEADERS frame.
+ *
+ * @param connection HTTP/2 connection
+ * @param flags flags of the frame
+ * @param id stream identifier
+ * @param payload payload of the frame
+ * @param len length of 'payload'
+ */
+static void
+handle_headers (struct MHD_Connection *connection,
+		unsigned int flags,
+		uint32_t id,
+		const unsigned char *payload,
+		size_t len)
+{
+  struct MHD_Http2Session *session = connection->http2;
+
+  if ( (0 == id) ||
+       (0 == (id & 1)) ||
+       (MHD_NO == strip_padding (flags, &payload, &len)) )
+    {
+      session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+		    "invalid HEADERS frame");
+      return;
+    }
+  if (0 != (flags & MHD_HTTP2_FLAG_PRIORITY))
+    {
+      /* we do not prioritize */
+      if (len < 5)
+	{
+	  session_fail (connection, MHD_HTTP2_FRAME_SIZE_ERROR,
+			"invalid HEADERS frame");
+	  return;
+	}
+      payload += 5;
+      len -= 5;
+    }
+  session->block_len = 0;
+  session->block_stream = id;
+  session->block_flags = flags;
+  if (MHD_NO == block_append (connection, payload, len))
+    return;
+  if (0 != (flags & MHD_HTTP2_FLAG_END_HEADERS))
+    headers_complete (connection);
+}
+
+
+/**
+ * Handle a DATA frame.
+ *
+ * @param connection HTTP/2 connection
+ * @param flags flags of the frame
+ * @param id stream identifier
+ * @param payload payload of the frame
+ * @param len length of 'payload'
+ */
+static void
+handle_data (struct MHD_Connection *connection,
+	     unsigned int flags,
+	     uint32_t id,
+	     const unsigned char *payload,
+	     size_t len)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  struct MHD_Http2Stream *stream;
+  struct MHD_Connection *c;
+  size_t frame_len;
+  size_t size;
+  char *upload;
+
+  frame_len = len;
+  if ( (0 == id) ||
+       (MHD_NO == strip_padding (flags, &payload, &len)) )
+    {
+      session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+		    "invalid DATA frame");
+      return;
+    }
+  /* flow control covers the whole frame, padding included */
+  if ((int64_t) frame_len > session->recv_window)
+    {
+      session_fail (connection, MHD_HTTP2_FLOW_CONTROL_ERROR,
+		    "peer exceeded the connection window");
+      return;
+    }
+  session->recv_window -= frame_len;
+  stream = stream_find (session, id);
+  if (NULL == stream)
+    {
+      if (id > session->last_stream_id)
+	{
+	  session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+			"DATA on idle stream");
+	  return;
+	}
+      session->recv_credit += frame_len; /* stream we closed, drop */
+      return;
+    }
+  session->recv_credit += frame_len - len;
+  if (MHD_YES == stream->remote_closed)
+    {
+      session->recv_credit += len;
+      stream_reset (connection, stream, MHD_HTTP2_STREAM_CLOSED);
+      return;
+    }
+  if ((int64_t) frame_len > stream->recv_window)
+    {
+      session->recv_credit += len;
+      stream_reset (connection, stream, MHD_HTTP2_FLOW_CONTROL_ERROR);
+      return;
+    }
+  stream->recv_window -= frame_len;
+  stream->recv_credit += frame_len - len;
+  stream->received += len;
+  if (0 != (flags & MHD_HTTP2_FLAG_END_STREAM))
+    stream->remote_closed = MHD_YES;
+  if ( (MHD_SIZE_UNKNOWN != stream->content_length) &&
+       ( (stream->received > stream->content_length) ||
+	 ( (MHD_YES == stream->remote_closed) &&
+	   (stream->received != stream->content_length) ) ) )
+    {
+      session->recv_credit += len;
+      stream_reset (connection, stream, MHD_HTTP2_PROTOCOL_ERROR);
+      return;
+    }
+  c = &stream->connection;
+  if ( (MHD_CONNECTION_HEADERS_PROCESSED != c->state) &&
+       (MHD_CONNECTION_CONTINUE_SENT != c->state) )
+    {
+      /* response already queued, the application does not want it */
+      session->recv_credit += len;
+      stream->recv_credit += len;
+      return;
+    }
+  if (stream->upload_off + len > stream->upload_size)
+    {
+      size = MHD_MAX (stream->upload_off + len, 2 * stream->upload_size);
+      size = MHD_MIN (size, session->stream_window);
+      upload = realloc (stream->upload, size);
+      if (NULL == upload)
+	{
+	  session->recv_credit += len;
+	  stream_reset (connection, stream, MHD_HTTP2_INTERNAL_ERROR);
+	  return;
+	}
+      stream->upload = upload;
+      stream->upload_size = size;
+    }
+  memcpy (&stream->upload[stream->upload_off], payload, len);
+  stream->upload_off += len;
+}
+
+
+/**
+ * Handle a SETTINGS frame.
+ *
+ * @param connection HTTP/2 connection
+ * @param flags flags of the frame
+ * @param id stream identifier
+ * @param payload payload of the frame
+ * @param len length of 'payload'
+ */
+static void
+handle_settings (struct MHD_Connection *connection,
+		 unsigned int flags,
+		 uint32_t id,
+		 const unsigned char *payload,
+		 size_t len)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  struct MHD_Http2Stream *stream;
+  size_t off;
+  uint32_t value;
+  int64_t delta;
+
+  if (0 != id)
+    {
+      session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+		    "SETTINGS on a stream");
+      return;
+    }
+  if (0 != (flags & MHD_HTTP2_FLAG_ACK))
+    {
+      if (0 != len)
+	session_fail (connection, MHD_HTTP2_FRAME_SIZE_ERROR,
+		      "SETTINGS acknowledgement with payload");
+      return;
+    }
+  if (0 != len % 6)
+    {
+      session_fail (connection, MHD_HTTP2_FRAME_SIZE_ERROR,
+		    "invalid SETTINGS frame");
+      return;
+    }
+  for (off = 0; off < len; off += 6)
+    {
+      value = get_uint32 (&payload[off + 2]);
+      switch ((payload[off] << 8) | payload[off + 1])
+	{
+	case MHD_HTTP2_SETTINGS_ENABLE_PUSH:
+	  if (value > 1)
+	    {
+	      session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+			    "invalid SETTINGS_ENABLE_PUSH");
+	      return;
+	    }
+	  break;
+	case MHD_HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
+	  if (value > MHD_HTTP2_MAX_WINDOW)
+	    {
+	      session_fail (connection, MHD_HTTP2_FLOW_CONTROL_ERROR,
+			    "invalid SETTINGS_INITIAL_WINDOW_SIZE");
+	      return;
+	    }
+	  /* applies to the streams that are already open, too */
+	  delta = (int64_t) value - session->peer_initial_window;
+	  for (stream = session->streams_head; NULL != stream; stream = stream->next)
+	    {
+	      stream->send_window += delta;
+	      if (stream->send_window > MHD_HTTP2_MAX_WINDOW)
+		{
+		  session_fail (connection, MHD_HTTP2_FLOW_CONTROL_ERROR,
+				"stream window too large");
+		  return;
+		}
+	    }
+	  session->peer_initial_window = value;
+	  break;
+	case MHD_HTTP2_SETTINGS_MAX_FRAME_SIZE:
+	  if ( (value < MHD_HTTP2_MAX_FRAME) ||
+	       (value > MHD_HTTP2_MAX_FRAME_LIMIT) )
+	    {
+	      session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+			    "invalid SETTINGS_MAX_FRAME_SIZE");
+	      return;
+	    }
+	  /* larger frames gain us nothing, we keep sending at most
+	     MHD_HTTP2_MAX_FRAME bytes per frame */
+	  break;
+	default:
+	  /* we do not compress with the dynamic table, send no
+	     push promises and ignore unknown settings */
+	  break;
+	}
+    }
+  session->got_settings = MHD_YES;
+  (void) queue_frame (connection, MHD_HTTP2_SETTINGS, MHD_HTTP2_FLAG_ACK,
+		      0, NULL, 0);
+}
+
+
+/**
+ * Handle a WINDOW_UPDATE frame.
+ *
+ * @param connection HTTP/2 connection
+ * @param id stream identifier
+ * @param payload payload of the frame
+ * @param len length of 'payload'
+ */
+static void
+handle_window_update (struct MHD_Connection *connection,
+		      uint32_t id,
+		      const unsigned char *payload,
+		      size_t len)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  struct MHD_Http2Stream *stream;
+  uint32_t increment;
+
+  if (4 != len)
+    {
+      session_fail (connection, MHD_HTTP2_FRAME_SIZE_ERROR,
+		    "invalid WINDOW_UPDATE frame");
+      return;
+    }
+  increment = get_uint32 (payload) & 0x7fffffff;
+  if (0 == id)
+    {
+      if (0 == increment)
+	{
+	  session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+			"zero WINDOW_UPDATE");
+	  return;
+	}
+      session->send_window += increment;
+      if (session->send_window > MHD_HTTP2_MAX_WINDOW)
+	session_fail (connection, MHD_HTTP2_FLOW_CONTROL_ERROR,
+		      "connection window too large");
+      return;
+    }
+  stream = stream_find (session, id);
+  if (NULL == stream)
+    {
+      if (id > session->last_stream_id)
+	session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+		      "WINDOW_UPDATE on idle stream");
+      return;
+    }
+  if (0 == increment)
+    {
+      stream_reset (connection, stream, MHD_HTTP2_PROTOCOL_ERROR);
+      return;
+    }
+  stream->send_window += increment;
+  if (stream->send_window > MHD_HTTP2_MAX_WINDOW)
+    stream_reset (connection, stream, MHD_HTTP2_FLOW_CONTROL_ERROR);
+}
+
+
+/**
+ * Handle a frame.
+ *
+ * @param connection HTTP/2 connection
+ * @param type frame type
+ * @param flags flags of the frame
+ * @param id stream identifier
+ * @param payload payload of the frame
+ * @param len length of 'payload'
+ */
+static void
+handle_frame (struct MHD_Connection *connection,
+	      unsigned int type,
+	      unsigned int flags,
+	      uint32_t id,
+	      const unsigned char *payload,
+	      size_t len)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  struct MHD_Http2Stream *stream;
+  unsigned char payload_copy[8];
+
+  if ( (MHD_NO == session->got_settings) &&
+       (MHD_HTTP2_SETTINGS != type) )
+    {
+      session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+		    "client preface lacks SETTINGS");
+      return;
+    }
+  if ( (0 != session->block_stream) &&
+       ( (MHD_HTTP2_CONTINUATION != type) ||
+	 (session->block_stream != id) ) )
+    {
+      session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+		    "header block interrupted");
+      return;
+    }
+  switch (type)
+    {
+    case MHD_HTTP2_DATA:
+      handle_data (connection, flags, id, payload, len);
+      break;
+    case MHD_HTTP2_HEADERS:
+      handle_headers (connection, flags, id, payload, len);
+      break;
+    case MHD_HTTP2_PRIORITY:
+      if (0 == id)
+	session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+		      "PRIORITY without stream");
+      else if (5 != len)
+	session_fail (connection, MHD_HTTP2_FRAME_SIZE_ERROR,
+		      "invalid PRIORITY frame");
+      break;
+    case MHD_HTTP2_RST_STREAM:
+      if ( (0 == id) ||
+	   (id > session->last_stream_id) )
+	{
+	  session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+			"RST_STREAM on idle stream");
+	  break;
+	}
+      if (4 != len)
+	{
+	  session_fail (connection, MHD_HTTP2_FRAME_SIZE_ERROR,
+			"invalid RST_STREAM frame");
+	  break;
+	}
+      stream = stream_find (session, id);
+      if (NULL != stream)
+	stream_close (connection, stream, MHD_REQUEST_TERMINATED_WITH_ERROR);
+      break;
+    case MHD_HTTP2_SETTINGS:
+      handle_settings (connection, flags, id, payload, len);
+      break;
+    case MHD_HTTP2_PUSH_PROMISE:
+      session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+		    "PUSH_PROMISE from client");
+      break;
+    case MHD_HTTP2_PING:
+      if (0 != id)
+	session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+		      "PING on a stream");
+      else if (8 != len)
+	session_fail (connection, MHD_HTTP2_FRAME_SIZE_ERROR,
+		      "invalid PING frame");
+      else if (0 == (flags & MHD_HTTP2_FLAG_ACK))
+	{
+	  memcpy (payload_copy, payload, sizeof (payload_copy));
+	  (void) queue_frame (connection, MHD_HTTP2_PING, MHD_HTTP2_FLAG_ACK,
+			      0, payload_copy, sizeof (payload_copy));
+	}
+      break;
+    case MHD_HTTP2_GOAWAY:
+      if (0 != id)
+	session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+		      "GOAWAY on a stream");
+      else if (len < 8)
+	session_fail (connection, MHD_HTTP2_FRAME_SIZE_ERROR,
+		      "invalid GOAWAY frame");
+      else
+	session->goaway_received = MHD_YES; /* finish the open streams */
+      break;
+    case MHD_HTTP2_WINDOW_UPDATE:
+      handle_window_update (connection, id, payload, len);
+      break;
+    case MHD_HTTP2_CONTINUATION:
+      if (0 == session->block_stream)
+	{
+	  session_fail (connection, MHD_HTTP2_PROTOCOL_ERROR,
+			"unexpected CONTINUATION");
+	  break;
+	}
+      if (MHD_NO == block_append (connection, payload, len))
+	break;
+      if (0 != (flags & MHD_HTTP2_FLAG_END_HEADERS))
+	headers_complete (connection);
+      break;
+    default:
+      /* unknown frame types must be ignored */
+      break;
+    }
+}
+
+
+/**
+ * Handle the complete frames in the input buffer (as long as the
+ * peer reads what we send).
+ *
+ * @param connection HTTP/2 connection
+ */
+static void
+process_input (struct MHD_Connection *connection)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  const unsigned char *hdr;
+  size_t off;
+  size_t len;
+
+  off = 0;
+  while ( (MHD_CONNECTION_CLOSED != connection->state) &&
+	  (MHD_NO == session->closing) &&
+	  (session->out_append - session->out_send < MHD_HTTP2_OUT_HIGH) &&
+	  (session->in_off - off >= MHD_HTTP2_FRAME_HEADER) )
+    {
+      hdr = &session->in[off];
+      len = ((size_t) hdr[0] << 16) | ((size_t) hdr[1] << 8) | hdr[2];
+      if (len > MHD_HTTP2_MAX_FRAME)
+	{
+	  session_fail (connection, MHD_HTTP2_FRAME_SIZE_ERROR,
+			"frame too large");
+	  break;
+	}
+      if (session->in_off - off < MHD_HTTP2_FRAME_HEADER + len)
+	break;
+      handle_frame (connection, hdr[3], hdr[4],
+		    get_uint32 (&hdr[5]) & 0x7fffffff,
+		    &hdr[MHD_HTTP2_FRAME_HEADER], len);
+      off += MHD_HTTP2_FRAME_HEADER + len;
+    }
+  if (off > 0)
+    {
+      memmove (session->in, &session->in[off], session->in_off - off);
+      session->in_off -= off;
+    }
+}
+
+
+/**
+ * Extend the windows of the peer by what the application consumed,
+ * once enough accumulated to be worth a WINDOW_UPDATE.
+ *
+ * @param connection HTTP/2 connection
+ */
+static void
+flush_credits (struct MHD_Connection *connection)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  struct MHD_Http2Stream *stream;
+  uint32_t window;
+
+  if (MHD_YES == session->closing)
+    return;
+  window = MHD_MAX (MHD_HTTP2_CONNECTION_WINDOW, 2 * session->stream_window);
+  if (session->recv_credit >= window / 4)
+    {
+      queue_uint32_frame (connection, MHD_HTTP2_WINDOW_UPDATE,
+			  0, session->recv_credit);
+      session->recv_window += session->recv_credit;
+      session->recv_credit = 0;
+    }
+  for (stream = session->streams_head; NULL != stream; stream = stream->next)
+    {
+      if ( (MHD_YES == stream->remote_closed) ||
+	   (stream->recv_credit < session->stream_window / 4) )
+	continue;
+      queue_uint32_frame (connection, MHD_HTTP2_WINDOW_UPDATE,
+			  stream->id, stream->recv_credit);
+      stream->recv_window += stream->recv_credit;
+      stream->recv_credit = 0;
+    }
+}
+
+
+int
+MHD_http2_try_start_ (struct MHD_Connection *connection)
+{
+  struct MHD_Http2Session *session;
+  unsigned char settings[12];
+  size_t settings_len;
+  size_t len;
+  uint32_t window;
+
+  if (0 == connection->read_buffer_offset)
+    return MHD_YES;
+  len = MHD_MIN (connection->read_buffer_offset, MHD_HTTP2_PREFACE_LEN);
+  if (0 != memcmp (connection->read_buffer, MHD_HTTP2_PREFACE, len))
+    {
+      connection->http2_allowed = MHD_NO;
+      return MHD_NO;
+    }
+  if (len < MHD_HTTP2_PREFACE_LEN)
+    return MHD_YES;
+  connection->http2_allowed = MHD_NO;
+  session = malloc (sizeof (struct MHD_Http2Session));
+  if (NULL == session)
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (connection->daemon,
+		"Not enough memory for HTTP/2 session!\n");
+#endif
+      MHD_connection_close (connection, MHD_REQUEST_TERMINATED_WITH_ERROR);
+      return MHD_YES;
+    }
+  memset (session, 0, sizeof (struct MHD_Http2Session));
+  len = connection->read_buffer_offset - MHD_HTTP2_PREFACE_LEN;
+  session->in_size = MHD_MAX (2 * (MHD_HTTP2_FRAME_HEADER + MHD_HTTP2_MAX_FRAME),
+			      len);
+  session->in = malloc (session->in_size);
+  if (NULL == session->in)
+    {
+      free (session);
+#if HAVE_MESSAGES
+      MHD_DLOG (connection->daemon,
+		"Not enough memory for HTTP/2 session!\n");
+#endif
+      MHD_connection_close (connection, MHD_REQUEST_TERMINATED_WITH_ERROR);
+      return MHD_YES;
+    }
+  memcpy (session->in,
+	  &connection->read_buffer[MHD_HTTP2_PREFACE_LEN],
+	  len);
+  session->in_off = len;
+  connection->read_buffer_offset = 0;
+  session->table_max = MHD_HPACK_TABLE_SIZE;
+  session->peer_initial_window = MHD_HTTP2_DEFAULT_WINDOW;
+  session->peer_max_frame = MHD_HTTP2_MAX_FRAME;
+  session->send_window = MHD_HTTP2_DEFAULT_WINDOW;
+  /* let the application buffer about as much of an upload as the
+     memory limit of a connection allows with HTTP/1.x */
+  session->stream_window = MHD_MAX (MHD_HTTP2_DEFAULT_WINDOW,
+				    connection->daemon->pool_size / 2);
+  window = MHD_MAX (MHD_HTTP2_CONNECTION_WINDOW, 2 * session->stream_window);
+  session->recv_window = window;
+  connection->http2 = session;
+  connection->version = MHD_HTTP_VERSION_2_0;
+  connection->state = MHD_CONNECTION_HTTP2;
+  /* server preface */
+  settings[0] = 0;
+  settings[1] = MHD_HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  put_uint32 (&settings[2], MHD_HTTP2_MAX_STREAMS);
+  settings_len = 6;
+  if (MHD_HTTP2_DEFAULT_WINDOW != session->stream_window)
+    {
+      settings[6] = 0;
+      settings[7] = MHD_HTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+      put_uint32 (&settings[8], session->stream_window);
+      settings_len += 6;
+    }
+  if (MHD_NO == queue_frame (connection, MHD_HTTP2_SETTINGS, 0, 0,
+			     settings, settings_len))
+    return MHD_YES;
+  queue_uint32_frame (connection, MHD_HTTP2_WINDOW_UPDATE, 0,
+		      window - MHD_HTTP2_DEFAULT_WINDOW);
+  return MHD_YES;
+}
+
+
+int
+MHD_http2_handle_read_ (struct MHD_Connection *connection)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  ssize_t ret;
+
+  if ( (MHD_YES == session->closing) ||
+       (MHD_YES == connection->read_closed) ||
+       (session->in_off == session->in_size) )
+    return MHD_YES;
+  ret = connection->recv_cls (connection,
+			      &session->in[session->in_off],
+			      session->in_size - session->in_off);
+  if (ret < 0)
+    {
+      if ((errno == EINTR) || (errno == EAGAIN))
+	return MHD_YES;
+#if HAVE_MESSAGES
+#if HTTPS_SUPPORT
+      if (0 != (connection->daemon->options & MHD_USE_SSL))
+	MHD_DLOG (connection->daemon,
+		  "Failed to receive data: %s\n",
+		  gnutls_strerror (ret));
+      else
+#endif
+	MHD_DLOG (connection->daemon,
+		  "Failed to receive data: %s\n", STRERROR (errno));
+#endif
+      MHD_connection_close (connection, MHD_REQUEST_TERMINATED_WITH_ERROR);
+      return MHD_YES;
+    }
+  if (0 == ret)
+    {
+      /* other side closed connection, whatever is open failed */
+      connection->read_closed = MHD_YES;
+      MHD_connection_close (connection,
+			    (NULL == session->streams_head)
+			    ? MHD_REQUEST_TERMINATED_COMPLETED_OK
+			    : MHD_REQUEST_TERMINATED_WITH_ERROR);
+      return MHD_YES;
+    }
+  session->in_off += ret;
+  if (NULL != connection->daemon->counters)
+    connection->daemon->counters->bytes_received += ret;
+  return MHD_YES;
+}
+
+
+int
+MHD_http2_handle_write_ (struct MHD_Connection *connection)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  ssize_t ret;
+
+  fill_output (connection);
+  if (MHD_CONNECTION_CLOSED == connection->state)
+    return MHD_YES;
+  if (session->out_send == session->out_append)
+    {
+#if HTTPS_SUPPORT
+      /* nothing new to write, only records gnutls batched */
+      (void) MHD_tls_connection_flush_ (connection);
+#endif
+      return MHD_YES;
+    }
+  ret = connection->send_cls (connection,
+			      &session->out[session->out_send],
+			      session->out_append - session->out_send);
+  if (ret < 0)
+    {
+      if ((errno == EINTR) || (errno == EAGAIN))
+	return MHD_YES;
+#if HAVE_MESSAGES
+      MHD_DLOG (connection->daemon,
+		"Failed to send data: %s\n", STRERROR (errno));
+#endif
+      MHD_connection_close (connection, MHD_REQUEST_TERMINATED_WITH_ERROR);
+      return MHD_YES;
+    }
+  if (NULL != connection->daemon->counters)
+    connection->daemon->counters->bytes_sent += ret;
+  session->out_send += ret;
+  if (session->out_send < session->out_append)
+    return MHD_YES;
+  session->out_send = 0;
+  session->out_append = 0;
+  fill_output (connection);
+#if HTTPS_SUPPORT
+  if ( (MHD_CONNECTION_CLOSED != connection->state) &&
+       (session->out_send == session->out_append) )
+    (void) MHD_tls_connection_flush_ (connection);
+#endif
+  return MHD_YES;
+}
+
+
+void
+MHD_http2_handle_idle_ (struct MHD_Connection *connection)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  struct MHD_Http2Stream *stream;
+  struct MHD_Http2Stream *next;
+
+  connection->response_unready = MHD_NO;
+  process_input (connection);
+  next = session->streams_head;
+  while ( (NULL != (stream = next)) &&
+	  (MHD_CONNECTION_CLOSED != connection->state) &&
+	  (MHD_NO == session->closing) )
+    {
+      next = stream->next;
+      stream_process (connection, stream);
+    }
+  if (MHD_CONNECTION_CLOSED == connection->state)
+    return;
+  fill_output (connection);
+  flush_credits (connection);
+  if (MHD_CONNECTION_CLOSED == connection->state)
+    return;
+  if (session->out_send != session->out_append)
+    return; /* first send what is queued */
+#if HTTPS_SUPPORT
+  if (MHD_YES == connection->tls_corked)
+    return;
+#endif
+  if (MHD_YES == session->closing)
+    MHD_connection_close (connection, MHD_REQUEST_TERMINATED_WITH_ERROR);
+  else if ( (MHD_YES == session->goaway_received) &&
+	    (NULL == session->streams_head) )
+    MHD_connection_close (connection, MHD_REQUEST_TERMINATED_COMPLETED_OK);
+}
+
+
+void
+MHD_http2_get_pollfd_ (struct MHD_Connection *connection,
+		       struct MHD_Pollfd *p)
+{
+  struct MHD_Http2Session *session = connection->http2;
+  struct MHD_Http2Stream *stream;
+
+  if ( (MHD_NO == connection->read_closed) &&
+       (MHD_NO == session->closing) &&
+       (session->in_off < session->in_size) &&
+       (session->out_append - session->out_send < MHD_HTTP2_OUT_HIGH) )
+    p->events |= MHD_POLL_ACTION_IN;
+  if (session->out_send != session->out_append)
+    p->events |= MHD_POLL_ACTION_OUT;
+#if HTTPS_SUPPORT
+  if (MHD_YES == connection->tls_corked)
+    p->events |= MHD_POLL_ACTION_OUT;
+#endif
+  /* wait for the pipe of (the first) stream whose pipe response
+     has no data yet; all streams are retried once it is readable */
+  for (stream = session->streams_head; NULL != stream; stream = stream->next)
+    if ( (MHD_CONNECTION_NORMAL_BODY_UNREADY == stream->connection.state) &&
+	 (NULL != stream->connection.response) &&
+	 (-1 != stream->connection.response->pipe_fd) )
+      {
+	p->source_fd = stream->connection.response->pipe_fd;
+	break;
+      }
+}
+
+
+void
+MHD_http2_close_streams_ (struct MHD_Connection *connection,
+			  enum MHD_RequestTerminationCode termination_code)
+{
+  struct MHD_Daemon *daemon = connection->daemon;
+  struct MHD_Http2Stream *stream;
+  struct MHD_Connection *c;
+
+  for (stream = connection->http2->streams_head; NULL != stream; stream = stream->next)
+    {
+      c = &stream->connection;
+      if ( (NULL != daemon->notify_completed) &&
+	   (MHD_YES == c->client_aware) )
+	daemon->notify_completed (daemon->notify_completed_cls,
+				  c,
+				  &c->client_context,
+				  termination_code);
+      c->client_aware = MHD_NO;
+    }
+}
+
+
+void
+MHD_http2_session_destroy_ (struct MHD_Connection *connection,
+			    enum MHD_RequestTerminationCode termination_code)
+{
+  struct MHD_Http2Session *session = connection->http2;
+
+  if (NULL == session)
+    return;
+  while (NULL != session->streams_head)
+    stream_close (connection, session->streams_head, termination_code);
+  hpack_evict (session, 0);
+  free (session->in);
+  free (session->out);
+  free (session->block);
+  free (session->scratch);
+  free (session);
+  connection->http2 = NULL;
+}
+
+/* end of connection_http2.c */
@@ -0,0 +1,108 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     This library is free software; you can redistribute it and/or
+     modify it under the terms of the GNU Lesser General Public
+     License as published by the Free Software Foundation; either
+     version 2.1 of the License, or (at your option) any later version.
+
+     This library is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Lesser General Public License for more details.
+
+     You should have received a copy of the GNU Lesser General Public
+     License along with this library; if not, write to the Free Software
+     Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/**
+ * @file connection_http2.h
+ * @brief HTTP/2 framing (RFC 7540) and header compression (RFC 7541)
+ *        for connections in state MHD_CONNECTION_HTTP2
+ * @author Christian Grothoff
+ */
+
+#ifndef CONNECTION_HTTP2_H
+#define CONNECTION_HTTP2_H
+
+#include "internal.h"
+
+/**
+ * Check if a new connection (in state MHD_CONNECTION_INIT) starts
+ * with the HTTP/2 connection preface and switch it to HTTP/2 if so.
+ * Clears 'http2_allowed' once the connection turns out to speak
+ * HTTP/1.x.
+ *
+ * @param connection connection to check
+ * @return MHD_YES if the connection switched to HTTP/2 (state
+ *         MHD_CONNECTION_HTTP2) or if we need more data to decide,
+ *         MHD_NO if the request is to be parsed as HTTP/1.x
+ */
+int
+MHD_http2_try_start_ (struct MHD_Connection *connection);
+
+/**
+ * Read from the socket of an HTTP/2 connection.
+ *
+ * @param connection connection to read from
+ * @return always MHD_YES
+ */
+int
+MHD_http2_handle_read_ (struct MHD_Connection *connection);
+
+/**
+ * Write to the socket of an HTTP/2 connection.
+ *
+ * @param connection connection to write to
+ * @return always MHD_YES
+ */
+int
+MHD_http2_handle_write_ (struct MHD_Connection *connection);
+
+/**
+ * Process the frames received on an HTTP/2 connection, run the
+ * handlers of its streams and prepare the frames to send.  Closes
+ * the connection (state MHD_CONNECTION_CLOSED) once it is done.
+ *
+ * @param connection connection to process
+ */
+void
+MHD_http2_handle_idle_ (struct MHD_Connection *connection);
+
+/**
+ * Determine what the event loop should wait for on an HTTP/2
+ * connection.
+ *
+ * @param connection connection to check
+ * @param p set to the events to wait for
+ */
+void
+MHD_http2_get_pollfd_ (struct MHD_Connection *connection,
+		       struct MHD_Pollfd *p);
+
+/**
+ * Tell the application that the requests on the streams of an
+ * HTTP/2 connection ended because the connection is closed.  The
+ * streams themselves are released by MHD_http2_session_destroy_.
+ *
+ * @param connection connection that is closed
+ * @param termination_code reason to give to the application
+ */
+void
+MHD_http2_close_streams_ (struct MHD_Connection *connection,
+			  enum MHD_RequestTerminationCode termination_code);
+
+/**
+ * Release the HTTP/2 state of a connection (and all its streams).
+ *
+ * @param connection connection to clean up
+ * @param termination_code reason to give to the application for
+ *        streams it was not yet told about
+ */
+void
+MHD_http2_session_destroy_ (struct MHD_Connection *connection,
+			    enum MHD_RequestTerminationCode termination_code);
+
+#endif
@@ -32,6 +32,198 @@
 #include "response.h"
 #include "reason_phrase.h"
 #include <gnutls/gnutls.h>
+#if HAVE_KTLS
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
+
+#if HAVE_KTLS
+/**
+ * Push function for gnutls once the kernel encrypts what we send:
+ * anything gnutls might still want to transmit (alerts, key updates)
+ * would be encrypted twice, so refuse it.  Only TLS 1.2 is offloaded,
+ * where gnutls does not send anything on its own after the handshake
+ * except for the alert when closing.
+ *
+ * @param ptr the connection
+ * @param data data gnutls wants to send
+ * @param size number of bytes in data
+ * @return always -1
+ */
+static ssize_t
+refuse_tls_push (gnutls_transport_ptr_t ptr,
+		 const void *data,
+		 size_t size)
+{
+  errno = EIO;
+  return -1;
+}
+
+
+/**
+ * Try to hand the encryption of the records we send on the
+ * connection to the kernel.  Leaves the connection with gnutls
+ * if the kernel or the negotiated cipher does not support it.
+ *
+ * @param connection connection that completed the handshake
+ */
+static void
+try_enable_ktls (struct MHD_Connection *connection)
+{
+  union
+  {
+    struct tls12_crypto_info_aes_gcm_128 aes_128;
+    struct tls12_crypto_info_aes_gcm_256 aes_256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    struct tls12_crypto_info_chacha20_poly1305 chacha20;
+#endif
+  } info;
+  gnutls_datum_t mac;
+  gnutls_datum_t iv;
+  gnutls_datum_t key;
+  unsigned char seq[8];
+  unsigned char *c_iv;
+  unsigned char *c_key;
+  unsigned char *c_salt;
+  unsigned char *c_seq;
+  size_t iv_size;
+  size_t key_size;
+  size_t salt_size;
+  socklen_t info_size;
+
+  /* with TLS 1.3, the client can ask for a key update at any time;
+     gnutls would then have to send its own KeyUpdate message and the
+     kernel would have to switch to the new key, so only offload
+     TLS 1.2 (where an attempt to renegotiate closes the connection) */
+  if (GNUTLS_TLS1_2 != gnutls_protocol_get_version (connection->tls_session))
+    return;
+  memset (&info, 0, sizeof (info));
+  switch (gnutls_cipher_get (connection->tls_session))
+    {
+    case GNUTLS_CIPHER_AES_128_GCM:
+      info.aes_128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+      c_iv = info.aes_128.iv;
+      iv_size = sizeof (info.aes_128.iv);
+      c_key = info.aes_128.key;
+      key_size = sizeof (info.aes_128.key);
+      c_salt = info.aes_128.salt;
+      salt_size = sizeof (info.aes_128.salt);
+      c_seq = info.aes_128.rec_seq;
+      info_size = sizeof (info.aes_128);
+      break;
+    case GNUTLS_CIPHER_AES_256_GCM:
+      info.aes_256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+      c_iv = info.aes_256.iv;
+      iv_size = sizeof (info.aes_256.iv);
+      c_key = info.aes_256.key;
+      key_size = sizeof (info.aes_256.key);
+      c_salt = info.aes_256.salt;
+      salt_size = sizeof (info.aes_256.salt);
+      c_seq = info.aes_256.rec_seq;
+      info_size = sizeof (info.aes_256);
+      break;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    case GNUTLS_CIPHER_CHACHA20_POLY1305:
+      info.chacha20.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+      c_iv = info.chacha20.iv;
+      iv_size = sizeof (info.chacha20.iv);
+      c_key = info.chacha20.key;
+      key_size = sizeof (info.chacha20.key);
+      c_salt = info.chacha20.salt;
+      salt_size = 0;
+      c_seq = info.chacha20.rec_seq;
+      info_size = sizeof (info.chacha20);
+      break;
+#endif
+    default:
+      return;
+    }
+  /* all variants start with the 'struct tls_crypto_info' */
+  info.aes_128.info.version = TLS_1_2_VERSION;
+  if ( (GNUTLS_E_SUCCESS !=
+	gnutls_record_get_state (connection->tls_session, 0,
+				 &mac, &iv, &key, seq)) ||
+       (key.size != key_size) )
+    return;
+  memcpy (c_key, key.data, key_size);
+  memcpy (c_seq, seq, sizeof (seq));
+  if (iv.size == salt_size + iv_size)
+    {
+      /* full nonce (CHACHA20-POLY1305) */
+      memcpy (c_salt, iv.data, salt_size);
+      memcpy (c_iv, &iv.data[salt_size], iv_size);
+    }
+  else if ( (iv.size == salt_size) &&
+	    (iv_size == sizeof (seq)) )
+    {
+      /* TLS 1.2 AES-GCM: the explicit part of the nonce is sent
+	 with each record, start from the sequence number like gnutls */
+      memcpy (c_salt, iv.data, salt_size);
+      memcpy (c_iv, seq, iv_size);
+    }
+  else
+    {
+      memset (&info, 0, sizeof (info));
+      return;
+    }
+  if ( (0 != setsockopt (connection->socket_fd, SOL_TCP, TCP_ULP,
+			 "tls", sizeof ("tls"))) ||
+       (0 != setsockopt (connection->socket_fd, SOL_TLS, TLS_TX,
+			 &info, info_size)) )
+    {
+      /* no kernel support, keep using gnutls */
+      memset (&info, 0, sizeof (info));
+      return;
+    }
+  memset (&info, 0, sizeof (info));
+  connection->ktls = MHD_YES;
+  gnutls_transport_set_push_function (connection->tls_session,
+				      &refuse_tls_push);
+}
+#endif
+
+
+/**
+ * Process the handshake data available for a connection (from the
+ * event loop or the handshake pool).
+ *
+ * @param connection connection to handshake on
+ */
+static void
+tls_handshake_step (struct MHD_Connection *connection)
+{
+  int ret;
+
+  ret = gnutls_handshake (connection->tls_session);
+  if (ret == GNUTLS_E_SUCCESS) 
+    {
+#if HAVE_KTLS
+      if (0 != (connection->daemon->options & MHD_USE_KTLS))
+	try_enable_ktls (connection);
+#endif
+      /* set connection state to enable HTTP processing */
+      connection->state = MHD_CONNECTION_INIT;
+      /* the request may have arrived with the end of the handshake */
+      MHD_tls_connection_update_read_ready_ (connection);
+      return;
+    }
+  if ( (ret == GNUTLS_E_AGAIN) || 
+       (ret == GNUTLS_E_INTERRUPTED) )
+    {
+      /* handshake not done */
+      return;
+    }
+  /* handshake failed */
+#if HAVE_MESSAGES
+  MHD_DLOG (connection->daemon,
+	    "Error: received handshake message out of context\n");
+#endif
+  MHD_connection_close (connection,
+			MHD_REQUEST_TERMINATED_WITH_ERROR);
+}
 
 
 /**
@@ -45,31 +237,14 @@
 static int
 run_tls_handshake (struct MHD_Connection *connection)
 {
-  int ret;
-
+  if (MHD_YES == connection->suspended)
+    return MHD_YES; /* already with the handshake pool */
   connection->last_activity = time (NULL);
   if (connection->state == MHD_TLS_CONNECTION_INIT)
     {
-      ret = gnutls_handshake (connection->tls_session);
-      if (ret == GNUTLS_E_SUCCESS) 
-	{
-	  /* set connection state to enable HTTP processing */
-	  connection->state = MHD_CONNECTION_INIT;
-	  return MHD_YES;	  
-	}
-      if ( (ret == GNUTLS_E_AGAIN) || 
-	   (ret == GNUTLS_E_INTERRUPTED) )
-	{
-	  /* handshake not done */
-	  return MHD_YES;
-	}
-      /* handshake failed */
-#if HAVE_MESSAGES
-      MHD_DLOG (connection->daemon,
-		"Error: received handshake message out of context\n");
-#endif
-      MHD_connection_close (connection,
-			    MHD_REQUEST_TERMINATED_WITH_ERROR);
+      if (MHD_NO == MHD_connection_offload_handshake_ (connection,
+						       &tls_handshake_step))
+	tls_handshake_step (connection);
       return MHD_YES;
     }
   return MHD_NO;
@@ -114,7 +289,17 @@ MHD_tls_connection_handle_write (struct MHD_Connection *connection)
 {
   if (MHD_YES == run_tls_handshake (connection))
     return MHD_YES;
-  return MHD_connection_handle_write (connection);
+  switch (connection->state)
+    {
+    case MHD_CONNECTION_NORMAL_BODY_UNREADY:
+    case MHD_CONNECTION_CHUNKED_BODY_UNREADY:
+    case MHD_CONNECTION_FOOTERS_SENT:
+      /* nothing new to write, only records gnutls batched */
+      MHD_tls_connection_flush_ (connection);
+      return MHD_YES;
+    default:
+      return MHD_connection_handle_write (connection);
+    }
 }
 
 
@@ -133,6 +318,8 @@ MHD_tls_connection_handle_idle (struct MHD_Connection *connection)
 {
   unsigned int timeout;
 
+  if (MHD_YES == connection->suspended)
+    return MHD_YES; /* handshake running in the handshake pool */
 #if DEBUG_STATES
   MHD_DLOG (connection->daemon, "%s: state: %s\n",
             __FUNCTION__, MHD_state_to_string (connection->state));
@@ -151,9 +338,8 @@ MHD_tls_connection_handle_idle (struct MHD_Connection *connection)
       gnutls_bye (connection->tls_session, GNUTLS_SHUT_RDWR);
       return MHD_connection_handle_idle (connection);
     default:
-      if ( (0 != gnutls_record_check_pending (connection->tls_session)) &&
-	   (MHD_YES != MHD_tls_connection_handle_read (connection)) )
-	return MHD_YES;
+      /* data gnutls already decrypted is read by the event loop
+	 (see 'tls_read_ready') */
       return MHD_connection_handle_idle (connection);
     }
   return MHD_YES;
@@ -28,11 +28,19 @@
 #include "internal.h"
 #include "response.h"
 #include "connection.h"
+#include "connection_http2.h"
 #include "memorypool.h"
 #include <limits.h>
 
+#if HAVE_NETINET_TCP_H
+/* for TCP_NODELAY */
+#include <netinet/tcp.h>
+#endif
+
 #if HTTPS_SUPPORT
 #include "connection_https.h"
+#include "tls_session_cache.h"
+#include "tls_host_cert.h"
 #include <gnutls/gnutls.h>
 #include <gcrypt.h>
 #endif
@@ -45,6 +53,16 @@
 #include <sys/sendfile.h>
 #endif
 
+#if HAVE_ZEROCOPY
+/* for SIOCOUTQ */
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#endif
+
+#if HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
 /**
  * Default connection limit.
  */
@@ -59,6 +77,54 @@
  */
 #define MHD_POOL_SIZE_DEFAULT (32 * 1024)
 
+/**
+ * Default number of seconds an idle cached thread waits for a new
+ * connection before terminating.
+ */
+#define MHD_THREAD_CACHE_TIMEOUT_DEFAULT 60
+
+/**
+ * Default number of seconds for which TLS sessions can be resumed.
+ */
+#define MHD_TLS_SESSION_TIMEOUT_DEFAULT 3600
+
+/**
+ * Size of the key for session tickets, as expected by gnutls.
+ */
+#define MHD_TLS_TICKET_KEY_SIZE 64
+
+/**
+ * Default payload of the TLS records sent during bulk transfers
+ * (the largest record TLS allows).
+ */
+#define MHD_TLS_RECORD_SIZE_DEFAULT 16384
+
+/**
+ * Payload of the TLS records at the start of a burst: small enough
+ * for one TCP segment, so that the client can decrypt it as soon as
+ * that segment arrives.
+ */
+#define MHD_TLS_SMALL_RECORD_SIZE 1400
+
+/**
+ * Number of bytes of a burst sent in small records; by then the
+ * TCP congestion window has opened up.
+ */
+#define MHD_TLS_SMALL_RECORD_BURST (64 * 1024)
+
+/**
+ * Number of seconds without sending after which the next write
+ * starts a new burst.
+ */
+#define MHD_TLS_BURST_IDLE 1
+
+/**
+ * How much busier (in permille of its time) a worker of the thread
+ * pool must be than the least busy worker before it hands some of
+ * its connections over to that worker.
+ */
+#define MHD_REBALANCE_LOAD_DIFFERENCE 250
+
 /**
  * Print extra messages with reasons for closing
  * sockets? (only adds non-error messages).
@@ -367,9 +433,17 @@ MHD_ip_limit_del(struct MHD_Daemon *daemon,
   MHD_ip_count_unlock (daemon);
 }
 
+
 #if HTTPS_SUPPORT
 static pthread_mutex_t MHD_gnutls_init_mutex;
 
+#if HAVE_KTLS
+static ssize_t
+send_param_adapter (struct MHD_Connection *connection,
+                    const void *other,
+		    size_t i);
+#endif
+
 /**
  * Callback for receiving data from the socket.
  *
@@ -386,6 +460,7 @@ recv_tls_adapter (struct MHD_Connection *connection, void *other, size_t i)
   if ( (res == GNUTLS_E_AGAIN) ||
        (res == GNUTLS_E_INTERRUPTED) )
     {
+      MHD_tls_connection_update_read_ready_ (connection);
       errno = EINTR;
       return -1;
     }
@@ -397,6 +472,7 @@ recv_tls_adapter (struct MHD_Connection *connection, void *other, size_t i)
       errno = EPIPE;
       return res;
     }
+  MHD_tls_connection_update_read_ready_ (connection);
   return res;
 }
 
@@ -413,10 +489,96 @@ static ssize_t
 send_tls_adapter (struct MHD_Connection *connection,
                   const void *other, size_t i)
 {
-  int res;
-  res = gnutls_record_send (connection->tls_session, other, i);
+  const char *data = other;
+  size_t record;
+  size_t corked;
+  size_t len;
+  size_t off;
+  ssize_t res;
+  time_t now;
+
+#if HAVE_KTLS
+  if (MHD_YES == connection->ktls)
+    return send_param_adapter (connection, other, i);
+#endif
+  if (0 == connection->daemon->tls_record_size)
+    {
+      res = gnutls_record_send (connection->tls_session, other, i);
+      if ( (res == GNUTLS_E_AGAIN) ||
+	   (res == GNUTLS_E_INTERRUPTED) )
+	{
+	  errno = EINTR;
+	  return -1;
+	}
+      return res;
+    }
+  now = time (NULL);
+  if ( (now - connection->tls_last_send >= MHD_TLS_BURST_IDLE) ||
+       ( (MHD_CONNECTION_HEADERS_SENDING == connection->state) &&
+	 (0 == connection->write_buffer_send_offset) ) )
+    connection->tls_burst = 0; /* new response or idle connection */
+  connection->tls_last_send = now;
+  off = 0;
+  res = 0;
+  while (off < i)
+    {
+      record = connection->daemon->tls_record_size;
+      if ( (connection->tls_burst < MHD_TLS_SMALL_RECORD_BURST) &&
+	   (record > MHD_TLS_SMALL_RECORD_SIZE) )
+	record = MHD_TLS_SMALL_RECORD_SIZE;
+      corked = 0;
+      if (MHD_YES == connection->tls_corked)
+	corked = gnutls_record_check_corked (connection->tls_session);
+      if (corked >= record)
+	{
+	  /* current record is full, send it first */
+	  if (MHD_NO == MHD_tls_connection_flush_ (connection))
+	    break;
+	  corked = 0;
+	}
+      len = i - off;
+      if ( (0 == corked) &&
+	   ( (len >= record) ||
+	     (MHD_YES == connection->tls_send_pending) ||
+	     (MHD_CONNECTION_CONTINUE_SENDING == connection->state) ) )
+	{
+	  /* full record (or no point in waiting for more data),
+	     send directly from the caller's buffer */
+	  res = gnutls_record_send (connection->tls_session,
+				    &data[off],
+				    MHD_MIN (len, record));
+	  if (res < 0)
+	    {
+	      connection->tls_send_pending =
+		( (res == GNUTLS_E_AGAIN) ||
+		  (res == GNUTLS_E_INTERRUPTED) ) ? MHD_YES : MHD_NO;
+	      break;
+	    }
+	  connection->tls_send_pending = MHD_NO;
+	}
+      else
+	{
+	  /* batch with the writes that follow; flushed once the
+	     record is full or the connection stops writing */
+	  if (MHD_NO == connection->tls_corked)
+	    {
+	      gnutls_record_cork (connection->tls_session);
+	      connection->tls_corked = MHD_YES;
+	    }
+	  res = gnutls_record_send (connection->tls_session,
+				    &data[off],
+				    MHD_MIN (len, record - corked));
+	  if (res < 0)
+	    break;
+	}
+      off += res;
+      connection->tls_burst += res;
+    }
+  if (off > 0)
+    return off;
   if ( (res == GNUTLS_E_AGAIN) ||
-       (res == GNUTLS_E_INTERRUPTED) )
+       (res == GNUTLS_E_INTERRUPTED) ||
+       (res == 0) )
     {
       errno = EINTR;
       return -1;
@@ -425,6 +587,148 @@ send_tls_adapter (struct MHD_Connection *connection,
 }
 
 
+/**
+ * Send the data gnutls holds back to fill the current TLS record of
+ * a connection (see MHD_OPTION_HTTPS_RECORD_SIZE).  Called whenever
+ * the connection stops writing for now, so that nothing batched is
+ * left behind.
+ *
+ * @param connection connection to flush
+ * @return MHD_YES if nothing is left to send, MHD_NO if the socket
+ *         cannot take all of it right now (or the connection failed)
+ */
+int
+MHD_tls_connection_flush_ (struct MHD_Connection *connection)
+{
+  ssize_t res;
+
+  if (MHD_YES != connection->tls_corked)
+    return MHD_YES;
+  res = gnutls_record_uncork (connection->tls_session, 0);
+  if ( (res == GNUTLS_E_AGAIN) ||
+       (res == GNUTLS_E_INTERRUPTED) )
+    return MHD_NO;
+  connection->tls_corked = MHD_NO;
+  if (res < 0)
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (connection->daemon,
+		"Failed to send data: %s\n",
+		gnutls_strerror (res));
+#endif
+      MHD_connection_close (connection,
+			    MHD_REQUEST_TERMINATED_WITH_ERROR);
+      return MHD_NO;
+    }
+  return MHD_YES;
+}
+
+
+/**
+ * Add a connection to the list of connections gnutls holds
+ * decrypted data for (if it is not in there already).  Must only
+ * be called by the thread running the event loop of the daemon.
+ *
+ * @param daemon daemon the connection belongs to
+ * @param connection connection to add
+ */
+static void
+tls_read_ready_insert (struct MHD_Daemon *daemon,
+		       struct MHD_Connection *connection)
+{
+  if (MHD_YES == connection->tls_read_listed)
+    return;
+  XDLL_insert (daemon->tls_read_ready_head,
+	       daemon->tls_read_ready_tail,
+	       connection);
+  connection->tls_read_listed = MHD_YES;
+}
+
+
+/**
+ * Remove a connection from the list of connections gnutls holds
+ * decrypted data for (if it is in there).  Must only be called by
+ * the thread running the event loop of the daemon.
+ *
+ * @param daemon daemon the connection belongs to
+ * @param connection connection to remove
+ */
+static void
+tls_read_ready_remove (struct MHD_Daemon *daemon,
+		       struct MHD_Connection *connection)
+{
+  if (MHD_NO == connection->tls_read_listed)
+    return;
+  XDLL_remove (daemon->tls_read_ready_head,
+	       daemon->tls_read_ready_tail,
+	       connection);
+  connection->tls_read_listed = MHD_NO;
+}
+
+
+/**
+ * Note whether gnutls holds decrypted data of a connection that we
+ * have not read yet (after reading from it or completing the
+ * handshake).  Such data is not signalled by the socket, so the
+ * connection goes into the daemon's list of connections the event
+ * loop reads from without waiting (see #process_tls_read_ready).
+ * With a thread per connection, and for suspended connections
+ * (which may be with the handshake pool), only the flag is set; the
+ * thread of the connection respectively resuming the connection
+ * takes care of the rest.
+ *
+ * @param connection connection to check
+ */
+void
+MHD_tls_connection_update_read_ready_ (struct MHD_Connection *connection)
+{
+  struct MHD_Daemon *daemon = connection->daemon;
+
+  connection->tls_read_ready =
+    (0 != gnutls_record_check_pending (connection->tls_session))
+    ? MHD_YES : MHD_NO;
+  if ( (0 != (daemon->options & MHD_USE_THREAD_PER_CONNECTION)) ||
+       (MHD_YES == connection->suspended) )
+    return;
+  if (MHD_YES == connection->tls_read_ready)
+    tls_read_ready_insert (daemon, connection);
+  else
+    tls_read_ready_remove (daemon, connection);
+}
+
+
+/**
+ * Read the data gnutls holds for the connections in the daemon's
+ * list and process it.  Only the connections in the list are
+ * touched, so the event loop does not have to ask gnutls about
+ * every connection in each iteration.
+ *
+ * @param daemon daemon to process
+ */
+static void
+process_tls_read_ready (struct MHD_Daemon *daemon)
+{
+  struct MHD_Connection *pos;
+  struct MHD_Connection *next;
+
+  next = daemon->tls_read_ready_head;
+  while (NULL != (pos = next))
+    {
+      next = pos->nextX;
+      if ( (MHD_YES == pos->suspended) ||
+	   (MHD_CONNECTION_CLOSED == pos->state) ||
+	   (MHD_CONNECTION_IN_CLEANUP == pos->state) )
+	{
+	  /* resuming puts it back if needed */
+	  tls_read_ready_remove (daemon, pos);
+	  continue;
+	}
+      pos->read_handler (pos);
+      pos->idle_handler (pos);
+    }
+}
+
+
 /**
  * Read and setup our certificate and key.
  *
@@ -462,6 +766,9 @@ MHD_init_daemon_certificate (struct MHD_Daemon *daemon)
 						  &cert, &key,
 						  GNUTLS_X509_FMT_PEM);
     }
+  /* with virtual hosts, clients must ask for one of them */
+  if (NULL != daemon->host_certs)
+    return 0;
 #if HAVE_MESSAGES
   MHD_DLOG (daemon, "You need to specify a certificate and key location\n");
 #endif
@@ -477,12 +784,58 @@ MHD_init_daemon_certificate (struct MHD_Daemon *daemon)
 static int
 MHD_TLS_init (struct MHD_Daemon *daemon)
 {
+  if (NULL == daemon->https_mem_ticket_key)
+    {
+      if (0 != gnutls_session_ticket_key_generate (&daemon->ticket_key))
+	return GNUTLS_E_MEMORY_ERROR;
+    }
+  else
+    {
+      if (MHD_TLS_TICKET_KEY_SIZE != daemon->https_mem_ticket_key_size)
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon,
+		    "Session ticket key must be %u bytes, not %u\n",
+		    MHD_TLS_TICKET_KEY_SIZE,
+		    (unsigned int) daemon->https_mem_ticket_key_size);
+#endif
+	  return -1;
+	}
+      daemon->ticket_key.data = gnutls_malloc (MHD_TLS_TICKET_KEY_SIZE);
+      if (NULL == daemon->ticket_key.data)
+	return GNUTLS_E_MEMORY_ERROR;
+      memcpy (daemon->ticket_key.data,
+	      daemon->https_mem_ticket_key,
+	      MHD_TLS_TICKET_KEY_SIZE);
+      daemon->ticket_key.size = MHD_TLS_TICKET_KEY_SIZE;
+    }
+  if (0 != daemon->session_cache_size)
+    {
+      if (NULL != daemon->session_store.store)
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon,
+		    "MHD_OPTION_HTTPS_SESSION_CACHE_SIZE cannot be combined with MHD_OPTION_HTTPS_SESSION_STORE\n");
+#endif
+	  return -1;
+	}
+      daemon->session_cache = MHD_tls_session_cache_create (daemon->session_cache_size);
+      if (NULL == daemon->session_cache)
+	return GNUTLS_E_MEMORY_ERROR;
+    }
   switch (daemon->cred_type)
     {
     case GNUTLS_CRD_CERTIFICATE:
       if (0 !=
           gnutls_certificate_allocate_credentials (&daemon->x509_cred))
         return GNUTLS_E_MEMORY_ERROR;
+      if ( (NULL != daemon->https_mem_host_certs) ||
+	   (NULL != daemon->host_cert_callback) )
+	{
+	  daemon->host_certs = MHD_tls_host_certs_create (daemon);
+	  if (NULL == daemon->host_certs)
+	    return -1;
+	}
       return MHD_init_daemon_certificate (daemon);
     default:
 #if HAVE_MESSAGES
@@ -497,704 +850,414 @@ MHD_TLS_init (struct MHD_Daemon *daemon)
 
 
 /**
- * Obtain the select sets for this daemon.
+ * Create an inter-thread communication channel used to wake up a
+ * thread blocked in select/poll: an eventfd where available, a pipe
+ * otherwise.  Both ends are non-blocking.
  *
- * @param daemon daemon to get sets from
- * @param read_fd_set read set
- * @param write_fd_set write set
- * @param except_fd_set except set
- * @param max_fd increased to largest FD added (if larger
- *               than existing value); can be NULL
- * @return MHD_YES on success, MHD_NO if this
- *         daemon was not started with the right
- *         options for this call.
+ * @param daemon daemon the channel is for (used for logging)
+ * @param itc where to store the read and write end of the channel
+ * @return MHD_YES on success, MHD_NO on error
  */
-int
-MHD_get_fdset (struct MHD_Daemon *daemon,
-               fd_set * read_fd_set,
-               fd_set * write_fd_set, fd_set * except_fd_set, int *max_fd)
+static int
+itc_init (struct MHD_Daemon *daemon,
+	  int itc[2])
 {
-  struct MHD_Connection *pos;
-  struct MHD_Connection *next;
-  int fd;
-
-  if ((daemon == NULL) || (read_fd_set == NULL) || (write_fd_set == NULL)
-      || (except_fd_set == NULL) || (max_fd == NULL)
-      || (-1 == (fd = daemon->socket_fd)) || (daemon->shutdown == MHD_YES)
-      || ((daemon->options & MHD_USE_THREAD_PER_CONNECTION) != 0)
-      || ((daemon->options & MHD_USE_POLL) != 0))
-    return MHD_NO;
-
-  FD_SET (fd, read_fd_set);
-  /* update max file descriptor */
-  if ((*max_fd) < fd) 
-    *max_fd = fd;
+#ifndef MINGW
+  int flags;
+  unsigned int i;
+#endif
 
-  next = daemon->connections_head;
-  while (NULL != (pos = next))
+#if HAVE_SYS_EVENTFD_H
+  itc[0] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  itc[1] = itc[0];
+  if (-1 != itc[0])
+    return MHD_YES;
+#endif
+  if (0 != PIPE (itc))
     {
-      next = pos->next;
-      if (MHD_YES != MHD_connection_get_fdset (pos,
-                                               read_fd_set,
-                                               write_fd_set,
-                                               except_fd_set, max_fd))
-        return MHD_NO;
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon,
+		"Failed to create inter-thread communication channel: %s\n",
+		STRERROR (errno));
+#endif
+      itc[0] = -1;
+      itc[1] = -1;
+      return MHD_NO;
+    }
+#ifndef MINGW
+  for (i = 0; i < 2; i++)
+    {
+      flags = fcntl (itc[i], F_GETFL);
+      if ( (flags == -1) ||
+	   (0 != fcntl (itc[i], F_SETFL, flags | O_NONBLOCK)) )
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon,
+		    "Failed to make inter-thread communication channel non-blocking: %s\n",
+		    STRERROR (errno));
+#endif
+	}
     }
-#if DEBUG_CONNECT
-  MHD_DLOG (daemon, "Maximum socket in select set: %d\n", *max_fd);
 #endif
   return MHD_YES;
 }
 
 
 /**
- * Main function of the thread that handles an individual
- * connection when MHD_USE_THREAD_PER_CONNECTION is set.
- * 
- * @param data the 'struct MHD_Connection' this thread will handle
- * @return always NULL
+ * Wake up the thread waiting on an inter-thread communication channel.
+ *
+ * @param itc channel to signal
  */
-static void *
-MHD_handle_connection (void *data)
+static void
+itc_signal (int itc[2])
 {
-  struct MHD_Connection *con = data;
-  int num_ready;
-  fd_set rs;
-  fd_set ws;
-  fd_set es;
-  int max;
-  struct timeval tv;
-  struct timeval *tvp;
-  unsigned int timeout;
-  time_t now;
-#ifdef HAVE_POLL_H
-  struct MHD_Pollfd mp;
-  struct pollfd p[1];
-#endif
+#if HAVE_SYS_EVENTFD_H
+  uint64_t one = 1;
 
-  timeout = con->daemon->connection_timeout;
-  while ( (!con->daemon->shutdown) && (con->state != MHD_CONNECTION_CLOSED) ) 
+  if (itc[0] == itc[1])
     {
-      tvp = NULL;
-      if (timeout > 0)
-	{
-	  now = time (NULL);
-	  if (now - con->last_activity > timeout)
-	    tv.tv_sec = 0;
-	  else
-	    tv.tv_sec = timeout - (now - con->last_activity);
-	  tv.tv_usec = 0;
-	  tvp = &tv;
-	}
-      if ((con->state == MHD_CONNECTION_NORMAL_BODY_UNREADY) ||
-	  (con->state == MHD_CONNECTION_CHUNKED_BODY_UNREADY))
-	{
-	  /* do not block (we're waiting for our callback to succeed) */
-	  tv.tv_sec = 0;
-	  tv.tv_usec = 0;
-	  tvp = &tv;
-	}
-#ifdef HAVE_POLL_H
-      if (0 == (con->daemon->options & MHD_USE_POLL)) 
-	{
-#else
-	{
+      (void) WRITE (itc[1], &one, sizeof (one));
+      return;
+    }
 #endif
-	  /* use select */
-	  FD_ZERO (&rs);
-	  FD_ZERO (&ws);
-	  FD_ZERO (&es);
-	  max = 0;
-	  MHD_connection_get_fdset (con, &rs, &ws, &es, &max);
-	  num_ready = SELECT (max + 1, &rs, &ws, &es, tvp);
-	  if (num_ready < 0) 
-	    {
-	      if (errno == EINTR)
-		continue;
-#if HAVE_MESSAGES
-	      MHD_DLOG (con->daemon, "Error during select (%d): `%s'\n", max,
-			STRERROR (errno));
-#endif
-	      break;
-	    }
-	  /* call appropriate connection handler if necessary */
-	  if (FD_ISSET (con->socket_fd, &rs))
-	    con->read_handler (con);
-	  if (FD_ISSET (con->socket_fd, &ws))
-	    con->write_handler (con);
-	  if (MHD_NO == con->idle_handler (con))
-	    goto exit;
-	}
-#ifdef HAVE_POLL_H
-      else
-	{
-	    /* use poll */
-	  memset(&mp, 0, sizeof (struct MHD_Pollfd));
-	  MHD_connection_get_pollfd(con, &mp);
-	  memset(&p, 0, sizeof (p));
-	  p[0].fd = mp.fd;
-	  if (mp.events & MHD_POLL_ACTION_IN) 
-	    p[0].events |= POLLIN;        
-	  if (mp.events & MHD_POLL_ACTION_OUT) 
-	    p[0].events |= POLLOUT;
-	  if (poll (p, 
-		    1, 
-		    (tvp == NULL) 
-		    ? -1 
-		    : tv.tv_sec * 1000) < 0)
-	    {
-	      if (errno == EINTR)
-		continue;
-#if HAVE_MESSAGES
-	      MHD_DLOG (con->daemon, "Error during poll: `%s'\n", 
-			STRERROR (errno));
-#endif
-	      break;
-	    }
-	  if (0 != (p[0].revents & POLLIN)) 
-	    con->read_handler (con);        
-	  if (0 != (p[0].revents & POLLOUT)) 
-	    con->write_handler (con);        
-	  if (0 != (p[0].revents & (POLLERR | POLLHUP))) 
-	    MHD_connection_close (con, MHD_REQUEST_TERMINATED_WITH_ERROR);      
-	  if (MHD_NO == con->idle_handler (con))
-	    goto exit;
-	}
-#endif
-    }
-  if (con->state != MHD_CONNECTION_IN_CLEANUP)
-    {
-#if DEBUG_CLOSE
-#if HAVE_MESSAGES
-      MHD_DLOG (con->daemon,
-                "Processing thread terminating, closing connection\n");
-#endif
-#endif
-      if (con->state != MHD_CONNECTION_CLOSED)
-	MHD_connection_close (con, MHD_REQUEST_TERMINATED_DAEMON_SHUTDOWN);
-      con->idle_handler (con);
-    }
-exit:
-  if (con->response != NULL)
-    {
-      MHD_destroy_response (con->response);
-      con->response = NULL;
-    }
-  return NULL;
+  (void) WRITE (itc[1], "r", 1);
 }
 
+
 /**
- * Callback for receiving data from the socket.
+ * Consume all pending wake-up signals of a channel.
  *
- * @param conn the MHD connection structure
- * @param other where to write received data to
- * @param i maximum size of other (in bytes)
- * @return number of bytes actually received
+ * @param itc channel to drain
  */
-static ssize_t
-recv_param_adapter (struct MHD_Connection *connection,
-		    void *other, 
-		    size_t i)
+static void
+itc_drain (int itc[2])
 {
-  if ( (connection->socket_fd == -1) ||
-       (connection->state == MHD_CONNECTION_CLOSED) )
-    {
-      errno = ENOTCONN;
-      return -1;
-    }
-  if (0 != (connection->daemon->options & MHD_USE_SSL))
-    return RECV (connection->socket_fd, other, i, MSG_NOSIGNAL);
-  return RECV (connection->socket_fd, other, i, MSG_NOSIGNAL);
+  char buf[64];
+
+  while (0 < READ (itc[0], buf, sizeof (buf)))
+    ;
 }
 
+
 /**
- * Callback for writing data to the socket.
+ * Close an inter-thread communication channel (if open).
  *
- * @param conn the MHD connection structure
- * @param other data to write
- * @param i number of bytes to write
- * @return actual number of bytes written
+ * @param itc channel to close
  */
-static ssize_t
-send_param_adapter (struct MHD_Connection *connection,
-                    const void *other,
-		    size_t i)
+static void
+itc_close (int itc[2])
 {
-#if LINUX
-  int fd;
-  off_t offset;
-  off_t left;
-  ssize_t ret;
-#endif
-  if ( (connection->socket_fd == -1) ||
-       (connection->state == MHD_CONNECTION_CLOSED) )
-    {
-      errno = ENOTCONN;
-      return -1;
-    }
-  if (0 != (connection->daemon->options & MHD_USE_SSL))
-    return SEND (connection->socket_fd, other, i, MSG_NOSIGNAL);
-#if LINUX
-  if ( (connection->write_buffer_append_offset ==
-	connection->write_buffer_send_offset) &&
-       (NULL != connection->response) &&
-       (-1 != (fd = connection->response->fd)) )
-    {
-      /* can use sendfile */
-      offset = (off_t) connection->response_write_position + connection->response->fd_off;
-      left = connection->response->total_size - connection->response_write_position;
-      if (left > SSIZE_MAX)
-	left = SSIZE_MAX; /* cap at return value limit */
-      ret = sendfile (connection->socket_fd, 
-		      fd,
-		      &offset,
-		      (size_t) left);
-      if (ret != -1)
-	return ret;
-      if ((EINTR == errno) || (EAGAIN == errno))
-	return 0;
-      if ( (EINVAL == errno) ||
-	   (EBADF == errno) )
-	return -1; 
-      /* None of the 'usual' sendfile errors occurred, so we should try
-	 to fall back to 'SEND'; see also this thread for info on
-	 odd libc/Linux behavior with sendfile:
-	 http://lists.gnu.org/archive/html/libmicrohttpd/2011-02/msg00015.html */
-    }
-#endif
-  return SEND (connection->socket_fd, other, i, MSG_NOSIGNAL);
+  if (-1 != itc[0])
+    CLOSE (itc[0]);
+  if ( (-1 != itc[1]) &&
+       (itc[1] != itc[0]) )
+    CLOSE (itc[1]);
+  itc[0] = -1;
+  itc[1] = -1;
 }
 
 
 /**
- * Create a thread and set the attributes according to our options.
- * 
- * @param thread handle to initialize
- * @param daemon daemon with options
- * @param start_routine main function of thread
- * @param arg argument for start_routine
- * @return 0 on success
+ * Reserve one connection from the global connection limit.  The
+ * limit ('max_connections' of the master) is shared by all worker
+ * daemons, so a worker only refuses a connection if the daemon as a
+ * whole is full, no matter how the existing connections happen to be
+ * spread over the workers.
+ *
+ * @param daemon daemon that is about to add a connection
+ * @return MHD_YES if the connection may be added,
+ *         MHD_NO if the connection limit has been reached
  */
 static int
-create_thread (pthread_t * thread,
-	       const struct MHD_Daemon *daemon,
-	       void *(*start_routine)(void*),
-	       void *arg)
+MHD_connection_budget_take (struct MHD_Daemon *daemon)
 {
-  pthread_attr_t attr;
-  pthread_attr_t *pattr;
-  int ret;
-  
-  if (daemon->thread_stack_size != 0) 
+  struct MHD_Daemon *master;
+  int result;
+
+  master = MHD_get_master (daemon);
+  MHD_ip_count_lock (master);
+  result = (master->total_connections < master->max_connections)
+    ? MHD_YES : MHD_NO;
+  if (MHD_YES == result)
     {
-      if (0 != (ret = pthread_attr_init (&attr))) 
-	goto ERR;
-      if (0 != (ret = pthread_attr_setstacksize (&attr, daemon->thread_stack_size)))
-	{
-	  pthread_attr_destroy (&attr);
-	  goto ERR;
-	}
-      pattr = &attr;
+      master->total_connections++;
+      if (daemon != master)
+	daemon->connections++;
     }
-  else
+  MHD_ip_count_unlock (master);
+  return result;
+}
+
+
+/**
+ * Return a connection obtained with 'MHD_connection_budget_take'
+ * to the global connection limit.
+ *
+ * @param daemon daemon that removed the connection
+ */
+static void
+MHD_connection_budget_release (struct MHD_Daemon *daemon)
+{
+  struct MHD_Daemon *master;
+  unsigned int i;
+  int was_full;
+
+  master = MHD_get_master (daemon);
+  MHD_ip_count_lock (master);
+  was_full = (master->total_connections >= master->max_connections);
+  master->total_connections--;
+  if (daemon != master)
+    daemon->connections--;
+  if (was_full)
     {
-      pattr = NULL;
+      /* workers stopped listening at the limit; let them
+	 accept again */
+      for (i = 0; i < master->worker_pool_size; i++)
+	itc_signal (master->worker_pool[i]->itc);
     }
-  ret = pthread_create (thread, pattr,
-			start_routine, arg);
-  if (daemon->thread_stack_size != 0) 
-    pthread_attr_destroy (&attr);
-  return ret;
- ERR:
-#if HAVE_MESSAGES
-  MHD_DLOG (daemon,
-	    "Failed to set thread stack size\n");
-#endif
-  errno = EINVAL;
-  return ret;
+  MHD_ip_count_unlock (master);
 }
 
 
 /**
- * Add another client connection to the set of connections 
- * managed by MHD.  This API is usually not needed (since
- * MHD will accept inbound connections on the server socket).
- * Use this API in special cases, for example if your HTTP
- * server is behind NAT and needs to connect out to the 
- * HTTP client.
+ * Check (without locking) if the daemon should accept another
+ * connection, that is if it is not draining and the global
+ * connection limit would permit another connection.  Used to decide
+ * whether to listen for new connections; the authoritative check is
+ * done by 'MHD_connection_budget_take'.
  *
- * The given client socket will be managed (and closed!) by MHD after
- * this call and must no longer be used directly by the application
- * afterwards.
- *
- * Per-IP connection limits are ignored when using this API.
+ * @param daemon daemon to check for
+ * @return MHD_YES if there is room for another connection
+ */
+static int
+MHD_connection_budget_available (struct MHD_Daemon *daemon)
+{
+  struct MHD_Daemon *master;
+
+  if (MHD_YES == daemon->draining)
+    return MHD_NO;
+  master = MHD_get_master (daemon);
+  return (master->total_connections < master->max_connections)
+    ? MHD_YES : MHD_NO;
+}
+
+
+/**
+ * Suspend handling of network data for a given connection.  This can
+ * be used to dequeue a connection from MHD's event loop for a while.
+ * Must only be called from the 'MHD_AccessHandlerCallback' or from
+ * the 'MHD_ContentReaderCallback' of the connection's response.
  *
- * @param daemon daemon that manages the connection
- * @param client_socket socket to manage (MHD will expect
- *        to receive an HTTP request from this socket next).
- * @param addr IP address of the client
- * @param addrlen number of bytes in addr
- * @return MHD_YES on success, MHD_NO if this daemon could
- *        not handle the connection (i.e. malloc failed, etc).
- *        The socket will be closed in any case.
+ * @param connection the connection to suspend
  */
-int 
-MHD_add_connection (struct MHD_Daemon *daemon, 
-		    int client_socket,
-		    const struct sockaddr *addr,
-		    socklen_t addrlen)
+void
+MHD_suspend_connection (struct MHD_Connection *connection)
 {
-  struct MHD_Connection *connection;
-  int res_thread_create;
-#if OSX
-  static int on = 1;
-#endif
+  struct MHD_Daemon *daemon;
 
-#ifndef WINDOWS
-  if ( (client_socket >= FD_SETSIZE) &&
-       (0 == (daemon->options & MHD_USE_POLL)) )
+  daemon = connection->daemon;
+  if (0 == (daemon->options & MHD_USE_SUSPEND_RESUME))
+    mhd_panic (mhd_panic_cls, __FILE__, __LINE__,
+	       "Cannot suspend connections without enabling MHD_USE_SUSPEND_RESUME!\n");
+  if (NULL != connection->http2_parent)
     {
 #if HAVE_MESSAGES
       MHD_DLOG (daemon,
-		"Socket descriptor larger than FD_SETSIZE: %d > %d\n",
-		client_socket,
-		FD_SETSIZE);
+		"Cannot suspend requests received over HTTP/2\n");
 #endif
-      SHUTDOWN (client_socket, SHUT_RDWR);
-      CLOSE (client_socket);
-      return MHD_NO;
+      return;
     }
-#endif
-
-
-#if HAVE_MESSAGES
-#if DEBUG_CONNECT
-  MHD_DLOG (daemon, "Accepted connection on socket %d\n", s);
-#endif
-#endif
-  if ((daemon->max_connections == 0)
-      || (MHD_ip_limit_add (daemon, addr, addrlen) == MHD_NO))
+  if ( (0 != (daemon->options & MHD_USE_THREAD_PER_CONNECTION)) &&
+       (-1 == connection->itc[0]) )
     {
-      /* above connection limit - reject */
+      /* creating the channel failed when the thread started; without
+	 it the thread could not be woken up, keep polling instead */
 #if HAVE_MESSAGES
       MHD_DLOG (daemon,
-                "Server reached connection limit (closing inbound connection)\n");
+		"Cannot suspend connection without a wake-up channel\n");
 #endif
-      SHUTDOWN (client_socket, SHUT_RDWR);
-      CLOSE (client_socket);
-      return MHD_NO;
+      return;
     }
-
-  /* apply connection acceptance policy if present */
-  if ((daemon->apc != NULL)
-      && (MHD_NO == daemon->apc (daemon->apc_cls, addr, addrlen)))
+  if (0 != pthread_mutex_lock (&daemon->cleanup_connection_mutex))
     {
-#if DEBUG_CLOSE
 #if HAVE_MESSAGES
-      MHD_DLOG (daemon, "Connection rejected, closing connection\n");
-#endif
+      MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
 #endif
-      SHUTDOWN (client_socket, SHUT_RDWR);
-      CLOSE (client_socket);
-      MHD_ip_limit_del (daemon, addr, addrlen);
-      return MHD_YES;
+      abort();
     }
-
-#if OSX
-#ifdef SOL_SOCKET
-#ifdef SO_NOSIGPIPE
-  setsockopt (client_socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof (on));
-#endif
-#endif
-#endif
-
-  connection = malloc (sizeof (struct MHD_Connection));
-  if (NULL == connection)
+  if (MHD_YES == connection->offloaded)
     {
-#if HAVE_MESSAGES
-      MHD_DLOG (daemon, "Error allocating memory: %s\n", STRERROR (errno));
-#endif
-      SHUTDOWN (client_socket, SHUT_RDWR);
-      CLOSE (client_socket);
-      MHD_ip_limit_del (daemon, addr, addrlen);
-      return MHD_NO;
+      /* called from the handler pool: already suspended, but
+	 stay that way once the handler returns */
+      connection->suspend_in_pool = MHD_YES;
     }
-  memset (connection, 0, sizeof (struct MHD_Connection));
-  connection->connection_timeout = daemon->connection_timeout;
-  connection->pool = NULL;
-  connection->addr = malloc (addrlen);
-  if (connection->addr == NULL)
+  else if (MHD_NO == connection->suspended)
     {
-#if HAVE_MESSAGES
-      MHD_DLOG (daemon, "Error allocating memory: %s\n", STRERROR (errno));
-#endif
-      SHUTDOWN (client_socket, SHUT_RDWR);
-      CLOSE (client_socket);
-      MHD_ip_limit_del (daemon, addr, addrlen);
-      free (connection);
-      return MHD_NO;
+      /* with a thread per connection, the thread waits on the
+	 connection's own channel; otherwise leave the event loop */
+      if (0 == (daemon->options & MHD_USE_THREAD_PER_CONNECTION))
+	{
+	  DLL_remove (daemon->connections_head,
+		      daemon->connections_tail,
+		      connection);
+	  DLL_insert (daemon->suspended_connections_head,
+		      daemon->suspended_connections_tail,
+		      connection);
+	  /* resumed before it was suspended, move it back right away */
+	  if (MHD_YES == connection->resuming)
+	    daemon->resuming = MHD_YES;
+	}
+      connection->suspended = MHD_YES;
     }
-  memcpy (connection->addr, addr, addrlen);
-  connection->addr_len = addrlen;
-  connection->socket_fd = client_socket;
-  connection->daemon = daemon;
-  connection->last_activity = time (NULL);
-
-  /* set default connection handlers  */
-  MHD_set_http_callbacks_ (connection);
-  connection->recv_cls = &recv_param_adapter;
-  connection->send_cls = &send_param_adapter;
-  /* non-blocking sockets are required on most systems and for GNUtls;
-     however, they somehow cause serious problems on CYGWIN (#1824) */
-#ifdef CYGWIN
-  if
-#if HTTPS_SUPPORT
-    (0 != (daemon->options & MHD_USE_SSL))
-#else
-    (0)
-#endif
-#endif
-  {
-    /* make socket non-blocking */
-#ifndef MINGW
-    int flags = fcntl (connection->socket_fd, F_GETFL);
-    if ( (flags == -1) ||
-	 (0 != fcntl (connection->socket_fd, F_SETFL, flags | O_NONBLOCK)) )
-      {
-#if HAVE_MESSAGES
-	FPRINTF(stderr, "Failed to make socket non-blocking: %s\n", 
-		STRERROR (errno));
-#endif
-      }
-#else
-    unsigned long flags = 1;
-    if (0 != ioctlsocket (connection->socket_fd, FIONBIO, &flags))
-      {
-#if HAVE_MESSAGES
-	FPRINTF(stderr, "Failed to make socket non-blocking: %s\n", 
-		STRERROR (errno));
-#endif
-      }
-#endif
-  }
-
-#if HTTPS_SUPPORT
-  if (0 != (daemon->options & MHD_USE_SSL))
+  if (0 != pthread_mutex_unlock (&daemon->cleanup_connection_mutex))
     {
-      connection->recv_cls = &recv_tls_adapter;
-      connection->send_cls = &send_tls_adapter;
-      connection->state = MHD_TLS_CONNECTION_INIT;
-      MHD_set_https_callbacks (connection);
-      gnutls_init (&connection->tls_session, GNUTLS_SERVER);
-      gnutls_priority_set (connection->tls_session,
-			   daemon->priority_cache);
-      switch (daemon->cred_type)
-        {
-          /* set needed credentials for certificate authentication. */
-        case GNUTLS_CRD_CERTIFICATE:
-          gnutls_credentials_set (connection->tls_session,
-				  GNUTLS_CRD_CERTIFICATE,
-				  daemon->x509_cred);
-          break;
-        default:
-#if HAVE_MESSAGES
-          MHD_DLOG (connection->daemon,
-                    "Failed to setup TLS credentials: unknown credential type %d\n",
-                    daemon->cred_type);
-#endif
-          SHUTDOWN (client_socket, SHUT_RDWR);
-          CLOSE (client_socket);
-          MHD_ip_limit_del (daemon, addr, addrlen);
-          free (connection->addr);
-          free (connection);
-          mhd_panic (mhd_panic_cls, __FILE__, __LINE__, 
 #if HAVE_MESSAGES
-		     "Unknown credential type"
-#else
-		     NULL
+      MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
 #endif
-		     );
- 	  return MHD_NO;
-        }
-      gnutls_transport_set_ptr (connection->tls_session,
-				(gnutls_transport_ptr_t) connection);
-      gnutls_transport_set_pull_function (connection->tls_session,
-					  (gnutls_pull_func) &
-                                               recv_param_adapter);
-      gnutls_transport_set_push_function (connection->tls_session,
-					  (gnutls_push_func) &
-                                               send_param_adapter);
-
-      if (daemon->https_mem_trust){
-      gnutls_certificate_server_set_request(connection->tls_session, GNUTLS_CERT_REQUEST);
-      }
+      abort();
     }
-#endif
+}
 
-  if (0 != pthread_mutex_lock(&daemon->cleanup_connection_mutex))
+
+/**
+ * Resume handling of network data for suspended connection.  It is
+ * safe to resume a suspended connection at any time (from any thread).
+ *
+ * @param connection the connection to resume
+ */
+void
+MHD_resume_connection (struct MHD_Connection *connection)
+{
+  struct MHD_Daemon *daemon;
+
+  daemon = connection->daemon;
+  if (0 == (daemon->options & MHD_USE_SUSPEND_RESUME))
+    mhd_panic (mhd_panic_cls, __FILE__, __LINE__,
+	       "Cannot resume connections without enabling MHD_USE_SUSPEND_RESUME!\n");
+  if (NULL != connection->http2_parent)
+    return; /* never suspended */
+  if (0 != pthread_mutex_lock (&daemon->cleanup_connection_mutex))
     {
 #if HAVE_MESSAGES
       MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
 #endif
       abort();
     }
-  DLL_insert (daemon->connections_head,
-	      daemon->connections_tail,
-	      connection);
-  if (0 != pthread_mutex_unlock(&daemon->cleanup_connection_mutex))
+  connection->resuming = MHD_YES;
+  daemon->resuming = MHD_YES;
+  if (0 != (daemon->options & MHD_USE_THREAD_PER_CONNECTION))
+    itc_signal (connection->itc);
+  if (0 != pthread_mutex_unlock (&daemon->cleanup_connection_mutex))
     {
 #if HAVE_MESSAGES
       MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
 #endif
       abort();
     }
-
-  /* attempt to create handler thread */
-  if (0 != (daemon->options & MHD_USE_THREAD_PER_CONNECTION))
-    {
-      res_thread_create = create_thread (&connection->pid, daemon,
-					 &MHD_handle_connection, connection);
-      if (res_thread_create != 0)
-        {
-#if HAVE_MESSAGES
-          MHD_DLOG (daemon, "Failed to create a thread: %s\n",
-                    STRERROR (res_thread_create));
-#endif
-          SHUTDOWN (client_socket, SHUT_RDWR);
-          CLOSE (client_socket);
-          MHD_ip_limit_del (daemon, addr, addrlen);
-	  if (0 != pthread_mutex_lock(&daemon->cleanup_connection_mutex))
-	    {
-#if HAVE_MESSAGES
-	      MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
-#endif
-	      abort();
-	    }
-	  DLL_remove (daemon->connections_head,
-		      daemon->connections_tail,
-		      connection);
-	  if (0 != pthread_mutex_unlock(&daemon->cleanup_connection_mutex))
-	    {
-#if HAVE_MESSAGES
-	      MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
-#endif
-	      abort();
-	    }
-          free (connection->addr);
-          free (connection);
-          return MHD_NO;
-        }
-    }
-  daemon->max_connections--;
-  return MHD_YES;  
+  if (0 == (daemon->options & MHD_USE_THREAD_PER_CONNECTION))
+    itc_signal (daemon->itc);
 }
 
 
 /**
- * Accept an incoming connection and create the MHD_Connection object for
- * it.  This function also enforces policy by way of checking with the
- * accept policy callback.
- * 
- * @param daemon handle with the listen socket
- * @return MHD_YES on success
+ * Move the connections that were resumed since the last call back
+ * to the list of active connections.  Must only be called by the
+ * thread running the event loop of the daemon.
+ *
+ * @param daemon daemon to process resumed connections of
+ * @return MHD_YES if a connection was resumed
  */
 static int
-MHD_accept_connection (struct MHD_Daemon *daemon)
+resume_suspended_connections (struct MHD_Daemon *daemon)
 {
-#if HAVE_INET6
-  struct sockaddr_in6 addrstorage;
-#else
-  struct sockaddr_in addrstorage;
-#endif
-  struct sockaddr *addr = (struct sockaddr *) &addrstorage;
-  socklen_t addrlen;
-  int s;
+  struct MHD_Connection *pos;
+  struct MHD_Connection *next;
+  int ret;
 
-  addrlen = sizeof (addrstorage);
-  memset (addr, 0, sizeof (addrstorage));
-  s = ACCEPT (daemon->socket_fd, addr, &addrlen);
-  if ((s == -1) || (addrlen <= 0))
+  ret = MHD_NO;
+  if (0 != pthread_mutex_lock (&daemon->cleanup_connection_mutex))
     {
 #if HAVE_MESSAGES
-      /* This could be a common occurance with multiple worker threads */
-      if ((EAGAIN != errno) && (EWOULDBLOCK != errno))
-        MHD_DLOG (daemon, "Error accepting connection: %s\n", STRERROR (errno));
+      MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
 #endif
-      if (s != -1)
-        {
-          SHUTDOWN (s, SHUT_RDWR);
-          CLOSE (s);
-          /* just in case */
-        }
-      return MHD_NO;
+      abort();
     }
-#if HAVE_MESSAGES
-#if DEBUG_CONNECT
-  MHD_DLOG (daemon, "Accepted connection on socket %d\n", s);
+  if (MHD_YES == daemon->resuming)
+    {
+      daemon->resuming = MHD_NO;
+      next = daemon->suspended_connections_head;
+      while (NULL != (pos = next))
+	{
+	  next = pos->next;
+	  if ( (MHD_NO == pos->resuming) ||
+	       (MHD_YES == pos->offloaded) )
+	    continue;
+	  DLL_remove (daemon->suspended_connections_head,
+		      daemon->suspended_connections_tail,
+		      pos);
+	  DLL_insert (daemon->connections_head,
+		      daemon->connections_tail,
+		      pos);
+	  pos->suspended = MHD_NO;
+	  pos->resuming = MHD_NO;
+	  /* timeouts restart when the connection is resumed */
+	  pos->last_activity = time (NULL);
+#if HTTPS_SUPPORT
+	  if (MHD_YES == pos->tls_read_ready)
+	    tls_read_ready_insert (daemon, pos);
 #endif
+	  ret = MHD_YES;
+	}
+    }
+  if (0 != pthread_mutex_unlock (&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
 #endif
-  return MHD_add_connection (daemon, s,
-			     addr, addrlen);
+      abort();
+    }
+  return ret;
 }
 
 
 /**
- * Free resources associated with all closed connections.
- * (destroy responses, free buffers, etc.).  All closed
- * connections are kept in the "cleanup" doubly-linked list.
+ * Add the connections that other workers of the thread pool handed
+ * over to this worker (see 'rebalance_connections') to its active
+ * connections.  Must only be called by the thread running the event
+ * loop of the daemon (or after it terminated).
  *
- * @param daemon daemon to clean up
+ * @param daemon worker daemon
  */
 static void
-MHD_cleanup_connections (struct MHD_Daemon *daemon)
+adopt_connections (struct MHD_Daemon *daemon)
 {
+  struct MHD_Connection *head;
   struct MHD_Connection *pos;
-  void *unused;
-  int rc;
 
-  if (0 != pthread_mutex_lock(&daemon->cleanup_connection_mutex))
+  if (NULL == daemon->master)
+    return;
+  MHD_ip_count_lock (daemon->master);
+  head = daemon->handoff_head;
+  daemon->handoff_head = NULL;
+  daemon->handoff_tail = NULL;
+  MHD_ip_count_unlock (daemon->master);
+  if (NULL == head)
+    return;
+  if (0 != pthread_mutex_lock (&daemon->cleanup_connection_mutex))
     {
 #if HAVE_MESSAGES
       MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
 #endif
       abort();
     }
-  while (NULL != (pos = daemon->cleanup_head))
+  while (NULL != (pos = head))
     {
-      DLL_remove (daemon->cleanup_head,
-		  daemon->cleanup_tail,
+      head = pos->next;
+      DLL_insert (daemon->connections_head,
+		  daemon->connections_tail,
 		  pos);
-      if ( (0 != (daemon->options & MHD_USE_THREAD_PER_CONNECTION)) &&
-	   (MHD_NO == pos->thread_joined) )
-	{ 
-	  if (0 != (rc = pthread_join (pos->pid, &unused)))
-	    {
-#if HAVE_MESSAGES
-	      MHD_DLOG (daemon, "Failed to join a thread: %s\n",
-			STRERROR (rc));
-#endif
-	      abort();
-	    }
-	}
-      MHD_pool_destroy (pos->pool);
-#if HTTPS_SUPPORT
-      if (pos->tls_session != NULL)
-	gnutls_deinit (pos->tls_session);
-#endif
-      MHD_ip_limit_del (daemon, (struct sockaddr*)pos->addr, pos->addr_len);
-      if (pos->response != NULL)
-	{
-	  MHD_destroy_response (pos->response);
-	  pos->response = NULL;
-	}
-      if (-1 != pos->socket_fd)
-	CLOSE (pos->socket_fd);
-      if (NULL != pos->addr)
-	free (pos->addr);
-      free (pos);
-      daemon->max_connections++;
     }
-  if (0 != pthread_mutex_unlock(&daemon->cleanup_connection_mutex))
+  if (0 != pthread_mutex_unlock (&daemon->cleanup_connection_mutex))
     {
 #if HAVE_MESSAGES
       MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
@@ -1205,236 +1268,2156 @@ MHD_cleanup_connections (struct MHD_Daemon *daemon)
 
 
 /**
- * Obtain timeout value for select for this daemon
- * (only needed if connection timeout is used).  The
- * returned value is how long select should at most
- * block, not the timeout value set for connections.
+ * Get the current time in microseconds (for measuring the load of
+ * the workers of the thread pool and the queue times of the handler
+ * and handshake pools).
  *
- * @param daemon daemon to query for timeout
- * @param timeout set to the timeout (in milliseconds)
- * @return MHD_YES on success, MHD_NO if timeouts are
- *        not used (or no connections exist that would
- *        necessiate the use of a timeout right now).
+ * @return current time
  */
-int
-MHD_get_timeout (struct MHD_Daemon *daemon,
-		 unsigned MHD_LONG_LONG *timeout)
+static unsigned MHD_LONG_LONG
+get_time_usec ()
 {
-  time_t earliest_deadline;
-  time_t now;
-  struct MHD_Connection *pos;
-  int have_timeout = MHD_NO;
+  struct timeval tv;
 
-  if (0 != (daemon->options & MHD_USE_THREAD_PER_CONNECTION))
-    {
-#if HAVE_MESSAGES
-      MHD_DLOG (daemon, "Illegal call to MHD_get_timeout\n");
-#endif  
-      return MHD_NO;
-    }
-  pos = daemon->connections_head;
-  if (pos == NULL)
-    return MHD_NO;              /* no connections */
-  while (pos != NULL)
-    {
-      if (0 != pos->connection_timeout) {
-        if (!have_timeout ||
-	    earliest_deadline > pos->last_activity + pos->connection_timeout)
-          earliest_deadline = pos->last_activity + pos->connection_timeout;
-#if HTTPS_SUPPORT
-        if (  (0 != (daemon->options & MHD_USE_SSL)) &&
-	      (0 != gnutls_record_check_pending (pos->tls_session)) )
-	  earliest_deadline = 0;
-#endif
-        have_timeout = MHD_YES;
-      }
-      pos = pos->next;
-    }
-  if (!have_timeout)
-    return MHD_NO;
-  now = time (NULL);
-  if (earliest_deadline < now)
-    *timeout = 0;
-  else
-    *timeout = 1000 * (1 + earliest_deadline - now);
-  return MHD_YES;
+  gettimeofday (&tv, NULL);
+  return (unsigned MHD_LONG_LONG) tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
 
 /**
- * Main select call.
+ * Obtain the select sets for this daemon.
  *
- * @param daemon daemon to run select loop for
- * @param may_block YES if blocking, NO if non-blocking
- * @return MHD_NO on serious errors, MHD_YES on success
+ * @param daemon daemon to get sets from
+ * @param read_fd_set read set
+ * @param write_fd_set write set
+ * @param except_fd_set except set
+ * @param max_fd increased to largest FD added (if larger
+ *               than existing value); can be NULL
+ * @return MHD_YES on success, MHD_NO if this
+ *         daemon was not started with the right
+ *         options for this call.
  */
-static int
-MHD_select (struct MHD_Daemon *daemon, 
-	    int may_block)
+int
+MHD_get_fdset (struct MHD_Daemon *daemon,
+               fd_set * read_fd_set,
+               fd_set * write_fd_set, fd_set * except_fd_set, int *max_fd)
 {
   struct MHD_Connection *pos;
   struct MHD_Connection *next;
-  int num_ready;
-  fd_set rs;
-  fd_set ws;
-  fd_set es;
-  int max;
-  struct timeval timeout;
-  struct timeval *tv;
-  unsigned MHD_LONG_LONG ltimeout;
-  int ds;
+  int fd;
 
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 0;
-  if (daemon->shutdown == MHD_YES)
+  if ((daemon == NULL) || (read_fd_set == NULL) || (write_fd_set == NULL)
+      || (except_fd_set == NULL) || (max_fd == NULL)
+      || (-1 == (fd = daemon->socket_fd)) || (daemon->shutdown == MHD_YES)
+      || ((daemon->options & MHD_USE_THREAD_PER_CONNECTION) != 0)
+      || ((daemon->options & MHD_USE_POLL) != 0))
     return MHD_NO;
-  FD_ZERO (&rs);
-  FD_ZERO (&ws);
-  FD_ZERO (&es);
-  max = 0;
-  if (0 == (daemon->options & MHD_USE_THREAD_PER_CONNECTION))
-    {
-      /* single-threaded, go over everything */
-      if (MHD_NO == MHD_get_fdset (daemon, &rs, &ws, &es, &max))
-        return MHD_NO;
 
-      /* If we're at the connection limit, no need to
-         accept new connections. */
-      if ( (daemon->max_connections == 0) && (daemon->socket_fd != -1) )
-        FD_CLR(daemon->socket_fd, &rs);
+  FD_SET (fd, read_fd_set);
+  /* update max file descriptor */
+  if ((*max_fd) < fd) 
+    *max_fd = fd;
+  if (-1 != daemon->itc[0])
+    {
+      /* wake up when a connection is resumed, added by another
+	 thread or on MHD_wakeup_daemon */
+      FD_SET (daemon->itc[0], read_fd_set);
+      if ((*max_fd) < daemon->itc[0])
+	*max_fd = daemon->itc[0];
     }
-  else
+
+  next = daemon->connections_head;
+  while (NULL != (pos = next))
     {
-      /* accept only, have one thread per connection */
-      max = daemon->socket_fd;
-      if (max == -1)
+      next = pos->next;
+      if (MHD_YES != MHD_connection_get_fdset (pos,
+                                               read_fd_set,
+                                               write_fd_set,
+                                               except_fd_set, max_fd))
         return MHD_NO;
-      FD_SET (max, &rs);
     }
-
-#ifndef HAVE_LISTEN_SHUTDOWN
-  if (-1 == daemon->wpipe[0])
-    return MHD_NO;
-  FD_SET (daemon->wpipe[0], &rs);
-  /* update max file descriptor */
-  if (max < daemon->wpipe[0])
-    max = daemon->wpipe[0];
+#if DEBUG_CONNECT
+  MHD_DLOG (daemon, "Maximum socket in select set: %d\n", *max_fd);
 #endif
+  return MHD_YES;
+}
 
-  tv = NULL;
-  if (may_block == MHD_NO)
+
+/**
+ * Complete the resumption of a connection with its own thread if
+ * MHD_resume_connection was called (possibly even before the
+ * connection was suspended).
+ *
+ * @param con the suspended connection
+ * @return MHD_YES if the connection was resumed
+ */
+static int
+finish_resume (struct MHD_Connection *con)
+{
+  struct MHD_Daemon *daemon = con->daemon;
+  int ret;
+
+  if (0 != pthread_mutex_lock (&daemon->cleanup_connection_mutex))
     {
-      timeout.tv_usec = 0;
-      timeout.tv_sec = 0;
-      tv = &timeout;
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
+#endif
+      abort();
     }
-  else if ( (0 == (daemon->options & MHD_USE_THREAD_PER_CONNECTION)) &&
-	    (MHD_YES == MHD_get_timeout (daemon, &ltimeout)) )
+  ret = con->resuming;
+  if (MHD_YES == ret)
     {
-      /* ltimeout is in ms */
-      timeout.tv_usec = (ltimeout % 1000) * 1000;
-      timeout.tv_sec = ltimeout / 1000;
-      tv = &timeout;
+      con->suspended = MHD_NO;
+      con->resuming = MHD_NO;
+      /* timeouts restart when the connection is resumed */
+      con->last_activity = time (NULL);
     }
-  num_ready = SELECT (max + 1, &rs, &ws, &es, tv);
-
-  if (daemon->shutdown == MHD_YES)
-    return MHD_NO;
-  if (num_ready < 0)
+  if (0 != pthread_mutex_unlock (&daemon->cleanup_connection_mutex))
     {
-      if (errno == EINTR)
-        return MHD_YES;
 #if HAVE_MESSAGES
-      MHD_DLOG (daemon, "select failed: %s\n", STRERROR (errno));
+      MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
 #endif
-      return MHD_NO;
-    }
-  ds = daemon->socket_fd;
-  if (ds == -1)
-    return MHD_YES;
-
-  /* select connection thread handling type */
-  if (FD_ISSET (ds, &rs))
-    MHD_accept_connection (daemon);
-  if (0 == (daemon->options & MHD_USE_THREAD_PER_CONNECTION))
-    {
-      /* do not have a thread per connection, process all connections now */
-      next = daemon->connections_head;
-      while (NULL != (pos = next))
-        {
-	  next = pos->next;
-          ds = pos->socket_fd;
-          if (ds != -1)
-            {
-              if (FD_ISSET (ds, &rs))
-                pos->read_handler (pos);
-              if (FD_ISSET (ds, &ws))
-                pos->write_handler (pos);
-	      pos->idle_handler (pos);
-            }
-        }
+      abort();
     }
-  return MHD_YES;
+  return ret;
 }
 
 
-#ifdef HAVE_POLL_H
 /**
- * Process all of our connections and possibly the server
- * socket using 'poll'.
+ * Block the thread of a suspended connection until the connection
+ * is resumed (or the daemon is stopped).  Used with
+ * MHD_USE_THREAD_PER_CONNECTION, where suspended connections do not
+ * leave the list of connections of the daemon.
  *
- * @param daemon daemon to run poll loop for
- * @param may_block YES if blocking, NO if non-blocking
- * @return MHD_NO on serious errors, MHD_YES on success
+ * @param con the suspended connection
  */
-static int
-MHD_poll_all (struct MHD_Daemon *daemon,
-	      int may_block)
+static void
+wait_for_resume (struct MHD_Connection *con)
 {
-  unsigned int num_connections;
-  struct MHD_Connection *pos;
-  struct MHD_Connection *next;
+  struct MHD_Daemon *daemon = con->daemon;
+#ifdef HAVE_POLL_H
+  struct pollfd p[1];
+#endif
+  fd_set rs;
 
-  num_connections = 0;
-  pos = daemon->connections_head;
-  while (pos != NULL)
+  if (MHD_YES == finish_resume (con))
     {
-      num_connections++;
-      pos = pos->next;
+      /* resumed already, do not wait for the signal */
+      itc_drain (con->itc);
+      return;
     }
-  {
- #ifdef HAVE_LISTEN_SHUTDOWN
-    struct pollfd p[1 + num_connections];
- #else
-    struct pollfd p[2 + num_connections];
- #endif
-    struct MHD_Pollfd mp;
-    unsigned MHD_LONG_LONG ltimeout;
-    unsigned int i;
-    int timeout;
-    unsigned int poll_server;
-    
-    memset (p, 0, sizeof (p));
-    if ( (daemon->max_connections > 0) && (daemon->socket_fd != -1) )
-      {
-	p[0].fd = daemon->socket_fd;
-	p[0].events = POLLIN;
-	p[0].revents = 0;
-#ifdef HAVE_LISTEN_SHUTDOWN
-	poll_server = 1;
-#else
-	p[1].fd = daemon->wpipe[0];
-	p[1].events = POLLIN;
-	p[1].revents = 0;
-	poll_server = 2;
+#ifdef HAVE_POLL_H
+  if (0 != (daemon->options & MHD_USE_POLL))
+    {
+      p[0].fd = con->itc[0];
+      p[0].events = POLLIN;
+      p[0].revents = 0;
+      if ( (poll (p, 1, -1) < 0) &&
+	   (errno != EINTR) )
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon, "Error during poll: `%s'\n",
+		    STRERROR (errno));
 #endif
-      }
-    else
-      {
-	poll_server = 0;
-      }
-    if (may_block == MHD_NO)
-      timeout = 0;
+	  MHD_connection_close (con, MHD_REQUEST_TERMINATED_WITH_ERROR);
+	}
+    }
+  else
+#endif
+    {
+      FD_ZERO (&rs);
+      FD_SET (con->itc[0], &rs);
+      if ( (SELECT (con->itc[0] + 1, &rs, NULL, NULL, NULL) < 0) &&
+	   (errno != EINTR) )
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon, "Error during select: `%s'\n",
+		    STRERROR (errno));
+#endif
+	  MHD_connection_close (con, MHD_REQUEST_TERMINATED_WITH_ERROR);
+	}
+    }
+  itc_drain (con->itc);
+  (void) finish_resume (con);
+}
+
+
+/**
+ * Main function of the thread that handles an individual
+ * connection when MHD_USE_THREAD_PER_CONNECTION is set.
+ * 
+ * @param data the 'struct MHD_Connection' this thread will handle
+ * @return always NULL
+ */
+static void *
+MHD_handle_connection (void *data)
+{
+  struct MHD_Connection *con = data;
+  int num_ready;
+  fd_set rs;
+  fd_set ws;
+  fd_set es;
+  int max;
+  struct timeval tv;
+  struct timeval *tvp;
+  unsigned int timeout;
+  time_t now;
+  struct MHD_Pollfd mp;
+#ifdef HAVE_POLL_H
+  struct pollfd p[2];
+#endif
+
+  if ( (0 != (con->daemon->options & MHD_USE_SUSPEND_RESUME)) &&
+       (-1 == con->itc[0]) &&
+       (MHD_YES == itc_init (con->daemon, con->itc)) )
+    {
+      /* channel to wait on while suspended; created before the
+	 application learns about the connection, so that it is
+	 there for any MHD_resume_connection */
+#ifndef WINDOWS
+      if ( (0 == (con->daemon->options & MHD_USE_POLL)) &&
+	   (con->itc[0] >= FD_SETSIZE) )
+	itc_close (con->itc);
+#endif
+    }
+  timeout = con->daemon->connection_timeout;
+  while ( (!con->daemon->shutdown) && (con->state != MHD_CONNECTION_CLOSED) ) 
+    {
+      if (MHD_YES == con->suspended)
+	{
+	  /* sleep until MHD_resume_connection or MHD_stop_daemon */
+	  wait_for_resume (con);
+	  /* process the connection right away, it may not have
+	     anything to wait for on its socket */
+	  if ( (MHD_NO == con->suspended) &&
+	       (MHD_NO == con->idle_handler (con)) )
+	    goto exit;
+	  continue;
+	}
+      tvp = NULL;
+      if (timeout > 0)
+	{
+	  now = time (NULL);
+	  if (now - con->last_activity > timeout)
+	    tv.tv_sec = 0;
+	  else
+	    tv.tv_sec = timeout - (now - con->last_activity);
+	  tv.tv_usec = 0;
+	  tvp = &tv;
+	}
+      memset (&mp, 0, sizeof (struct MHD_Pollfd));
+      MHD_connection_get_pollfd (con, &mp);
+      if ( ( (con->state == MHD_CONNECTION_NORMAL_BODY_UNREADY) ||
+	     (con->state == MHD_CONNECTION_CHUNKED_BODY_UNREADY) ||
+	     (MHD_YES == con->response_unready) ) &&
+	   (-1 == mp.source_fd) )
+	{
+	  /* do not block (we're waiting for our callback to succeed) */
+	  tv.tv_sec = 0;
+	  tv.tv_usec = 0;
+	  tvp = &tv;
+	}
+      if (MHD_TLS_READ_READY (con))
+	{
+	  /* do not block, gnutls already has data for us */
+	  tv.tv_sec = 0;
+	  tv.tv_usec = 0;
+	  tvp = &tv;
+	}
+#ifdef HAVE_POLL_H
+      if (0 == (con->daemon->options & MHD_USE_POLL)) 
+	{
+#else
+	{
+#endif
+	  /* use select */
+	  FD_ZERO (&rs);
+	  FD_ZERO (&ws);
+	  FD_ZERO (&es);
+	  max = 0;
+	  if (mp.fd >= 0)
+	    {
+	      if (0 != (mp.events & MHD_POLL_ACTION_IN))
+		FD_SET (mp.fd, &rs);
+	      if (0 != (mp.events & MHD_POLL_ACTION_OUT))
+		FD_SET (mp.fd, &ws);
+	      max = mp.fd;
+	    }
+	  if (mp.source_fd >= 0)
+	    {
+	      /* pipe response waiting for data */
+	      FD_SET (mp.source_fd, &rs);
+	      if (max < mp.source_fd)
+		max = mp.source_fd;
+	    }
+	  num_ready = SELECT (max + 1, &rs, &ws, &es, tvp);
+	  if (num_ready < 0) 
+	    {
+	      if (errno == EINTR)
+		continue;
+#if HAVE_MESSAGES
+	      MHD_DLOG (con->daemon, "Error during select (%d): `%s'\n", max,
+			STRERROR (errno));
+#endif
+	      break;
+	    }
+	  /* call appropriate connection handler if necessary */
+	  if ( (FD_ISSET (con->socket_fd, &rs)) ||
+	       (MHD_TLS_READ_READY (con)) )
+	    con->read_handler (con);
+	  if (FD_ISSET (con->socket_fd, &ws))
+	    con->write_handler (con);
+	  if (MHD_NO == con->idle_handler (con))
+	    goto exit;
+	}
+#ifdef HAVE_POLL_H
+      else
+	{
+	    /* use poll */
+	  memset(&p, 0, sizeof (p));
+	  p[0].fd = mp.fd;
+	  if (mp.events & MHD_POLL_ACTION_IN) 
+	    p[0].events |= POLLIN;        
+	  if (mp.events & MHD_POLL_ACTION_OUT) 
+	    p[0].events |= POLLOUT;
+	  /* pipe response waiting for data (poll ignores -1) */
+	  p[1].fd = mp.source_fd;
+	  p[1].events = POLLIN;
+	  if (poll (p, 
+		    2, 
+		    (tvp == NULL) 
+		    ? -1 
+		    : tv.tv_sec * 1000) < 0)
+	    {
+	      if (errno == EINTR)
+		continue;
+#if HAVE_MESSAGES
+	      MHD_DLOG (con->daemon, "Error during poll: `%s'\n", 
+			STRERROR (errno));
+#endif
+	      break;
+	    }
+	  if ( (0 != (p[0].revents & POLLIN)) ||
+	       (MHD_TLS_READ_READY (con)) )
+	    con->read_handler (con);        
+	  if (0 != (p[0].revents & POLLOUT)) 
+	    con->write_handler (con);        
+#if HAVE_ZEROCOPY
+	  if ( (0 != (p[0].revents & POLLERR)) &&
+	       (con->zerocopy_pending > 0) )
+	    {
+	      /* completions of 'MSG_ZEROCOPY' transmissions, not an error */
+	      MHD_connection_reap_zerocopy (con);
+	      p[0].revents &= ~POLLERR;
+	    }
+#endif
+	  if (0 != (p[0].revents & (POLLERR | POLLHUP))) 
+	    MHD_connection_close (con, MHD_REQUEST_TERMINATED_WITH_ERROR);      
+	  if (MHD_NO == con->idle_handler (con))
+	    goto exit;
+	}
+#endif
+    }
+  if (con->state != MHD_CONNECTION_IN_CLEANUP)
+    {
+#if DEBUG_CLOSE
+#if HAVE_MESSAGES
+      MHD_DLOG (con->daemon,
+                "Processing thread terminating, closing connection\n");
+#endif
+#endif
+      if (con->state != MHD_CONNECTION_CLOSED)
+	MHD_connection_close (con, MHD_REQUEST_TERMINATED_DAEMON_SHUTDOWN);
+      con->idle_handler (con);
+    }
+exit:
+  if (con->response != NULL)
+    {
+      MHD_destroy_response (con->response);
+      con->response = NULL;
+    }
+  return NULL;
+}
+
+/**
+ * Callback for receiving data from the socket.
+ *
+ * @param conn the MHD connection structure
+ * @param other where to write received data to
+ * @param i maximum size of other (in bytes)
+ * @return number of bytes actually received
+ */
+static ssize_t
+recv_param_adapter (struct MHD_Connection *connection,
+		    void *other, 
+		    size_t i)
+{
+  if ( (connection->socket_fd == -1) ||
+       (connection->state == MHD_CONNECTION_CLOSED) )
+    {
+      errno = ENOTCONN;
+      return -1;
+    }
+  if (0 != (connection->daemon->options & MHD_USE_SSL))
+    return RECV (connection->socket_fd, other, i, MSG_NOSIGNAL);
+  return RECV (connection->socket_fd, other, i, MSG_NOSIGNAL);
+}
+
+#if LINUX
+/**
+ * Maximum number of memory segments we pass to the
+ * kernel in one call when sending an iovec-backed response.
+ */
+#define MHD_IOVEC_BATCH 64
+
+
+/**
+ * Send the next part of an iovec-backed response directly from
+ * the application's segments: consecutive memory segments are
+ * gathered into a single 'sendmsg' call, file segments are
+ * transmitted using 'sendfile'.
+ *
+ * @param connection the MHD connection structure
+ * @return actual number of bytes written
+ */
+static ssize_t
+send_iovec_segments (struct MHD_Connection *connection)
+{
+  struct MHD_Response *response = connection->response;
+  const struct MHD_IoVec *seg;
+  struct iovec vec[MHD_IOVEC_BATCH];
+  struct msghdr msg;
+  unsigned int i;
+  unsigned int cnt;
+  size_t off;
+  size_t left;
+  off_t offset;
+  ssize_t ret;
+
+  i = MHD_response_find_iov_segment (response,
+				     connection->response_write_position,
+				     &off);
+  if (i == response->data_iovcnt)
+    return 0;
+  seg = &response->data_iov[i];
+  if (seg->fd != -1)
+    {
+      offset = seg->fd_off + (off_t) off;
+      left = seg->iov_len - off;
+      if (left > SSIZE_MAX)
+	left = SSIZE_MAX; /* cap at return value limit */
+      ret = sendfile (connection->socket_fd,
+		      seg->fd,
+		      &offset,
+		      left);
+      if ( (ret == -1) &&
+	   ((EINTR == errno) || (EAGAIN == errno)) )
+	return 0;
+      return ret;
+    }
+  cnt = 0;
+  while ( (i < response->data_iovcnt) &&
+	  (cnt < MHD_IOVEC_BATCH) &&
+	  (response->data_iov[i].fd == -1) )
+    {
+      seg = &response->data_iov[i];
+      vec[cnt].iov_base = (char *) seg->iov_base + off;
+      vec[cnt].iov_len = seg->iov_len - off;
+      off = 0;
+      cnt++;
+      i++;
+    }
+  memset (&msg, 0, sizeof (struct msghdr));
+  msg.msg_iov = vec;
+  msg.msg_iovlen = cnt;
+  return sendmsg (connection->socket_fd, &msg, MSG_NOSIGNAL);
+}
+#endif
+
+
+#if HAVE_ZEROCOPY
+/**
+ * Send data of an in-memory response using 'MSG_ZEROCOPY'.  The
+ * kernel keeps using the response buffer after the call returns,
+ * so we hold a reference to the response until the completions
+ * have been reaped.  Falls back to a normal 'send' whenever
+ * zero-copy is not possible.
+ *
+ * @param connection the MHD connection structure
+ * @param other data to write
+ * @param i number of bytes to write
+ * @return actual number of bytes written
+ */
+static ssize_t
+send_zerocopy (struct MHD_Connection *connection,
+	       const void *other,
+	       size_t i)
+{
+  const int on = 1;
+  ssize_t ret;
+
+  if (0 == connection->zerocopy_state)
+    connection->zerocopy_state =
+      (0 == setsockopt (connection->socket_fd, SOL_SOCKET, SO_ZEROCOPY,
+			&on, sizeof (on))) ? 1 : -1;
+  if (connection->zerocopy_pending > 0)
+    MHD_connection_reap_zerocopy (connection);
+  if ( (1 != connection->zerocopy_state) ||
+       ( (NULL != connection->zerocopy_response) &&
+	 (connection->response != connection->zerocopy_response) ) )
+    {
+      /* not available, or still waiting for the kernel to
+	 release the buffer of an earlier response */
+      return SEND (connection->socket_fd, other, i, MSG_NOSIGNAL);
+    }
+  ret = SEND (connection->socket_fd, other, i, MSG_NOSIGNAL | MSG_ZEROCOPY);
+  if ( (-1 == ret) &&
+       (ENOBUFS == errno) )
+    {
+      /* out of locked memory for zero-copy, copy instead */
+      return SEND (connection->socket_fd, other, i, MSG_NOSIGNAL);
+    }
+  if (ret <= 0)
+    return ret;
+  if (NULL == connection->zerocopy_response)
+    {
+      MHD_increment_response_rc (connection->response);
+      connection->zerocopy_response = connection->response;
+    }
+  connection->zerocopy_pending++;
+  return ret;
+}
+#endif
+
+
+/**
+ * Callback for writing data to the socket.
+ *
+ * @param conn the MHD connection structure
+ * @param other data to write
+ * @param i number of bytes to write
+ * @return actual number of bytes written
+ */
+static ssize_t
+send_param_adapter (struct MHD_Connection *connection,
+                    const void *other,
+		    size_t i)
+{
+#if LINUX
+  int fd;
+  off_t offset;
+  off_t left;
+  ssize_t ret;
+#endif
+  if ( (connection->socket_fd == -1) ||
+       (connection->state == MHD_CONNECTION_CLOSED) )
+    {
+      errno = ENOTCONN;
+      return -1;
+    }
+  if (MHD_TLS_IN_USERSPACE (connection))
+    return SEND (connection->socket_fd, other, i, MSG_NOSIGNAL);
+#if LINUX
+  if ( (connection->write_buffer_append_offset ==
+	connection->write_buffer_send_offset) &&
+       (NULL != connection->response) &&
+       (-1 != (fd = connection->response->fd)) )
+    {
+      /* can use sendfile */
+      offset = (off_t) connection->response_write_position + connection->response->fd_off;
+      left = connection->response->total_size - connection->response_write_position;
+      if (left > SSIZE_MAX)
+	left = SSIZE_MAX; /* cap at return value limit */
+      ret = sendfile (connection->socket_fd, 
+		      fd,
+		      &offset,
+		      (size_t) left);
+      if (ret != -1)
+	return ret;
+      if ((EINTR == errno) || (EAGAIN == errno))
+	return 0;
+      if ( (EINVAL == errno) ||
+	   (EBADF == errno) )
+	return -1; 
+      /* None of the 'usual' sendfile errors occurred, so we should try
+	 to fall back to 'SEND'; see also this thread for info on
+	 odd libc/Linux behavior with sendfile:
+	 http://lists.gnu.org/archive/html/libmicrohttpd/2011-02/msg00015.html */
+    }
+  if ( (connection->write_buffer_append_offset ==
+	connection->write_buffer_send_offset) &&
+       (NULL != connection->response) &&
+       (NULL != connection->response->data_iov) )
+    return send_iovec_segments (connection);
+#endif
+#if HAVE_ZEROCOPY
+  /* kernel TLS does not support 'MSG_ZEROCOPY' */
+  if ( (0 != connection->daemon->zerocopy_threshold) &&
+       (0 == (connection->daemon->options & MHD_USE_SSL)) &&
+       (connection->state == MHD_CONNECTION_NORMAL_BODY_READY) &&
+       (NULL != connection->response) &&
+       (NULL == connection->response->crc) &&
+       (connection->response->total_size >=
+	connection->daemon->zerocopy_threshold) )
+    return send_zerocopy (connection, other, i);
+#endif
+#if HAVE_SPLICE
+  if ( (connection->state == MHD_CONNECTION_NORMAL_BODY_READY) &&
+       (NULL != connection->response) &&
+       (-1 != connection->response->splice_pipe[0]) )
+    {
+      /* move the data from the splice pipe, ignoring 'other' */
+      return MHD_response_splice_to (connection->response,
+				     connection->socket_fd,
+				     SSIZE_MAX);
+    }
+#endif
+  return SEND (connection->socket_fd, other, i, MSG_NOSIGNAL);
+}
+
+
+/**
+ * Create a thread and set the attributes according to our options.
+ * 
+ * @param thread handle to initialize
+ * @param daemon daemon with options
+ * @param start_routine main function of thread
+ * @param arg argument for start_routine
+ * @return 0 on success
+ */
+static int
+create_thread (pthread_t * thread,
+	       const struct MHD_Daemon *daemon,
+	       void *(*start_routine)(void*),
+	       void *arg)
+{
+  pthread_attr_t attr;
+  pthread_attr_t *pattr;
+  int ret;
+  
+  if (daemon->thread_stack_size != 0) 
+    {
+      if (0 != (ret = pthread_attr_init (&attr))) 
+	goto ERR;
+      if (0 != (ret = pthread_attr_setstacksize (&attr, daemon->thread_stack_size)))
+	{
+	  pthread_attr_destroy (&attr);
+	  goto ERR;
+	}
+      pattr = &attr;
+    }
+  else
+    {
+      pattr = NULL;
+    }
+  ret = pthread_create (thread, pattr,
+			start_routine, arg);
+  if (daemon->thread_stack_size != 0) 
+    pthread_attr_destroy (&attr);
+  return ret;
+ ERR:
+#if HAVE_MESSAGES
+  MHD_DLOG (daemon,
+	    "Failed to set thread stack size\n");
+#endif
+  errno = EINVAL;
+  return ret;
+}
+
+
+/**
+ * Main function of a cached thread (MHD_OPTION_THREAD_CACHE_SIZE):
+ * handle the assigned connection like a thread of its own would,
+ * then wait for the next connection; terminate if the cache is full,
+ * no connection arrives within the idle timeout or the daemon is
+ * shut down.
+ *
+ * @param cls the 'struct MHD_CachedThread'
+ * @return always NULL
+ */
+static void *
+cached_thread_run (void *cls)
+{
+  struct MHD_CachedThread *t = cls;
+  struct MHD_Daemon *daemon = t->daemon;
+  struct MHD_Connection *con;
+  struct timespec deadline;
+
+  pthread_mutex_lock (&daemon->thread_cache_mutex);
+  while (NULL != (con = t->connection))
+    {
+      pthread_mutex_unlock (&daemon->thread_cache_mutex);
+      MHD_handle_connection (con);
+      /* tell MHD_cleanup_connections that it may free 'con' */
+      if (0 != pthread_mutex_lock (&daemon->cleanup_connection_mutex))
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
+#endif
+	  abort();
+	}
+      con->thread_done = MHD_YES;
+      pthread_cond_broadcast (&daemon->thread_done_cond);
+      if (0 != pthread_mutex_unlock (&daemon->cleanup_connection_mutex))
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
+#endif
+	  abort();
+	}
+      pthread_mutex_lock (&daemon->thread_cache_mutex);
+      t->connection = NULL;
+      if ( (MHD_YES == daemon->shutdown) ||
+	   (daemon->idle_threads >= daemon->thread_cache_size) )
+	break;
+      DLL_insert (daemon->idle_threads_head,
+		  daemon->idle_threads_tail,
+		  t);
+      daemon->idle_threads++;
+      deadline.tv_sec = time (NULL) + daemon->thread_cache_timeout;
+      deadline.tv_nsec = 0;
+      while ( (NULL == t->connection) &&
+	      (MHD_NO == daemon->shutdown) )
+	{
+	  if (ETIMEDOUT == pthread_cond_timedwait (&t->cond,
+						   &daemon->thread_cache_mutex,
+						   &deadline))
+	    break;
+	}
+      if (NULL == t->connection)
+	{
+	  /* idle for too long or shutting down */
+	  DLL_remove (daemon->idle_threads_head,
+		      daemon->idle_threads_tail,
+		      t);
+	  daemon->idle_threads--;
+	}
+    }
+  /* leave joining the thread to MHD_cleanup_connections */
+  DLL_insert (daemon->dead_threads_head,
+	      daemon->dead_threads_tail,
+	      t);
+  daemon->live_threads--;
+  pthread_cond_broadcast (&daemon->thread_cache_cond);
+  pthread_mutex_unlock (&daemon->thread_cache_mutex);
+  return NULL;
+}
+
+
+/**
+ * Hand a new connection to an idle cached thread, or start a new
+ * cached thread for it.
+ *
+ * @param daemon daemon the connection belongs to
+ * @param connection the new connection
+ * @return 0 on success, error code of pthread_create otherwise
+ */
+static int
+thread_cache_assign (struct MHD_Daemon *daemon,
+		     struct MHD_Connection *connection)
+{
+  struct MHD_CachedThread *t;
+  int ret;
+
+  pthread_mutex_lock (&daemon->thread_cache_mutex);
+  if (NULL != (t = daemon->idle_threads_head))
+    {
+      DLL_remove (daemon->idle_threads_head,
+		  daemon->idle_threads_tail,
+		  t);
+      daemon->idle_threads--;
+      t->connection = connection;
+      pthread_cond_signal (&t->cond);
+      pthread_mutex_unlock (&daemon->thread_cache_mutex);
+      return 0;
+    }
+  pthread_mutex_unlock (&daemon->thread_cache_mutex);
+  t = malloc (sizeof (struct MHD_CachedThread));
+  if (NULL == t)
+    return ENOMEM;
+  memset (t, 0, sizeof (struct MHD_CachedThread));
+  t->daemon = daemon;
+  t->connection = connection;
+  if (0 != (ret = pthread_cond_init (&t->cond, NULL)))
+    {
+      free (t);
+      return ret;
+    }
+  /* hold the lock so that the thread cannot terminate (and be
+     joined) before 't->pid' is set */
+  pthread_mutex_lock (&daemon->thread_cache_mutex);
+  ret = create_thread (&t->pid, daemon, &cached_thread_run, t);
+  if (0 == ret)
+    daemon->live_threads++;
+  pthread_mutex_unlock (&daemon->thread_cache_mutex);
+  if (0 != ret)
+    {
+      pthread_cond_destroy (&t->cond);
+      free (t);
+    }
+  return ret;
+}
+
+
+/**
+ * Join the cached threads that terminated.
+ *
+ * @param daemon daemon to join cached threads of
+ */
+static void
+thread_cache_reap (struct MHD_Daemon *daemon)
+{
+  struct MHD_CachedThread *t;
+  void *unused;
+  int rc;
+
+  pthread_mutex_lock (&daemon->thread_cache_mutex);
+  while (NULL != (t = daemon->dead_threads_head))
+    {
+      DLL_remove (daemon->dead_threads_head,
+		  daemon->dead_threads_tail,
+		  t);
+      pthread_mutex_unlock (&daemon->thread_cache_mutex);
+      if (0 != (rc = pthread_join (t->pid, &unused)))
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon, "Failed to join a thread: %s\n",
+		    STRERROR (rc));
+#endif
+	  abort();
+	}
+      pthread_cond_destroy (&t->cond);
+      free (t);
+      pthread_mutex_lock (&daemon->thread_cache_mutex);
+    }
+  pthread_mutex_unlock (&daemon->thread_cache_mutex);
+}
+
+
+/**
+ * Set up the (empty) thread cache of a daemon.
+ *
+ * @param daemon daemon to set up the thread cache for
+ * @return MHD_YES on success, MHD_NO on error
+ */
+static int
+thread_cache_init (struct MHD_Daemon *daemon)
+{
+  if (0 != pthread_mutex_init (&daemon->thread_cache_mutex, NULL))
+    return MHD_NO;
+  if (0 != pthread_cond_init (&daemon->thread_cache_cond, NULL))
+    {
+      pthread_mutex_destroy (&daemon->thread_cache_mutex);
+      return MHD_NO;
+    }
+  if (0 != pthread_cond_init (&daemon->thread_done_cond, NULL))
+    {
+      pthread_cond_destroy (&daemon->thread_cache_cond);
+      pthread_mutex_destroy (&daemon->thread_cache_mutex);
+      return MHD_NO;
+    }
+  return MHD_YES;
+}
+
+
+/**
+ * Terminate all cached threads (the daemon must be shutting down
+ * and all connections must be closed) and release the thread cache.
+ *
+ * @param daemon daemon to destroy the thread cache of
+ */
+static void
+thread_cache_destroy (struct MHD_Daemon *daemon)
+{
+  struct MHD_CachedThread *t;
+
+  pthread_mutex_lock (&daemon->thread_cache_mutex);
+  for (t = daemon->idle_threads_head; NULL != t; t = t->next)
+    pthread_cond_signal (&t->cond);
+  while (0 != daemon->live_threads)
+    pthread_cond_wait (&daemon->thread_cache_cond,
+		       &daemon->thread_cache_mutex);
+  pthread_mutex_unlock (&daemon->thread_cache_mutex);
+  thread_cache_reap (daemon);
+  pthread_cond_destroy (&daemon->thread_done_cond);
+  pthread_cond_destroy (&daemon->thread_cache_cond);
+  pthread_mutex_destroy (&daemon->thread_cache_mutex);
+}
+
+
+/**
+ * Main function of the threads of the handler (or handshake) pool:
+ * run the queued calls and hand the connections back to their event
+ * loops.
+ *
+ * @param cls the 'struct MHD_HandlerPool'
+ * @return always NULL
+ */
+static void *
+handler_pool_run (void *cls)
+{
+  struct MHD_HandlerPool *pool = cls;
+  struct MHD_Connection *pos;
+  struct MHD_Daemon *daemon;
+  unsigned MHD_LONG_LONG waited;
+
+  pthread_mutex_lock (&pool->mutex);
+  while (1)
+    {
+      while ( (NULL == pool->head) &&
+	      (MHD_NO == pool->shutdown) )
+	pthread_cond_wait (&pool->cond, &pool->mutex);
+      if (MHD_YES == pool->shutdown)
+	break;
+      pos = pool->head;
+      pool->head = pos->offload_next;
+      if (NULL == pool->head)
+	pool->tail = NULL;
+      pool->queued--;
+      pool->calls++;
+      waited = get_time_usec () - pos->offload_time;
+      pool->queue_time += waited;
+      if (waited > pool->max_queue_time)
+	pool->max_queue_time = waited;
+      pthread_mutex_unlock (&pool->mutex);
+
+      pos->offload_call (pos);
+
+      daemon = pos->daemon;
+      if (0 != pthread_mutex_lock (&daemon->cleanup_connection_mutex))
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
+#endif
+	  abort();
+	}
+      pos->offloaded = MHD_NO;
+      if (MHD_YES == pos->suspend_in_pool)
+	{
+	  /* application suspended the connection; the handler is
+	     called again once it is resumed */
+	  pos->suspend_in_pool = MHD_NO;
+	}
+      else
+	{
+	  pos->offload_done = pool->repeat_calls;
+	  pos->resuming = MHD_YES;
+	}
+      if (MHD_YES == pos->resuming)
+	daemon->resuming = MHD_YES;
+      if (0 != pthread_mutex_unlock (&daemon->cleanup_connection_mutex))
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
+#endif
+	  abort();
+	}
+      itc_signal (daemon->itc);
+      pthread_mutex_lock (&pool->mutex);
+    }
+  pthread_mutex_unlock (&pool->mutex);
+  return NULL;
+}
+
+
+/**
+ * Stop the threads of a handler pool.  Calls still queued are not
+ * run; their connections stay suspended and are closed with the
+ * daemon.
+ *
+ * @param pool pool to stop
+ */
+static void
+handler_pool_stop (struct MHD_HandlerPool *pool)
+{
+  unsigned int i;
+  void *unused;
+  int rc;
+
+  pthread_mutex_lock (&pool->mutex);
+  pool->shutdown = MHD_YES;
+  pthread_cond_broadcast (&pool->cond);
+  pthread_mutex_unlock (&pool->mutex);
+  for (i = 0; i < pool->num_threads; i++)
+    {
+      if (0 != (rc = pthread_join (pool->threads[i], &unused)))
+	abort ();
+    }
+  pool->num_threads = 0;
+}
+
+
+/**
+ * Stop a handler pool (if running) and release its resources.
+ *
+ * @param pool pool to destroy
+ */
+static void
+handler_pool_destroy (struct MHD_HandlerPool *pool)
+{
+  handler_pool_stop (pool);
+  pthread_cond_destroy (&pool->cond);
+  pthread_mutex_destroy (&pool->mutex);
+  free (pool->threads);
+  free (pool);
+}
+
+
+/**
+ * Create a handler pool for a daemon and start its threads.
+ *
+ * @param daemon daemon to create the pool for
+ * @param num_threads number of threads to start
+ * @param repeat_calls MHD_YES if the event loop invokes the
+ *        offloaded call again once the pool ran it (see
+ *        'MHD_connection_offload_')
+ * @return NULL on error
+ */
+static struct MHD_HandlerPool *
+handler_pool_create (struct MHD_Daemon *daemon,
+		     unsigned int num_threads,
+		     int repeat_calls)
+{
+  struct MHD_HandlerPool *pool;
+  unsigned int i;
+  int res_thread_create;
+
+  pool = malloc (sizeof (struct MHD_HandlerPool));
+  if (NULL == pool)
+    return NULL;
+  memset (pool, 0, sizeof (struct MHD_HandlerPool));
+  pool->repeat_calls = repeat_calls;
+  pool->threads = malloc (sizeof (pthread_t) * num_threads);
+  if (NULL == pool->threads)
+    {
+      free (pool);
+      return NULL;
+    }
+  if (0 != pthread_mutex_init (&pool->mutex, NULL))
+    {
+      free (pool->threads);
+      free (pool);
+      return NULL;
+    }
+  if (0 != pthread_cond_init (&pool->cond, NULL))
+    {
+      pthread_mutex_destroy (&pool->mutex);
+      free (pool->threads);
+      free (pool);
+      return NULL;
+    }
+  for (i = 0; i < num_threads; i++)
+    {
+      res_thread_create = create_thread (&pool->threads[i], daemon,
+					 &handler_pool_run, pool);
+      if (0 != res_thread_create)
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon,
+		    "Failed to create handler pool thread: %s\n",
+		    STRERROR (res_thread_create));
+#endif
+	  handler_pool_destroy (pool);
+	  return NULL;
+	}
+      pool->num_threads++;
+    }
+  return pool;
+}
+
+
+/**
+ * Suspend a connection and queue it with a handler pool.
+ *
+ * @param pool pool to run 'call'
+ * @param connection connection to run the call for
+ * @param call function to run
+ */
+static void
+offload_to_pool (struct MHD_HandlerPool *pool,
+		 struct MHD_Connection *connection,
+		 OffloadCallback call)
+{
+  struct MHD_Daemon *daemon = connection->daemon;
+
+  /* leave the event loop while the pool runs the call */
+  if (0 != pthread_mutex_lock (&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
+#endif
+      abort();
+    }
+  DLL_remove (daemon->connections_head,
+	      daemon->connections_tail,
+	      connection);
+  DLL_insert (daemon->suspended_connections_head,
+	      daemon->suspended_connections_tail,
+	      connection);
+  connection->suspended = MHD_YES;
+  connection->offloaded = MHD_YES;
+  if (0 != pthread_mutex_unlock (&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
+#endif
+      abort();
+    }
+  connection->offload_call = call;
+  connection->offload_next = NULL;
+  connection->offload_time = get_time_usec ();
+  pthread_mutex_lock (&pool->mutex);
+  if (NULL == pool->tail)
+    pool->head = connection;
+  else
+    pool->tail->offload_next = connection;
+  pool->tail = connection;
+  pool->queued++;
+  pthread_cond_signal (&pool->cond);
+  pthread_mutex_unlock (&pool->mutex);
+}
+
+
+/**
+ * Run a call into the application's access handler for a
+ * connection.  Without a handler pool, 'call' is run right away.
+ * Otherwise the connection is suspended and handed to the pool the
+ * first time; once the pool has run 'call', the next invocation for
+ * the connection returns MHD_YES without running it again.
+ *
+ * @param connection connection to run the call for
+ * @param call function calling the access handler
+ * @return MHD_YES if 'call' has been run, MHD_NO if the connection
+ *         was handed to the handler pool
+ */
+int
+MHD_connection_offload_ (struct MHD_Connection *connection,
+			 OffloadCallback call)
+{
+  struct MHD_HandlerPool *pool = connection->daemon->handler_pool;
+
+  if (NULL == pool)
+    {
+      call (connection);
+      return MHD_YES;
+    }
+  if (MHD_YES == connection->offload_done)
+    {
+      connection->offload_done = MHD_NO;
+      return MHD_YES;
+    }
+  offload_to_pool (pool, connection, call);
+  return MHD_NO;
+}
+
+
+#if HTTPS_SUPPORT
+/**
+ * Hand the next step of the TLS handshake of a connection to the
+ * handshake pool (if the daemon has one).  The connection is
+ * suspended until the pool ran 'call'.
+ *
+ * @param connection connection to run the step for
+ * @param call function running the step
+ * @return MHD_YES if the connection was handed to the handshake
+ *         pool, MHD_NO if the caller should run 'call' itself
+ */
+int
+MHD_connection_offload_handshake_ (struct MHD_Connection *connection,
+				   OffloadCallback call)
+{
+  struct MHD_HandlerPool *pool = connection->daemon->handshake_pool;
+
+  if (NULL == pool)
+    return MHD_NO;
+  offload_to_pool (pool, connection, call);
+  return MHD_YES;
+}
+#endif
+
+
+/**
+ * Add another client connection to the set of connections 
+ * managed by MHD.
+ *
+ * @param daemon daemon that manages the connection
+ * @param client_socket socket to manage (MHD will expect
+ *        to receive an HTTP request from this socket next).
+ * @param addr IP address of the client
+ * @param addrlen number of bytes in addr
+ * @param external_add MHD_YES if the connection was not accepted
+ *        by the event loop of the daemon itself (which then
+ *        needs to be woken up to start processing it)
+ * @return MHD_YES on success, MHD_NO if this daemon could
+ *        not handle the connection (i.e. malloc failed, etc).
+ *        The socket will be closed in any case.
+ */
+static int 
+internal_add_connection (struct MHD_Daemon *daemon, 
+			 int client_socket,
+			 const struct sockaddr *addr,
+			 socklen_t addrlen,
+			 int external_add)
+{
+  struct MHD_Connection *connection;
+  int res_thread_create;
+#if OSX || (HTTPS_SUPPORT && defined(TCP_NODELAY))
+  static int on = 1;
+#endif
+
+#ifndef WINDOWS
+  if ( (client_socket >= FD_SETSIZE) &&
+       (0 == (daemon->options & MHD_USE_POLL)) )
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon,
+		"Socket descriptor larger than FD_SETSIZE: %d > %d\n",
+		client_socket,
+		FD_SETSIZE);
+#endif
+      SHUTDOWN (client_socket, SHUT_RDWR);
+      CLOSE (client_socket);
+      return MHD_NO;
+    }
+#endif
+
+
+#if HAVE_MESSAGES
+#if DEBUG_CONNECT
+  MHD_DLOG (daemon, "Accepted connection on socket %d\n", s);
+#endif
+#endif
+  if (MHD_NO == MHD_connection_budget_take (daemon))
+    {
+      /* above connection limit - reject */
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon,
+                "Server reached connection limit (closing inbound connection)\n");
+#endif
+      SHUTDOWN (client_socket, SHUT_RDWR);
+      CLOSE (client_socket);
+      return MHD_NO;
+    }
+  if (MHD_NO == MHD_ip_limit_add (daemon, addr, addrlen))
+    {
+      MHD_connection_budget_release (daemon);
+      /* above per-IP connection limit - reject */
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon,
+                "Client reached per-IP connection limit (closing inbound connection)\n");
+#endif
+      SHUTDOWN (client_socket, SHUT_RDWR);
+      CLOSE (client_socket);
+      return MHD_NO;
+    }
+
+  /* apply connection acceptance policy if present */
+  if ((daemon->apc != NULL)
+      && (MHD_NO == daemon->apc (daemon->apc_cls, addr, addrlen)))
+    {
+#if DEBUG_CLOSE
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Connection rejected, closing connection\n");
+#endif
+#endif
+      SHUTDOWN (client_socket, SHUT_RDWR);
+      CLOSE (client_socket);
+      MHD_ip_limit_del (daemon, addr, addrlen);
+      MHD_connection_budget_release (daemon);
+      return MHD_YES;
+    }
+
+#if OSX
+#ifdef SOL_SOCKET
+#ifdef SO_NOSIGPIPE
+  setsockopt (client_socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof (on));
+#endif
+#endif
+#endif
+
+  connection = malloc (sizeof (struct MHD_Connection));
+  if (NULL == connection)
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Error allocating memory: %s\n", STRERROR (errno));
+#endif
+      SHUTDOWN (client_socket, SHUT_RDWR);
+      CLOSE (client_socket);
+      MHD_ip_limit_del (daemon, addr, addrlen);
+      MHD_connection_budget_release (daemon);
+      return MHD_NO;
+    }
+  memset (connection, 0, sizeof (struct MHD_Connection));
+  connection->connection_timeout = daemon->connection_timeout;
+  connection->pool = NULL;
+  connection->addr = malloc (addrlen);
+  if (connection->addr == NULL)
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Error allocating memory: %s\n", STRERROR (errno));
+#endif
+      SHUTDOWN (client_socket, SHUT_RDWR);
+      CLOSE (client_socket);
+      MHD_ip_limit_del (daemon, addr, addrlen);
+      MHD_connection_budget_release (daemon);
+      free (connection);
+      return MHD_NO;
+    }
+  memcpy (connection->addr, addr, addrlen);
+  connection->addr_len = addrlen;
+  connection->socket_fd = client_socket;
+  connection->itc[0] = -1;
+  connection->itc[1] = -1;
+  connection->daemon = daemon;
+  connection->last_activity = time (NULL);
+  connection->http2_allowed = (0 != (daemon->options & MHD_USE_HTTP2)) ? MHD_YES : MHD_NO;
+
+  /* set default connection handlers  */
+  MHD_set_http_callbacks_ (connection);
+  connection->recv_cls = &recv_param_adapter;
+  connection->send_cls = &send_param_adapter;
+  /* non-blocking sockets are required on most systems and for GNUtls;
+     however, they somehow cause serious problems on CYGWIN (#1824) */
+#ifdef CYGWIN
+  if
+#if HTTPS_SUPPORT
+    (0 != (daemon->options & MHD_USE_SSL))
+#else
+    (0)
+#endif
+#endif
+  {
+    /* make socket non-blocking */
+#ifndef MINGW
+    int flags = fcntl (connection->socket_fd, F_GETFL);
+    if ( (flags == -1) ||
+	 (0 != fcntl (connection->socket_fd, F_SETFL, flags | O_NONBLOCK)) )
+      {
+#if HAVE_MESSAGES
+	FPRINTF(stderr, "Failed to make socket non-blocking: %s\n", 
+		STRERROR (errno));
+#endif
+      }
+#else
+    unsigned long flags = 1;
+    if (0 != ioctlsocket (connection->socket_fd, FIONBIO, &flags))
+      {
+#if HAVE_MESSAGES
+	FPRINTF(stderr, "Failed to make socket non-blocking: %s\n", 
+		STRERROR (errno));
+#endif
+      }
+#endif
+  }
+
+#if HTTPS_SUPPORT
+  if (0 != (daemon->options & MHD_USE_SSL))
+    {
+      connection->recv_cls = &recv_tls_adapter;
+      connection->send_cls = &send_tls_adapter;
+      connection->state = MHD_TLS_CONNECTION_INIT;
+      MHD_set_https_callbacks (connection);
+      gnutls_init (&connection->tls_session, GNUTLS_SERVER);
+      gnutls_priority_set (connection->tls_session,
+			   daemon->priority_cache);
+      MHD_tls_session_cache_setup (daemon, connection->tls_session);
+      MHD_tls_host_certs_setup (connection);
+#ifdef TCP_NODELAY
+      /* gnutls sends the records of a handshake flight with separate
+	 writes; Nagle's algorithm would hold all but the first back
+	 until the (delayed) ACK of the client.  Responses are already
+	 sent in full records (see send_tls_adapter). */
+      setsockopt (client_socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+#endif
+#if HAVE_GNUTLS_ALPN
+      if (0 != (daemon->options & MHD_USE_HTTP2))
+	{
+	  /* offer HTTP/2 first; clients that pick it still start with
+	     the connection preface, which is what we go by */
+	  static const gnutls_datum_t protocols[] = {
+	    { (unsigned char *) "h2", 2 },
+	    { (unsigned char *) "http/1.1", 8 }
+	  };
+
+	  gnutls_alpn_set_protocols (connection->tls_session,
+				     protocols, 2,
+				     GNUTLS_ALPN_SERVER_PRECEDENCE);
+	}
+#endif
+      switch (daemon->cred_type)
+        {
+          /* set needed credentials for certificate authentication. */
+        case GNUTLS_CRD_CERTIFICATE:
+          gnutls_credentials_set (connection->tls_session,
+				  GNUTLS_CRD_CERTIFICATE,
+				  daemon->x509_cred);
+          break;
+        default:
+#if HAVE_MESSAGES
+          MHD_DLOG (connection->daemon,
+                    "Failed to setup TLS credentials: unknown credential type %d\n",
+                    daemon->cred_type);
+#endif
+          SHUTDOWN (client_socket, SHUT_RDWR);
+          CLOSE (client_socket);
+          MHD_ip_limit_del (daemon, addr, addrlen);
+          MHD_connection_budget_release (daemon);
+          free (connection->addr);
+          free (connection);
+          mhd_panic (mhd_panic_cls, __FILE__, __LINE__, 
+#if HAVE_MESSAGES
+		     "Unknown credential type"
+#else
+		     NULL
+#endif
+		     );
+ 	  return MHD_NO;
+        }
+      gnutls_transport_set_ptr (connection->tls_session,
+				(gnutls_transport_ptr_t) connection);
+      gnutls_transport_set_pull_function (connection->tls_session,
+					  (gnutls_pull_func) &
+                                               recv_param_adapter);
+      gnutls_transport_set_push_function (connection->tls_session,
+					  (gnutls_push_func) &
+                                               send_param_adapter);
+
+      if (daemon->https_mem_trust){
+      gnutls_certificate_server_set_request(connection->tls_session, GNUTLS_CERT_REQUEST);
+      }
+    }
+#endif
+
+  if (0 != pthread_mutex_lock(&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
+#endif
+      abort();
+    }
+  DLL_insert (daemon->connections_head,
+	      daemon->connections_tail,
+	      connection);
+  if (0 != pthread_mutex_unlock(&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
+#endif
+      abort();
+    }
+  if (NULL != daemon->counters)
+    {
+      daemon->counters->connections++;
+      daemon->counters->current_connections++;
+    }
+
+  /* attempt to create handler thread */
+  if (0 != (daemon->options & MHD_USE_THREAD_PER_CONNECTION))
+    {
+      if (0 != daemon->thread_cache_size)
+	res_thread_create = thread_cache_assign (daemon, connection);
+      else
+	res_thread_create = create_thread (&connection->pid, daemon,
+					   &MHD_handle_connection, connection);
+      if (res_thread_create != 0)
+        {
+#if HAVE_MESSAGES
+          MHD_DLOG (daemon, "Failed to create a thread: %s\n",
+                    STRERROR (res_thread_create));
+#endif
+          SHUTDOWN (client_socket, SHUT_RDWR);
+          CLOSE (client_socket);
+          MHD_ip_limit_del (daemon, addr, addrlen);
+          MHD_connection_budget_release (daemon);
+	  if (0 != pthread_mutex_lock(&daemon->cleanup_connection_mutex))
+	    {
+#if HAVE_MESSAGES
+	      MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
+#endif
+	      abort();
+	    }
+	  DLL_remove (daemon->connections_head,
+		      daemon->connections_tail,
+		      connection);
+	  if (0 != pthread_mutex_unlock(&daemon->cleanup_connection_mutex))
+	    {
+#if HAVE_MESSAGES
+	      MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
+#endif
+	      abort();
+	    }
+          free (connection->addr);
+          free (connection);
+          return MHD_NO;
+        }
+    }
+  else if ( (MHD_YES == external_add) &&
+	    (-1 != daemon->itc[0]) )
+    {
+      /* the event loop may be blocked without watching the new
+	 socket */
+      itc_signal (daemon->itc);
+    }
+  return MHD_YES;  
+}
+
+
+/**
+ * Add another client connection to the set of connections 
+ * managed by MHD.  This API is usually not needed (since
+ * MHD will accept inbound connections on the server socket).
+ * Use this API in special cases, for example if your HTTP
+ * server is behind NAT and needs to connect out to the 
+ * HTTP client, or if connections are accepted by a thread
+ * of the application.  If the daemon runs its own event loop,
+ * the loop is woken up to process the new connection.
+ *
+ * The given client socket will be managed (and closed!) by MHD after
+ * this call and must no longer be used directly by the application
+ * afterwards.
+ *
+ * Per-IP connection limits are ignored when using this API.
+ *
+ * @param daemon daemon that manages the connection
+ * @param client_socket socket to manage (MHD will expect
+ *        to receive an HTTP request from this socket next).
+ * @param addr IP address of the client
+ * @param addrlen number of bytes in addr
+ * @return MHD_YES on success, MHD_NO if this daemon could
+ *        not handle the connection (i.e. malloc failed, etc).
+ *        The socket will be closed in any case.
+ */
+int 
+MHD_add_connection (struct MHD_Daemon *daemon, 
+		    int client_socket,
+		    const struct sockaddr *addr,
+		    socklen_t addrlen)
+{
+  return internal_add_connection (daemon, client_socket,
+				  addr, addrlen,
+				  MHD_YES);
+}
+
+
+/**
+ * Accept an incoming connection and create the MHD_Connection object for
+ * it.  This function also enforces policy by way of checking with the
+ * accept policy callback.
+ * 
+ * @param daemon handle with the listen socket
+ * @return MHD_YES on success
+ */
+static int
+MHD_accept_connection (struct MHD_Daemon *daemon)
+{
+#if HAVE_INET6
+  struct sockaddr_in6 addrstorage;
+#else
+  struct sockaddr_in addrstorage;
+#endif
+  struct sockaddr *addr = (struct sockaddr *) &addrstorage;
+  socklen_t addrlen;
+  int s;
+
+  addrlen = sizeof (addrstorage);
+  memset (addr, 0, sizeof (addrstorage));
+  s = ACCEPT (daemon->socket_fd, addr, &addrlen);
+  if ((s == -1) || (addrlen <= 0))
+    {
+#if HAVE_MESSAGES
+      /* This could be a common occurance with multiple worker threads */
+      if ((EAGAIN != errno) && (EWOULDBLOCK != errno))
+        MHD_DLOG (daemon, "Error accepting connection: %s\n", STRERROR (errno));
+#endif
+      if (s != -1)
+        {
+          SHUTDOWN (s, SHUT_RDWR);
+          CLOSE (s);
+          /* just in case */
+        }
+      return MHD_NO;
+    }
+#if HAVE_MESSAGES
+#if DEBUG_CONNECT
+  MHD_DLOG (daemon, "Accepted connection on socket %d\n", s);
+#endif
+#endif
+  return internal_add_connection (daemon, s,
+				  addr, addrlen,
+				  MHD_NO);
+}
+
+
+#if HAVE_ZEROCOPY
+/**
+ * How often (in ms) does the event loop check lingering connections
+ * for their zero-copy completions?
+ */
+#define MHD_ZEROCOPY_LINGER_POLL_MS 10
+#endif
+
+
+/**
+ * Close the socket of a connection that was cleaned up and
+ * release the connection itself.
+ *
+ * @param daemon daemon the connection belonged to
+ * @param pos connection to free
+ */
+static void
+free_connection (struct MHD_Daemon *daemon,
+		 struct MHD_Connection *pos)
+{
+  itc_close (pos->itc);
+  if (-1 != pos->socket_fd)
+    CLOSE (pos->socket_fd);
+  if (NULL != pos->addr)
+    free (pos->addr);
+  free (pos);
+  MHD_connection_budget_release (daemon);
+  if (NULL != daemon->counters)
+    daemon->counters->current_connections--;
+}
+
+
+#if HAVE_ZEROCOPY
+/**
+ * Check if the kernel is done with the buffer of the zero-copy
+ * response of a lingering connection, that is if it can no longer
+ * transmit from it.  This is the case once all completions were
+ * reported, once the send queue of the socket is empty or once the
+ * TCP connection is dead (i.e. the peer stopped acknowledging data
+ * for longer than 'TCP_USER_TIMEOUT'), as then the kernel will not
+ * send anything anymore.
+ *
+ * @param pos lingering connection to check
+ * @return MHD_YES if the response may be released
+ */
+static int
+lingering_done (struct MHD_Connection *pos)
+{
+  int outq;
+  struct tcp_info ti;
+  socklen_t len;
+
+  MHD_connection_reap_zerocopy (pos);
+  if (NULL == pos->zerocopy_response)
+    return MHD_YES;
+  if ( (0 == ioctl (pos->socket_fd, SIOCOUTQ, &outq)) &&
+       (0 == outq) )
+    return MHD_YES;
+  len = sizeof (ti);
+  if ( (0 == getsockopt (pos->socket_fd, IPPROTO_TCP, TCP_INFO, &ti, &len)) &&
+       (TCP_CLOSE == ti.tcpi_state) )
+    return MHD_YES;
+  return MHD_NO;
+}
+
+
+/**
+ * Release the zero-copy response of a lingering connection and free
+ * the connection.
+ *
+ * @param daemon daemon the connection belonged to
+ * @param pos lingering connection (already removed from the list)
+ */
+static void
+free_lingering_connection (struct MHD_Daemon *daemon,
+			   struct MHD_Connection *pos)
+{
+  struct MHD_Response *response;
+
+  /* close the socket before releasing the buffer */
+  response = pos->zerocopy_response;
+  free_connection (daemon, pos);
+  if (NULL != response)
+    MHD_destroy_response (response);
+}
+
+
+/**
+ * Process the completions of the lingering connections (without
+ * blocking) and free those for which the kernel is done with the
+ * buffer of their response.  There is no deadline: a connection
+ * whose peer stops acknowledging data lingers until TCP gives up on
+ * it (see 'TCP_USER_TIMEOUT' set in 'MHD_cleanup_connections').
+ * Must be called with the cleanup mutex held.
+ *
+ * @param daemon daemon to process lingering connections for
+ */
+static void
+reap_lingering_connections (struct MHD_Daemon *daemon)
+{
+  struct MHD_Connection *pos;
+  struct MHD_Connection *next;
+
+  next = daemon->linger_head;
+  while (NULL != (pos = next))
+    {
+      next = pos->next;
+      if (MHD_NO == lingering_done (pos))
+	continue;
+      DLL_remove (daemon->linger_head,
+		  daemon->linger_tail,
+		  pos);
+      free_lingering_connection (daemon, pos);
+    }
+}
+
+
+/**
+ * Free all lingering connections when the daemon stops.  Waiting for
+ * the peers could stall 'MHD_stop_daemon' for a long time, so the
+ * connections that still have data in flight are reset instead
+ * (closing with a zero 'SO_LINGER' timeout discards the send queue),
+ * after which the kernel no longer transmits from the buffers.
+ *
+ * @param daemon daemon to free the lingering connections of
+ */
+static void
+abort_lingering_connections (struct MHD_Daemon *daemon)
+{
+  struct MHD_Connection *pos;
+  struct linger sl;
+
+  if (0 != pthread_mutex_lock(&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
+#endif
+      abort();
+    }
+  while (NULL != (pos = daemon->linger_head))
+    {
+      DLL_remove (daemon->linger_head,
+		  daemon->linger_tail,
+		  pos);
+      if (MHD_NO == lingering_done (pos))
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon,
+		    "Resetting connection with %u zero-copy transmissions pending\n",
+		    pos->zerocopy_pending);
+#endif
+	  sl.l_onoff = 1;
+	  sl.l_linger = 0;
+	  if (0 != setsockopt (pos->socket_fd, SOL_SOCKET, SO_LINGER,
+			       &sl, sizeof (sl)))
+	    {
+	      /* we cannot make sure that the kernel is done with the
+		 buffer, leak the response rather than let it go out
+		 with reused memory */
+#if HAVE_MESSAGES
+	      MHD_DLOG (daemon,
+			"Failed to reset connection: %s\n",
+			STRERROR (errno));
+#endif
+	      pos->zerocopy_response = NULL;
+	    }
+	}
+      free_lingering_connection (daemon, pos);
+    }
+  if (0 != pthread_mutex_unlock(&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
+#endif
+      abort();
+    }
+}
+#endif
+
+
+/**
+ * Free resources associated with all closed connections.
+ * (destroy responses, free buffers, etc.).  All closed
+ * connections are kept in the "cleanup" doubly-linked list.
+ *
+ * @param daemon daemon to clean up
+ */
+static void
+MHD_cleanup_connections (struct MHD_Daemon *daemon)
+{
+  struct MHD_Connection *pos;
+  void *unused;
+  int rc;
+
+  if (0 != pthread_mutex_lock(&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
+#endif
+      abort();
+    }
+  while (NULL != (pos = daemon->cleanup_head))
+    {
+      DLL_remove (daemon->cleanup_head,
+		  daemon->cleanup_tail,
+		  pos);
+      if ( (0 != (daemon->options & MHD_USE_THREAD_PER_CONNECTION)) &&
+	   (0 != daemon->thread_cache_size) )
+	{
+	  /* cached threads do not terminate, wait until it is done */
+	  while (MHD_NO == pos->thread_done)
+	    pthread_cond_wait (&daemon->thread_done_cond,
+			       &daemon->cleanup_connection_mutex);
+	}
+      else if ( (0 != (daemon->options & MHD_USE_THREAD_PER_CONNECTION)) &&
+		(MHD_NO == pos->thread_joined) )
+	{ 
+	  if (0 != (rc = pthread_join (pos->pid, &unused)))
+	    {
+#if HAVE_MESSAGES
+	      MHD_DLOG (daemon, "Failed to join a thread: %s\n",
+			STRERROR (rc));
+#endif
+	      abort();
+	    }
+	}
+      MHD_http2_session_destroy_ (pos, MHD_REQUEST_TERMINATED_DAEMON_SHUTDOWN);
+      MHD_pool_destroy (pos->pool);
+#if HTTPS_SUPPORT
+      tls_read_ready_remove (daemon, pos);
+      if (pos->tls_session != NULL)
+	gnutls_deinit (pos->tls_session);
+      MHD_tls_host_certs_release (pos);
+#endif
+      MHD_ip_limit_del (daemon, (struct sockaddr*)pos->addr, pos->addr_len);
+      if (pos->response != NULL)
+	{
+	  MHD_destroy_response (pos->response);
+	  pos->response = NULL;
+	}
+#if HAVE_ZEROCOPY
+      if (NULL != pos->zerocopy_response)
+	MHD_connection_reap_zerocopy (pos);
+      if (NULL != pos->zerocopy_response)
+	{
+	  /* the kernel still uses the buffer of the response, keep
+	     the socket open (without blocking) until it is done */
+#ifdef TCP_USER_TIMEOUT
+	  if (0 != pos->connection_timeout)
+	    {
+	      /* let TCP give up on a dead peer after the connection
+		 timeout instead of retransmitting for many minutes */
+	      unsigned int ms = pos->connection_timeout * 1000;
+
+	      (void) setsockopt (pos->socket_fd, IPPROTO_TCP, TCP_USER_TIMEOUT,
+				 &ms, sizeof (ms));
+	    }
+#endif
+	  DLL_insert (daemon->linger_head,
+		      daemon->linger_tail,
+		      pos);
+	  continue;
+	}
+#endif
+      free_connection (daemon, pos);
+    }
+#if HAVE_ZEROCOPY
+  reap_lingering_connections (daemon);
+#endif
+  if (0 != pthread_mutex_unlock(&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
+#endif
+      abort();
+    }
+  if (0 != daemon->thread_cache_size)
+    thread_cache_reap (daemon);
+}
+
+
+/**
+ * Obtain timeout value for select for this daemon
+ * (only needed if connection timeout is used).  The
+ * returned value is how long select should at most
+ * block, not the timeout value set for connections.
+ *
+ * @param daemon daemon to query for timeout
+ * @param timeout set to the timeout (in milliseconds)
+ * @return MHD_YES on success, MHD_NO if timeouts are
+ *        not used (or no connections exist that would
+ *        necessiate the use of a timeout right now).
+ */
+int
+MHD_get_timeout (struct MHD_Daemon *daemon,
+		 unsigned MHD_LONG_LONG *timeout)
+{
+  time_t earliest_deadline;
+  time_t now;
+  struct MHD_Connection *pos;
+  int have_timeout = MHD_NO;
+
+  if (0 != (daemon->options & MHD_USE_THREAD_PER_CONNECTION))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Illegal call to MHD_get_timeout\n");
+#endif  
+      return MHD_NO;
+    }
+#if HTTPS_SUPPORT
+  if (NULL != daemon->tls_read_ready_head)
+    {
+      /* gnutls already has data for us, do not wait for the sockets */
+      *timeout = 0;
+      return MHD_YES;
+    }
+#endif
+#if HAVE_ZEROCOPY
+  if (NULL != daemon->linger_head)
+    {
+      /* check the lingering connections for completions */
+      *timeout = MHD_ZEROCOPY_LINGER_POLL_MS;
+      return MHD_YES;
+    }
+#endif
+  pos = daemon->connections_head;
+  while (pos != NULL)
+    {
+      if (0 != pos->connection_timeout) {
+        if (!have_timeout ||
+	    earliest_deadline > pos->last_activity + pos->connection_timeout)
+          earliest_deadline = pos->last_activity + pos->connection_timeout;
+        have_timeout = MHD_YES;
+      }
+      pos = pos->next;
+    }
+  if (!have_timeout)
+    {
+      if ( (NULL == daemon->master) ||
+	   (0 == daemon->rebalance_interval) )
+	return MHD_NO;
+      /* workers wake up regularly to measure their load */
+      *timeout = daemon->rebalance_interval;
+      return MHD_YES;
+    }
+  now = time (NULL);
+  if (earliest_deadline < now)
+    *timeout = 0;
+  else
+    *timeout = 1000 * (1 + earliest_deadline - now);
+  if ( (NULL != daemon->master) &&
+       (0 != daemon->rebalance_interval) &&
+       (*timeout > daemon->rebalance_interval) )
+    *timeout = daemon->rebalance_interval;
+  return MHD_YES;
+}
+
+
+/**
+ * Main select call.
+ *
+ * @param daemon daemon to run select loop for
+ * @param may_block YES if blocking, NO if non-blocking
+ * @return MHD_NO on serious errors, MHD_YES on success
+ */
+static int
+MHD_select (struct MHD_Daemon *daemon, 
+	    int may_block)
+{
+  struct MHD_Connection *pos;
+  struct MHD_Connection *next;
+  int num_ready;
+  fd_set rs;
+  fd_set ws;
+  fd_set es;
+  int max;
+  struct timeval timeout;
+  struct timeval *tv;
+  unsigned MHD_LONG_LONG ltimeout;
+  unsigned MHD_LONG_LONG idle_start;
+  int ds;
+
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 0;
+  if (daemon->shutdown == MHD_YES)
+    return MHD_NO;
+  if ( (0 != (daemon->options & MHD_USE_SUSPEND_RESUME)) &&
+       (MHD_YES == resume_suspended_connections (daemon)) )
+    may_block = MHD_NO; /* resumed connections need processing */
+  if (0 != daemon->rebalance_interval)
+    adopt_connections (daemon);
+  FD_ZERO (&rs);
+  FD_ZERO (&ws);
+  FD_ZERO (&es);
+  max = 0;
+  if (0 == (daemon->options & MHD_USE_THREAD_PER_CONNECTION))
+    {
+      /* single-threaded, go over everything */
+      if (MHD_NO == MHD_get_fdset (daemon, &rs, &ws, &es, &max))
+        return MHD_NO;
+
+      /* If we're at the connection limit, no need to
+         accept new connections. */
+      if ( (MHD_NO == MHD_connection_budget_available (daemon)) &&
+	   (daemon->socket_fd != -1) )
+        FD_CLR(daemon->socket_fd, &rs);
+    }
+  else
+    {
+      /* accept only, have one thread per connection */
+      max = daemon->socket_fd;
+      if (max == -1)
+        return MHD_NO;
+      FD_SET (max, &rs);
+      if (-1 != daemon->itc[0])
+	{
+	  /* wake up on MHD_stop_daemon and MHD_wakeup_daemon */
+	  FD_SET (daemon->itc[0], &rs);
+	  if (max < daemon->itc[0])
+	    max = daemon->itc[0];
+	}
+    }
+
+  if (NULL != daemon->counters)
+    {
+      /* worker process, watch for the parent to stop us */
+      FD_SET (daemon->process_pipe[0], &rs);
+      if (max < daemon->process_pipe[0])
+	max = daemon->process_pipe[0];
+    }
+
+  tv = NULL;
+  if (may_block == MHD_NO)
+    {
+      timeout.tv_usec = 0;
+      timeout.tv_sec = 0;
+      tv = &timeout;
+    }
+  else if ( (0 == (daemon->options & MHD_USE_THREAD_PER_CONNECTION)) &&
+	    (MHD_YES == MHD_get_timeout (daemon, &ltimeout)) )
+    {
+      /* ltimeout is in ms */
+      timeout.tv_usec = (ltimeout % 1000) * 1000;
+      timeout.tv_sec = ltimeout / 1000;
+      tv = &timeout;
+    }
+#if HAVE_ZEROCOPY
+  else if (NULL != daemon->linger_head)
+    {
+      /* thread per connection, check the lingering connections */
+      timeout.tv_usec = MHD_ZEROCOPY_LINGER_POLL_MS * 1000;
+      timeout.tv_sec = 0;
+      tv = &timeout;
+    }
+#endif
+  if (0 != daemon->rebalance_interval)
+    idle_start = get_time_usec ();
+  num_ready = SELECT (max + 1, &rs, &ws, &es, tv);
+  if (0 != daemon->rebalance_interval)
+    daemon->idle_time += get_time_usec () - idle_start;
+
+  if (daemon->shutdown == MHD_YES)
+    return MHD_NO;
+  if (num_ready < 0)
+    {
+      if (errno == EINTR)
+        return MHD_YES;
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "select failed: %s\n", STRERROR (errno));
+#endif
+      return MHD_NO;
+    }
+  if ( (-1 != daemon->itc[0]) &&
+       (FD_ISSET (daemon->itc[0], &rs)) )
+    itc_drain (daemon->itc);
+  if ( (NULL != daemon->counters) &&
+       (FD_ISSET (daemon->process_pipe[0], &rs)) )
+    {
+      /* parent closed the pipe (or terminated) */
+      daemon->shutdown = MHD_YES;
+      return MHD_NO;
+    }
+  ds = daemon->socket_fd;
+  if (ds == -1)
+    return MHD_YES;
+
+  /* select connection thread handling type */
+  if (FD_ISSET (ds, &rs))
+    MHD_accept_connection (daemon);
+  if (0 == (daemon->options & MHD_USE_THREAD_PER_CONNECTION))
+    {
+      /* do not have a thread per connection, process all connections now */
+      next = daemon->connections_head;
+      while (NULL != (pos = next))
+        {
+	  next = pos->next;
+          ds = pos->socket_fd;
+          if (ds != -1)
+            {
+              if (FD_ISSET (ds, &rs))
+                pos->read_handler (pos);
+              if (FD_ISSET (ds, &ws))
+                pos->write_handler (pos);
+	      pos->idle_handler (pos);
+            }
+        }
+#if HTTPS_SUPPORT
+      process_tls_read_ready (daemon);
+#endif
+    }
+  return MHD_YES;
+}
+
+
+#ifdef HAVE_POLL_H
+/**
+ * Process all of our connections and possibly the server
+ * socket using 'poll'.
+ *
+ * @param daemon daemon to run poll loop for
+ * @param may_block YES if blocking, NO if non-blocking
+ * @return MHD_NO on serious errors, MHD_YES on success
+ */
+static int
+MHD_poll_all (struct MHD_Daemon *daemon,
+	      int may_block)
+{
+  unsigned int num_connections;
+  struct MHD_Connection *pos;
+  struct MHD_Connection *next;
+
+  if ( (0 != (daemon->options & MHD_USE_SUSPEND_RESUME)) &&
+       (MHD_YES == resume_suspended_connections (daemon)) )
+    may_block = MHD_NO; /* resumed connections need processing */
+  if (0 != daemon->rebalance_interval)
+    adopt_connections (daemon);
+  num_connections = 0;
+  pos = daemon->connections_head;
+  while (pos != NULL)
+    {
+      num_connections++;
+      pos = pos->next;
+    }
+  {
+    struct pollfd p[3 + 2 * num_connections];
+    struct MHD_Pollfd mp;
+    unsigned MHD_LONG_LONG ltimeout;
+    unsigned MHD_LONG_LONG idle_start;
+    unsigned int i;
+    int timeout;
+    unsigned int poll_server;
+    unsigned int poll_itc;
+    unsigned int poll_parent;
+    int num_ready;
+    
+    memset (p, 0, sizeof (p));
+    if ( (MHD_YES == MHD_connection_budget_available (daemon)) &&
+	 (daemon->socket_fd != -1) )
+      {
+	p[0].fd = daemon->socket_fd;
+	p[0].events = POLLIN;
+	p[0].revents = 0;
+	poll_server = 1;
+      }
+    else
+      {
+	poll_server = 0;
+      }
+    if (may_block == MHD_NO)
+      timeout = 0;
     else if ( (0 != (daemon->options & MHD_USE_THREAD_PER_CONNECTION)) ||
 	      (MHD_YES != MHD_get_timeout (daemon, &ltimeout)) )
       timeout = -1;
@@ -1452,178 +3435,1188 @@ MHD_poll_all (struct MHD_Daemon *daemon,
 	  p[poll_server+i].events |= POLLIN;        
 	if (mp.events & MHD_POLL_ACTION_OUT) 
 	  p[poll_server+i].events |= POLLOUT;
+	/* pipe response waiting for data (poll ignores -1) */
+	p[poll_server + num_connections + i].fd = mp.source_fd;
+	p[poll_server + num_connections + i].events = POLLIN;
 	i++;
 	pos = pos->next;
       }
-    if (poll (p, poll_server + num_connections, timeout) < 0) 
+    poll_itc = 0;
+    if (-1 != daemon->itc[0])
+      {
+	/* wake up when a connection is resumed, added by another
+	   thread, on MHD_stop_daemon or on MHD_wakeup_daemon */
+	p[poll_server + 2 * num_connections].fd = daemon->itc[0];
+	p[poll_server + 2 * num_connections].events = POLLIN;
+	poll_itc = 1;
+      }
+    poll_parent = 0;
+    if (NULL != daemon->counters)
+      {
+	/* worker process, watch for the parent to stop us */
+	p[poll_server + 2 * num_connections + poll_itc].fd = daemon->process_pipe[0];
+	p[poll_server + 2 * num_connections + poll_itc].events = POLLIN;
+	poll_parent = 1;
+      }
+    if (0 != daemon->rebalance_interval)
+      idle_start = get_time_usec ();
+    num_ready = poll (p, poll_server + 2 * num_connections + poll_itc + poll_parent,
+		      timeout);
+    if (0 != daemon->rebalance_interval)
+      daemon->idle_time += get_time_usec () - idle_start;
+    if (num_ready < 0)
       {
 	if (errno == EINTR)
 	  return MHD_YES;
 #if HAVE_MESSAGES
-	MHD_DLOG (daemon, "poll failed: %s\n", STRERROR (errno));
+	MHD_DLOG (daemon, "poll failed: %s\n", STRERROR (errno));
+#endif
+	return MHD_NO;
+      }
+    /* handle shutdown cases */
+    if (daemon->shutdown == MHD_YES) 
+      return MHD_NO;  
+    if ( (0 != poll_itc) &&
+	 (0 != (p[poll_server + 2 * num_connections].revents & POLLIN)) )
+      itc_drain (daemon->itc);
+    if ( (0 != poll_parent) &&
+	 (0 != p[poll_server + 2 * num_connections + poll_itc].revents) )
+      {
+	/* parent closed the pipe (or terminated) */
+	daemon->shutdown = MHD_YES;
+	return MHD_NO;
+      }
+    if (daemon->socket_fd < 0) 
+      return MHD_YES; 
+    i = 0;
+    next = daemon->connections_head;
+    while (NULL != (pos = next))
+      {
+	next = pos->next;
+	/* first, sanity checks */
+	if (i >= num_connections)
+	  break; /* connection list changed somehow, retry later ... */
+	MHD_connection_get_pollfd (pos, &mp);
+	if (p[poll_server+i].fd != mp.fd)
+	  break; /* fd mismatch, something else happened, retry later ... */
+
+	/* normal handling */
+	if (0 != (p[poll_server+i].revents & POLLIN)) 
+	  pos->read_handler (pos);
+	if (0 != (p[poll_server+i].revents & POLLOUT)) 
+	  pos->write_handler (pos);	
+	if (0 != (p[poll_server+i].revents & POLLERR))
+	  {
+#if HAVE_ZEROCOPY
+	    if (pos->zerocopy_pending > 0)
+	      MHD_connection_reap_zerocopy (pos); /* completions */
+	    else
+#endif
+	    if (MHD_CONNECTION_CLOSED != pos->state)
+	      MHD_connection_close (pos, MHD_REQUEST_TERMINATED_WITH_ERROR);
+	  }
+	pos->idle_handler (pos);
+	i++;
+      }
+#if HTTPS_SUPPORT
+    process_tls_read_ready (daemon);
+#endif
+    if ( (0 != poll_server) &&
+	 (0 != (p[0].revents & POLLIN)) )
+      MHD_accept_connection (daemon);
+  }
+  return MHD_YES;
+}
+
+
+/**
+ * Process only the listen socket using 'poll'.
+ *
+ * @param daemon daemon to run poll loop for
+ * @param may_block YES if blocking, NO if non-blocking
+ * @return MHD_NO on serious errors, MHD_YES on success
+ */
+static int
+MHD_poll_listen_socket (struct MHD_Daemon *daemon,
+			int may_block)
+{
+  struct pollfd p[2];
+  unsigned int poll_itc;
+  int timeout;
+  
+  memset (&p, 0, sizeof (p));
+  p[0].fd = daemon->socket_fd;
+  p[0].events = POLLIN;
+  p[0].revents = 0;
+  poll_itc = 0;
+  if (-1 != daemon->itc[0])
+    {
+      /* wake up on MHD_stop_daemon and MHD_wakeup_daemon */
+      p[1].fd = daemon->itc[0];
+      p[1].events = POLLIN;
+      p[1].revents = 0;
+      poll_itc = 1;
+    }
+  if (may_block == MHD_NO)
+    timeout = 0;
+#if HAVE_ZEROCOPY
+  else if (NULL != daemon->linger_head)
+    timeout = MHD_ZEROCOPY_LINGER_POLL_MS; /* check lingering connections */
+#endif
+  else
+    timeout = -1;
+  if (poll (p, 1 + poll_itc, timeout) < 0)
+    {
+      if (errno == EINTR)
+	return MHD_YES;
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "poll failed: %s\n", STRERROR (errno));
+#endif
+      return MHD_NO;
+    }
+  /* handle shutdown cases */
+  if (daemon->shutdown == MHD_YES) 
+    return MHD_NO;  
+  if ( (0 != poll_itc) &&
+       (0 != (p[1].revents & POLLIN)) )
+    itc_drain (daemon->itc);
+  if (daemon->socket_fd < 0) 
+    return MHD_YES; 
+  if (0 != (p[0].revents & POLLIN))
+    MHD_accept_connection (daemon);  
+  return MHD_YES;
+}
+#endif
+
+
+/**
+ * Do 'poll'-based processing.
+ *
+ * @param daemon daemon to run poll loop for
+ * @param may_block YES if blocking, NO if non-blocking
+ * @return MHD_NO on serious errors, MHD_YES on success
+ */
+static int
+MHD_poll (struct MHD_Daemon *daemon,
+	  int may_block)
+{
+#ifdef HAVE_POLL_H
+  if (daemon->shutdown == MHD_YES)
+    return MHD_NO;
+  if (0 == (daemon->options & MHD_USE_THREAD_PER_CONNECTION))
+    return MHD_poll_all (daemon, may_block);
+  else
+    return MHD_poll_listen_socket (daemon, may_block);
+#else
+  return MHD_NO;
+#endif
+}
+
+
+/**
+ * Run webserver operations (without blocking unless
+ * in client callbacks).  This method should be called
+ * by clients in combination with MHD_get_fdset
+ * if the client-controlled select method is used.
+ *
+ * @return MHD_YES on success, MHD_NO if this
+ *         daemon was not started with the right
+ *         options for this call.
+ */
+int
+MHD_run (struct MHD_Daemon *daemon)
+{
+  if ((daemon->shutdown != MHD_NO) || (0 != (daemon->options
+                                             & MHD_USE_THREAD_PER_CONNECTION))
+      || (0 != (daemon->options & MHD_USE_SELECT_INTERNALLY)))
+    return MHD_NO;
+  if ((daemon->options & MHD_USE_POLL) == 0) 
+    {
+      MHD_select (daemon, MHD_NO);
+    }
+  else
+    {
+      MHD_poll (daemon, MHD_NO);
+    }
+  MHD_cleanup_connections (daemon);
+  return MHD_YES;
+}
+
+
+/**
+ * Wake up the event loop(s) of a daemon so that it re-evaluates its
+ * state (timeouts, responses queued or connections added by other
+ * threads) immediately instead of when its current wait ends.  Safe
+ * to call from any thread.  With external select, the application's
+ * 'select' returns as the daemon's file descriptors (from
+ * 'MHD_get_fdset') include the one used for waking it up.
+ *
+ * @param daemon daemon to wake up
+ * @return MHD_YES on success, MHD_NO if the daemon is shutting down
+ */
+int
+MHD_wakeup_daemon (struct MHD_Daemon *daemon)
+{
+  unsigned int i;
+
+  if (MHD_YES == daemon->shutdown)
+    return MHD_NO;
+  if (0 != daemon->worker_pool_size)
+    {
+      MHD_ip_count_lock (daemon);
+      for (i = 0; i < daemon->worker_pool_size; i++)
+	itc_signal (daemon->worker_pool[i]->itc);
+      MHD_ip_count_unlock (daemon);
+      return MHD_YES;
+    }
+  if (-1 == daemon->itc[0])
+    return MHD_NO;
+  itc_signal (daemon->itc);
+  return MHD_YES;
+}
+
+
+/**
+ * Bind the calling thread to the CPU selected for the daemon
+ * (MHD_OPTION_THREAD_POOL_CPU_AFFINITY), if any.
+ *
+ * @param daemon daemon the thread runs
+ */
+static void
+bind_thread_to_cpu (struct MHD_Daemon *daemon)
+{
+#if HAVE_PTHREAD_SETAFFINITY_NP
+  cpu_set_t set;
+  int rc;
+
+  if (-1 == daemon->cpu)
+    return;
+  CPU_ZERO (&set);
+  CPU_SET (daemon->cpu, &set);
+  if (0 != (rc = pthread_setaffinity_np (pthread_self (), sizeof (set), &set)))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to bind thread to CPU %d: %s\n",
+		daemon->cpu, STRERROR (rc));
+#endif
+    }
+#endif
+}
+
+
+/**
+ * Select the CPU for a new worker of the thread pool: the first of
+ * the configured CPUs that is used by the fewest (non-draining)
+ * workers.
+ *
+ * @param master daemon owning the thread pool
+ * @return CPU number, -1 if threads are not bound to CPUs
+ */
+static int
+pick_worker_cpu (struct MHD_Daemon *master)
+{
+  unsigned int best;
+  unsigned int best_use;
+  unsigned int use;
+  unsigned int i;
+  unsigned int j;
+
+  if (NULL == master->cpu_affinity)
+    return -1;
+  best = 0;
+  best_use = UINT_MAX;
+  for (i = 0; i < master->cpu_affinity_size; i++)
+    {
+      use = 0;
+      for (j = 0; j < master->worker_pool_size; j++)
+	if ( (MHD_NO == master->worker_pool[j]->draining) &&
+	     (master->worker_pool[j]->cpu == (int) master->cpu_affinity[i]) )
+	  use++;
+      if (use < best_use)
+	{
+	  best = i;
+	  best_use = use;
+	}
+    }
+  return (int) master->cpu_affinity[best];
+}
+
+
+/**
+ * Check if a connection is idle between two requests, that is if
+ * it neither processes a request nor has (part of) the next request
+ * waiting to be read.
+ *
+ * @param connection connection to check
+ * @return MHD_YES if the connection is idle
+ */
+static int
+connection_is_idle (struct MHD_Connection *connection)
+{
+  char c;
+
+  if ( (MHD_CONNECTION_INIT != connection->state) ||
+       (0 != connection->read_buffer_offset) ||
+       (-1 == connection->socket_fd) )
+    return MHD_NO;
+  if (MHD_TLS_READ_READY (connection))
+    return MHD_NO;
+  /* do not touch a request that is already on its way */
+  if (0 < RECV (connection->socket_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT))
+    return MHD_NO;
+  return MHD_YES;
+}
+
+
+/**
+ * Hand connections of a busy worker of the thread pool over to the
+ * least busy worker.  Called by the thread of the worker between
+ * two iterations of its event loop; does nothing until the
+ * rebalancing interval has passed since the load was last measured.
+ * Only connections that are idle between requests are moved, so a
+ * request is always processed by a single thread.
+ *
+ * @param daemon worker daemon
+ */
+static void
+rebalance_connections (struct MHD_Daemon *daemon)
+{
+  struct MHD_Daemon *master;
+  struct MHD_Daemon *target;
+  struct MHD_Connection *pos;
+  struct MHD_Connection *next;
+  struct MHD_Connection *head;
+  struct MHD_Connection *tail;
+  unsigned MHD_LONG_LONG now;
+  unsigned MHD_LONG_LONG window;
+  unsigned int load;
+  unsigned int move;
+  unsigned int i;
+
+  master = daemon->master;
+  now = get_time_usec ();
+  if (now < daemon->load_start)
+    {
+      /* clock was set back, start over */
+      daemon->load_start = now;
+      daemon->idle_time = 0;
+      return;
+    }
+  window = now - daemon->load_start;
+  if (window < 1000 * (unsigned MHD_LONG_LONG) daemon->rebalance_interval)
+    return;
+  if (daemon->idle_time >= window)
+    load = 0;
+  else
+    load = (unsigned int) (1000 - daemon->idle_time * 1000 / window);
+  daemon->load_start = now;
+  daemon->idle_time = 0;
+
+  /* find the least busy worker */
+  target = NULL;
+  move = 0;
+  MHD_ip_count_lock (master);
+  daemon->load = load;
+  if (MHD_NO == daemon->draining)
+    {
+      for (i = 0; i < master->worker_pool_size; i++)
+	{
+	  if ( (daemon == master->worker_pool[i]) ||
+	       (MHD_YES == master->worker_pool[i]->draining) )
+	    continue;
+	  if ( (NULL == target) ||
+	       (master->worker_pool[i]->load < target->load) )
+	    target = master->worker_pool[i];
+	}
+      if ( (NULL != target) &&
+	   (load >= target->load + MHD_REBALANCE_LOAD_DIFFERENCE) &&
+	   (daemon->connections > target->connections) )
+	move = (daemon->connections - target->connections) / 2;
+    }
+  MHD_ip_count_unlock (master);
+  if (0 == move)
+    return;
+
+  head = NULL;
+  tail = NULL;
+  if (0 != pthread_mutex_lock (&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
+#endif
+      abort();
+    }
+  next = daemon->connections_head;
+  while ( (0 < move) &&
+	  (NULL != (pos = next)) )
+    {
+      next = pos->next;
+      if (MHD_NO == connection_is_idle (pos))
+	continue;
+      DLL_remove (daemon->connections_head,
+		  daemon->connections_tail,
+		  pos);
+      DLL_insert (head, tail, pos);
+      move--;
+    }
+  if (0 != pthread_mutex_unlock (&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
+#endif
+      abort();
+    }
+  if (NULL == head)
+    return;
+
+  /* the target may have been retired (and even freed) meanwhile */
+  MHD_ip_count_lock (master);
+  for (i = 0; i < master->worker_pool_size; i++)
+    if (target == master->worker_pool[i])
+      break;
+  if ( (i < master->worker_pool_size) &&
+       (MHD_NO == target->draining) )
+    {
+      while (NULL != (pos = head))
+	{
+	  DLL_remove (head, tail, pos);
+	  pos->daemon = target;
+	  DLL_insert (target->handoff_head,
+		      target->handoff_tail,
+		      pos);
+	  daemon->connections--;
+	  target->connections++;
+	}
+      itc_signal (target->itc);
+    }
+  MHD_ip_count_unlock (master);
+  if (NULL == head)
+    return;
+  /* keep the connections */
+  if (0 != pthread_mutex_lock (&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
+#endif
+      abort();
+    }
+  while (NULL != (pos = head))
+    {
+      DLL_remove (head, tail, pos);
+      DLL_insert (daemon->connections_head,
+		  daemon->connections_tail,
+		  pos);
+    }
+  if (0 != pthread_mutex_unlock (&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
+#endif
+      abort();
+    }
+}
+
+
+/**
+ * Make progress on draining a retired worker: close connections
+ * that are idle between requests (requests in progress are
+ * completed first) and check if any connections are left.
+ *
+ * @param daemon draining worker daemon
+ * @return MHD_YES if the worker has no connections left and
+ *         its thread should exit
+ */
+static int
+drain_connections (struct MHD_Daemon *daemon)
+{
+  struct MHD_Connection *pos;
+  struct MHD_Connection *next;
+  int done;
+
+  next = daemon->connections_head;
+  while (NULL != (pos = next))
+    {
+      next = pos->next;
+      if (MHD_NO == connection_is_idle (pos))
+	continue;
+      MHD_connection_close (pos, MHD_REQUEST_TERMINATED_DAEMON_SHUTDOWN);
+      /* moves the connection to the cleanup list */
+      pos->idle_handler (pos);
+    }
+  MHD_cleanup_connections (daemon);
+  if (0 != pthread_mutex_lock (&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
+#endif
+      abort();
+    }
+  done = ( (NULL == daemon->connections_head) &&
+	   (NULL == daemon->suspended_connections_head) );
+  if (0 != pthread_mutex_unlock (&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
+#endif
+      abort();
+    }
+  if (!done)
+    return MHD_NO;
+  MHD_ip_count_lock (daemon->master);
+  /* another worker may just have handed us a connection */
+  if (NULL == daemon->handoff_head)
+    daemon->drained = MHD_YES;
+  done = (MHD_YES == daemon->drained);
+  MHD_ip_count_unlock (daemon->master);
+  return done ? MHD_YES : MHD_NO;
+}
+
+
+/**
+ * Thread that runs the select loop until the daemon
+ * is explicitly shut down.
+ *
+ * @param cls 'struct MHD_Deamon' to run select loop in a thread for
+ * @return always NULL (on shutdown)
+ */
+static void *
+MHD_select_thread (void *cls)
+{
+  struct MHD_Daemon *daemon = cls;
+
+  /* bind before anything is allocated, so that connections
+     end up in memory local to the CPU */
+  bind_thread_to_cpu (daemon);
+  while (daemon->shutdown == MHD_NO)
+    {
+      if ((daemon->options & MHD_USE_POLL) == 0) 
+	MHD_select (daemon, MHD_YES);
+      else 
+	MHD_poll (daemon, MHD_YES);      
+      MHD_cleanup_connections (daemon);
+      if ( (NULL != daemon->master) &&
+	   (0 != daemon->rebalance_interval) &&
+	   (daemon->shutdown == MHD_NO) )
+	rebalance_connections (daemon);
+      if ( (MHD_YES == daemon->draining) &&
+	   (MHD_YES == drain_connections (daemon)) )
+	break;
+    }
+  return NULL;
+}
+
+
+/**
+ * Create a worker daemon for the thread pool of the given master,
+ * add it to the master's 'worker_pool' (which must have room for
+ * it) and start its thread.
+ *
+ * @param master daemon owning the thread pool
+ * @return MHD_YES on success, MHD_NO on error
+ */
+static int
+create_worker (struct MHD_Daemon *master)
+{
+  struct MHD_Daemon *d;
+  int res_thread_create;
+
+  d = malloc (sizeof (struct MHD_Daemon));
+  if (NULL == d)
+    return MHD_NO;
+  /* Create copy of the Daemon object for the worker */
+  memcpy (d, master, sizeof (struct MHD_Daemon));
+
+  /* Adjust pooling params for worker daemons; note that memcpy()
+     has already copied MHD_USE_SELECT_INTERNALLY thread model into
+     the worker threads. */
+  d->master = master;
+  d->worker_pool_size = 0;
+  d->worker_pool = NULL;
+  d->connections = 0;
+  d->draining = MHD_NO;
+  d->drained = MHD_NO;
+  d->cpu = pick_worker_cpu (master);
+  d->load = 0;
+  d->load_start = get_time_usec ();
+  d->idle_time = 0;
+  d->handoff_head = NULL;
+  d->handoff_tail = NULL;
+
+  /* The connection limit is not split between the workers;
+     they all draw from the master's budget.  A worker that
+     stopped listening because the budget ran out is woken
+     up via its 'itc' once another worker frees a slot. */
+  d->itc[0] = -1;
+  d->itc[1] = -1;
+  if (MHD_YES != itc_init (d, d->itc))
+    {
+      free (d);
+      return MHD_NO;
+    }
+
+  /* register the worker before it can wait for a wake-up */
+  MHD_ip_count_lock (master);
+  master->worker_pool[master->worker_pool_size++] = d;
+  MHD_ip_count_unlock (master);
+
+  /* Spawn the worker thread */
+  if (0 != (res_thread_create = create_thread (&d->pid, master, &MHD_select_thread, d)))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (master,
+		"Failed to create pool thread: %s\n", 
+		STRERROR (res_thread_create));
 #endif
-	return MHD_NO;
-      }
-    /* handle shutdown cases */
-    if (daemon->shutdown == MHD_YES) 
-      return MHD_NO;  
-    if (daemon->socket_fd < 0) 
-      return MHD_YES; 
-    i = 0;
-    next = daemon->connections_head;
-    while (NULL != (pos = next))
-      {
-	next = pos->next;
-	/* first, sanity checks */
-	if (i >= num_connections)
-	  break; /* connection list changed somehow, retry later ... */
-	MHD_connection_get_pollfd (pos, &mp);
-	if (p[poll_server+i].fd != mp.fd)
-	  break; /* fd mismatch, something else happened, retry later ... */
+      MHD_ip_count_lock (master);
+      master->worker_pool_size--;
+      MHD_ip_count_unlock (master);
+      itc_close (d->itc);
+      free (d);
+      return MHD_NO;
+    }
+  return MHD_YES;
+}
 
-	/* normal handling */
-	if (0 != (p[poll_server+i].revents & POLLIN)) 
-	  pos->read_handler (pos);
-	if (0 != (p[poll_server+i].revents & POLLOUT)) 
-	  pos->write_handler (pos);	
-	pos->idle_handler (pos);
+
+/**
+ * Join and free the workers of the thread pool that finished
+ * draining.
+ *
+ * @param master daemon owning the thread pool
+ */
+static void
+reap_workers (struct MHD_Daemon *master)
+{
+  struct MHD_Daemon *d;
+  void *unused;
+  unsigned int i;
+  int rc;
+
+  i = 0;
+  while (1)
+    {
+      MHD_ip_count_lock (master);
+      while ( (i < master->worker_pool_size) &&
+	      (MHD_NO == master->worker_pool[i]->drained) )
 	i++;
-      }
-    if ( (0 != poll_server) &&
-	 (0 != (p[0].revents & POLLIN)) )
-      MHD_accept_connection (daemon);
-  }
-  return MHD_YES;
+      if (i == master->worker_pool_size)
+	{
+	  MHD_ip_count_unlock (master);
+	  return;
+	}
+      d = master->worker_pool[i];
+      memmove (&master->worker_pool[i],
+	       &master->worker_pool[i + 1],
+	       (master->worker_pool_size - i - 1) * sizeof (struct MHD_Daemon *));
+      master->worker_pool_size--;
+      MHD_ip_count_unlock (master);
+      if (0 != (rc = pthread_join (d->pid, &unused)))
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (master, "Failed to join a thread: %s\n",
+		    STRERROR (rc));
+#endif
+	  abort();
+	}
+      itc_close (d->itc);
+      free (d);
+    }
 }
 
 
 /**
- * Process only the listen socket using 'poll'.
+ * Change the number of (non-draining) workers in the thread pool.
+ * New workers start accepting immediately; surplus workers stop
+ * accepting, finish the requests they are processing and exit.
  *
- * @param daemon daemon to run poll loop for
- * @param may_block YES if blocking, NO if non-blocking
- * @return MHD_NO on serious errors, MHD_YES on success
+ * @param daemon master daemon with a thread pool
+ * @param size desired number of workers
+ * @return MHD_YES on success, MHD_NO on error
  */
 static int
-MHD_poll_listen_socket (struct MHD_Daemon *daemon,
-			int may_block)
+resize_worker_pool (struct MHD_Daemon *daemon,
+		    unsigned int size)
 {
-#ifdef HAVE_LISTEN_SHUTDOWN
-  struct pollfd p[1];
-#else
-  struct pollfd p[2];
+  struct MHD_Daemon **pool;
+  struct MHD_Daemon **old;
+  unsigned int active;
+  unsigned int i;
+
+  if ( (NULL != daemon->master) ||
+       (NULL == daemon->worker_pool) )
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon,
+		"Thread pool can only be resized if the daemon was started with a thread pool\n");
 #endif
-  int timeout;
+      return MHD_NO;
+    }
+  if (0 == size)
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon,
+		"Thread pool must have at least one thread\n");
+#endif
+      return MHD_NO;
+    }
+  reap_workers (daemon);
+  active = 0;
+  for (i = 0; i < daemon->worker_pool_size; i++)
+    if (MHD_NO == daemon->worker_pool[i]->draining)
+      active++;
+  if (size > active)
+    {
+      if (daemon->worker_pool_size + (size - active) >=
+	  SIZE_MAX / sizeof (struct MHD_Daemon *))
+	return MHD_NO;
+      pool = malloc ((daemon->worker_pool_size + (size - active))
+		     * sizeof (struct MHD_Daemon *));
+      if (NULL == pool)
+	return MHD_NO;
+      MHD_ip_count_lock (daemon);
+      memcpy (pool,
+	      daemon->worker_pool,
+	      daemon->worker_pool_size * sizeof (struct MHD_Daemon *));
+      old = daemon->worker_pool;
+      daemon->worker_pool = pool;
+      MHD_ip_count_unlock (daemon);
+      free (old);
+      for (; active < size; active++)
+	if (MHD_YES != create_worker (daemon))
+	  return MHD_NO;
+      return MHD_YES;
+    }
+  /* retire the most recently created workers */
+  for (i = daemon->worker_pool_size; (i > 0) && (active > size); i--)
+    {
+      if (MHD_YES == daemon->worker_pool[i - 1]->draining)
+	continue;
+      daemon->worker_pool[i - 1]->draining = MHD_YES;
+      itc_signal (daemon->worker_pool[i - 1]->itc);
+      active--;
+    }
+  return MHD_YES;
+}
+
+
+/**
+ * Close all connections for the daemon; must only be called after
+ * all of the threads have been joined and there is no more concurrent
+ * activity on the connection lists.
+ *
+ * @param daemon daemon to close down
+ */
+static void
+close_all_connections (struct MHD_Daemon *daemon)
+{
+  struct MHD_Connection *pos;
+  void *unused;
+  int rc;
   
-  memset (&p, 0, sizeof (p));
-  p[0].fd = daemon->socket_fd;
-  p[0].events = POLLIN;
-  p[0].revents = 0;
-#ifndef HAVE_LISTEN_SHUTDOWN
-  p[1].fd = daemon->wpipe[0];
-  p[1].events = POLLIN;
-  p[1].revents = 0;
+  /* connections handed over by other workers are ours as well */
+  adopt_connections (daemon);
+  /* first, make sure all threads are aware of shutdown; need to
+     traverse DLLs in peace... */
+  if (0 != pthread_mutex_lock(&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
 #endif
-  if (may_block == MHD_NO)
-    timeout = 0;
-  else
-    timeout = -1;
-  if (poll (p, (sizeof(p)/sizeof(struct pollfd)), timeout) < 0)
+      abort();
+    }
+  /* connections still suspended are closed as well */
+  while (NULL != (pos = daemon->suspended_connections_head))
+    {
+      DLL_remove (daemon->suspended_connections_head,
+		  daemon->suspended_connections_tail,
+		  pos);
+      DLL_insert (daemon->connections_head,
+		  daemon->connections_tail,
+		  pos);
+      pos->suspended = MHD_NO;
+    }
+  for (pos = daemon->connections_head; pos != NULL; pos = pos->next)    
+    {
+      SHUTDOWN (pos->socket_fd, 
+		(pos->read_closed == MHD_YES) ? SHUT_WR : SHUT_RDWR);    
+      /* wake up threads of suspended connections */
+      if (MHD_YES == pos->suspended)
+	itc_signal (pos->itc);
+    }
+  if (0 != pthread_mutex_unlock(&daemon->cleanup_connection_mutex))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
+#endif
+      abort();
+    }
+
+  /* now, collect threads */
+  if ( (0 != (daemon->options & MHD_USE_THREAD_PER_CONNECTION)) &&
+       (0 != daemon->thread_cache_size) )
+    {
+      /* cached threads stay around, wait until they are done
+	 with their connections */
+      if (0 != pthread_mutex_lock(&daemon->cleanup_connection_mutex))
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
+#endif
+	  abort();
+	}
+      while (NULL != daemon->connections_head)
+	pthread_cond_wait (&daemon->thread_done_cond,
+			   &daemon->cleanup_connection_mutex);
+      if (0 != pthread_mutex_unlock(&daemon->cleanup_connection_mutex))
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
+#endif
+	  abort();
+	}
+    }
+  else if (0 != (daemon->options & MHD_USE_THREAD_PER_CONNECTION))
+    {
+      while (NULL != (pos = daemon->connections_head))
+	{
+	  if (0 != (rc = pthread_join (pos->pid, &unused)))
+	    {
+#if HAVE_MESSAGES
+	      MHD_DLOG (daemon, "Failed to join a thread: %s\n",
+			STRERROR (rc));
+#endif
+	      abort();
+	    }
+	  pos->thread_joined = MHD_YES;
+	}
+    }
+
+  /* now that we're alone, move everyone to cleanup */
+  while (NULL != (pos = daemon->connections_head))
+    {
+      pos->state = MHD_CONNECTION_CLOSED;
+      DLL_remove (daemon->connections_head,
+		  daemon->connections_tail,
+		  pos);
+      DLL_insert (daemon->cleanup_head,
+		  daemon->cleanup_tail,
+		  pos);
+    }
+  MHD_cleanup_connections (daemon);
+#if HAVE_ZEROCOPY
+  abort_lingering_connections (daemon);
+#endif
+}
+
+
+#if HAVE_FORK
+/**
+ * Body of a worker process (MHD_OPTION_PROCESS_POOL_SIZE): run the
+ * event loop of the daemon until the parent stops it, then exit.
+ *
+ * @param daemon the daemon (the worker's copy of it)
+ * @param slot index of the worker process
+ */
+static void
+run_worker_process (struct MHD_Daemon *daemon,
+		    unsigned int slot)
+{
+  unsigned int i;
+
+  /* only the parent may keep the pipe open */
+  CLOSE (daemon->process_pipe[1]);
+  daemon->process_pipe[1] = -1;
+  for (i = 0; i < daemon->process_pool_size; i++)
+    if (-1 != daemon->processes[i].status_fd)
+      CLOSE (daemon->processes[i].status_fd);
+  /* another thread of the parent may have held a lock when
+     we were forked */
+  pthread_mutex_init (&daemon->per_ip_connection_mutex, NULL);
+  pthread_mutex_init (&daemon->cleanup_connection_mutex, NULL);
+  /* the parent's channel must not be shared */
+  itc_close (daemon->itc);
+  if (MHD_YES != itc_init (daemon, daemon->itc))
+    _exit (1);
+  daemon->counters = &daemon->process_counters[slot];
+  daemon->counters->current_connections = 0;
+  if (NULL != daemon->cpu_affinity)
+    daemon->cpu = (int) daemon->cpu_affinity[slot % daemon->cpu_affinity_size];
+  daemon->pid = pthread_self ();
+  MHD_select_thread (daemon);
+  close_all_connections (daemon);
+  /* do not run the application's 'atexit' handlers */
+  _exit (0);
+}
+
+
+/**
+ * Start a worker process.
+ *
+ * @param daemon daemon with a process pool (in the parent)
+ * @param slot index of the worker process to start
+ * @return MHD_YES on success, MHD_NO on error
+ */
+static int
+spawn_worker_process (struct MHD_Daemon *daemon,
+		      unsigned int slot)
+{
+  int status[2];
+  pid_t pid;
+
+  if (0 != PIPE (status))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon,
+		"Failed to create pipe for worker process: %s\n",
+		STRERROR (errno));
+#endif
+      return MHD_NO;
+    }
+  if (status[0] >= FD_SETSIZE)
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon,
+		"file descriptor for worker process pipe exceeds maximum value\n");
+#endif
+      CLOSE (status[0]);
+      CLOSE (status[1]);
+      return MHD_NO;
+    }
+  pid = fork ();
+  if (-1 == pid)
     {
-      if (errno == EINTR)
-	return MHD_YES;
 #if HAVE_MESSAGES
-      MHD_DLOG (daemon, "poll failed: %s\n", STRERROR (errno));
+      MHD_DLOG (daemon,
+		"Failed to fork worker process: %s\n",
+		STRERROR (errno));
 #endif
+      CLOSE (status[0]);
+      CLOSE (status[1]);
       return MHD_NO;
     }
-  /* handle shutdown cases */
-  if (daemon->shutdown == MHD_YES) 
-    return MHD_NO;  
-  if (daemon->socket_fd < 0) 
-    return MHD_YES; 
-  if (0 != (p[0].revents & POLLIN))
-    MHD_accept_connection (daemon);  
+  if (0 == pid)
+    {
+      /* the write end stays open until the worker terminates */
+      CLOSE (status[0]);
+      run_worker_process (daemon, slot);
+    }
+  CLOSE (status[1]);
+  MHD_ip_count_lock (daemon);
+  daemon->processes[slot].pid = pid;
+  daemon->processes[slot].status_fd = status[0];
+  daemon->processes[slot].started = time (NULL);
+  MHD_ip_count_unlock (daemon);
   return MHD_YES;
 }
-#endif
 
 
 /**
- * Do 'poll'-based processing.
+ * Collect a worker process that terminated (or is about to).
  *
- * @param daemon daemon to run poll loop for
- * @param may_block YES if blocking, NO if non-blocking
- * @return MHD_NO on serious errors, MHD_YES on success
+ * @param daemon daemon with a process pool (in the parent)
+ * @param slot index of the worker process
  */
-static int
-MHD_poll (struct MHD_Daemon *daemon,
-	  int may_block)
+static void
+reap_worker_process (struct MHD_Daemon *daemon,
+		     unsigned int slot)
 {
-#ifdef HAVE_POLL_H
-  if (daemon->shutdown == MHD_YES)
-    return MHD_NO;
-  if (0 == (daemon->options & MHD_USE_THREAD_PER_CONNECTION))
-    return MHD_poll_all (daemon, may_block);
-  else
-    return MHD_poll_listen_socket (daemon, may_block);
-#else
-  return MHD_NO;
-#endif
+  int status;
+
+  while ( (-1 == waitpid (daemon->processes[slot].pid, &status, 0)) &&
+	  (EINTR == errno) )
+    ;
+#if HAVE_MESSAGES
+  if (WIFSIGNALED (status))
+    MHD_DLOG (daemon,
+	      "Worker process %d terminated by signal %d\n",
+	      (int) daemon->processes[slot].pid,
+	      WTERMSIG (status));
+  else if ( (WIFEXITED (status)) &&
+	    (0 != WEXITSTATUS (status)) )
+    MHD_DLOG (daemon,
+	      "Worker process %d exited with status %d\n",
+	      (int) daemon->processes[slot].pid,
+	      WEXITSTATUS (status));
+#endif
+  CLOSE (daemon->processes[slot].status_fd);
+  MHD_ip_count_lock (daemon);
+  daemon->processes[slot].pid = -1;
+  daemon->processes[slot].status_fd = -1;
+  /* its connections are gone */
+  daemon->process_counters[slot].current_connections = 0;
+  MHD_ip_count_unlock (daemon);
 }
 
 
 /**
- * Run webserver operations (without blocking unless
- * in client callbacks).  This method should be called
- * by clients in combination with MHD_get_fdset
- * if the client-controlled select method is used.
+ * Thread of the parent process that restarts worker processes that
+ * terminated (at most once per second and worker) until the daemon
+ * is stopped, then makes the workers exit.
  *
- * @return MHD_YES on success, MHD_NO if this
- *         daemon was not started with the right
- *         options for this call.
+ * @param cls the 'struct MHD_Daemon' with a process pool
+ * @return always NULL
  */
-int
-MHD_run (struct MHD_Daemon *daemon)
+static void *
+MHD_process_supervisor (void *cls)
 {
-  if ((daemon->shutdown != MHD_NO) || (0 != (daemon->options
-                                             & MHD_USE_THREAD_PER_CONNECTION))
-      || (0 != (daemon->options & MHD_USE_SELECT_INTERNALLY)))
-    return MHD_NO;
-  if ((daemon->options & MHD_USE_POLL) == 0) 
-    {
-      MHD_select (daemon, MHD_NO);
-    }
-  else
+  struct MHD_Daemon *daemon = cls;
+  struct timeval timeout;
+  struct timeval *tv;
+  fd_set rs;
+  time_t now;
+  unsigned int i;
+  int max;
+
+  while (MHD_NO == daemon->shutdown)
     {
-      MHD_poll (daemon, MHD_NO);
+      FD_ZERO (&rs);
+      FD_SET (daemon->itc[0], &rs);
+      max = daemon->itc[0];
+      now = time (NULL);
+      tv = NULL;
+      for (i = 0; i < daemon->process_pool_size; i++)
+	{
+	  if (-1 == daemon->processes[i].pid)
+	    {
+	      if ( (now <= daemon->processes[i].started) ||
+		   (MHD_YES != spawn_worker_process (daemon, i)) )
+		{
+		  /* try again later */
+		  timeout.tv_sec = 1;
+		  timeout.tv_usec = 0;
+		  tv = &timeout;
+		  continue;
+		}
+	      MHD_ip_count_lock (daemon);
+	      daemon->process_restarts++;
+	      MHD_ip_count_unlock (daemon);
+	    }
+	  FD_SET (daemon->processes[i].status_fd, &rs);
+	  if (max < daemon->processes[i].status_fd)
+	    max = daemon->processes[i].status_fd;
+	}
+      if (SELECT (max + 1, &rs, NULL, NULL, tv) < 0)
+	{
+	  if (EINTR == errno)
+	    continue;
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon, "select failed: %s\n", STRERROR (errno));
+#endif
+	  break;
+	}
+      if (FD_ISSET (daemon->itc[0], &rs))
+	itc_drain (daemon->itc);
+      for (i = 0; i < daemon->process_pool_size; i++)
+	if ( (-1 != daemon->processes[i].status_fd) &&
+	     (FD_ISSET (daemon->processes[i].status_fd, &rs)) )
+	  reap_worker_process (daemon, i);
     }
-  MHD_cleanup_connections (daemon);
-  return MHD_YES;
+
+  /* tell the workers to close their connections and exit */
+  CLOSE (daemon->process_pipe[1]);
+  daemon->process_pipe[1] = -1;
+  for (i = 0; i < daemon->process_pool_size; i++)
+    if (-1 != daemon->processes[i].pid)
+      reap_worker_process (daemon, i);
+  return NULL;
 }
 
 
 /**
- * Thread that runs the select loop until the daemon
- * is explicitly shut down.
+ * Start the worker processes of a daemon and the thread that
+ * supervises them.
  *
- * @param cls 'struct MHD_Deamon' to run select loop in a thread for
- * @return always NULL (on shutdown)
+ * @param daemon daemon with MHD_OPTION_PROCESS_POOL_SIZE
+ * @return MHD_YES on success, MHD_NO on error (then no worker
+ *         processes are left running)
  */
-static void *
-MHD_select_thread (void *cls)
+static int
+start_process_pool (struct MHD_Daemon *daemon)
 {
-  struct MHD_Daemon *daemon = cls;
-  while (daemon->shutdown == MHD_NO)
+  size_t size;
+  unsigned int i;
+  int res_thread_create;
+
+  size = daemon->process_pool_size * sizeof (struct MHD_ProcessCounters);
+  daemon->process_counters = mmap (NULL, size,
+				   PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_ANONYMOUS,
+				   -1, 0);
+  if (MAP_FAILED == daemon->process_counters)
     {
-      if ((daemon->options & MHD_USE_POLL) == 0) 
-	MHD_select (daemon, MHD_YES);
-      else 
-	MHD_poll (daemon, MHD_YES);      
-      MHD_cleanup_connections (daemon);
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon,
+		"Failed to map memory for worker processes: %s\n",
+		STRERROR (errno));
+#endif
+      daemon->process_counters = NULL;
+      return MHD_NO;
     }
-  return NULL;
+  memset (daemon->process_counters, 0, size);
+  daemon->processes = malloc (daemon->process_pool_size
+			      * sizeof (struct MHD_WorkerProcess));
+  if (NULL == daemon->processes)
+    goto fail;
+  for (i = 0; i < daemon->process_pool_size; i++)
+    {
+      daemon->processes[i].pid = -1;
+      daemon->processes[i].status_fd = -1;
+      daemon->processes[i].started = 0;
+    }
+  if (0 != PIPE (daemon->process_pipe))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon,
+		"Failed to create pipe for worker processes: %s\n",
+		STRERROR (errno));
+#endif
+      goto fail;
+    }
+  if ( (0 == (daemon->options & MHD_USE_POLL)) &&
+       (daemon->process_pipe[0] >= FD_SETSIZE) )
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon,
+		"file descriptor for worker process pipe exceeds maximum value\n");
+#endif
+      goto fail_pipe;
+    }
+  for (i = 0; i < daemon->process_pool_size; i++)
+    if (MHD_YES != spawn_worker_process (daemon, i))
+      goto fail_workers;
+  if (0 != (res_thread_create =
+	    create_thread (&daemon->pid, daemon, &MHD_process_supervisor, daemon)))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon,
+                "Failed to create supervisor thread: %s\n", 
+		STRERROR (res_thread_create));
+#endif
+      goto fail_workers;
+    }
+  return MHD_YES;
+
+ fail_workers:
+  /* make the workers that were started exit */
+  CLOSE (daemon->process_pipe[1]);
+  daemon->process_pipe[1] = -1;
+  for (i = 0; i < daemon->process_pool_size; i++)
+    if (-1 != daemon->processes[i].pid)
+      reap_worker_process (daemon, i);
+ fail_pipe:
+  if (-1 != daemon->process_pipe[1])
+    CLOSE (daemon->process_pipe[1]);
+  CLOSE (daemon->process_pipe[0]);
+  daemon->process_pipe[0] = -1;
+  daemon->process_pipe[1] = -1;
+ fail:
+  free (daemon->processes);
+  daemon->processes = NULL;
+  munmap (daemon->process_counters, size);
+  daemon->process_counters = NULL;
+  return MHD_NO;
 }
+#endif
 
 
 /**
@@ -1713,6 +4706,7 @@ parse_options_va (struct MHD_Daemon *daemon,
 #if HTTPS_SUPPORT
   int ret;
   const char *pstr;
+  const struct MHD_TlsSessionStore *store;
 #endif
   
   while (MHD_OPTION_END != (opt = va_arg (ap, enum MHD_OPTION)))
@@ -1746,7 +4740,7 @@ parse_options_va (struct MHD_Daemon *daemon,
           break;
         case MHD_OPTION_THREAD_POOL_SIZE:
           daemon->worker_pool_size = va_arg (ap, unsigned int);
-	  if (daemon->worker_pool_size >= SIZE_MAX / sizeof (struct MHD_Daemon))
+	  if (daemon->worker_pool_size >= SIZE_MAX / sizeof (struct MHD_Daemon *))
 	    {
 #if HAVE_MESSAGES
 	      FPRINTF (stderr,
@@ -1756,40 +4750,211 @@ parse_options_va (struct MHD_Daemon *daemon,
 	      return MHD_NO;
 	    }
           break;
-#if HTTPS_SUPPORT
-        case MHD_OPTION_HTTPS_MEM_KEY:
-	  if (0 != (daemon->options & MHD_USE_SSL))
-	    daemon->https_mem_key = va_arg (ap, const char *);
+        case MHD_OPTION_THREAD_CACHE_SIZE:
+          daemon->thread_cache_size = va_arg (ap, unsigned int);
+          break;
+        case MHD_OPTION_THREAD_CACHE_TIMEOUT:
+          daemon->thread_cache_timeout = va_arg (ap, unsigned int);
+          break;
+        case MHD_OPTION_THREAD_POOL_REBALANCE_INTERVAL:
+          daemon->rebalance_interval = va_arg (ap, unsigned int);
+          break;
+        case MHD_OPTION_PROCESS_POOL_SIZE:
+          daemon->process_pool_size = va_arg (ap, unsigned int);
+#if HAVE_FORK
+	  if (daemon->process_pool_size >= SIZE_MAX / sizeof (struct MHD_WorkerProcess))
+	    {
+#if HAVE_MESSAGES
+	      FPRINTF (stderr,
+		       "Specified process pool size (%u) too big\n",
+		       daemon->process_pool_size);
+#endif
+	      return MHD_NO;
+	    }
+#else
+	  if (0 != daemon->process_pool_size)
+	    {
+#if HAVE_MESSAGES
+	      FPRINTF (stderr,
+		       "MHD_OPTION_PROCESS_POOL_SIZE is not supported on this platform\n");
+#endif
+	      return MHD_NO;
+	    }
+#endif
+          break;
+        case MHD_OPTION_THREAD_POOL_CPU_AFFINITY:
+          daemon->cpu_affinity_size = va_arg (ap, unsigned int);
+          daemon->cpu_affinity = va_arg (ap, const unsigned int *);
+#if HAVE_PTHREAD_SETAFFINITY_NP
+	  for (i = 0; i < daemon->cpu_affinity_size; i++)
+	    if (daemon->cpu_affinity[i] >= CPU_SETSIZE)
+	      {
+#if HAVE_MESSAGES
+		FPRINTF (stderr,
+			 "Invalid CPU %u for MHD_OPTION_THREAD_POOL_CPU_AFFINITY\n",
+			 daemon->cpu_affinity[i]);
+#endif
+		return MHD_NO;
+	      }
+#else
+	  if (0 != daemon->cpu_affinity_size)
+	    {
+#if HAVE_MESSAGES
+	      FPRINTF (stderr,
+		       "MHD_OPTION_THREAD_POOL_CPU_AFFINITY is not supported on this platform\n");
+#endif
+	      return MHD_NO;
+	    }
+#endif
+	  if (0 == daemon->cpu_affinity_size)
+	    daemon->cpu_affinity = NULL;
+          break;
+        case MHD_OPTION_HANDLER_POOL_SIZE:
+          daemon->handler_pool_size = va_arg (ap, unsigned int);
+	  if (daemon->handler_pool_size >= SIZE_MAX / sizeof (pthread_t))
+	    {
+#if HAVE_MESSAGES
+	      FPRINTF (stderr,
+		       "Specified handler pool size (%u) too big\n",
+		       daemon->handler_pool_size);
+#endif
+	      return MHD_NO;
+	    }
+          break;
+#if HTTPS_SUPPORT
+        case MHD_OPTION_HTTPS_MEM_KEY:
+	  if (0 != (daemon->options & MHD_USE_SSL))
+	    daemon->https_mem_key = va_arg (ap, const char *);
+#if HAVE_MESSAGES
+	  else
+	    FPRINTF (stderr,
+		     "MHD HTTPS option %d passed to MHD but MHD_USE_SSL not set\n",
+		     opt);	  
+#endif
+          break;
+        case MHD_OPTION_HTTPS_MEM_CERT:
+	  if (0 != (daemon->options & MHD_USE_SSL))
+	    daemon->https_mem_cert = va_arg (ap, const char *);
+#if HAVE_MESSAGES
+	  else
+	    FPRINTF (stderr,
+		     "MHD HTTPS option %d passed to MHD but MHD_USE_SSL not set\n",
+		     opt);	  
+#endif
+          break;
+        case MHD_OPTION_HTTPS_MEM_TRUST:
+	  if (0 != (daemon->options & MHD_USE_SSL))
+	    daemon->https_mem_trust = va_arg (ap, const char *);
+#if HAVE_MESSAGES
+	  else
+	    FPRINTF (stderr,
+		     "MHD HTTPS option %d passed to MHD but MHD_USE_SSL not set\n",
+		     opt);
+#endif
+          break;
+	case MHD_OPTION_HTTPS_CRED_TYPE:
+	  daemon->cred_type = va_arg (ap, gnutls_credentials_type_t);
+	  break;
+        case MHD_OPTION_HTTPS_SESSION_CACHE_SIZE:
+	  if (0 != (daemon->options & MHD_USE_SSL))
+	    daemon->session_cache_size = va_arg (ap, unsigned int);
+#if HAVE_MESSAGES
+	  else
+	    FPRINTF (stderr,
+		     "MHD HTTPS option %d passed to MHD but MHD_USE_SSL not set\n",
+		     opt);
+#endif
+          break;
+        case MHD_OPTION_HTTPS_SESSION_TIMEOUT:
+	  daemon->session_timeout = va_arg (ap, unsigned int);
+          break;
+        case MHD_OPTION_HTTPS_SESSION_STORE:
+	  if (0 != (daemon->options & MHD_USE_SSL))
+	    {
+	      store = va_arg (ap, const struct MHD_TlsSessionStore *);
+	      if ( (NULL == store->store) ||
+		   (NULL == store->retrieve) )
+		{
+#if HAVE_MESSAGES
+		  FPRINTF (stderr,
+			   "MHD_OPTION_HTTPS_SESSION_STORE requires 'store' and 'retrieve' functions\n");
+#endif
+		  return MHD_NO;
+		}
+	      daemon->session_store = *store;
+	    }
+#if HAVE_MESSAGES
+	  else
+	    FPRINTF (stderr,
+		     "MHD HTTPS option %d passed to MHD but MHD_USE_SSL not set\n",
+		     opt);
+#endif
+          break;
+        case MHD_OPTION_HTTPS_SESSION_TICKET_KEY:
+	  if (0 != (daemon->options & MHD_USE_SSL))
+	    {
+	      daemon->https_mem_ticket_key_size = va_arg (ap, size_t);
+	      daemon->https_mem_ticket_key = va_arg (ap, const void *);
+	    }
+#if HAVE_MESSAGES
+	  else
+	    FPRINTF (stderr,
+		     "MHD HTTPS option %d passed to MHD but MHD_USE_SSL not set\n",
+		     opt);
+#endif
+          break;
+        case MHD_OPTION_HTTPS_HANDSHAKE_POOL_SIZE:
+	  if (0 != (daemon->options & MHD_USE_SSL))
+	    {
+	      daemon->handshake_pool_size = va_arg (ap, unsigned int);
+	      if (daemon->handshake_pool_size >= SIZE_MAX / sizeof (pthread_t))
+		{
+#if HAVE_MESSAGES
+		  FPRINTF (stderr,
+			   "Specified handshake pool size (%u) too big\n",
+			   daemon->handshake_pool_size);
+#endif
+		  return MHD_NO;
+		}
+	    }
+#if HAVE_MESSAGES
+	  else
+	    FPRINTF (stderr,
+		     "MHD HTTPS option %d passed to MHD but MHD_USE_SSL not set\n",
+		     opt);
+#endif
+          break;
+        case MHD_OPTION_HTTPS_RECORD_SIZE:
+	  daemon->tls_record_size = va_arg (ap, size_t);
 #if HAVE_MESSAGES
-	  else
+	  if (0 == (daemon->options & MHD_USE_SSL))
 	    FPRINTF (stderr,
 		     "MHD HTTPS option %d passed to MHD but MHD_USE_SSL not set\n",
-		     opt);	  
+		     opt);
 #endif
           break;
-        case MHD_OPTION_HTTPS_MEM_CERT:
+        case MHD_OPTION_HTTPS_MEM_HOST_CERTS:
 	  if (0 != (daemon->options & MHD_USE_SSL))
-	    daemon->https_mem_cert = va_arg (ap, const char *);
+	    daemon->https_mem_host_certs =
+	      va_arg (ap, const struct MHD_HttpsHostCert *);
 #if HAVE_MESSAGES
 	  else
 	    FPRINTF (stderr,
 		     "MHD HTTPS option %d passed to MHD but MHD_USE_SSL not set\n",
-		     opt);	  
+		     opt);
 #endif
           break;
-        case MHD_OPTION_HTTPS_MEM_TRUST:
-	  if (0 != (daemon->options & MHD_USE_SSL))
-	    daemon->https_mem_trust = va_arg (ap, const char *);
+        case MHD_OPTION_HTTPS_HOST_CERT_CALLBACK:
+	  daemon->host_cert_callback =
+	    va_arg (ap, MHD_HttpsHostCertCallback);
+	  daemon->host_cert_callback_cls = va_arg (ap, void *);
 #if HAVE_MESSAGES
-	  else
+	  if (0 == (daemon->options & MHD_USE_SSL))
 	    FPRINTF (stderr,
 		     "MHD HTTPS option %d passed to MHD but MHD_USE_SSL not set\n",
 		     opt);
 #endif
           break;
-	case MHD_OPTION_HTTPS_CRED_TYPE:
-	  daemon->cred_type = va_arg (ap, gnutls_credentials_type_t);
-	  break;
         case MHD_OPTION_HTTPS_PRIORITIES:
 	  if (daemon->options & MHD_USE_SSL)
 	    {
@@ -1836,6 +5001,15 @@ parse_options_va (struct MHD_Daemon *daemon,
         case MHD_OPTION_THREAD_STACK_SIZE:
           daemon->thread_stack_size = va_arg (ap, size_t);
           break;
+        case MHD_OPTION_ZEROCOPY_THRESHOLD:
+          daemon->zerocopy_threshold = va_arg (ap, size_t);
+#if HAVE_MESSAGES && !HAVE_ZEROCOPY
+	  if (daemon->zerocopy_threshold > 0)
+	    FPRINTF (stderr,
+		     "MSG_ZEROCOPY not supported by this platform, option %d ignored\n",
+		     opt);
+#endif
+          break;
 	case MHD_OPTION_ARRAY:
 	  oa = va_arg (ap, struct MHD_OptionItem*);
 	  i = 0;
@@ -1846,6 +5020,8 @@ parse_options_va (struct MHD_Daemon *daemon,
 		  /* all options taking 'size_t' */
 		case MHD_OPTION_CONNECTION_MEMORY_LIMIT:
 		case MHD_OPTION_THREAD_STACK_SIZE:
+		case MHD_OPTION_ZEROCOPY_THRESHOLD:
+		case MHD_OPTION_HTTPS_RECORD_SIZE:
 		  if (MHD_YES != parse_options (daemon,
 						servaddr,
 						opt,
@@ -1859,6 +5035,14 @@ parse_options_va (struct MHD_Daemon *daemon,
 		case MHD_OPTION_CONNECTION_TIMEOUT:
 		case MHD_OPTION_PER_IP_CONNECTION_LIMIT:
 		case MHD_OPTION_THREAD_POOL_SIZE:
+		case MHD_OPTION_HANDLER_POOL_SIZE:
+		case MHD_OPTION_THREAD_CACHE_SIZE:
+		case MHD_OPTION_THREAD_CACHE_TIMEOUT:
+		case MHD_OPTION_THREAD_POOL_REBALANCE_INTERVAL:
+		case MHD_OPTION_PROCESS_POOL_SIZE:
+		case MHD_OPTION_HTTPS_SESSION_CACHE_SIZE:
+		case MHD_OPTION_HTTPS_SESSION_TIMEOUT:
+		case MHD_OPTION_HTTPS_HANDSHAKE_POOL_SIZE:
 		  if (MHD_YES != parse_options (daemon,
 						servaddr,
 						opt,
@@ -1882,6 +5066,8 @@ parse_options_va (struct MHD_Daemon *daemon,
 		case MHD_OPTION_HTTPS_MEM_CERT:
 		case MHD_OPTION_HTTPS_MEM_TRUST:
 		case MHD_OPTION_HTTPS_PRIORITIES:
+		case MHD_OPTION_HTTPS_SESSION_STORE:
+		case MHD_OPTION_HTTPS_MEM_HOST_CERTS:
 		case MHD_OPTION_ARRAY:
 		  if (MHD_YES != parse_options (daemon,
 						servaddr,
@@ -1895,6 +5081,7 @@ parse_options_va (struct MHD_Daemon *daemon,
 		case MHD_OPTION_URI_LOG_CALLBACK:
 		case MHD_OPTION_EXTERNAL_LOGGER:
 		case MHD_OPTION_UNESCAPE_CALLBACK:
+		case MHD_OPTION_HTTPS_HOST_CERT_CALLBACK:
 		  if (MHD_YES != parse_options (daemon,
 						servaddr,
 						opt,
@@ -1905,6 +5092,7 @@ parse_options_va (struct MHD_Daemon *daemon,
 		  break;
 		  /* options taking size_t-number followed by pointer */
 		case MHD_OPTION_DIGEST_AUTH_RANDOM:
+		case MHD_OPTION_HTTPS_SESSION_TICKET_KEY:
 		  if (MHD_YES != parse_options (daemon,
 						servaddr,
 						opt,
@@ -1913,6 +5101,16 @@ parse_options_va (struct MHD_Daemon *daemon,
 						MHD_OPTION_END))
 		    return MHD_NO;
 		  break;
+		  /* options taking unsigned int-number followed by pointer */
+		case MHD_OPTION_THREAD_POOL_CPU_AFFINITY:
+		  if (MHD_YES != parse_options (daemon,
+						servaddr,
+						opt,
+						(unsigned int) oa[i].value,
+						oa[i].ptr_value,
+						MHD_OPTION_END))
+		    return MHD_NO;
+		  break;
 		default:
 		  return MHD_NO;
 		}
@@ -1993,6 +5191,10 @@ MHD_start_daemon_va (unsigned int options,
     }
 #endif
   retVal->socket_fd = -1;
+  retVal->itc[0] = -1;
+  retVal->itc[1] = -1;
+  retVal->process_pipe[0] = -1;
+  retVal->process_pipe[1] = -1;
   retVal->options = (enum MHD_OPTION) options;
   retVal->port = port;
   retVal->apc = apc;
@@ -2001,36 +5203,14 @@ MHD_start_daemon_va (unsigned int options,
   retVal->default_handler_cls = dh_cls;
   retVal->max_connections = MHD_MAX_CONNECTIONS_DEFAULT;
   retVal->pool_size = MHD_POOL_SIZE_DEFAULT;
+  retVal->thread_cache_timeout = MHD_THREAD_CACHE_TIMEOUT_DEFAULT;
+#if HTTPS_SUPPORT
+  retVal->session_timeout = MHD_TLS_SESSION_TIMEOUT_DEFAULT;
+  retVal->tls_record_size = MHD_TLS_RECORD_SIZE_DEFAULT;
+#endif
+  retVal->cpu = -1;
   retVal->unescape_callback = &MHD_http_unescape;
   retVal->connection_timeout = 0;       /* no timeout */
-#ifndef HAVE_LISTEN_SHUTDOWN
-  retVal->wpipe[0] = -1;
-  retVal->wpipe[1] = -1;
-  if (0 != PIPE (retVal->wpipe))
-    {
-#if HAVE_MESSAGES
-      FPRINTF(stderr, 
-	      "Failed to create control pipe: %s\n",
-	      STRERROR (errno));
-#endif
-      free (retVal);
-      return NULL;
-    }
-#ifndef WINDOWS
-  if ( (0 == (options & MHD_USE_POLL)) &&
-       (retVal->wpipe[0] >= FD_SETSIZE) )
-    {
-#if HAVE_MESSAGES
-      FPRINTF(stderr, 
-	      "file descriptor for control pipe exceeds maximum value\n");
-#endif
-      CLOSE (retVal->wpipe[0]);
-      CLOSE (retVal->wpipe[1]);
-      free (retVal);
-      return NULL;
-    }
-#endif
-#endif
 #ifdef DAUTH_SUPPORT
   retVal->digest_auth_rand_size = 0;
   retVal->digest_auth_random = NULL;
@@ -2135,6 +5315,21 @@ MHD_start_daemon_va (unsigned int options,
       goto free_and_fail;
     }
 
+  /* worker processes run a single internal select thread each */
+  if ( (0 != retVal->process_pool_size) &&
+       ( (0 == (options & MHD_USE_SELECT_INTERNALLY)) ||
+	 (0 != (options & MHD_USE_THREAD_PER_CONNECTION)) ||
+	 (0 != retVal->worker_pool_size) ||
+	 (0 != retVal->handler_pool_size) ||
+	 (0 != retVal->handshake_pool_size) ) )
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (retVal,
+		"MHD_OPTION_PROCESS_POOL_SIZE only works with MHD_USE_SELECT_INTERNALLY and without thread, handler or handshake pools\n");
+#endif
+      goto free_and_fail;
+    }
+
 #ifdef __SYMBIAN32__
   if (0 != (options & (MHD_USE_SELECT_INTERNALLY | MHD_USE_THREAD_PER_CONNECTION)))
     {
@@ -2180,6 +5375,31 @@ MHD_start_daemon_va (unsigned int options,
 	  MHD_DLOG (retVal, 
 		    "setsockopt failed: %s\n", 
 		    STRERROR (errno));
+#endif
+	}
+      if (0 != (options & MHD_USE_REUSEPORT))
+	{
+#if HAVE_DECL_SO_REUSEPORT
+	  if (SETSOCKOPT (socket_fd,
+			  SOL_SOCKET,
+			  SO_REUSEPORT,
+			  &on, sizeof (on)) < 0)
+	    {
+#if HAVE_MESSAGES
+	      MHD_DLOG (retVal, 
+			"setsockopt (SO_REUSEPORT) failed: %s\n", 
+			STRERROR (errno));
+#endif
+	      CLOSE (socket_fd);
+	      goto free_and_fail;
+	    }
+#else
+#if HAVE_MESSAGES
+	  MHD_DLOG (retVal, 
+		    "SO_REUSEPORT is not supported on this platform\n");
+#endif
+	  CLOSE (socket_fd);
+	  goto free_and_fail;
 #endif
 	}
       
@@ -2304,6 +5524,80 @@ MHD_start_daemon_va (unsigned int options,
       goto free_and_fail;
     }
 
+  if ( (0 != retVal->handler_pool_size) ||
+       (0 != retVal->handshake_pool_size) )
+    {
+      if (0 != (options & MHD_USE_THREAD_PER_CONNECTION))
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (retVal,
+		    "MHD_OPTION_HANDLER_POOL_SIZE and MHD_OPTION_HTTPS_HANDSHAKE_POOL_SIZE cannot be used with MHD_USE_THREAD_PER_CONNECTION.\n");
+#endif
+	  CLOSE (socket_fd);
+	  pthread_mutex_destroy (&retVal->cleanup_connection_mutex);
+	  pthread_mutex_destroy (&retVal->per_ip_connection_mutex);
+	  goto free_and_fail;
+	}
+      /* the pool hands connections back like resumed connections */
+      options |= MHD_USE_SUSPEND_RESUME;
+      retVal->options = (enum MHD_OPTION) options;
+    }
+  /* with a thread pool, each worker gets its own channel (and
+     with a thread per connection, each suspended connection); with
+     worker processes, the channel wakes up the thread supervising
+     them (and each worker creates its own) */
+  if (0 == retVal->worker_pool_size)
+    {
+      if (MHD_YES != itc_init (retVal, retVal->itc))
+	{
+	  CLOSE (socket_fd);
+	  pthread_mutex_destroy (&retVal->cleanup_connection_mutex);
+	  pthread_mutex_destroy (&retVal->per_ip_connection_mutex);
+	  goto free_and_fail;
+	}
+#ifndef WINDOWS
+      if ( (0 == (options & MHD_USE_POLL)) &&
+	   (retVal->itc[0] >= FD_SETSIZE) )
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (retVal,
+		    "file descriptor for inter-thread communication channel exceeds maximum value\n");
+#endif
+	  CLOSE (socket_fd);
+	  pthread_mutex_destroy (&retVal->cleanup_connection_mutex);
+	  pthread_mutex_destroy (&retVal->per_ip_connection_mutex);
+	  goto free_and_fail;
+	}
+#endif
+    }
+
+  if (0 != retVal->handler_pool_size)
+    {
+      retVal->handler_pool = handler_pool_create (retVal,
+						  retVal->handler_pool_size,
+						  MHD_YES);
+      if (NULL == retVal->handler_pool)
+	{
+	  CLOSE (socket_fd);
+	  pthread_mutex_destroy (&retVal->cleanup_connection_mutex);
+	  pthread_mutex_destroy (&retVal->per_ip_connection_mutex);
+	  goto free_and_fail;
+	}
+    }
+  if (0 != retVal->handshake_pool_size)
+    {
+      retVal->handshake_pool = handler_pool_create (retVal,
+						    retVal->handshake_pool_size,
+						    MHD_NO);
+      if (NULL == retVal->handshake_pool)
+	{
+	  CLOSE (socket_fd);
+	  pthread_mutex_destroy (&retVal->cleanup_connection_mutex);
+	  pthread_mutex_destroy (&retVal->per_ip_connection_mutex);
+	  goto free_and_fail;
+	}
+    }
+
 #if HTTPS_SUPPORT
   /* initialize HTTPS daemon certificate aspects & send / recv functions */
   if ((0 != (options & MHD_USE_SSL)) && (0 != MHD_TLS_init (retVal)))
@@ -2318,9 +5612,27 @@ MHD_start_daemon_va (unsigned int options,
       goto free_and_fail;
     }
 #endif
+  if (0 == (options & MHD_USE_THREAD_PER_CONNECTION))
+    retVal->thread_cache_size = 0; /* only used with a thread per connection */
+  if ( (NULL != retVal->cpu_affinity) &&
+       (0 == (options & MHD_USE_THREAD_PER_CONNECTION)) &&
+       (0 == retVal->worker_pool_size) )
+    retVal->cpu = (int) retVal->cpu_affinity[0];
+  if ( (0 != retVal->thread_cache_size) &&
+       (MHD_YES != thread_cache_init (retVal)) )
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (retVal, "Failed to initialize thread cache\n");
+#endif
+      pthread_mutex_destroy (&retVal->cleanup_connection_mutex);
+      pthread_mutex_destroy (&retVal->per_ip_connection_mutex);
+      CLOSE (socket_fd);
+      goto free_and_fail;
+    }
   if ( ( (0 != (options & MHD_USE_THREAD_PER_CONNECTION)) ||
 	 ( (0 != (options & MHD_USE_SELECT_INTERNALLY)) &&
-	   (0 == retVal->worker_pool_size)) ) && 
+	   (0 == retVal->worker_pool_size) &&
+	   (0 == retVal->process_pool_size) ) ) && 
        (0 != (res_thread_create =
 	      create_thread (&retVal->pid, retVal, &MHD_select_thread, retVal))))
     {
@@ -2329,11 +5641,32 @@ MHD_start_daemon_va (unsigned int options,
                 "Failed to create listen thread: %s\n", 
 		STRERROR (res_thread_create));
 #endif
+      if (0 != retVal->thread_cache_size)
+	thread_cache_destroy (retVal);
       pthread_mutex_destroy (&retVal->cleanup_connection_mutex);
       pthread_mutex_destroy (&retVal->per_ip_connection_mutex);
       CLOSE (socket_fd);
       goto free_and_fail;
     }
+#if HAVE_FORK
+  if (0 != retVal->process_pool_size)
+    {
+      int sk_flags;
+
+      /* all workers wake up for a new connection, but only one
+	 gets it; accept must not block the others */
+      sk_flags = fcntl (socket_fd, F_GETFL);
+      if ( (sk_flags < 0) ||
+	   (fcntl (socket_fd, F_SETFL, sk_flags | O_NONBLOCK) < 0) ||
+	   (MHD_YES != start_process_pool (retVal)) )
+	{
+	  pthread_mutex_destroy (&retVal->cleanup_connection_mutex);
+	  pthread_mutex_destroy (&retVal->per_ip_connection_mutex);
+	  CLOSE (socket_fd);
+	  goto free_and_fail;
+	}
+    }
+#endif
   if (retVal->worker_pool_size > 0)
     {
 #ifndef MINGW
@@ -2341,14 +5674,7 @@ MHD_start_daemon_va (unsigned int options,
 #else
       unsigned long sk_flags;
 #endif
-
-      /* Coarse-grained count of connections per thread (note error
-       * due to integer division). Also keep track of how many
-       * connections are leftover after an equal split. */
-      unsigned int conns_per_thread = retVal->max_connections
-                                      / retVal->worker_pool_size;
-      unsigned int leftover_conns = retVal->max_connections
-                                    % retVal->worker_pool_size;
+      unsigned int num_workers;
 
       i = 0; /* we need this in case fcntl or malloc fails */
 
@@ -2373,45 +5699,18 @@ MHD_start_daemon_va (unsigned int options,
 #endif // MINGW
 
       /* Allocate memory for pooled objects */
-      retVal->worker_pool = malloc (sizeof (struct MHD_Daemon)
+      retVal->worker_pool = malloc (sizeof (struct MHD_Daemon *)
                                     * retVal->worker_pool_size);
       if (NULL == retVal->worker_pool)
         goto thread_failed;
 
-      /* Start the workers in the pool */
-      for (i = 0; i < retVal->worker_pool_size; ++i)
-        {
-          /* Create copy of the Daemon object for each worker */
-          struct MHD_Daemon *d = &retVal->worker_pool[i];
-          memcpy (d, retVal, sizeof (struct MHD_Daemon));
-
-          /* Adjust pooling params for worker daemons; note that memcpy()
-             has already copied MHD_USE_SELECT_INTERNALLY thread model into
-             the worker threads. */
-          d->master = retVal;
-          d->worker_pool_size = 0;
-          d->worker_pool = NULL;
-
-          /* Divide available connections evenly amongst the threads.
-           * Thread indexes in [0, leftover_conns) each get one of the
-           * leftover connections. */
-          d->max_connections = conns_per_thread;
-          if (i < leftover_conns)
-            ++d->max_connections;
-
-          /* Spawn the worker thread */
-          if (0 != (res_thread_create = create_thread (&d->pid, retVal, &MHD_select_thread, d)))
-            {
-#if HAVE_MESSAGES
-              MHD_DLOG (retVal,
-                        "Failed to create pool thread: %s\n", 
-			STRERROR (res_thread_create));
-#endif
-              /* Free memory for this worker; cleanup below handles
-               * all previously-created workers. */
-              goto thread_failed;
-            }
-        }
+      /* Start the workers in the pool; 'create_worker' adds them
+	 to 'worker_pool' one by one */
+      num_workers = retVal->worker_pool_size;
+      retVal->worker_pool_size = 0;
+      for (i = 0; i < num_workers; ++i)
+	if (MHD_YES != create_worker (retVal))
+	  goto thread_failed;
     }
   return retVal;
 
@@ -2433,14 +5732,19 @@ thread_failed:
   /* Shutdown worker threads we've already created. Pretend
      as though we had fully initialized our daemon, but
      with a smaller number of threads than had been
-     requested. */
-  retVal->worker_pool_size = i - 1;
+     requested ('worker_pool_size' counts the workers
+     that were created). */
   MHD_stop_daemon (retVal);
   return NULL;
 
  free_and_fail:
   /* clean up basic memory state in 'retVal' and return NULL to 
      indicate failure */
+  itc_close (retVal->itc);
+  if (NULL != retVal->handler_pool)
+    handler_pool_destroy (retVal->handler_pool);
+  if (NULL != retVal->handshake_pool)
+    handler_pool_destroy (retVal->handshake_pool);
 #ifdef DAUTH_SUPPORT
   free (retVal->nnc);
   pthread_mutex_destroy (&retVal->nnc_lock);
@@ -2448,75 +5752,18 @@ thread_failed:
 #if HTTPS_SUPPORT
   if (options & MHD_USE_SSL)
     gnutls_priority_deinit (retVal->priority_cache);
-#endif
-  free (retVal);
-  return NULL;
-}
-
-
-/**
- * Close all connections for the daemon; must only be called after
- * all of the threads have been joined and there is no more concurrent
- * activity on the connection lists.
- *
- * @param daemon daemon to close down
- */
-static void
-close_all_connections (struct MHD_Daemon *daemon)
-{
-  struct MHD_Connection *pos;
-  void *unused;
-  int rc;
-  
-  /* first, make sure all threads are aware of shutdown; need to
-     traverse DLLs in peace... */
-  if (0 != pthread_mutex_lock(&daemon->cleanup_connection_mutex))
-    {
-#if HAVE_MESSAGES
-      MHD_DLOG (daemon, "Failed to acquire cleanup mutex\n");
-#endif
-      abort();
-    }
-  for (pos = daemon->connections_head; pos != NULL; pos = pos->next)    
-    SHUTDOWN (pos->socket_fd, 
-	      (pos->read_closed == MHD_YES) ? SHUT_WR : SHUT_RDWR);    
-  if (0 != pthread_mutex_unlock(&daemon->cleanup_connection_mutex))
+  if (NULL != retVal->session_cache)
+    MHD_tls_session_cache_destroy (retVal->session_cache);
+  if (NULL != retVal->host_certs)
+    MHD_tls_host_certs_destroy (retVal->host_certs);
+  if (NULL != retVal->ticket_key.data)
     {
-#if HAVE_MESSAGES
-      MHD_DLOG (daemon, "Failed to release cleanup mutex\n");
-#endif
-      abort();
+      memset (retVal->ticket_key.data, 0, retVal->ticket_key.size);
+      gnutls_free (retVal->ticket_key.data);
     }
-
-  /* now, collect threads */
-  if (0 != (daemon->options & MHD_USE_THREAD_PER_CONNECTION))
-    {
-      while (NULL != (pos = daemon->connections_head))
-	{
-	  if (0 != (rc = pthread_join (pos->pid, &unused)))
-	    {
-#if HAVE_MESSAGES
-	      MHD_DLOG (daemon, "Failed to join a thread: %s\n",
-			STRERROR (rc));
 #endif
-	      abort();
-	    }
-	  pos->thread_joined = MHD_YES;
-	}
-    }
-
-  /* now that we're alone, move everyone to cleanup */
-  while (NULL != (pos = daemon->connections_head))
-    {
-      pos->state = MHD_CONNECTION_CLOSED;
-      DLL_remove (daemon->connections_head,
-		  daemon->connections_tail,
-		  pos);
-      DLL_insert (daemon->cleanup_head,
-		  daemon->cleanup_tail,
-		  pos);
-    }
-  MHD_cleanup_connections (daemon);
+  free (retVal);
+  return NULL;
 }
 
 
@@ -2541,26 +5788,29 @@ MHD_stop_daemon (struct MHD_Daemon *daemon)
   /* Prepare workers for shutdown */
   for (i = 0; i < daemon->worker_pool_size; ++i)
     {
-      daemon->worker_pool[i].shutdown = MHD_YES;
-      daemon->worker_pool[i].socket_fd = -1;
+      daemon->worker_pool[i]->shutdown = MHD_YES;
+      daemon->worker_pool[i]->socket_fd = -1;
+      /* workers at the connection limit are not listening */
+      itc_signal (daemon->worker_pool[i]->itc);
     }
-#ifdef HAVE_LISTEN_SHUTDOWN
-  SHUTDOWN (fd, SHUT_RDWR);
-#else
-  if (daemon->wpipe[1] != -1)
-    WRITE (daemon->wpipe[1], "e", 1);
-#endif
-#if DEBUG_CLOSE
-#if HAVE_MESSAGES
-  MHD_DLOG (daemon, "MHD listen socket shutdown\n");
-#endif
-#endif
-
-
-  /* Signal workers to stop and clean them up */
+  /* wake up our own event loop (or the thread supervising the
+     worker processes, which stop once it closes their pipe) */
+  if (-1 != daemon->itc[0])
+    itc_signal (daemon->itc);
+
+  /* let running handlers (and handshakes) finish before
+     connections are closed */
+  if (NULL != daemon->handler_pool)
+    handler_pool_stop (daemon->handler_pool);
+  if (NULL != daemon->handshake_pool)
+    handler_pool_stop (daemon->handshake_pool);
+
+  /* Signal workers to stop and clean them up; all of them must
+     have stopped before the first is freed, as workers hand
+     connections to each other */
   for (i = 0; i < daemon->worker_pool_size; ++i)
     {
-      if (0 != (rc = pthread_join (daemon->worker_pool[i].pid, &unused)))
+      if (0 != (rc = pthread_join (daemon->worker_pool[i]->pid, &unused)))
 	{
 #if HAVE_MESSAGES
 	  MHD_DLOG (daemon, "Failed to join a thread: %s\n",
@@ -2568,11 +5818,17 @@ MHD_stop_daemon (struct MHD_Daemon *daemon)
 #endif
 	  abort();
 	}
-      close_all_connections (&daemon->worker_pool[i]);
+    }
+  for (i = 0; i < daemon->worker_pool_size; ++i)
+    {
+      close_all_connections (daemon->worker_pool[i]);
+      itc_close (daemon->worker_pool[i]->itc);
+      free (daemon->worker_pool[i]);
     }
   free (daemon->worker_pool);
 
-  /* clean up master threads */
+  /* clean up master threads (or the thread supervising the
+     worker processes) */
   if ((0 != (daemon->options & MHD_USE_THREAD_PER_CONNECTION)) ||
       ((0 != (daemon->options & MHD_USE_SELECT_INTERNALLY))
         && (0 == daemon->worker_pool_size)))
@@ -2586,7 +5842,23 @@ MHD_stop_daemon (struct MHD_Daemon *daemon)
 	  abort();
 	}
     }
+#if HAVE_FORK
+  if (0 != daemon->process_pool_size)
+    {
+      CLOSE (daemon->process_pipe[0]);
+      free (daemon->processes);
+      munmap (daemon->process_counters,
+	      daemon->process_pool_size * sizeof (struct MHD_ProcessCounters));
+    }
+#endif
   close_all_connections (daemon);
+  if (0 != daemon->thread_cache_size)
+    thread_cache_destroy (daemon);
+  itc_close (daemon->itc);
+  if (NULL != daemon->handler_pool)
+    handler_pool_destroy (daemon->handler_pool);
+  if (NULL != daemon->handshake_pool)
+    handler_pool_destroy (daemon->handshake_pool);
   CLOSE (fd);
 
   /* TLS clean up */
@@ -2596,6 +5868,15 @@ MHD_stop_daemon (struct MHD_Daemon *daemon)
       gnutls_priority_deinit (daemon->priority_cache);
       if (daemon->x509_cred)
         gnutls_certificate_free_credentials (daemon->x509_cred);
+      if (NULL != daemon->session_cache)
+	MHD_tls_session_cache_destroy (daemon->session_cache);
+      if (NULL != daemon->host_certs)
+	MHD_tls_host_certs_destroy (daemon->host_certs);
+      if (NULL != daemon->ticket_key.data)
+	{
+	  memset (daemon->ticket_key.data, 0, daemon->ticket_key.size);
+	  gnutls_free (daemon->ticket_key.data);
+	}
       /* lock MHD_gnutls_global mutex since it uses reference counting */
       if (0 != pthread_mutex_lock (&MHD_gnutls_init_mutex))
 	{
@@ -2621,20 +5902,95 @@ MHD_stop_daemon (struct MHD_Daemon *daemon)
   pthread_mutex_destroy (&daemon->per_ip_connection_mutex);
   pthread_mutex_destroy (&daemon->cleanup_connection_mutex);
 
-#ifndef HAVE_LISTEN_SHUTDOWN
-  if (daemon->wpipe[1] != -1)
+  free (daemon);
+}
+
+
+/**
+ * Change an option of a running daemon.  Currently, only
+ * MHD_OPTION_THREAD_POOL_SIZE can be changed.
+ *
+ * @param daemon daemon to modify
+ * @param option option to set
+ * @param ... arguments to the option, depending on the option type
+ * @return MHD_YES on success, MHD_NO if setting the option failed
+ *         (or if the option cannot be changed at runtime)
+ */
+int
+MHD_set_daemon_option (struct MHD_Daemon *daemon,
+		       enum MHD_OPTION option,
+		       ...)
+{
+  va_list ap;
+  unsigned int size;
+
+  switch (option)
     {
-      char c;
+    case MHD_OPTION_THREAD_POOL_SIZE:
+      va_start (ap, option);
+      size = va_arg (ap, unsigned int);
+      va_end (ap);
+      return resize_worker_pool (daemon, size);
+    default:
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon,
+		"Option %d cannot be changed while the daemon is running\n",
+		(int) option);
+#endif
+      return MHD_NO;
+    }
+}
+
 
-      /* just to be sure, remove the one char we 
-	 wrote into the pipe */
-      (void) READ (daemon->wpipe[0], &c, 1);
-      CLOSE (daemon->wpipe[0]);
-      CLOSE (daemon->wpipe[1]);
+/**
+ * Sum up the counters of the worker processes of a daemon into
+ * its 'process_statistics'.
+ *
+ * @param daemon daemon with MHD_OPTION_PROCESS_POOL_SIZE
+ */
+static void
+collect_process_statistics (struct MHD_Daemon *daemon)
+{
+  struct MHD_ProcessStatistics *stats = &daemon->process_statistics;
+  struct MHD_ProcessCounters *counters;
+  unsigned int i;
+
+  memset (stats, 0, sizeof (struct MHD_ProcessStatistics));
+  MHD_ip_count_lock (daemon);
+  stats->restarts = daemon->process_restarts;
+  for (i = 0; i < daemon->process_pool_size; i++)
+    {
+      if (-1 != daemon->processes[i].pid)
+	stats->processes++;
+      counters = &daemon->process_counters[i];
+      stats->current_connections += counters->current_connections;
+      stats->connections += counters->connections;
+      stats->requests += counters->requests;
+      stats->bytes_received += counters->bytes_received;
+      stats->bytes_sent += counters->bytes_sent;
     }
-#endif
+  MHD_ip_count_unlock (daemon);
+}
 
-  free (daemon);
+
+/**
+ * Copy the counters of the handshake pool of a daemon into its
+ * 'handshake_statistics'.
+ *
+ * @param daemon daemon with MHD_OPTION_HTTPS_HANDSHAKE_POOL_SIZE
+ */
+static void
+collect_handshake_statistics (struct MHD_Daemon *daemon)
+{
+  struct MHD_HandshakeStatistics *stats = &daemon->handshake_statistics;
+  struct MHD_HandlerPool *pool = daemon->handshake_pool;
+
+  pthread_mutex_lock (&pool->mutex);
+  stats->queued = pool->queued;
+  stats->steps = pool->calls;
+  stats->queue_time = pool->queue_time;
+  stats->max_queue_time = pool->max_queue_time;
+  pthread_mutex_unlock (&pool->mutex);
 }
 
 
@@ -2652,10 +6008,39 @@ const union MHD_DaemonInfo *
 MHD_get_daemon_info (struct MHD_Daemon *daemon,
                      enum MHD_DaemonInfoType infoType, ...)
 {
+  va_list ap;
+  unsigned int worker;
+
   switch (infoType)
     {
     case MHD_DAEMON_INFO_LISTEN_FD:
       return (const union MHD_DaemonInfo *) &daemon->socket_fd;
+    case MHD_DAEMON_INFO_CURRENT_CONNECTIONS:
+      return (const union MHD_DaemonInfo *) &daemon->total_connections;
+    case MHD_DAEMON_INFO_WORKER_CONNECTIONS:
+      va_start (ap, infoType);
+      worker = va_arg (ap, unsigned int);
+      va_end (ap);
+      /* the pool may be resized by another thread */
+      MHD_ip_count_lock (daemon);
+      if (worker >= daemon->worker_pool_size)
+	{
+	  MHD_ip_count_unlock (daemon);
+	  return NULL;
+	}
+      daemon->worker_connections = daemon->worker_pool[worker]->connections;
+      MHD_ip_count_unlock (daemon);
+      return (const union MHD_DaemonInfo *) &daemon->worker_connections;
+    case MHD_DAEMON_INFO_PROCESS_STATISTICS:
+      if (NULL == daemon->process_counters)
+	return NULL;
+      collect_process_statistics (daemon);
+      return (const union MHD_DaemonInfo *) &daemon->process_statistics;
+    case MHD_DAEMON_INFO_HANDSHAKE_STATISTICS:
+      if (NULL == daemon->handshake_pool)
+	return NULL;
+      collect_handshake_statistics (daemon);
+      return (const union MHD_DaemonInfo *) &daemon->handshake_statistics;
    default:
       return NULL;
     };
@@ -2733,6 +6118,7 @@ MHD_init ()
 void ATTRIBUTE_DESTRUCTOR 
 MHD_fini ()
 {
+  MHD_response_cache_fini ();
 #if HTTPS_SUPPORT
   gnutls_global_deinit ();
   if (0 != pthread_mutex_destroy(&MHD_gnutls_init_mutex))
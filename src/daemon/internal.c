@@ -78,6 +78,8 @@ MHD_state_to_string (enum MHD_CONNECTION_STATE state)
       return "closed";
     case MHD_TLS_CONNECTION_INIT:
       return "secure connection init";
+    case MHD_CONNECTION_HTTP2:
+      return "http/2";
     default:
       return "unrecognized connection state";
     }
@@ -157,4 +159,115 @@ MHD_http_unescape (void *cls,
   return wpos - val; /* = strlen(val) */
 }
 
+/**
+ * Names of the days of the week for HTTP dates.
+ */
+static const char *const days[] =
+  { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+
+/**
+ * Names of the months for HTTP dates.
+ */
+static const char *const mons[] =
+  { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct",
+    "Nov", "Dec" };
+
+
+/**
+ * Format a time as an HTTP date (RFC 1123 format,
+ * i.e. "Sun, 06 Nov 1994 08:49:37 GMT").
+ *
+ * @param t time to format
+ * @param date where to write the date, with at least
+ *        64 bytes available space
+ */
+void
+MHD_format_http_date (time_t t, char *date)
+{
+  struct tm now;
+
+  gmtime_r (&t, &now);
+  SPRINTF (date,
+           "%3s, %02u %3s %04u %02u:%02u:%02u GMT",
+           days[now.tm_wday % 7],
+           (unsigned int) now.tm_mday,
+           mons[now.tm_mon % 12],
+           (unsigned int) (1900 + now.tm_year),
+	   (unsigned int) now.tm_hour,
+	   (unsigned int) now.tm_min,
+	   (unsigned int) now.tm_sec);
+}
+
+
+/**
+ * Parse an HTTP date in any of the three formats permitted by
+ * RFC 2616, section 3.3.1 (RFC 1123, RFC 850 and asctime).
+ *
+ * @param date the date to parse
+ * @param t set to the time given by 'date'
+ * @return MHD_YES on success, MHD_NO if 'date' is malformed
+ */
+int
+MHD_parse_http_date (const char *date, time_t *t)
+{
+  char mon[4];
+  unsigned int day;
+  unsigned int month;
+  unsigned int year;
+  unsigned int hour;
+  unsigned int min;
+  unsigned int sec;
+  const char *comma;
+  int64_t y;
+  int64_t era;
+  int64_t yoe;
+  int64_t doy;
+  int64_t doe;
+
+  comma = strchr (date, ',');
+  if (comma == NULL)
+    {
+      /* asctime: "Sun Nov  6 08:49:37 1994" */
+      if (6 != sscanf (date, "%*3s %3s %2u %2u:%2u:%2u %4u",
+		       mon, &day, &hour, &min, &sec, &year))
+	return MHD_NO;
+    }
+  else if (NULL != strchr (comma, '-'))
+    {
+      /* RFC 850: "Sunday, 06-Nov-94 08:49:37 GMT" */
+      if (6 != sscanf (&comma[1], " %2u-%3s-%4u %2u:%2u:%2u GMT",
+		       &day, mon, &year, &hour, &min, &sec))
+	return MHD_NO;
+      if (year < 70)
+	year += 2000;
+      else if (year < 100)
+	year += 1900;
+    }
+  else
+    {
+      /* RFC 1123: "Sun, 06 Nov 1994 08:49:37 GMT" */
+      if (6 != sscanf (&comma[1], " %2u %3s %4u %2u:%2u:%2u GMT",
+		       &day, mon, &year, &hour, &min, &sec))
+	return MHD_NO;
+    }
+  for (month = 0; month < 12; month++)
+    if (0 == strcasecmp (mon, mons[month]))
+      break;
+  if ( (month == 12) ||
+       (day < 1) || (day > 31) ||
+       (hour > 23) || (min > 59) || (sec > 60) ||
+       (year < 1970) )
+    return MHD_NO;
+  /* days since the epoch for the proleptic Gregorian calendar */
+  month++;
+  y = (month <= 2) ? year - 1 : year;
+  era = y / 400;
+  yoe = y - era * 400;
+  doy = (153 * ((month > 2) ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  *t = (time_t) ((era * 146097 + doe - 719468) * 86400 
+		 + hour * 3600 + min * 60 + sec);
+  return MHD_YES;
+}
+
 /* end of internal.c */
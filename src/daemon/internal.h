@@ -49,6 +49,44 @@
  */
 #define MHD_BUF_INC_SIZE 2048
 
+/**
+ * Can we transmit large buffers using 'MSG_ZEROCOPY'?
+ */
+#if HAVE_DECL_MSG_ZEROCOPY && HAVE_DECL_SO_ZEROCOPY && HAVE_LINUX_ERRQUEUE_H
+#define HAVE_ZEROCOPY 1
+#endif
+
+/**
+ * Can we hand the record encryption of TLS connections to the
+ * kernel ('MHD_USE_KTLS')?
+ */
+#if HTTPS_SUPPORT && HAVE_LINUX_TLS_H && HAVE_DECL_TCP_ULP && HAVE_GNUTLS_RECORD_GET_STATE
+#define HAVE_KTLS 1
+#endif
+
+/**
+ * Does gnutls encrypt what MHD sends on connection 'c'?  This is
+ * the case for all TLS connections except those where the kernel
+ * took over the encryption; those can use sendfile and splice.
+ */
+#if HAVE_KTLS
+#define MHD_TLS_IN_USERSPACE(c) \
+  ( (0 != ((c)->daemon->options & MHD_USE_SSL)) && (MHD_YES != (c)->ktls) )
+#else
+#define MHD_TLS_IN_USERSPACE(c) \
+  (0 != ((c)->daemon->options & MHD_USE_SSL))
+#endif
+
+/**
+ * Does gnutls hold decrypted data of connection 'c' that we have
+ * not read yet (which the socket will not signal)?
+ */
+#if HTTPS_SUPPORT
+#define MHD_TLS_READ_READY(c) (MHD_YES == (c)->tls_read_ready)
+#else
+#define MHD_TLS_READ_READY(c) 0
+#endif
+
 /**
  * Handler for fatal errors.
  */
@@ -96,6 +134,13 @@ struct MHD_Pollfd
    * Which events do we care about for this socket?
    */
   enum MHD_PollActions events;
+
+  /**
+   * Descriptor the response body is read from while the response
+   * is not ready (pipe responses), -1 if none.  Becoming readable
+   * means the connection should try again.
+   */
+  int source_fd;
 };
 
 
@@ -151,6 +196,25 @@ size_t MHD_http_unescape (void *cls,
 			  struct MHD_Connection *connection,
 			  char *val);
 
+/**
+ * Format a time as an HTTP date (RFC 1123 format).
+ *
+ * @param t time to format
+ * @param date where to write the date, with at least
+ *        64 bytes available space
+ */
+void MHD_format_http_date (time_t t, char *date);
+
+/**
+ * Parse an HTTP date in any of the formats permitted
+ * by RFC 2616, section 3.3.1.
+ *
+ * @param date the date to parse
+ * @param t set to the time given by 'date'
+ * @return MHD_YES on success, MHD_NO if 'date' is malformed
+ */
+int MHD_parse_http_date (const char *date, time_t *t);
+
 /**
  * Header or cookie in HTTP request or response.
  */
@@ -239,6 +303,36 @@ struct MHD_Response
    */
   off_t fd_off;
 
+  /**
+   * 'ETag' header that MHD generated for a file descriptor
+   * response, NULL if there is none (or the application replaced
+   * it).  Set only while the response is created.
+   */
+  struct MHD_HTTP_Header *generated_etag;
+
+  /**
+   * 'Last-Modified' header that MHD generated for a file
+   * descriptor response, NULL if there is none (or the application
+   * replaced it).
+   */
+  struct MHD_HTTP_Header *generated_last_modified;
+
+  /**
+   * Segments of the body if this response was created
+   * with 'MHD_create_response_from_iovec', otherwise NULL.
+   */
+  struct MHD_IoVec *data_iov;
+
+  /**
+   * Function to call once 'data_iov' is no longer needed.
+   */
+  MHD_ContentReaderFreeCallback data_iov_free;
+
+  /**
+   * Closure for 'data_iov_free'.
+   */
+  void *data_iov_free_cls;
+
   /**
    * Size of data.
    */
@@ -255,11 +349,57 @@ struct MHD_Response
    */
   unsigned int reference_count;
 
+  /**
+   * Number of bytes currently buffered in 'splice_pipe'.
+   */
+  size_t splice_buffered;
+
+  /**
+   * Area at the end of the response allocation from which
+   * header and footer entries are carved; entries that do
+   * not fit are allocated individually.
+   */
+  char *header_arena;
+
+  /**
+   * Size of 'header_arena'.
+   */
+  size_t header_arena_size;
+
+  /**
+   * Number of bytes of 'header_arena' in use.
+   */
+  size_t header_arena_pos;
+
+  /**
+   * Total size of the allocation holding this response
+   * (used to decide if it can be recycled).
+   */
+  size_t alloc_size;
+
+  /**
+   * Number of entries in 'data_iov'.
+   */
+  unsigned int data_iovcnt;
+
   /**
    * File-descriptor if this response is FD-backed.
    */
   int fd;
 
+  /**
+   * Pipe or socket the body is read from if this response was
+   * created with 'MHD_create_response_from_pipe', otherwise -1.
+   */
+  int pipe_fd;
+
+  /**
+   * Pipe used to move data from 'pipe_fd' to the client's socket
+   * with 'splice' (without copying it to user space); -1 if
+   * 'splice' is not available.
+   */
+  int splice_pipe[2];
+
 };
 
 /**
@@ -397,7 +537,13 @@ enum MHD_CONNECTION_STATE
    * Handshake messages will be processed in this state & while
    * in the 'MHD_TLS_HELLO_REQUEST' state
    */
-  MHD_TLS_CONNECTION_INIT = MHD_CONNECTION_CLOSED + 1
+  MHD_TLS_CONNECTION_INIT = MHD_CONNECTION_CLOSED + 1,
+
+  /**
+   * The client sent the HTTP/2 connection preface; the connection
+   * is processed by the HTTP/2 framing layer from now on.
+   */
+  MHD_CONNECTION_HTTP2 = MHD_TLS_CONNECTION_INIT + 1
 
 };
 
@@ -437,6 +583,21 @@ typedef ssize_t (*TransmitCallback) (struct MHD_Connection * conn,
                                      const void *write_to, size_t max_bytes);
 
 
+/**
+ * Function the handler pool runs on behalf of the event loop
+ * (calls into the application's access handler, or steps of the
+ * TLS handshake for the handshake pool).
+ *
+ * @param connection the connection to run it for
+ */
+typedef void (*OffloadCallback) (struct MHD_Connection *connection);
+
+/**
+ * State of a connection that speaks HTTP/2 (see connection_http2.c).
+ */
+struct MHD_Http2Session;
+
+
 /**
  * State kept for each HTTP request.
  */
@@ -595,6 +756,32 @@ struct MHD_Connection
    */
   uint64_t response_write_position;
 
+  /**
+   * Number of bytes of the current chunk that still have to be
+   * spliced from the pipe of the response (chunked pipe responses).
+   */
+  size_t splice_left;
+
+  /**
+   * Response whose buffer is still used by the kernel for
+   * 'MSG_ZEROCOPY' transmissions that have not yet completed.
+   * We hold a reference to it until the last completion is
+   * received; NULL if there is none.
+   */
+  struct MHD_Response *zerocopy_response;
+
+  /**
+   * Number of 'MSG_ZEROCOPY' transmissions on this socket for
+   * which the kernel has not yet reported completion.
+   */
+  unsigned int zerocopy_pending;
+
+  /**
+   * Did we enable 'SO_ZEROCOPY' on the socket?  0 if we did
+   * not try yet, 1 if it is enabled, -1 if it failed.
+   */
+  int zerocopy_state;
+
   /**
    * Position in the 100 CONTINUE message that
    * we need to send when receiving http 1.1 requests.
@@ -646,6 +833,71 @@ struct MHD_Connection
    */
   int thread_joined;
 
+  /**
+   * Set to MHD_YES once a cached thread (see
+   * MHD_OPTION_THREAD_CACHE_SIZE) is done with the connection.
+   * Protected by the daemon's 'cleanup_connection_mutex'.
+   */
+  int thread_done;
+
+  /**
+   * Is the connection suspended (MHD_YES)?  Unless a thread per
+   * connection is used, it is then not in the list of active
+   * connections of the daemon.
+   */
+  int suspended;
+
+  /**
+   * Was the connection resumed (MHD_YES) and should be
+   * moved back to the active connections by the event loop?
+   * Reset once the request completes.
+   */
+  int resuming;
+
+  /**
+   * Channel used to wake up the thread of a suspended connection
+   * when it is resumed (thread-per-connection mode with
+   * MHD_USE_SUSPEND_RESUME only; created when the thread of the
+   * connection starts).  -1 if not used.
+   */
+  int itc[2];
+
+  /**
+   * Next connection in the job queue of the handler pool.
+   */
+  struct MHD_Connection *offload_next;
+
+  /**
+   * Function the handler pool is to run for this connection.
+   */
+  OffloadCallback offload_call;
+
+  /**
+   * When the connection was queued with the handler pool (in
+   * microseconds).
+   */
+  unsigned MHD_LONG_LONG offload_time;
+
+  /**
+   * MHD_YES while the connection is with the handler pool (it is
+   * then also suspended).  Protected by the daemon's
+   * 'cleanup_connection_mutex'.
+   */
+  int offloaded;
+
+  /**
+   * MHD_YES if the handler pool ran 'offload_call' and the event
+   * loop has yet to continue processing the connection.
+   */
+  int offload_done;
+
+  /**
+   * MHD_YES if the application suspended the connection from a
+   * handler running in the handler pool; it then stays suspended
+   * after the handler returns.
+   */
+  int suspend_in_pool;
+
   /**
    * State in the FSM for this connection.
    */
@@ -704,6 +956,24 @@ struct MHD_Connection
    */
   int (*idle_handler) (struct MHD_Connection * connection);
 
+  /**
+   * HTTP/2 state of the connection, NULL while it speaks HTTP/1.x.
+   */
+  struct MHD_Http2Session *http2;
+
+  /**
+   * For the connections MHD passes to the application for the
+   * streams of an HTTP/2 connection: the connection the stream
+   * belongs to.  NULL for all other connections.
+   */
+  struct MHD_Connection *http2_parent;
+
+  /**
+   * MHD_YES until we know the connection does not start with the
+   * HTTP/2 connection preface (only if 'MHD_USE_HTTP2' is set).
+   */
+  int http2_allowed;
+
   /**
    * Function used for reading HTTP request stream.
    */
@@ -730,6 +1000,70 @@ struct MHD_Connection
    */
   int cipher;
 
+  /**
+   * Virtual host whose credentials the TLS session uses (see
+   * 'MHD_OPTION_HTTPS_HOST_CERT_CALLBACK'), NULL for the default.
+   */
+  struct MHD_TlsHost *tls_host;
+
+  /**
+   * MHD_YES if the kernel encrypts the records we send on this
+   * connection (see 'MHD_USE_KTLS'); we then write plaintext to
+   * the socket (and can use sendfile/splice) while gnutls only
+   * decrypts what we receive.
+   */
+  int ktls;
+
+  /**
+   * Number of bytes of the current burst handed to gnutls; the
+   * start of a burst (a response, or data after the connection was
+   * idle) goes out in small TLS records.
+   */
+  uint64_t tls_burst;
+
+  /**
+   * Last time we handed data to gnutls.
+   */
+  time_t tls_last_send;
+
+  /**
+   * MHD_YES while gnutls is corked, holding back small writes to
+   * send them in a single record with the data that follows.
+   */
+  int tls_corked;
+
+  /**
+   * MHD_YES if gnutls could only partially write the last record we
+   * passed to it directly; it has to be completed before we may
+   * cork again.
+   */
+  int tls_send_pending;
+
+  /**
+   * Next connection in the list of connections gnutls holds
+   * decrypted data for (see 'tls_read_ready').
+   */
+  struct MHD_Connection *nextX;
+
+  /**
+   * Previous connection in the list of connections gnutls holds
+   * decrypted data for.
+   */
+  struct MHD_Connection *prevX;
+
+  /**
+   * MHD_YES if gnutls holds decrypted data of this connection that
+   * we have not read yet.  The socket does not signal such data, so
+   * the connection must be read from without waiting for it.
+   */
+  int tls_read_ready;
+
+  /**
+   * MHD_YES while the connection is in the daemon's list of
+   * connections gnutls holds decrypted data for.
+   */
+  int tls_read_listed;
+
 #endif
 };
 
@@ -755,6 +1089,184 @@ typedef size_t (*UnescapeCallback)(void *cls,
 				   struct MHD_Connection *conn,
 				   char *uri);
 
+/**
+ * A thread that handles connections one after the other in
+ * thread-per-connection mode (see MHD_OPTION_THREAD_CACHE_SIZE).
+ */
+struct MHD_CachedThread
+{
+
+  /**
+   * This is a doubly-linked list (idle or terminated threads).
+   */
+  struct MHD_CachedThread *next;
+
+  /**
+   * This is a doubly-linked list (idle or terminated threads).
+   */
+  struct MHD_CachedThread *prev;
+
+  /**
+   * Daemon the thread belongs to.
+   */
+  struct MHD_Daemon *daemon;
+
+  /**
+   * Connection to handle next, NULL while idle.
+   */
+  struct MHD_Connection *connection;
+
+  /**
+   * Signalled when a connection is assigned to the idle thread.
+   */
+  pthread_cond_t cond;
+
+  /**
+   * The thread.
+   */
+  pthread_t pid;
+
+};
+
+
+/**
+ * Threads running the application's access handler (see
+ * MHD_OPTION_HANDLER_POOL_SIZE) or the TLS handshakes (see
+ * MHD_OPTION_HTTPS_HANDSHAKE_POOL_SIZE) on behalf of the event
+ * loops.  Shared by the master daemon (which owns it) and its
+ * worker daemons.
+ */
+struct MHD_HandlerPool
+{
+
+  /**
+   * Head of the queue of connections waiting for a thread.
+   */
+  struct MHD_Connection *head;
+
+  /**
+   * Tail of the queue of connections waiting for a thread.
+   */
+  struct MHD_Connection *tail;
+
+  /**
+   * The threads of the pool.
+   */
+  pthread_t *threads;
+
+  /**
+   * Protects the queue and 'shutdown'.
+   */
+  pthread_mutex_t mutex;
+
+  /**
+   * Signalled when a job is queued or the pool is shut down.
+   */
+  pthread_cond_t cond;
+
+  /**
+   * Number of entries in 'threads' that are running.
+   */
+  unsigned int num_threads;
+
+  /**
+   * MHD_YES if the threads should terminate.
+   */
+  int shutdown;
+
+  /**
+   * MHD_YES if the event loop invokes the offloaded call again once
+   * the pool ran it (access handler calls, see 'offload_done'),
+   * MHD_NO if it simply continues with the connection (handshake
+   * steps).
+   */
+  int repeat_calls;
+
+  /**
+   * Number of connections in the queue.
+   */
+  unsigned int queued;
+
+  /**
+   * Number of calls run by the pool.
+   */
+  unsigned MHD_LONG_LONG calls;
+
+  /**
+   * Total time (in microseconds) calls waited in the queue.
+   */
+  unsigned MHD_LONG_LONG queue_time;
+
+  /**
+   * Longest time (in microseconds) a call waited in the queue.
+   */
+  unsigned MHD_LONG_LONG max_queue_time;
+
+};
+
+
+/**
+ * Counters of a worker process (see MHD_OPTION_PROCESS_POOL_SIZE).
+ * Kept in memory shared with the parent process; only the worker
+ * process writes them (and the parent once the worker terminated).
+ */
+struct MHD_ProcessCounters
+{
+
+  /**
+   * Number of connections currently open.
+   */
+  volatile unsigned int current_connections;
+
+  /**
+   * Number of connections accepted.
+   */
+  volatile unsigned MHD_LONG_LONG connections;
+
+  /**
+   * Number of requests answered.
+   */
+  volatile unsigned MHD_LONG_LONG requests;
+
+  /**
+   * Number of bytes received from clients.
+   */
+  volatile unsigned MHD_LONG_LONG bytes_received;
+
+  /**
+   * Number of bytes sent to clients.
+   */
+  volatile unsigned MHD_LONG_LONG bytes_sent;
+
+};
+
+
+/**
+ * State the parent process keeps for each of its worker processes.
+ */
+struct MHD_WorkerProcess
+{
+
+  /**
+   * Process ID of the worker, -1 if not running.
+   */
+  pid_t pid;
+
+  /**
+   * Read end of a pipe whose write end only the worker holds; it
+   * becomes readable (end of file) when the worker terminates.
+   * -1 if not running.
+   */
+  int status_fd;
+
+  /**
+   * When the worker was (last) started.
+   */
+  time_t started;
+
+};
+
+
 /**
  * State kept for each MHD daemon.
  */
@@ -781,6 +1293,16 @@ struct MHD_Daemon
    */
   struct MHD_Connection *connections_tail;
 
+  /**
+   * Head of doubly-linked list of suspended connections.
+   */
+  struct MHD_Connection *suspended_connections_head;
+
+  /**
+   * Tail of doubly-linked list of suspended connections.
+   */
+  struct MHD_Connection *suspended_connections_tail;
+
   /**
    * Tail of doubly-linked list of connections to clean up.
    */
@@ -791,6 +1313,18 @@ struct MHD_Daemon
    */
   struct MHD_Connection *cleanup_tail;
 
+  /**
+   * Head of doubly-linked list of closed connections whose socket
+   * is kept open until the kernel reports the completion of their
+   * 'MSG_ZEROCOPY' transmissions.
+   */
+  struct MHD_Connection *linger_head;
+
+  /**
+   * Tail of doubly-linked list of lingering connections.
+   */
+  struct MHD_Connection *linger_tail;
+
   /**
    * Function to call to check if we should
    * accept or reject an incoming request.
@@ -857,9 +1391,12 @@ struct MHD_Daemon
   struct MHD_Daemon *master;
 
   /**
-   * Worker daemons (one per thread)
+   * Worker daemons (one per thread).  Each worker is allocated
+   * separately so that the array can be resized while connections
+   * refer to their worker.  Modified under the master's
+   * 'per_ip_connection_mutex'.
    */
-  struct MHD_Daemon *worker_pool;
+  struct MHD_Daemon **worker_pool;
 
   /**
    * Table storing number of connections per IP
@@ -877,17 +1414,208 @@ struct MHD_Daemon
   size_t thread_stack_size;
 
   /**
-   * Number of worker daemons
+   * Responses of at least this size are transmitted using
+   * 'MSG_ZEROCOPY' (0 to always copy).
+   */
+  size_t zerocopy_threshold;
+
+  /**
+   * Threads running the access handler (NULL if the event loops
+   * call it directly).
+   */
+  struct MHD_HandlerPool *handler_pool;
+
+  /**
+   * Threads running the TLS handshakes (NULL if the event loops
+   * run them).
+   */
+  struct MHD_HandlerPool *handshake_pool;
+
+  /**
+   * Number of worker daemons (including workers that are
+   * draining)
    */
   unsigned int worker_pool_size;
 
+  /**
+   * Set to MHD_YES when this worker was retired by shrinking the
+   * thread pool: it no longer accepts connections and its thread
+   * exits once the remaining connections are done.
+   */
+  int draining;
+
+  /**
+   * Set by a draining worker (under the master's
+   * 'per_ip_connection_mutex') right before its thread exits.
+   */
+  int drained;
+
+  /**
+   * CPUs to bind the threads of the pool to
+   * (MHD_OPTION_THREAD_POOL_CPU_AFFINITY), NULL for none.
+   */
+  const unsigned int *cpu_affinity;
+
+  /**
+   * Number of entries in 'cpu_affinity'.
+   */
+  unsigned int cpu_affinity_size;
+
+  /**
+   * CPU the thread of this daemon binds itself to, -1 for none.
+   */
+  int cpu;
+
+  /**
+   * Interval (in ms) at which the workers of the thread pool
+   * rebalance their connections, 0 for never.
+   */
+  unsigned int rebalance_interval;
+
+  /**
+   * Load of this worker (in permille of the time it was not waiting
+   * for events) during the last rebalancing interval.  Protected by
+   * the master's 'per_ip_connection_mutex'.
+   */
+  unsigned int load;
+
+  /**
+   * Start of the current load measurement (in microseconds).
+   */
+  unsigned MHD_LONG_LONG load_start;
+
+  /**
+   * Time (in microseconds) this worker spent waiting for events
+   * since 'load_start'.
+   */
+  unsigned MHD_LONG_LONG idle_time;
+
+  /**
+   * Number of worker processes (MHD_OPTION_PROCESS_POOL_SIZE),
+   * 0 for none.
+   */
+  unsigned int process_pool_size;
+
+  /**
+   * State of the worker processes (only in the parent process).
+   * Protected by 'per_ip_connection_mutex'.
+   */
+  struct MHD_WorkerProcess *processes;
+
+  /**
+   * Counters of all worker processes, in memory shared by the
+   * parent and the workers ('process_pool_size' entries).
+   */
+  struct MHD_ProcessCounters *process_counters;
+
+  /**
+   * Counters of this worker process, NULL if this is not a
+   * worker process.
+   */
+  struct MHD_ProcessCounters *counters;
+
+  /**
+   * Pipe to the worker processes.  The parent holds the write end;
+   * the workers watch the read end and exit when it is closed.
+   */
+  int process_pipe[2];
+
+  /**
+   * Number of times a worker process was restarted.  Protected by
+   * 'per_ip_connection_mutex'.
+   */
+  unsigned int process_restarts;
+
+  /**
+   * Result of the last MHD_DAEMON_INFO_PROCESS_STATISTICS query.
+   */
+  struct MHD_ProcessStatistics process_statistics;
+
+  /**
+   * Result of the last MHD_DAEMON_INFO_WORKER_CONNECTIONS query
+   * (copied, as the worker may be retired right afterwards).
+   */
+  unsigned int worker_connections;
+
+  /**
+   * Result of the last MHD_DAEMON_INFO_HANDSHAKE_STATISTICS query.
+   */
+  struct MHD_HandshakeStatistics handshake_statistics;
+
+  /**
+   * Head of the connections handed over to this worker by another
+   * worker of the pool, to be added to its connections by its own
+   * thread.  Protected by the master's 'per_ip_connection_mutex'.
+   */
+  struct MHD_Connection *handoff_head;
+
+  /**
+   * Tail of the connections handed over to this worker.
+   */
+  struct MHD_Connection *handoff_tail;
+
+  /**
+   * Number of threads in the handler pool.
+   */
+  unsigned int handler_pool_size;
+
+  /**
+   * Number of threads in the handshake pool.
+   */
+  unsigned int handshake_pool_size;
+
+  /**
+   * Maximum number of idle threads kept for new connections in
+   * thread-per-connection mode (0 to create a thread per
+   * connection).
+   */
+  unsigned int thread_cache_size;
+
+  /**
+   * After how many seconds an idle cached thread terminates.
+   */
+  unsigned int thread_cache_timeout;
+
+  /**
+   * Number of idle threads in the thread cache.
+   */
+  unsigned int idle_threads;
+
+  /**
+   * Number of cached threads that have not terminated yet.
+   */
+  unsigned int live_threads;
+
+  /**
+   * Head of the DLL of idle cached threads.
+   */
+  struct MHD_CachedThread *idle_threads_head;
+
+  /**
+   * Tail of the DLL of idle cached threads.
+   */
+  struct MHD_CachedThread *idle_threads_tail;
+
+  /**
+   * Head of the DLL of terminated cached threads that still need to
+   * be joined.
+   */
+  struct MHD_CachedThread *dead_threads_head;
+
+  /**
+   * Tail of the DLL of terminated cached threads that still need to
+   * be joined.
+   */
+  struct MHD_CachedThread *dead_threads_tail;
+
   /**
    * PID of the select thread (if we have internal select)
    */
   pthread_t pid;
 
   /**
-   * Mutex for per-IP connection counts.
+   * Mutex for per-IP connection counts and the global
+   * connection count.
    */
   pthread_mutex_t per_ip_connection_mutex;
 
@@ -896,17 +1624,43 @@ struct MHD_Daemon
    */
   pthread_mutex_t cleanup_connection_mutex;
 
+  /**
+   * Signalled (with 'cleanup_connection_mutex') when a cached thread
+   * is done with a connection.
+   */
+  pthread_cond_t thread_done_cond;
+
+  /**
+   * Protects the lists and counters of the thread cache.
+   */
+  pthread_mutex_t thread_cache_mutex;
+
+  /**
+   * Signalled (with 'thread_cache_mutex') when a cached thread
+   * terminates.
+   */
+  pthread_cond_t thread_cache_cond;
+
   /**
    * Listen socket.
    */
   int socket_fd;
 
-#ifndef HAVE_LISTEN_SHUTDOWN
   /**
-   * Pipe we use to signal shutdown.
+   * Inter-thread communication channel used to wake up the event
+   * loop: on shutdown, when a connection is resumed or added by
+   * another thread and on MHD_wakeup_daemon (-1 for the master of
+   * a thread pool, whose workers have their own).  An eventfd
+   * (then both entries are the same) or a pipe.
    */
-  int wpipe[2];
-#endif
+  int itc[2];
+
+  /**
+   * Set to MHD_YES if a connection was resumed and the event loop
+   * must move it back to the active connections.  Protected by
+   * 'cleanup_connection_mutex'.
+   */
+  int resuming;
 
   /**
    * Are we shutting down?
@@ -914,10 +1668,25 @@ struct MHD_Daemon
   int shutdown;
 
   /**
-   * Limit on the number of parallel connections.
+   * Limit on the number of parallel connections.  Only the
+   * master's value is used; worker daemons share it.
    */
   unsigned int max_connections;
 
+  /**
+   * Number of connections currently handled by this worker daemon
+   * (unused in the master).  Protected by the master's
+   * 'per_ip_connection_mutex'.
+   */
+  unsigned int connections;
+
+  /**
+   * Number of connections currently handled by the master and all
+   * of its workers (only used in the master).  Protected by
+   * 'per_ip_connection_mutex'.
+   */
+  unsigned int total_connections;
+
   /**
    * After how many seconds of inactivity should
    * connections time out?  Zero for no timeout.
@@ -977,6 +1746,88 @@ struct MHD_Daemon
    */
   const char *https_mem_trust;
 
+  /**
+   * Keys and certificates of virtual hosts given with
+   * MHD_OPTION_HTTPS_MEM_HOST_CERTS, NULL if none.
+   */
+  const struct MHD_HttpsHostCert *https_mem_host_certs;
+
+  /**
+   * Function to look up the keys and certificates of virtual hosts
+   * (MHD_OPTION_HTTPS_HOST_CERT_CALLBACK), NULL if none.
+   */
+  MHD_HttpsHostCertCallback host_cert_callback;
+
+  /**
+   * Closure for 'host_cert_callback'.
+   */
+  void *host_cert_callback_cls;
+
+  /**
+   * Credentials of the virtual hosts (shared by the workers of a
+   * thread pool, owned by the master), NULL if the daemon has none.
+   */
+  struct MHD_TlsHostCerts *host_certs;
+
+  /**
+   * Cache of TLS sessions for resumption (shared by the workers of
+   * a thread pool, owned by the master), NULL if disabled.
+   */
+  struct MHD_TlsSessionCache *session_cache;
+
+  /**
+   * Maximum number of sessions in 'session_cache'
+   * (MHD_OPTION_HTTPS_SESSION_CACHE_SIZE).
+   */
+  unsigned int session_cache_size;
+
+  /**
+   * Number of seconds for which TLS sessions can be resumed.
+   */
+  unsigned int session_timeout;
+
+  /**
+   * Size of the TLS records we send during bulk transfers
+   * (MHD_OPTION_HTTPS_RECORD_SIZE), 0 to send each write as it is.
+   */
+  size_t tls_record_size;
+
+  /**
+   * Head of the list of connections gnutls holds decrypted data for;
+   * the event loop reads from these without waiting for the socket.
+   * Only used by the thread running the event loop.
+   */
+  struct MHD_Connection *tls_read_ready_head;
+
+  /**
+   * Tail of the list of connections gnutls holds decrypted data for.
+   */
+  struct MHD_Connection *tls_read_ready_tail;
+
+  /**
+   * Session store of the application ('store' is NULL if none
+   * was given).
+   */
+  struct MHD_TlsSessionStore session_store;
+
+  /**
+   * Key for session tickets given by the application
+   * (MHD_OPTION_HTTPS_SESSION_TICKET_KEY), NULL if none.
+   */
+  const void *https_mem_ticket_key;
+
+  /**
+   * Number of bytes in 'https_mem_ticket_key'.
+   */
+  size_t https_mem_ticket_key_size;
+
+  /**
+   * Master key for session tickets (shared by the workers of a
+   * thread pool, owned by the master); a copy of
+   * 'https_mem_ticket_key' or a random key.
+   */
+  gnutls_datum_t ticket_key;
+
 #endif
 
 #ifdef DAUTH_SUPPORT
@@ -1011,6 +1862,66 @@ struct MHD_Daemon
 };
 
 
+/**
+ * Run a call into the application's access handler for a
+ * connection.  Without a handler pool, 'call' is run right away.
+ * Otherwise the connection is suspended and handed to the pool the
+ * first time; once the pool has run 'call', the next invocation for
+ * the connection returns MHD_YES without running it again.
+ *
+ * @param connection connection to run the call for
+ * @param call function calling the access handler
+ * @return MHD_YES if 'call' has been run, MHD_NO if the connection
+ *         was handed to the handler pool
+ */
+int
+MHD_connection_offload_ (struct MHD_Connection *connection,
+			 OffloadCallback call);
+
+
+#if HTTPS_SUPPORT
+/**
+ * Hand the next step of the TLS handshake of a connection to the
+ * handshake pool (if the daemon has one).  The connection is
+ * suspended until the pool ran 'call'.
+ *
+ * @param connection connection to run the step for
+ * @param call function running the step
+ * @return MHD_YES if the connection was handed to the handshake
+ *         pool, MHD_NO if the caller should run 'call' itself
+ */
+int
+MHD_connection_offload_handshake_ (struct MHD_Connection *connection,
+				   OffloadCallback call);
+
+
+/**
+ * Send the data gnutls holds back to fill the current TLS record of
+ * a connection (see MHD_OPTION_HTTPS_RECORD_SIZE).  Called whenever
+ * the connection stops writing for now, so that nothing batched is
+ * left behind.
+ *
+ * @param connection connection to flush
+ * @return MHD_YES if nothing is left to send, MHD_NO if the socket
+ *         cannot take all of it right now (or the connection failed)
+ */
+int
+MHD_tls_connection_flush_ (struct MHD_Connection *connection);
+
+
+/**
+ * Note whether gnutls holds decrypted data of a connection that we
+ * have not read yet (after reading from it or completing the
+ * handshake).
+ *
+ * @param connection connection to check
+ */
+void
+MHD_tls_connection_update_read_ready_ (struct MHD_Connection *connection);
+#endif
+
+
+
 #if EXTRA_CHECKS
 #define EXTRA_CHECK(a) if (!(a)) abort();
 #else
@@ -1058,4 +1969,44 @@ struct MHD_Daemon
   (element)->prev = NULL; } while (0)
 
 
+/**
+ * Insert an element at the tail of a DLL using the 'nextX' and
+ * 'prevX' fields of the element (for lists an element is in in
+ * addition to one using 'next' and 'prev').
+ *
+ * @param head pointer to the head of the DLL
+ * @param tail pointer to the tail of the DLL
+ * @param element element to insert
+ */
+#define XDLL_insert(head,tail,element) do { \
+  (element)->nextX = NULL; \
+  (element)->prevX = (tail); \
+  if ((head) == NULL) \
+    (head) = element; \
+  else \
+    (tail)->nextX = element; \
+  (tail) = (element); } while (0)
+
+
+/**
+ * Remove an element from a DLL using the 'nextX' and 'prevX'
+ * fields of the element.
+ *
+ * @param head pointer to the head of the DLL
+ * @param tail pointer to the tail of the DLL
+ * @param element element to remove
+ */
+#define XDLL_remove(head,tail,element) do { \
+  if ((element)->prevX == NULL) \
+    (head) = (element)->nextX;  \
+  else \
+    (element)->prevX->nextX = (element)->nextX; \
+  if ((element)->nextX == NULL) \
+    (tail) = (element)->prevX;  \
+  else \
+    (element)->nextX->prevX = (element)->prevX; \
+  (element)->nextX = NULL; \
+  (element)->prevX = NULL; } while (0)
+
+
 #endif
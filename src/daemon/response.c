@@ -29,7 +29,275 @@
 
 
 /**
- * Add a header or footer line to the response.
+ * Size of the area reserved at the end of each response for its
+ * header and footer entries.  Responses with a typical number of
+ * headers thus need no allocations beyond the response itself.
+ */
+#define MHD_RESPONSE_HEADER_ARENA 512
+
+/**
+ * Allocations for responses that fit into this many bytes (including
+ * the header area) are rounded up to it and recycled through a
+ * per-thread cache instead of being returned to 'free'.
+ */
+#define MHD_RESPONSE_CACHE_BLOCK 2048
+
+/**
+ * Maximum number of response allocations cached per thread.
+ */
+#define MHD_RESPONSE_CACHE_SIZE 16
+
+/**
+ * Alignment of header entries within the header area.
+ */
+#define MHD_RESPONSE_ALIGN (2 * sizeof (void *))
+
+
+/**
+ * Per-thread cache of response allocations.
+ */
+struct ResponseCache
+{
+  /**
+   * Cached allocations (each of MHD_RESPONSE_CACHE_BLOCK bytes).
+   */
+  void *blocks[MHD_RESPONSE_CACHE_SIZE];
+
+  /**
+   * Number of valid entries in 'blocks'.
+   */
+  unsigned int count;
+};
+
+
+/**
+ * Key for the per-thread 'struct ResponseCache'.
+ */
+static pthread_key_t cache_key;
+
+/**
+ * Ensures 'cache_key' is created exactly once.
+ */
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+/**
+ * MHD_YES if 'cache_key' was created successfully.
+ */
+static int cache_key_ok;
+
+
+/**
+ * Release the response cache of a terminating thread.
+ *
+ * @param cls the 'struct ResponseCache' of the thread
+ */
+static void
+cache_release (void *cls)
+{
+  struct ResponseCache *cache = cls;
+
+  while (cache->count > 0)
+    free (cache->blocks[--cache->count]);
+  free (cache);
+}
+
+
+/**
+ * Create the key for the per-thread response caches.
+ */
+static void
+cache_key_init ()
+{
+  cache_key_ok = (0 == pthread_key_create (&cache_key, &cache_release))
+    ? MHD_YES : MHD_NO;
+}
+
+
+/**
+ * Get the response cache of the calling thread.
+ *
+ * @param create MHD_YES to create the cache if the thread has none
+ * @return NULL if the thread has no cache (or on error)
+ */
+static struct ResponseCache *
+get_cache (int create)
+{
+  struct ResponseCache *cache;
+
+  pthread_once (&cache_once, &cache_key_init);
+  if (MHD_YES != cache_key_ok)
+    return NULL;
+  cache = pthread_getspecific (cache_key);
+  if ( (cache != NULL) ||
+       (MHD_YES != create) )
+    return cache;
+  cache = malloc (sizeof (struct ResponseCache));
+  if (cache == NULL)
+    return NULL;
+  cache->count = 0;
+  if (0 != pthread_setspecific (cache_key, cache))
+    {
+      free (cache);
+      return NULL;
+    }
+  return cache;
+}
+
+
+/**
+ * Allocate and initialize a response object followed by 'extra'
+ * bytes for the data buffer of the response and the area for its
+ * header entries.  Small responses are taken from the per-thread
+ * cache if possible.
+ *
+ * @param extra number of bytes to reserve after the response for data
+ * @return NULL on error (out of memory)
+ */
+static struct MHD_Response *
+response_alloc (size_t extra)
+{
+  struct MHD_Response *response;
+  struct ResponseCache *cache;
+  size_t size;
+  size_t arena;
+
+  if (extra > SIZE_MAX - sizeof (struct MHD_Response) -
+      MHD_RESPONSE_HEADER_ARENA - MHD_RESPONSE_ALIGN)
+    return NULL;
+  size = sizeof (struct MHD_Response) + extra + MHD_RESPONSE_HEADER_ARENA;
+  response = NULL;
+  if (size <= MHD_RESPONSE_CACHE_BLOCK)
+    {
+      size = MHD_RESPONSE_CACHE_BLOCK;
+      cache = get_cache (MHD_NO);
+      if ( (cache != NULL) &&
+	   (cache->count > 0) )
+	response = cache->blocks[--cache->count];
+    }
+  if (response == NULL)
+    response = malloc (size);
+  if (response == NULL)
+    return NULL;
+  memset (response, 0, sizeof (struct MHD_Response));
+  if (pthread_mutex_init (&response->mutex, NULL) != 0)
+    {
+      free (response);
+      return NULL;
+    }
+  response->fd = -1;
+  response->pipe_fd = -1;
+  response->splice_pipe[0] = -1;
+  response->splice_pipe[1] = -1;
+  response->reference_count = 1;
+  response->alloc_size = size;
+  /* header area follows the data, aligned for the entries */
+  arena = sizeof (struct MHD_Response) + extra;
+  arena = (arena + MHD_RESPONSE_ALIGN - 1) & ~(MHD_RESPONSE_ALIGN - 1);
+  if (arena < size)
+    {
+      response->header_arena = ((char *) response) + arena;
+      response->header_arena_size = size - arena;
+    }
+  return response;
+}
+
+
+/**
+ * Release the response cache of the calling thread and delete the
+ * key for the per-thread caches (called when the library is
+ * unloaded).  Caches of threads that are still running at that
+ * point can no longer be released.
+ */
+void
+MHD_response_cache_fini ()
+{
+  struct ResponseCache *cache;
+
+  if (MHD_YES != cache_key_ok)
+    return;
+  cache = pthread_getspecific (cache_key);
+  if (cache != NULL)
+    {
+      (void) pthread_setspecific (cache_key, NULL);
+      cache_release (cache);
+    }
+  cache_key_ok = MHD_NO;
+  (void) pthread_key_delete (cache_key);
+}
+
+
+/**
+ * Return the memory of a response object that is no longer used
+ * to the per-thread cache (or to 'free').
+ *
+ * @param response response to release
+ */
+static void
+response_release (struct MHD_Response *response)
+{
+  struct ResponseCache *cache;
+
+  pthread_mutex_destroy (&response->mutex);
+  if (response->alloc_size == MHD_RESPONSE_CACHE_BLOCK)
+    {
+      cache = get_cache (MHD_YES);
+      if ( (cache != NULL) &&
+	   (cache->count < MHD_RESPONSE_CACHE_SIZE) )
+	{
+	  cache->blocks[cache->count++] = response;
+	  return;
+	}
+    }
+  free (response);
+}
+
+
+/**
+ * Free a header or footer entry of a response.
+ *
+ * @param response response the entry belongs to
+ * @param hdr entry to free
+ */
+static void
+free_response_entry (struct MHD_Response *response,
+		     struct MHD_HTTP_Header *hdr)
+{
+  char *pos = (char *) hdr;
+
+  /* entries in the header area are released with the response */
+  if ( (pos >= response->header_arena) &&
+       (pos < response->header_arena + response->header_arena_size) )
+    return;
+  free (hdr);
+}
+
+
+/**
+ * Check that a header name or value is not empty and contains
+ * no characters that would break the framing of the response,
+ * determining its length in the same pass.
+ *
+ * @param str string to check
+ * @return length of str, 0 if str is invalid
+ */
+static size_t
+check_header_string (const char *str)
+{
+  size_t len;
+
+  for (len = 0; '\0' != str[len]; len++)
+    if ( ('\t' == str[len]) ||
+	 ('\r' == str[len]) ||
+	 ('\n' == str[len]) )
+      return 0;
+  return len;
+}
+
+
+/**
+ * Add a header or footer line to the response.  The entry, name and
+ * value are stored in one block, taken from the header area of the
+ * response if there is enough room left.
  *
  * @param response response to add a header to
  * @param kind header or footer
@@ -44,34 +312,34 @@ add_response_entry (struct MHD_Response *response,
 		    const char *content)
 {
   struct MHD_HTTP_Header *hdr;
+  size_t hlen;
+  size_t clen;
+  size_t size;
 
   if ((response == NULL) ||
       (header == NULL) ||
       (content == NULL) ||
-      (strlen (header) == 0) ||
-      (strlen (content) == 0) ||
-      (NULL != strstr (header, "\t")) ||
-      (NULL != strstr (header, "\r")) ||
-      (NULL != strstr (header, "\n")) ||
-      (NULL != strstr (content, "\t")) ||
-      (NULL != strstr (content, "\r")) || (NULL != strstr (content, "\n")))
-    return MHD_NO;
-  hdr = malloc (sizeof (struct MHD_HTTP_Header));
-  if (hdr == NULL)
+      (0 == (hlen = check_header_string (header))) ||
+      (0 == (clen = check_header_string (content))))
     return MHD_NO;
-  hdr->header = strdup (header);
-  if (hdr->header == NULL)
+  size = sizeof (struct MHD_HTTP_Header) + hlen + clen + 2;
+  size = (size + MHD_RESPONSE_ALIGN - 1) & ~(MHD_RESPONSE_ALIGN - 1);
+  if (size <= response->header_arena_size - response->header_arena_pos)
     {
-      free (hdr);
-      return MHD_NO;
+      hdr = (struct MHD_HTTP_Header *)
+	&response->header_arena[response->header_arena_pos];
+      response->header_arena_pos += size;
     }
-  hdr->value = strdup (content);
-  if (hdr->value == NULL)
+  else
     {
-      free (hdr->header);
-      free (hdr);
-      return MHD_NO;
+      hdr = malloc (size);
+      if (hdr == NULL)
+	return MHD_NO;
     }
+  hdr->header = (char *) &hdr[1];
+  memcpy (hdr->header, header, hlen + 1);
+  hdr->value = &hdr->header[hlen + 1];
+  memcpy (hdr->value, content, clen + 1);
   hdr->kind = kind;
   hdr->next = response->first_header;
   response->first_header = hdr;
@@ -91,6 +359,25 @@ int
 MHD_add_response_header (struct MHD_Response *response,
                          const char *header, const char *content)
 {
+  struct MHD_HTTP_Header **generated;
+
+  generated = NULL;
+  if ( (response != NULL) &&
+       (header != NULL) )
+    {
+      if (0 == strcasecmp (header, MHD_HTTP_HEADER_ETAG))
+	generated = &response->generated_etag;
+      else if (0 == strcasecmp (header, MHD_HTTP_HEADER_LAST_MODIFIED))
+	generated = &response->generated_last_modified;
+    }
+  /* the application's validators replace the ones we derived
+     from the file */
+  if ( (generated != NULL) &&
+       (*generated != NULL) &&
+       (MHD_YES == MHD_del_response_header (response,
+					    (*generated)->header,
+					    (*generated)->value)) )
+    *generated = NULL;
   return add_response_entry (response,
 			     MHD_HEADER_KIND,
 			     header,
@@ -141,13 +428,15 @@ MHD_del_response_header (struct MHD_Response *response,
       if ((0 == strcmp (header, pos->header)) &&
           (0 == strcmp (content, pos->value)))
         {
-          free (pos->header);
-          free (pos->value);
           if (prev == NULL)
             response->first_header = pos->next;
           else
             prev->next = pos->next;
-          free (pos);
+	  if (pos == response->generated_etag)
+	    response->generated_etag = NULL;
+	  if (pos == response->generated_last_modified)
+	    response->generated_last_modified = NULL;
+          free_response_entry (response, pos);
           return MHD_YES;
         }
       prev = pos;
@@ -235,22 +524,14 @@ MHD_create_response_from_callback (uint64_t size,
 
   if ((crc == NULL) || (block_size == 0))
     return NULL;
-  retVal = malloc (sizeof (struct MHD_Response) + block_size);
+  retVal = response_alloc (block_size);
   if (retVal == NULL)
     return NULL;
-  memset (retVal, 0, sizeof (struct MHD_Response));
-  retVal->fd = -1;
   retVal->data = (void *) &retVal[1];
   retVal->data_buffer_size = block_size;
-  if (pthread_mutex_init (&retVal->mutex, NULL) != 0)
-    {
-      free (retVal);
-      return NULL;
-    }
   retVal->crc = crc;
   retVal->crfc = crfc;
   retVal->crc_cls = crc_cls;
-  retVal->reference_count = 1;
   retVal->total_size = size;
   return retVal;
 }
@@ -297,6 +578,40 @@ free_callback (void *cls)
 }
 
 
+/**
+ * Give a file descriptor response the 'ETag' and 'Last-Modified'
+ * headers derived from 'fstat' (for regular files).  Done while the
+ * response is created, so the headers of a response that may be
+ * queued do not change behind the back of other threads.
+ *
+ * @param response the new response
+ */
+static void
+add_file_validators (struct MHD_Response *response)
+{
+  struct stat sbuf;
+  char buf[128];
+
+  if ( (0 != fstat (response->fd, &sbuf)) ||
+       (! S_ISREG (sbuf.st_mode)) )
+    return;
+  SPRINTF (buf,
+	   "\"%" MHD_LONG_LONG_PRINTF "x-%" MHD_LONG_LONG_PRINTF
+	   "x-%" MHD_LONG_LONG_PRINTF "x-%" MHD_LONG_LONG_PRINTF "x\"",
+	   (unsigned MHD_LONG_LONG) sbuf.st_ino,
+	   (unsigned MHD_LONG_LONG) sbuf.st_mtime,
+	   (unsigned MHD_LONG_LONG) response->fd_off,
+	   (unsigned MHD_LONG_LONG) response->total_size);
+  if (MHD_YES == add_response_entry (response, MHD_HEADER_KIND,
+				     MHD_HTTP_HEADER_ETAG, buf))
+    response->generated_etag = response->first_header;
+  MHD_format_http_date (sbuf.st_mtime, buf);
+  if (MHD_YES == add_response_entry (response, MHD_HEADER_KIND,
+				     MHD_HTTP_HEADER_LAST_MODIFIED, buf))
+    response->generated_last_modified = response->first_header;
+}
+
+
 /**
  * Create a response object.  The response object can be extended with
  * header information and then be used any number of times.
@@ -322,6 +637,7 @@ struct MHD_Response *MHD_create_response_from_fd_at_offset (size_t size,
   ret->fd = fd;
   ret->fd_off = offset;
   ret->crc_cls = ret;
+  add_file_validators (ret);
   return ret;
 }
 
@@ -343,6 +659,154 @@ struct MHD_Response *MHD_create_response_from_fd (size_t size,
 }
 
 
+/**
+ * Read data from the pipe (or socket) of the response.  Used
+ * whenever 'splice' cannot be used (i.e. for HTTPS).
+ *
+ * @param cls pointer to the response
+ * @param pos offset in the body (ignored, the data is a stream)
+ * @param buf where to write the data
+ * @param max number of bytes to write at most
+ * @return number of bytes written, 0 if no data is available yet
+ */
+static ssize_t
+pipe_reader (void *cls, uint64_t pos, char *buf, size_t max)
+{
+  struct MHD_Response *response = cls;
+  ssize_t n;
+
+  do
+    n = read (response->pipe_fd, buf, max);
+  while ((n < 0) && (EINTR == errno));
+  if (n == 0)
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  if ( (n < 0) &&
+       ( (EAGAIN == errno) || (EWOULDBLOCK == errno) ) )
+    return 0; /* no data yet, the connection waits for 'pipe_fd' */
+  if (n < 0)
+    return MHD_CONTENT_READER_END_WITH_ERROR;
+  return n;
+}
+
+
+/**
+ * Destroy pipe reader context.  Closes the pipe (and our
+ * splice pipe).
+ *
+ * @param cls pointer to the response
+ */
+static void
+pipe_free_callback (void *cls)
+{
+  struct MHD_Response *response = cls;
+
+  (void) close (response->pipe_fd);
+  response->pipe_fd = -1;
+  if (response->splice_pipe[0] != -1)
+    {
+      (void) close (response->splice_pipe[0]);
+      (void) close (response->splice_pipe[1]);
+      response->splice_pipe[0] = -1;
+      response->splice_pipe[1] = -1;
+    }
+}
+
+
+#if HAVE_SPLICE
+ssize_t
+MHD_response_fill_splice_pipe (struct MHD_Response *response)
+{
+  ssize_t ret;
+
+  if (response->splice_buffered > 0)
+    return response->splice_buffered;
+  do
+    ret = splice (response->pipe_fd, NULL,
+		  response->splice_pipe[1], NULL,
+		  64 * 1024,
+		  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  while ((ret < 0) && (EINTR == errno));
+  if (ret == 0)
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  if (ret < 0)
+    return ( (EAGAIN == errno) || (EWOULDBLOCK == errno) )
+      ? 0
+      : MHD_CONTENT_READER_END_WITH_ERROR;
+  response->splice_buffered = ret;
+  return ret;
+}
+
+
+ssize_t
+MHD_response_splice_to (struct MHD_Response *response,
+			int fd,
+			size_t max)
+{
+  ssize_t ret;
+
+  if (max > response->splice_buffered)
+    max = response->splice_buffered;
+  if (max == 0)
+    return 0;
+  ret = splice (response->splice_pipe[0], NULL,
+		fd, NULL,
+		max,
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (ret > 0)
+    response->splice_buffered -= ret;
+  return ret;
+}
+#endif
+
+
+/**
+ * Create a response object that streams data from a pipe or socket
+ * until the other side closes it.  The size of the body is unknown,
+ * so HTTP/1.1 clients receive it with chunked encoding.  Where
+ * possible, MHD moves the data to the client with 'splice' without
+ * copying it through user space; for HTTPS it falls back to 'read'.
+ * The response can be queued only once.
+ *
+ * @param fd pipe or socket to read the body from; will be closed
+ *        when response is destroyed; MHD puts fd into non-blocking
+ *        mode and waits for it to become readable together with
+ *        the client's socket
+ * @return NULL on error (i.e. invalid arguments, out of memory)
+ */
+struct MHD_Response *
+MHD_create_response_from_pipe (int fd)
+{
+  struct MHD_Response *ret;
+  int flags;
+
+  if (fd == -1)
+    return NULL;
+  flags = fcntl (fd, F_GETFL);
+  if ( (flags == -1) ||
+       ( (0 == (flags & O_NONBLOCK)) &&
+	 (0 != fcntl (fd, F_SETFL, flags | O_NONBLOCK)) ) )
+    return NULL;
+  ret = MHD_create_response_from_callback (MHD_SIZE_UNKNOWN,
+					   4 * 1024,
+					   &pipe_reader,
+					   NULL,
+					   &pipe_free_callback);
+  if (ret == NULL)
+    return NULL;
+  ret->pipe_fd = fd;
+  ret->crc_cls = ret;
+#if HAVE_SPLICE
+  if (0 != pipe (ret->splice_pipe))
+    {
+      /* not fatal, we just cannot use splice */
+      ret->splice_pipe[0] = -1;
+      ret->splice_pipe[1] = -1;
+    }
+#endif
+  return ret;
+}
+
+
 /**
  * Create a response object.  The response object can be extended with
  * header information and then be used any number of times.
@@ -361,37 +825,22 @@ MHD_create_response_from_data (size_t size,
                                void *data, int must_free, int must_copy)
 {
   struct MHD_Response *retVal;
-  void *tmp;
 
   if ((data == NULL) && (size > 0))
     return NULL;
-  retVal = malloc (sizeof (struct MHD_Response));
+  /* copies are kept in the same allocation as the response */
+  retVal = response_alloc (must_copy ? size : 0);
   if (retVal == NULL)
     return NULL;
-  memset (retVal, 0, sizeof (struct MHD_Response));
-  retVal->fd = -1;
-  if (pthread_mutex_init (&retVal->mutex, NULL) != 0)
-    {
-      free (retVal);
-      return NULL;
-    }
   if ((must_copy) && (size > 0))
     {
-      tmp = malloc (size);
-      if (tmp == NULL)
-        {
-	  pthread_mutex_destroy (&retVal->mutex);
-          free (retVal);
-          return NULL;
-        }
-      memcpy (tmp, data, size);
-      must_free = MHD_YES;
-      data = tmp;
+      memcpy (&retVal[1], data, size);
+      data = &retVal[1];
+      must_free = MHD_NO;
     }
   retVal->crc = NULL;
   retVal->crfc = must_free ? &free : NULL;
   retVal->crc_cls = must_free ? data : NULL;
-  retVal->reference_count = 1;
   retVal->total_size = size;
   retVal->data = data;
   retVal->data_size = size;
@@ -420,6 +869,617 @@ MHD_create_response_from_buffer (size_t size,
 }
 
 
+unsigned int
+MHD_response_find_iov_segment (const struct MHD_Response *response,
+			       uint64_t pos,
+			       size_t *seg_off)
+{
+  unsigned int i;
+
+  for (i = 0; i < response->data_iovcnt; i++)
+    {
+      if (pos < response->data_iov[i].iov_len)
+	{
+	  *seg_off = (size_t) pos;
+	  return i;
+	}
+      pos -= response->data_iov[i].iov_len;
+    }
+  *seg_off = 0;
+  return response->data_iovcnt;
+}
+
+
+/**
+ * Copy data from the segments of an iovec-backed response
+ * into the buffer.  Used whenever the segments cannot be
+ * transmitted directly (i.e. for HTTPS).
+ * 
+ * @param cls pointer to the response
+ * @param pos offset in the body to access
+ * @param buf where to write the data
+ * @param max number of bytes to write at most
+ * @return number of bytes written
+ */
+static ssize_t
+iovec_reader (void *cls, uint64_t pos, char *buf, size_t max)
+{
+  struct MHD_Response *response = cls;
+  const struct MHD_IoVec *seg;
+  unsigned int i;
+  size_t off;
+  size_t len;
+  size_t done;
+  ssize_t n;
+
+  done = 0;
+  i = MHD_response_find_iov_segment (response, pos, &off);
+  while ( (done < max) &&
+	  (i < response->data_iovcnt) )
+    {
+      seg = &response->data_iov[i];
+      len = MHD_MIN (max - done, seg->iov_len - off);
+      if (seg->fd == -1)
+	{
+	  memcpy (&buf[done], &((const char *) seg->iov_base)[off], len);
+	}
+      else
+	{
+#if HAVE_PREAD
+	  /* segments may share a descriptor with other responses */
+	  n = pread (seg->fd, &buf[done], len, seg->fd_off + off);
+#else
+	  (void) lseek (seg->fd, seg->fd_off + off, SEEK_SET);
+	  n = read (seg->fd, &buf[done], len);
+#endif
+	  if (n <= 0)
+	    return (done > 0) ? (ssize_t) done : MHD_CONTENT_READER_END_WITH_ERROR;
+	  len = (size_t) n;
+	}
+      done += len;
+      off += len;
+      if (off == seg->iov_len)
+	{
+	  i++;
+	  off = 0;
+	}
+    }
+  if (done == 0)
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  return done;
+}
+
+
+/**
+ * Destroy iovec reader context.  Releases the segment
+ * list and calls the application's cleanup function.
+ *
+ * @param cls pointer to the response
+ */
+static void
+iovec_free_callback (void *cls)
+{
+  struct MHD_Response *response = cls;
+
+  if (response->data_iov_free != NULL)
+    response->data_iov_free (response->data_iov_free_cls);
+  free (response->data_iov);
+  response->data_iov = NULL;
+}
+
+
+/**
+ * Create a response object from a list of memory and file segments.
+ * The response object can be extended with header information and
+ * then be used any number of times.
+ *
+ * @param iov array of segments
+ * @param iovcnt number of entries in 'iov'
+ * @param crfc function to call once MHD no longer needs the segments
+ * @param crfc_cls argument to give to 'crfc'
+ * @return NULL on error (i.e. invalid arguments, out of memory)
+ */
+struct MHD_Response *
+MHD_create_response_from_iovec (const struct MHD_IoVec *iov,
+				unsigned int iovcnt,
+				MHD_ContentReaderFreeCallback crfc,
+				void *crfc_cls)
+{
+  struct MHD_Response *ret;
+  struct MHD_IoVec *copy;
+  uint64_t total;
+  unsigned int i;
+
+  if ((iov == NULL) && (iovcnt > 0))
+    return NULL;
+  total = 0;
+  for (i = 0; i < iovcnt; i++)
+    {
+      if ( (iov[i].fd == -1) &&
+	   (iov[i].iov_base == NULL) &&
+	   (iov[i].iov_len > 0) )
+	return NULL;
+      total += iov[i].iov_len;
+    }
+  copy = malloc (sizeof (struct MHD_IoVec) * (iovcnt + 1));
+  if (copy == NULL)
+    return NULL;
+  if (iovcnt > 0)
+    memcpy (copy, iov, sizeof (struct MHD_IoVec) * iovcnt);
+  ret = MHD_create_response_from_callback (total,
+					   4 * 1024,
+					   &iovec_reader,
+					   NULL,
+					   &iovec_free_callback);
+  if (ret == NULL)
+    {
+      free (copy);
+      return NULL;
+    }
+  ret->crc_cls = ret;
+  ret->data_iov = copy;
+  ret->data_iovcnt = iovcnt;
+  ret->data_iov_free = crfc;
+  ret->data_iov_free_cls = crfc_cls;
+  return ret;
+}
+
+
+/**
+ * Maximum number of ranges we are willing to serve for a single
+ * request; requests asking for more get the full body.
+ */
+#define MHD_MAX_RANGES 16
+
+
+/**
+ * State kept for a response that serves ranges of another response.
+ */
+struct RangeContext
+{
+  /**
+   * Response we take the data from (we hold a reference).
+   */
+  struct MHD_Response *base;
+
+  /**
+   * Part headers of a 'multipart/byteranges' body follow
+   * this struct in memory.
+   */
+};
+
+
+/**
+ * Release a range response's reference to the original response.
+ *
+ * @param cls the 'struct RangeContext'
+ */
+static void
+range_free_callback (void *cls)
+{
+  struct RangeContext *ctx = cls;
+
+  MHD_destroy_response (ctx->base);
+  free (ctx);
+}
+
+
+/**
+ * Parse the value of a 'Range' header (RFC 2616, section 14.35).
+ *
+ * @param spec value of the header
+ * @param total size of the body
+ * @param first set to the first byte of each satisfiable range
+ * @param last set to the last byte of each satisfiable range
+ * @param cnt set to the number of satisfiable ranges
+ * @return MHD_NO if the header is malformed or asks for too
+ *         many ranges (and should thus be ignored)
+ */
+static int
+parse_ranges (const char *spec,
+	      uint64_t total,
+	      uint64_t *first,
+	      uint64_t *last,
+	      unsigned int *cnt)
+{
+  const char *pos;
+  char *end;
+  uint64_t a;
+  uint64_t b;
+  unsigned int seen;
+  unsigned int n;
+
+  if (0 != strncasecmp (spec, "bytes=", strlen ("bytes=")))
+    return MHD_NO;
+  pos = &spec[strlen ("bytes=")];
+  seen = 0;
+  n = 0;
+  while (1)
+    {
+      while ((*pos == ' ') || (*pos == '\t') || (*pos == ','))
+	pos++;
+      if (*pos == '\0')
+	break;
+      if (++seen > MHD_MAX_RANGES)
+	return MHD_NO;
+      if (*pos == '-')
+	{
+	  /* suffix range, last 'b' bytes */
+	  if ((pos[1] < '0') || (pos[1] > '9'))
+	    return MHD_NO;
+	  b = strtoull (&pos[1], &end, 10);
+	  if ( (b > 0) && (total > 0) )
+	    {
+	      first[n] = (b < total) ? total - b : 0;
+	      last[n] = total - 1;
+	      n++;
+	    }
+	}
+      else
+	{
+	  if ((*pos < '0') || (*pos > '9'))
+	    return MHD_NO;
+	  a = strtoull (pos, &end, 10);
+	  if (*end != '-')
+	    return MHD_NO;
+	  pos = &end[1];
+	  if ((*pos >= '0') && (*pos <= '9'))
+	    {
+	      b = strtoull (pos, &end, 10);
+	      if (b < a)
+		return MHD_NO;
+	    }
+	  else
+	    {
+	      b = MHD_SIZE_UNKNOWN;
+	      end = (char *) pos;
+	    }
+	  if (a < total)
+	    {
+	      first[n] = a;
+	      last[n] = (b < total) ? b : total - 1;
+	      n++;
+	    }
+	}
+      pos = end;
+      while ((*pos == ' ') || (*pos == '\t'))
+	pos++;
+      if ((*pos != ',') && (*pos != '\0'))
+	return MHD_NO;
+    }
+  if (seen == 0)
+    return MHD_NO;
+  *cnt = n;
+  return MHD_YES;
+}
+
+
+/**
+ * Describe a slice of the body of a response as segments.
+ *
+ * @param response response with random access to its body
+ * @param start first byte of the slice
+ * @param len number of bytes in the slice
+ * @param iov where to store the segments
+ * @return number of segments written to 'iov'
+ */
+static unsigned int
+add_slice (const struct MHD_Response *response,
+	   uint64_t start,
+	   uint64_t len,
+	   struct MHD_IoVec *iov)
+{
+  const struct MHD_IoVec *seg;
+  unsigned int n;
+  unsigned int i;
+  size_t off;
+  size_t take;
+
+  if (response->data_iov == NULL)
+    {
+      memset (iov, 0, sizeof (struct MHD_IoVec));
+      iov->iov_len = (size_t) len;
+      iov->fd = response->fd;
+      if (response->fd != -1)
+	iov->fd_off = response->fd_off + (off_t) start;
+      else
+	iov->iov_base = &response->data[start];
+      return 1;
+    }
+  n = 0;
+  i = MHD_response_find_iov_segment (response, start, &off);
+  while ( (len > 0) &&
+	  (i < response->data_iovcnt) )
+    {
+      seg = &response->data_iov[i];
+      take = seg->iov_len - off;
+      if (take > len)
+	take = (size_t) len;
+      iov[n] = *seg;
+      iov[n].iov_len = take;
+      if (seg->fd == -1)
+	iov[n].iov_base = (const char *) seg->iov_base + off;
+      else
+	iov[n].fd_off = seg->fd_off + (off_t) off;
+      n++;
+      len -= take;
+      off = 0;
+      i++;
+    }
+  return n;
+}
+
+
+/**
+ * Closure for 'copy_range_header'.
+ */
+struct HeaderCopyContext
+{
+  /**
+   * Response to copy the headers to.
+   */
+  struct MHD_Response *response;
+
+  /**
+   * Skip the 'Content-Type' header?
+   */
+  int skip_type;
+
+  /**
+   * Set to MHD_NO if we ran out of memory.
+   */
+  int ok;
+};
+
+
+/**
+ * Copy a header of the original response to the range response.
+ *
+ * @param cls the 'struct HeaderCopyContext'
+ * @param kind header or footer
+ * @param key name of the header
+ * @param value value of the header
+ * @return MHD_YES to continue iterating
+ */
+static int
+copy_range_header (void *cls,
+		   enum MHD_ValueKind kind,
+		   const char *key,
+		   const char *value)
+{
+  struct HeaderCopyContext *hcc = cls;
+
+  if ( (0 == strcasecmp (key, MHD_HTTP_HEADER_CONTENT_LENGTH)) ||
+       ( (hcc->skip_type) &&
+	 (0 == strcasecmp (key, MHD_HTTP_HEADER_CONTENT_TYPE)) ) )
+    return MHD_YES;
+  if (MHD_NO == add_response_entry (hcc->response, kind, key, value))
+    {
+      hcc->ok = MHD_NO;
+      return MHD_NO;
+    }
+  return MHD_YES;
+}
+
+
+int
+MHD_response_is_seekable (const struct MHD_Response *response)
+{
+  if (response->total_size == MHD_SIZE_UNKNOWN)
+    return MHD_NO;
+  if ( (response->crc == NULL) ||
+       (response->fd != -1) ||
+       (response->data_iov != NULL) )
+    return MHD_YES;
+  return MHD_NO;
+}
+
+
+struct MHD_Response *
+MHD_create_range_response (struct MHD_Response *response,
+			   const char *range,
+			   const void *uniq,
+			   unsigned int *status_code)
+{
+  uint64_t first[MHD_MAX_RANGES];
+  uint64_t last[MHD_MAX_RANGES];
+  char boundary[48];
+  char buf[128];
+  struct HeaderCopyContext hcc;
+  struct RangeContext *ctx;
+  struct MHD_Response *ret;
+  struct MHD_IoVec *iov;
+  const char *type;
+  char *parts;
+  unsigned int cnt;
+  unsigned int iovcnt;
+  unsigned int i;
+  size_t size;
+  size_t off;
+  int len;
+
+  if ( (MHD_YES != MHD_response_is_seekable (response)) ||
+       (MHD_YES != parse_ranges (range, response->total_size,
+				 first, last, &cnt)) )
+    return NULL;
+  for (i = 1; i < cnt; i++)
+    if (first[i] <= last[i - 1])
+      return NULL;              /* overlapping or unordered, send everything */
+  if (cnt == 0)
+    {
+      ret = MHD_create_response_from_buffer (0, "", MHD_RESPMEM_PERSISTENT);
+      if (ret == NULL)
+	return NULL;
+      SPRINTF (buf,
+	       "bytes */%" MHD_LONG_LONG_PRINTF "u",
+	       (unsigned MHD_LONG_LONG) response->total_size);
+      if (MHD_NO == MHD_add_response_header (ret,
+					     MHD_HTTP_HEADER_CONTENT_RANGE,
+					     buf))
+	{
+	  MHD_destroy_response (ret);
+	  return NULL;
+	}
+      *status_code = MHD_HTTP_REQUESTED_RANGE_NOT_SATISFIABLE;
+      return ret;
+    }
+  type = MHD_get_response_header (response, MHD_HTTP_HEADER_CONTENT_TYPE);
+  size = 0;
+  if (cnt > 1)
+    {
+      SPRINTF (boundary,
+	       "MHD-%08X%016" MHD_LONG_LONG_PRINTF "X",
+	       (unsigned int) time (NULL),
+	       (unsigned MHD_LONG_LONG) (size_t) uniq);
+      size = (cnt + 1) * (strlen (boundary) + sizeof (buf) + 
+			  ((type != NULL) ? strlen (type) : 0));
+    }
+  ctx = malloc (sizeof (struct RangeContext) + size);
+  if (ctx == NULL)
+    return NULL;
+  iov = malloc (sizeof (struct MHD_IoVec) *
+		((cnt + 1) * (((response->data_iov != NULL) 
+			       ? response->data_iovcnt : 1) + 1)));
+  if (iov == NULL)
+    {
+      free (ctx);
+      return NULL;
+    }
+  parts = (char *) &ctx[1];
+  ctx->base = response;
+  iovcnt = 0;
+  off = 0;
+  for (i = 0; i < cnt; i++)
+    {
+      if (cnt > 1)
+	{
+	  len = SPRINTF (&parts[off],
+			 "%s--%s\r\n%s%s%s" 
+			 "Content-Range: bytes %" MHD_LONG_LONG_PRINTF "u-%"
+			 MHD_LONG_LONG_PRINTF "u/%" MHD_LONG_LONG_PRINTF "u\r\n\r\n",
+			 (i == 0) ? "" : "\r\n",
+			 boundary,
+			 (type != NULL) ? "Content-Type: " : "",
+			 (type != NULL) ? type : "",
+			 (type != NULL) ? "\r\n" : "",
+			 (unsigned MHD_LONG_LONG) first[i],
+			 (unsigned MHD_LONG_LONG) last[i],
+			 (unsigned MHD_LONG_LONG) response->total_size);
+	  memset (&iov[iovcnt], 0, sizeof (struct MHD_IoVec));
+	  iov[iovcnt].iov_base = &parts[off];
+	  iov[iovcnt].iov_len = len;
+	  iov[iovcnt].fd = -1;
+	  iovcnt++;
+	  off += len;
+	}
+      iovcnt += add_slice (response,
+			   first[i],
+			   last[i] - first[i] + 1,
+			   &iov[iovcnt]);
+    }
+  if (cnt > 1)
+    {
+      len = SPRINTF (&parts[off], "\r\n--%s--\r\n", boundary);
+      memset (&iov[iovcnt], 0, sizeof (struct MHD_IoVec));
+      iov[iovcnt].iov_base = &parts[off];
+      iov[iovcnt].iov_len = len;
+      iov[iovcnt].fd = -1;
+      iovcnt++;
+    }
+  ret = MHD_create_response_from_iovec (iov, iovcnt,
+					&range_free_callback, ctx);
+  free (iov);
+  if (ret == NULL)
+    {
+      free (ctx);
+      return NULL;
+    }
+  MHD_increment_response_rc (response);
+  hcc.response = ret;
+  hcc.skip_type = (cnt > 1);
+  hcc.ok = MHD_YES;
+  MHD_get_response_headers (response, &copy_range_header, &hcc);
+  if (cnt > 1)
+    SPRINTF (buf, "multipart/byteranges; boundary=%s", boundary);
+  else
+    SPRINTF (buf,
+	     "bytes %" MHD_LONG_LONG_PRINTF "u-%" MHD_LONG_LONG_PRINTF
+	     "u/%" MHD_LONG_LONG_PRINTF "u",
+	     (unsigned MHD_LONG_LONG) first[0],
+	     (unsigned MHD_LONG_LONG) last[0],
+	     (unsigned MHD_LONG_LONG) response->total_size);
+  if ( (MHD_YES != hcc.ok) ||
+       (MHD_NO == MHD_add_response_header (ret,
+					   (cnt > 1)
+					   ? MHD_HTTP_HEADER_CONTENT_TYPE
+					   : MHD_HTTP_HEADER_CONTENT_RANGE,
+					   buf)) )
+    {
+      MHD_destroy_response (ret);
+      return NULL;
+    }
+  *status_code = MHD_HTTP_PARTIAL_CONTENT;
+  return ret;
+}
+
+
+/**
+ * Headers of a response that are repeated in the
+ * "304 Not Modified" response for it (RFC 2616, section 10.3.5).
+ */
+static const char *const not_modified_headers[] =
+  {
+    MHD_HTTP_HEADER_ETAG,
+    MHD_HTTP_HEADER_LAST_MODIFIED,
+    MHD_HTTP_HEADER_CACHE_CONTROL,
+    MHD_HTTP_HEADER_CONTENT_LOCATION,
+    MHD_HTTP_HEADER_EXPIRES,
+    MHD_HTTP_HEADER_VARY,
+    MHD_HTTP_HEADER_DATE,
+    NULL
+  };
+
+
+void
+MHD_response_get_validators (struct MHD_Response *response,
+			     const char **etag,
+			     time_t *last_modified)
+{
+  const char *have;
+
+  *etag = MHD_get_response_header (response, MHD_HTTP_HEADER_ETAG);
+  *last_modified = (time_t) -1;
+  have = MHD_get_response_header (response, MHD_HTTP_HEADER_LAST_MODIFIED);
+  if (have != NULL)
+    (void) MHD_parse_http_date (have, last_modified);
+}
+
+
+struct MHD_Response *
+MHD_response_get_not_modified (struct MHD_Response *response)
+{
+  struct MHD_Response *ret;
+  const char *value;
+  unsigned int i;
+
+  ret = MHD_create_response_from_buffer (0, "", MHD_RESPMEM_PERSISTENT);
+  if (ret == NULL)
+    return NULL;
+  for (i = 0; NULL != not_modified_headers[i]; i++)
+    {
+      value = MHD_get_response_header (response, not_modified_headers[i]);
+      if ( (value != NULL) &&
+	   (MHD_NO == add_response_entry (ret, MHD_HEADER_KIND,
+					  not_modified_headers[i], value)) )
+	{
+	  MHD_destroy_response (ret);
+	  return NULL;
+	}
+    }
+  return ret;
+}
+
+
 /**
  * Destroy a response object and associated resources.  Note that
  * libmicrohttpd may keep some of the resources around if the response
@@ -440,18 +1500,15 @@ MHD_destroy_response (struct MHD_Response *response)
       return;
     }
   pthread_mutex_unlock (&response->mutex);
-  pthread_mutex_destroy (&response->mutex);
   if (response->crfc != NULL)
     response->crfc (response->crc_cls);
   while (response->first_header != NULL)
     {
       pos = response->first_header;
       response->first_header = pos->next;
-      free (pos->header);
-      free (pos->value);
-      free (pos);
+      free_response_entry (response, pos);
     }
-  free (response);
+  response_release (response);
 }
 
 
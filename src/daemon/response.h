@@ -34,4 +34,122 @@
 void MHD_increment_response_rc (struct MHD_Response *response);
 
 
+/**
+ * Find the segment of an iovec-backed response that
+ * contains the given position of the body.
+ *
+ * @param response response created with MHD_create_response_from_iovec
+ * @param pos position in the body
+ * @param seg_off set to the offset of 'pos' within the segment
+ * @return index of the segment, 'data_iovcnt' if 'pos' is
+ *         at or beyond the end of the body
+ */
+unsigned int
+MHD_response_find_iov_segment (const struct MHD_Response *response,
+			       uint64_t pos,
+			       size_t *seg_off);
+
+
+/**
+ * Release the response cache of the calling thread and delete
+ * the key for the per-thread caches.  Called when the library
+ * is unloaded.
+ */
+void
+MHD_response_cache_fini (void);
+
+
+/**
+ * Check if the body of a response can be accessed at
+ * arbitrary offsets (i.e. to serve ranges of it).
+ *
+ * @param response response to check
+ * @return MHD_YES for buffer, file and iovec responses of known size
+ */
+int
+MHD_response_is_seekable (const struct MHD_Response *response);
+
+
+/**
+ * Create a response that serves the ranges listed in a 'Range'
+ * header from the body of another response.  The new response
+ * carries the headers of the original response and keeps a
+ * reference to it.
+ *
+ * @param response response with the full body, must be seekable
+ * @param range value of the 'Range' header of the request
+ * @param uniq value that differs between concurrent requests (the
+ *        connection), used for the boundary of multipart responses
+ * @param status_code set to the status code to use for the
+ *        new response (206 or 416)
+ * @return NULL if the 'Range' header should be ignored and
+ *         the full response sent instead
+ */
+struct MHD_Response *
+MHD_create_range_response (struct MHD_Response *response,
+			   const char *range,
+			   const void *uniq,
+			   unsigned int *status_code);
+
+
+/**
+ * Get the validators of a response (its 'ETag' and 'Last-Modified'
+ * headers).  Does not modify the response.
+ *
+ * @param response response to inspect
+ * @param etag set to the entity tag, NULL if there is none
+ * @param last_modified set to the modification time,
+ *        (time_t) -1 if unknown
+ */
+void
+MHD_response_get_validators (struct MHD_Response *response,
+			     const char **etag,
+			     time_t *last_modified);
+
+
+/**
+ * Get the "304 Not Modified" response to send instead of the given
+ * response.  It is built from the current headers of 'response' on
+ * every call; the caller must destroy it.
+ *
+ * @param response the full response
+ * @return NULL on error (out of memory)
+ */
+struct MHD_Response *
+MHD_response_get_not_modified (struct MHD_Response *response);
+
+
+#if HAVE_SPLICE
+/**
+ * Make sure the splice pipe of a pipe response holds data,
+ * moving data from the response's pipe (or socket) if needed.
+ * Does not block; if the pipe has no data yet, the connection
+ * has to wait for it to become readable.
+ *
+ * @param response response created with MHD_create_response_from_pipe
+ * @return number of bytes buffered in the splice pipe, 0 if no
+ *         data is available yet, MHD_CONTENT_READER_END_OF_STREAM
+ *         at the end of the stream, MHD_CONTENT_READER_END_WITH_ERROR
+ *         on error
+ */
+ssize_t
+MHD_response_fill_splice_pipe (struct MHD_Response *response);
+
+
+/**
+ * Move data buffered in the splice pipe of a pipe response
+ * to a socket (without blocking).
+ *
+ * @param response response created with MHD_create_response_from_pipe
+ * @param fd socket to write to
+ * @param max maximum number of bytes to move
+ * @return number of bytes moved, -1 on error (see errno)
+ */
+ssize_t
+MHD_response_splice_to (struct MHD_Response *response,
+			int fd,
+			size_t max);
+#endif
+
+
 #endif
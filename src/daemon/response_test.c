@@ -0,0 +1,164 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file response_test.c
+ * @brief  Testcase for management of response objects and their headers
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "microhttpd.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifndef WINDOWS
+#include <unistd.h>
+#endif
+
+/**
+ * Number of headers to add; enough to need more
+ * than the space reserved inside the response.
+ */
+#define NUM_HEADERS 64
+
+
+static int
+testHeaders ()
+{
+  struct MHD_Response *r;
+  char name[32];
+  char value[64];
+  unsigned int i;
+  const char *v;
+
+  r = MHD_create_response_from_buffer (0, NULL, MHD_RESPMEM_PERSISTENT);
+  if (r == NULL)
+    return 1;
+  for (i = 0; i < NUM_HEADERS; i++)
+    {
+      snprintf (name, sizeof (name), "X-Header-%u", i);
+      snprintf (value, sizeof (value), "value of header number %u", i);
+      if (MHD_YES != MHD_add_response_header (r, name, value))
+	{
+	  MHD_destroy_response (r);
+	  return 2;
+	}
+    }
+  if (NUM_HEADERS != MHD_get_response_headers (r, NULL, NULL))
+    {
+      MHD_destroy_response (r);
+      return 4;
+    }
+  for (i = 0; i < NUM_HEADERS; i++)
+    {
+      snprintf (name, sizeof (name), "X-Header-%u", i);
+      snprintf (value, sizeof (value), "value of header number %u", i);
+      v = MHD_get_response_header (r, name);
+      if ( (v == NULL) ||
+	   (0 != strcmp (v, value)) )
+	{
+	  MHD_destroy_response (r);
+	  return 8;
+	}
+    }
+  /* delete from both the front and the back of the list */
+  if ( (MHD_YES != MHD_del_response_header (r, "X-Header-0",
+					    "value of header number 0")) ||
+       (MHD_YES != MHD_del_response_header (r, "X-Header-63",
+					    "value of header number 63")) ||
+       (MHD_NO != MHD_del_response_header (r, "X-Header-1", "wrong")) ||
+       (NULL != MHD_get_response_header (r, "X-Header-0")) ||
+       (NUM_HEADERS - 2 != MHD_get_response_headers (r, NULL, NULL)) )
+    {
+      MHD_destroy_response (r);
+      return 16;
+    }
+  MHD_destroy_response (r);
+  return 0;
+}
+
+
+static int
+testInvalidHeaders ()
+{
+  struct MHD_Response *r;
+  int ret;
+
+  r = MHD_create_response_from_buffer (0, NULL, MHD_RESPMEM_PERSISTENT);
+  if (r == NULL)
+    return 32;
+  ret = 0;
+  if ( (MHD_NO != MHD_add_response_header (r, "", "value")) ||
+       (MHD_NO != MHD_add_response_header (r, "Name", "")) ||
+       (MHD_NO != MHD_add_response_header (r, "Na\nme", "value")) ||
+       (MHD_NO != MHD_add_response_header (r, "Name", "val\rue")) ||
+       (MHD_NO != MHD_add_response_footer (r, "Name", "val\tue")) ||
+       (0 != MHD_get_response_headers (r, NULL, NULL)) )
+    ret = 64;
+  MHD_destroy_response (r);
+  return ret;
+}
+
+
+static int
+testRecycle ()
+{
+  struct MHD_Response *r;
+  char data[128];
+  unsigned int i;
+
+  for (i = 0; i < 1000; i++)
+    {
+      memset (data, 'a' + (i % 26), sizeof (data));
+      r = MHD_create_response_from_buffer (sizeof (data), data,
+					   MHD_RESPMEM_MUST_COPY);
+      if (r == NULL)
+	return 128;
+      /* modify our copy, the response must not change */
+      memset (data, '!', sizeof (data));
+      if ( (MHD_YES != MHD_add_response_header (r, "Content-Type",
+						"text/plain")) ||
+	   (MHD_YES != MHD_add_response_footer (r, "X-Footer", "done")) ||
+	   (0 != strcmp ("text/plain",
+			 MHD_get_response_header (r, "Content-Type"))) )
+	{
+	  MHD_destroy_response (r);
+	  return 256;
+	}
+      MHD_destroy_response (r);
+    }
+  return 0;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  int errorCount = 0;
+
+  errorCount += testHeaders ();
+  errorCount += testInvalidHeaders ();
+  errorCount += testRecycle ();
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  return errorCount != 0;       /* 0 == pass */
+}
@@ -0,0 +1,648 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     This library is free software; you can redistribute it and/or
+     modify it under the terms of the GNU Lesser General Public
+     License as published by the Free Software Foundation; either
+     version 2.1 of the License, or (at your option) any later version.
+
+     This library is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Lesser General Public License for more details.
+
+     You should have received a copy of the GNU Lesser General Public
+     License along with this library; if not, write to the Free Software
+     Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/**
+ * @file tls_host_cert.c
+ * @brief credentials of virtual hosts, selected by the host name the
+ *        client sends in the TLS handshake (SNI)
+ * @author Christian Grothoff
+ */
+#include "tls_host_cert.h"
+#include <ctype.h>
+
+/**
+ * Number of hash buckets of the table of hosts.
+ */
+#define MHD_TLS_HOST_BUCKETS 256
+
+/**
+ * Longest host name (as defined by DNS).
+ */
+#define MHD_TLS_HOST_NAME_MAX 255
+
+/**
+ * Maximum number of hosts returned by the callback that we keep;
+ * the least recently used ones are dropped (and looked up again
+ * when a client asks for them).
+ */
+#define MHD_TLS_HOST_CACHE_MAX 1024
+
+
+/**
+ * A virtual host.  Its name follows the struct.
+ */
+struct MHD_TlsHost
+{
+  /**
+   * Next host in the same hash bucket.
+   */
+  struct MHD_TlsHost *hash_next;
+
+  /**
+   * Next host returned by the callback, in order of last use
+   * (most recent first).
+   */
+  struct MHD_TlsHost *next;
+
+  /**
+   * Previous host returned by the callback, in order of last use.
+   */
+  struct MHD_TlsHost *prev;
+
+  /**
+   * Credentials of the host.
+   */
+  gnutls_certificate_credentials_t cred;
+
+  /**
+   * Hash of the name.
+   */
+  unsigned int hash;
+
+  /**
+   * Number of TLS sessions using 'cred'.
+   */
+  unsigned int rc;
+
+  /**
+   * MHD_YES if the host was returned by the callback (and may be
+   * dropped from the table again).
+   */
+  int dynamic;
+
+  /**
+   * MHD_YES if the host was dropped from the table while sessions
+   * were still using it; it is freed once the last one is done.
+   */
+  int evicted;
+};
+
+
+/**
+ * Table of the virtual hosts of a daemon.
+ */
+struct MHD_TlsHostCerts
+{
+  /**
+   * Protects all other members except for the callback (hosts are
+   * added and dropped while the daemon runs if we have a
+   * 'callback').
+   */
+  pthread_mutex_t mutex;
+
+  /**
+   * Hash table of the hosts.
+   */
+  struct MHD_TlsHost *buckets[MHD_TLS_HOST_BUCKETS];
+
+  /**
+   * Most recently used host returned by the callback.
+   */
+  struct MHD_TlsHost *head;
+
+  /**
+   * Least recently used host returned by the callback (dropped
+   * first).
+   */
+  struct MHD_TlsHost *tail;
+
+  /**
+   * Number of hosts returned by the callback in the table.
+   */
+  unsigned int count;
+
+  /**
+   * Function to look up hosts not in the table, NULL for none.
+   */
+  MHD_HttpsHostCertCallback callback;
+
+  /**
+   * Closure for 'callback'.
+   */
+  void *callback_cls;
+};
+
+
+/**
+ * Hash a host name (FNV-1a).
+ *
+ * @param name host name
+ * @return hash value
+ */
+static unsigned int
+hash_name (const char *name)
+{
+  unsigned int hash = 2166136261U;
+
+  while ('\0' != *name)
+    {
+      hash ^= (unsigned char) *name++;
+      hash *= 16777619U;
+    }
+  return hash;
+}
+
+
+/**
+ * Bring a host name into the form we use as key: lower case,
+ * without a trailing dot.
+ *
+ * @param name host name to normalize (in place)
+ * @return MHD_NO if the name is not a valid host name
+ */
+static int
+normalize_name (char *name)
+{
+  size_t len;
+  size_t i;
+
+  len = strlen (name);
+  if ( (len > 0) &&
+       ('.' == name[len - 1]) )
+    name[--len] = '\0';
+  if ( (0 == len) ||
+       (len > MHD_TLS_HOST_NAME_MAX) )
+    return MHD_NO;
+  for (i = 0; i < len; i++)
+    name[i] = tolower ((unsigned char) name[i]);
+  return MHD_YES;
+}
+
+
+/**
+ * Load the key and certificate of a host.
+ *
+ * @param daemon daemon the host belongs to
+ * @param mem_key private key (PEM)
+ * @param mem_cert certificate (chain) (PEM)
+ * @param cred set to the credentials
+ * @return 0 on success, a gnutls error code otherwise
+ */
+static int
+load_credentials (struct MHD_Daemon *daemon,
+		  const char *mem_key,
+		  const char *mem_cert,
+		  gnutls_certificate_credentials_t *cred)
+{
+  gnutls_datum_t key;
+  gnutls_datum_t cert;
+  int ret;
+
+  if ( (NULL == mem_key) ||
+       (NULL == mem_cert) )
+    return GNUTLS_E_INVALID_REQUEST;
+  if (0 != (ret = gnutls_certificate_allocate_credentials (cred)))
+    return ret;
+  key.data = (unsigned char *) mem_key;
+  key.size = strlen (mem_key);
+  cert.data = (unsigned char *) mem_cert;
+  cert.size = strlen (mem_cert);
+  ret = gnutls_certificate_set_x509_key_mem (*cred,
+					     &cert, &key,
+					     GNUTLS_X509_FMT_PEM);
+  if ( (ret >= 0) &&
+       (NULL != daemon->https_mem_trust) )
+    {
+      /* clients of virtual hosts are verified like all others */
+      cert.data = (unsigned char *) daemon->https_mem_trust;
+      cert.size = strlen (daemon->https_mem_trust);
+      ret = gnutls_certificate_set_x509_trust_mem (*cred, &cert,
+						   GNUTLS_X509_FMT_PEM);
+    }
+  if (ret < 0)
+    {
+      gnutls_certificate_free_credentials (*cred);
+      return ret;
+    }
+  return 0;
+}
+
+
+/**
+ * Find a host in the table.  Must be called with the table's mutex
+ * held.
+ *
+ * @param certs table to search
+ * @param name normalized host name
+ * @param hash hash of 'name'
+ * @return NULL if the host is not in the table
+ */
+static struct MHD_TlsHost *
+host_find (struct MHD_TlsHostCerts *certs,
+	   const char *name,
+	   unsigned int hash)
+{
+  struct MHD_TlsHost *pos;
+
+  for (pos = certs->buckets[hash % MHD_TLS_HOST_BUCKETS];
+       NULL != pos;
+       pos = pos->hash_next)
+    if ( (pos->hash == hash) &&
+	 (0 == strcmp ((const char *) &pos[1], name)) )
+      return pos;
+  return NULL;
+}
+
+
+/**
+ * Free a host that is no longer in the table and no longer used.
+ *
+ * @param host host to free
+ */
+static void
+host_free (struct MHD_TlsHost *host)
+{
+  gnutls_certificate_free_credentials (host->cred);
+  free (host);
+}
+
+
+/**
+ * Drop a host returned by the callback from the table.  Sessions
+ * that still use its credentials keep them until they are done.
+ * Must be called with the table's mutex held.
+ *
+ * @param certs table the host is in
+ * @param host host to drop
+ */
+static void
+host_evict (struct MHD_TlsHostCerts *certs,
+	    struct MHD_TlsHost *host)
+{
+  struct MHD_TlsHost **pos;
+
+  pos = &certs->buckets[host->hash % MHD_TLS_HOST_BUCKETS];
+  while (*pos != host)
+    pos = &(*pos)->hash_next;
+  *pos = host->hash_next;
+  DLL_remove (certs->head,
+	      certs->tail,
+	      host);
+  certs->count--;
+  if (0 == host->rc)
+    host_free (host);
+  else
+    host->evicted = MHD_YES;
+}
+
+
+/**
+ * Add a host to the table (or replace the credentials of a host
+ * that is in the table already).  If the table is full of hosts
+ * returned by the callback, the least recently used one is dropped.
+ * Must be called with the table's mutex held.
+ *
+ * @param certs table to add the host to
+ * @param name normalized host name
+ * @param cred credentials of the host (now owned by the table)
+ * @param dynamic MHD_YES if the host was returned by the callback
+ * @return NULL on error ('cred' was freed)
+ */
+static struct MHD_TlsHost *
+host_add (struct MHD_TlsHostCerts *certs,
+	  const char *name,
+	  gnutls_certificate_credentials_t cred,
+	  int dynamic)
+{
+  struct MHD_TlsHost *host;
+  unsigned int hash;
+
+  hash = hash_name (name);
+  if (NULL != (host = host_find (certs, name, hash)))
+    {
+      /* only happens while loading the configured hosts */
+      gnutls_certificate_free_credentials (host->cred);
+      host->cred = cred;
+      return host;
+    }
+  host = malloc (sizeof (struct MHD_TlsHost) + strlen (name) + 1);
+  if (NULL == host)
+    {
+      gnutls_certificate_free_credentials (cred);
+      return NULL;
+    }
+  memset (host, 0, sizeof (struct MHD_TlsHost));
+  host->cred = cred;
+  host->hash = hash;
+  host->dynamic = dynamic;
+  strcpy ((char *) &host[1], name);
+  host->hash_next = certs->buckets[hash % MHD_TLS_HOST_BUCKETS];
+  certs->buckets[hash % MHD_TLS_HOST_BUCKETS] = host;
+  if (MHD_YES == dynamic)
+    {
+      if (certs->count >= MHD_TLS_HOST_CACHE_MAX)
+	host_evict (certs, certs->tail);
+      DLL_insert (certs->head,
+		  certs->tail,
+		  host);
+      certs->count++;
+    }
+  return host;
+}
+
+
+/**
+ * Mark a host as used by one more session.  Must be called with the
+ * table's mutex held.
+ *
+ * @param certs table the host is in
+ * @param host host to use
+ * @return host
+ */
+static struct MHD_TlsHost *
+host_use (struct MHD_TlsHostCerts *certs,
+	  struct MHD_TlsHost *host)
+{
+  host->rc++;
+  if (MHD_YES == host->dynamic)
+    {
+      /* keep hosts that are in use from being dropped */
+      DLL_remove (certs->head,
+		  certs->tail,
+		  host);
+      DLL_insert (certs->head,
+		  certs->tail,
+		  host);
+    }
+  return host;
+}
+
+
+/**
+ * A session no longer uses the credentials of a host.
+ *
+ * @param certs table the host belongs to
+ * @param host host the session used
+ */
+static void
+host_release (struct MHD_TlsHostCerts *certs,
+	      struct MHD_TlsHost *host)
+{
+  pthread_mutex_lock (&certs->mutex);
+  host->rc--;
+  if ( (0 == host->rc) &&
+       (MHD_YES == host->evicted) )
+    host_free (host);
+  pthread_mutex_unlock (&certs->mutex);
+}
+
+
+/**
+ * Look up a host in the table: first the host itself, then a
+ * wildcard entry of its parent domain.
+ *
+ * @param certs table to search
+ * @param name normalized host name
+ * @return NULL if the host is not in the table, otherwise the
+ *         host (to be released with 'host_release')
+ */
+static struct MHD_TlsHost *
+table_lookup (struct MHD_TlsHostCerts *certs,
+	      const char *name)
+{
+  char wildcard[MHD_TLS_HOST_NAME_MAX + 2];
+  struct MHD_TlsHost *host;
+  const char *parent;
+
+  pthread_mutex_lock (&certs->mutex);
+  host = host_find (certs, name, hash_name (name));
+  if ( (NULL == host) &&
+       (NULL != (parent = strchr (name, '.'))) )
+    {
+      wildcard[0] = '*';
+      strcpy (&wildcard[1], parent);
+      host = host_find (certs, wildcard, hash_name (wildcard));
+    }
+  if (NULL != host)
+    host_use (certs, host);
+  pthread_mutex_unlock (&certs->mutex);
+  return host;
+}
+
+
+/**
+ * Look up a host, asking the application (and remembering its
+ * answer) if the host is not in the table.
+ *
+ * @param daemon daemon the host belongs to
+ * @param name normalized host name
+ * @return NULL if the host is unknown, otherwise the host (to be
+ *         released with 'host_release')
+ */
+static struct MHD_TlsHost *
+host_lookup (struct MHD_Daemon *daemon,
+	     const char *name)
+{
+  struct MHD_TlsHostCerts *certs = daemon->host_certs;
+  struct MHD_TlsHost *host;
+  gnutls_certificate_credentials_t cred;
+  const char *mem_key;
+  const char *mem_cert;
+  int ret;
+
+  if (NULL != (host = table_lookup (certs, name)))
+    return host;
+  if ( (NULL == certs->callback) ||
+       (MHD_YES != certs->callback (certs->callback_cls,
+				    name,
+				    &mem_key,
+				    &mem_cert)) )
+    return NULL;
+  if (0 != (ret = load_credentials (daemon, mem_key, mem_cert, &cred)))
+    {
+#if HAVE_MESSAGES
+      MHD_DLOG (daemon,
+		"Failed to load the certificate of `%s': %s\n",
+		name,
+		gnutls_strerror (ret));
+#endif
+      return NULL;
+    }
+  pthread_mutex_lock (&certs->mutex);
+  if (NULL != (host = host_find (certs, name, hash_name (name))))
+    {
+      /* another thread was faster */
+      gnutls_certificate_free_credentials (cred);
+    }
+  else
+    {
+      host = host_add (certs, name, cred, MHD_YES);
+    }
+  if (NULL != host)
+    host_use (certs, host);
+  pthread_mutex_unlock (&certs->mutex);
+  return host;
+}
+
+
+/**
+ * Select the credentials of the host the client asks for (gnutls
+ * post client hello function).  Clients that do not use SNI, or ask
+ * for an unknown host, keep the default credentials of the daemon.
+ *
+ * @param session TLS session in the handshake
+ * @return 0 (continue with the handshake)
+ */
+static int
+select_host_cert (gnutls_session_t session)
+{
+  struct MHD_Connection *connection = gnutls_session_get_ptr (session);
+  struct MHD_TlsHost *host;
+  char name[MHD_TLS_HOST_NAME_MAX + 2];
+  size_t size;
+  unsigned int type;
+
+  size = sizeof (name);
+  if ( (GNUTLS_E_SUCCESS !=
+	gnutls_server_name_get (session, name, &size, &type, 0)) ||
+       (GNUTLS_NAME_DNS != type) ||
+       (MHD_NO == normalize_name (name)) )
+    return 0;
+  if (NULL == (host = host_lookup (connection->daemon, name)))
+    return 0;
+  gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, host->cred);
+  /* the client may say hello again (TLS 1.3 hello retry request) */
+  MHD_tls_host_certs_release (connection);
+  connection->tls_host = host;
+  return 0;
+}
+
+
+/**
+ * Create the table of virtual hosts of a daemon and load the
+ * credentials given with MHD_OPTION_HTTPS_MEM_HOST_CERTS.
+ *
+ * @param daemon daemon to create the table for
+ * @return NULL on error
+ */
+struct MHD_TlsHostCerts *
+MHD_tls_host_certs_create (struct MHD_Daemon *daemon)
+{
+  struct MHD_TlsHostCerts *certs;
+  const struct MHD_HttpsHostCert *pos;
+  gnutls_certificate_credentials_t cred;
+  char name[MHD_TLS_HOST_NAME_MAX + 2];
+  int ret;
+
+  certs = malloc (sizeof (struct MHD_TlsHostCerts));
+  if (NULL == certs)
+    return NULL;
+  memset (certs, 0, sizeof (struct MHD_TlsHostCerts));
+  if (0 != pthread_mutex_init (&certs->mutex, NULL))
+    {
+      free (certs);
+      return NULL;
+    }
+  certs->callback = daemon->host_cert_callback;
+  certs->callback_cls = daemon->host_cert_callback_cls;
+  for (pos = daemon->https_mem_host_certs;
+       (NULL != pos) && (NULL != pos->host);
+       pos++)
+    {
+      if ( (strlen (pos->host) >= sizeof (name)) ||
+	   (MHD_NO == normalize_name (strcpy (name, pos->host))) )
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon,
+		    "Invalid host name `%s'\n",
+		    pos->host);
+#endif
+	  MHD_tls_host_certs_destroy (certs);
+	  return NULL;
+	}
+      if (0 != (ret = load_credentials (daemon,
+					pos->mem_key,
+					pos->mem_cert,
+					&cred)))
+	{
+#if HAVE_MESSAGES
+	  MHD_DLOG (daemon,
+		    "Failed to load the certificate of `%s': %s\n",
+		    pos->host,
+		    gnutls_strerror (ret));
+#endif
+	  MHD_tls_host_certs_destroy (certs);
+	  return NULL;
+	}
+      if (NULL == host_add (certs, name, cred, MHD_NO))
+	{
+	  MHD_tls_host_certs_destroy (certs);
+	  return NULL;
+	}
+    }
+  return certs;
+}
+
+
+/**
+ * Destroy the table of virtual hosts (and their credentials).
+ *
+ * @param certs table to destroy
+ */
+void
+MHD_tls_host_certs_destroy (struct MHD_TlsHostCerts *certs)
+{
+  struct MHD_TlsHost *pos;
+  unsigned int i;
+
+  for (i = 0; i < MHD_TLS_HOST_BUCKETS; i++)
+    while (NULL != (pos = certs->buckets[i]))
+      {
+	certs->buckets[i] = pos->hash_next;
+	host_free (pos);
+      }
+  pthread_mutex_destroy (&certs->mutex);
+  free (certs);
+}
+
+
+/**
+ * Make the new TLS session of a connection pick the credentials of
+ * the host the client asks for, if the daemon has virtual hosts.
+ *
+ * @param connection connection with a new TLS session
+ */
+void
+MHD_tls_host_certs_setup (struct MHD_Connection *connection)
+{
+  if (NULL == connection->daemon->host_certs)
+    return;
+  gnutls_session_set_ptr (connection->tls_session, connection);
+  gnutls_handshake_set_post_client_hello_function (connection->tls_session,
+						   &select_host_cert);
+}
+
+
+/**
+ * Release the credentials of the virtual host the TLS session of a
+ * connection used.  Must be called once the session was destroyed
+ * (or no longer uses the credentials).
+ *
+ * @param connection connection to release the host of
+ */
+void
+MHD_tls_host_certs_release (struct MHD_Connection *connection)
+{
+  if (NULL == connection->tls_host)
+    return;
+  host_release (connection->daemon->host_certs, connection->tls_host);
+  connection->tls_host = NULL;
+}
+
+/* end of tls_host_cert.c */
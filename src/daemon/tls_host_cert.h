@@ -0,0 +1,82 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     This library is free software; you can redistribute it and/or
+     modify it under the terms of the GNU Lesser General Public
+     License as published by the Free Software Foundation; either
+     version 2.1 of the License, or (at your option) any later version.
+
+     This library is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Lesser General Public License for more details.
+
+     You should have received a copy of the GNU Lesser General Public
+     License along with this library; if not, write to the Free Software
+     Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/**
+ * @file tls_host_cert.h
+ * @brief credentials of virtual hosts, selected by the host name the
+ *        client sends in the TLS handshake (SNI); this file is only
+ *        compiled if ENABLE_HTTPS is set
+ * @author Christian Grothoff
+ */
+
+#ifndef TLS_HOST_CERT_H
+#define TLS_HOST_CERT_H
+
+#include "internal.h"
+
+#if HTTPS_SUPPORT
+
+/**
+ * Opaque handle for the credentials of the virtual hosts of a
+ * daemon.  The table is thread-safe; all threads of a daemon
+ * (including the workers of a thread pool) share the table of the
+ * master daemon.
+ */
+struct MHD_TlsHostCerts;
+
+/**
+ * Create the table of virtual hosts of a daemon and load the
+ * credentials given with MHD_OPTION_HTTPS_MEM_HOST_CERTS.
+ *
+ * @param daemon daemon to create the table for
+ * @return NULL on error
+ */
+struct MHD_TlsHostCerts *
+MHD_tls_host_certs_create (struct MHD_Daemon *daemon);
+
+/**
+ * Destroy the table of virtual hosts (and their credentials).
+ *
+ * @param certs table to destroy
+ */
+void
+MHD_tls_host_certs_destroy (struct MHD_TlsHostCerts *certs);
+
+/**
+ * Make the new TLS session of a connection pick the credentials of
+ * the host the client asks for, if the daemon has virtual hosts.
+ *
+ * @param connection connection with a new TLS session
+ */
+void
+MHD_tls_host_certs_setup (struct MHD_Connection *connection);
+
+/**
+ * Release the credentials of the virtual host the TLS session of a
+ * connection used.  Must be called once the session was destroyed
+ * (or no longer uses the credentials).
+ *
+ * @param connection connection to release the host of
+ */
+void
+MHD_tls_host_certs_release (struct MHD_Connection *connection);
+
+#endif
+
+#endif
@@ -0,0 +1,541 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     This library is free software; you can redistribute it and/or
+     modify it under the terms of the GNU Lesser General Public
+     License as published by the Free Software Foundation; either
+     version 2.1 of the License, or (at your option) any later version.
+
+     This library is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Lesser General Public License for more details.
+
+     You should have received a copy of the GNU Lesser General Public
+     License along with this library; if not, write to the Free Software
+     Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/**
+ * @file tls_session_cache.c
+ * @brief cache of TLS sessions for session resumption
+ * @author Christian Grothoff
+ */
+#include "tls_session_cache.h"
+#include <limits.h>
+
+/**
+ * Number of independently locked parts of a cache.  Sessions are
+ * assigned to a shard by the hash of their ID, so that threads
+ * resuming different sessions rarely wait for each other.
+ */
+#define MHD_TLS_SESSION_SHARDS 16
+
+/**
+ * Longest session ID we store (as defined by TLS).
+ */
+#define MHD_TLS_SESSION_ID_MAX 32
+
+
+/**
+ * A session in the cache.  The session data follows the struct.
+ */
+struct MHD_TlsSession
+{
+  /**
+   * Next session in the same hash bucket.
+   */
+  struct MHD_TlsSession *hash_next;
+
+  /**
+   * Next session in the shard, in order of last use (most
+   * recent first).
+   */
+  struct MHD_TlsSession *next;
+
+  /**
+   * Previous session in the shard, in order of last use.
+   */
+  struct MHD_TlsSession *prev;
+
+  /**
+   * When does the session expire?
+   */
+  time_t expires;
+
+  /**
+   * Hash of 'id'.
+   */
+  unsigned int hash;
+
+  /**
+   * Number of bytes in 'id'.
+   */
+  size_t id_size;
+
+  /**
+   * Number of bytes of session data.
+   */
+  size_t data_size;
+
+  /**
+   * Session ID.
+   */
+  unsigned char id[MHD_TLS_SESSION_ID_MAX];
+};
+
+
+/**
+ * Independently locked part of a cache.
+ */
+struct MHD_TlsSessionShard
+{
+  /**
+   * Protects all other members.
+   */
+  pthread_mutex_t mutex;
+
+  /**
+   * Hash table of the sessions ('num_buckets' entries).
+   */
+  struct MHD_TlsSession **buckets;
+
+  /**
+   * Most recently used session.
+   */
+  struct MHD_TlsSession *head;
+
+  /**
+   * Least recently used session (evicted first).
+   */
+  struct MHD_TlsSession *tail;
+
+  /**
+   * Number of sessions in the shard.
+   */
+  unsigned int count;
+};
+
+
+/**
+ * Session cache.
+ */
+struct MHD_TlsSessionCache
+{
+  /**
+   * Shards of the cache.
+   */
+  struct MHD_TlsSessionShard shards[MHD_TLS_SESSION_SHARDS];
+
+  /**
+   * Number of shards in use (fewer than MHD_TLS_SESSION_SHARDS
+   * for very small caches).
+   */
+  unsigned int num_shards;
+
+  /**
+   * Maximum number of sessions per shard.
+   */
+  unsigned int shard_max;
+
+  /**
+   * Number of hash buckets per shard.
+   */
+  unsigned int num_buckets;
+};
+
+
+/**
+ * Hash a session ID (FNV-1a).
+ *
+ * @param id session ID
+ * @param id_size number of bytes in 'id'
+ * @return hash value
+ */
+static unsigned int
+hash_id (const unsigned char *id, size_t id_size)
+{
+  unsigned int hash = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < id_size; i++)
+    {
+      hash ^= id[i];
+      hash *= 16777619U;
+    }
+  return hash;
+}
+
+
+/**
+ * Create a session cache.
+ *
+ * @param max_sessions maximum number of sessions to keep
+ * @return NULL on error
+ */
+struct MHD_TlsSessionCache *
+MHD_tls_session_cache_create (unsigned int max_sessions)
+{
+  struct MHD_TlsSessionCache *cache;
+  unsigned int i;
+
+  if (0 == max_sessions)
+    return NULL;
+  cache = malloc (sizeof (struct MHD_TlsSessionCache));
+  if (NULL == cache)
+    return NULL;
+  memset (cache, 0, sizeof (struct MHD_TlsSessionCache));
+  cache->num_shards = MHD_MIN (max_sessions, MHD_TLS_SESSION_SHARDS);
+  cache->shard_max = (max_sessions + cache->num_shards - 1) / cache->num_shards;
+  cache->num_buckets = cache->shard_max;
+  for (i = 0; i < cache->num_shards; i++)
+    {
+      cache->shards[i].buckets = calloc (cache->num_buckets,
+					 sizeof (struct MHD_TlsSession *));
+      if ( (NULL == cache->shards[i].buckets) ||
+	   (0 != pthread_mutex_init (&cache->shards[i].mutex, NULL)) )
+	{
+	  free (cache->shards[i].buckets);
+	  while (i-- > 0)
+	    {
+	      pthread_mutex_destroy (&cache->shards[i].mutex);
+	      free (cache->shards[i].buckets);
+	    }
+	  free (cache);
+	  return NULL;
+	}
+    }
+  return cache;
+}
+
+
+/**
+ * Destroy a session cache (and all sessions in it).
+ *
+ * @param cache cache to destroy
+ */
+void
+MHD_tls_session_cache_destroy (struct MHD_TlsSessionCache *cache)
+{
+  struct MHD_TlsSession *pos;
+  unsigned int i;
+
+  for (i = 0; i < cache->num_shards; i++)
+    {
+      while (NULL != (pos = cache->shards[i].head))
+	{
+	  cache->shards[i].head = pos->next;
+	  free (pos);
+	}
+      pthread_mutex_destroy (&cache->shards[i].mutex);
+      free (cache->shards[i].buckets);
+    }
+  free (cache);
+}
+
+
+/**
+ * Find a session in a shard.  Must be called with the
+ * shard's mutex held.
+ *
+ * @param cache cache the shard belongs to
+ * @param shard shard to search
+ * @param hash hash of the session ID
+ * @param id session ID
+ * @param id_size number of bytes in 'id'
+ * @return NULL if the session is not in the shard
+ */
+static struct MHD_TlsSession *
+shard_find (struct MHD_TlsSessionCache *cache,
+	    struct MHD_TlsSessionShard *shard,
+	    unsigned int hash,
+	    const unsigned char *id,
+	    size_t id_size)
+{
+  struct MHD_TlsSession *pos;
+
+  for (pos = shard->buckets[(hash / cache->num_shards) % cache->num_buckets];
+       NULL != pos;
+       pos = pos->hash_next)
+    if ( (pos->hash == hash) &&
+	 (pos->id_size == id_size) &&
+	 (0 == memcmp (pos->id, id, id_size)) )
+      return pos;
+  return NULL;
+}
+
+
+/**
+ * Remove a session from its shard and free it.  Must be called
+ * with the shard's mutex held.
+ *
+ * @param cache cache the shard belongs to
+ * @param shard shard of the session
+ * @param session session to remove
+ */
+static void
+shard_remove (struct MHD_TlsSessionCache *cache,
+	      struct MHD_TlsSessionShard *shard,
+	      struct MHD_TlsSession *session)
+{
+  struct MHD_TlsSession **pos;
+
+  pos = &shard->buckets[(session->hash / cache->num_shards) % cache->num_buckets];
+  while (*pos != session)
+    pos = &(*pos)->hash_next;
+  *pos = session->hash_next;
+  DLL_remove (shard->head,
+	      shard->tail,
+	      session);
+  shard->count--;
+  free (session);
+}
+
+
+/**
+ * Store a session (gnutls database store function).
+ *
+ * @param cls our daemon
+ * @param key session ID
+ * @param data session data
+ * @return 0 on success, -1 on error
+ */
+static int
+cache_store (void *cls,
+	     gnutls_datum_t key,
+	     gnutls_datum_t data)
+{
+  struct MHD_Daemon *daemon = cls;
+  struct MHD_TlsSessionCache *cache = daemon->session_cache;
+  struct MHD_TlsSessionShard *shard;
+  struct MHD_TlsSession *session;
+  struct MHD_TlsSession *old;
+  unsigned int hash;
+
+  if (key.size > MHD_TLS_SESSION_ID_MAX)
+    return -1;
+  session = malloc (sizeof (struct MHD_TlsSession) + data.size);
+  if (NULL == session)
+    return -1;
+  hash = hash_id (key.data, key.size);
+  session->hash = hash;
+  session->id_size = key.size;
+  memcpy (session->id, key.data, key.size);
+  session->data_size = data.size;
+  memcpy (&session[1], data.data, data.size);
+  session->expires = time (NULL) + daemon->session_timeout;
+  shard = &cache->shards[hash % cache->num_shards];
+  pthread_mutex_lock (&shard->mutex);
+  if (NULL != (old = shard_find (cache, shard, hash, key.data, key.size)))
+    shard_remove (cache, shard, old);
+  if (shard->count >= cache->shard_max)
+    shard_remove (cache, shard, shard->tail);
+  session->hash_next = shard->buckets[(hash / cache->num_shards) % cache->num_buckets];
+  shard->buckets[(hash / cache->num_shards) % cache->num_buckets] = session;
+  DLL_insert (shard->head,
+	      shard->tail,
+	      session);
+  shard->count++;
+  pthread_mutex_unlock (&shard->mutex);
+  return 0;
+}
+
+
+/**
+ * Look up a session (gnutls database retrieve function).
+ *
+ * @param cls our daemon
+ * @param key session ID
+ * @return copy of the session data (allocated with gnutls_malloc),
+ *         { NULL, 0 } if the session is not (or no longer) cached
+ */
+static gnutls_datum_t
+cache_retrieve (void *cls,
+		gnutls_datum_t key)
+{
+  struct MHD_Daemon *daemon = cls;
+  struct MHD_TlsSessionCache *cache = daemon->session_cache;
+  struct MHD_TlsSessionShard *shard;
+  struct MHD_TlsSession *session;
+  gnutls_datum_t ret;
+  unsigned int hash;
+
+  ret.data = NULL;
+  ret.size = 0;
+  if (key.size > MHD_TLS_SESSION_ID_MAX)
+    return ret;
+  hash = hash_id (key.data, key.size);
+  shard = &cache->shards[hash % cache->num_shards];
+  pthread_mutex_lock (&shard->mutex);
+  session = shard_find (cache, shard, hash, key.data, key.size);
+  if ( (NULL != session) &&
+       (session->expires < time (NULL)) )
+    {
+      shard_remove (cache, shard, session);
+      session = NULL;
+    }
+  if ( (NULL != session) &&
+       (NULL != (ret.data = gnutls_malloc (session->data_size))) )
+    {
+      memcpy (ret.data, &session[1], session->data_size);
+      ret.size = session->data_size;
+      /* keep sessions that are resumed from being evicted */
+      DLL_remove (shard->head,
+		  shard->tail,
+		  session);
+      DLL_insert (shard->head,
+		  shard->tail,
+		  session);
+    }
+  pthread_mutex_unlock (&shard->mutex);
+  return ret;
+}
+
+
+/**
+ * Remove a session (gnutls database remove function).
+ *
+ * @param cls our daemon
+ * @param key session ID
+ * @return 0 on success, -1 if the session was not cached
+ */
+static int
+cache_remove (void *cls,
+	      gnutls_datum_t key)
+{
+  struct MHD_Daemon *daemon = cls;
+  struct MHD_TlsSessionCache *cache = daemon->session_cache;
+  struct MHD_TlsSessionShard *shard;
+  struct MHD_TlsSession *session;
+  unsigned int hash;
+
+  if (key.size > MHD_TLS_SESSION_ID_MAX)
+    return -1;
+  hash = hash_id (key.data, key.size);
+  shard = &cache->shards[hash % cache->num_shards];
+  pthread_mutex_lock (&shard->mutex);
+  session = shard_find (cache, shard, hash, key.data, key.size);
+  if (NULL != session)
+    shard_remove (cache, shard, session);
+  pthread_mutex_unlock (&shard->mutex);
+  return (NULL != session) ? 0 : -1;
+}
+
+
+/**
+ * Store a session in the application's store.
+ *
+ * @param cls our daemon
+ * @param key session ID
+ * @param data session data
+ * @return 0 on success, -1 on error
+ */
+static int
+store_store (void *cls,
+	     gnutls_datum_t key,
+	     gnutls_datum_t data)
+{
+  struct MHD_Daemon *daemon = cls;
+  const struct MHD_TlsSessionStore *store = &daemon->session_store;
+
+  if (MHD_YES != store->store (store->cls,
+			       key.data, key.size,
+			       data.data, data.size,
+			       daemon->session_timeout))
+    return -1;
+  return 0;
+}
+
+
+/**
+ * Look up a session in the application's store.
+ *
+ * @param cls our daemon
+ * @param key session ID
+ * @return copy of the session data (allocated with gnutls_malloc),
+ *         { NULL, 0 } if the session is not stored
+ */
+static gnutls_datum_t
+store_retrieve (void *cls,
+		gnutls_datum_t key)
+{
+  struct MHD_Daemon *daemon = cls;
+  const struct MHD_TlsSessionStore *store = &daemon->session_store;
+  gnutls_datum_t ret;
+  void *data;
+  size_t data_size;
+
+  ret.data = NULL;
+  ret.size = 0;
+  data_size = 0;
+  data = store->retrieve (store->cls,
+			  key.data, key.size,
+			  &data_size);
+  if (NULL == data)
+    return ret;
+  if ( (0 != data_size) &&
+       (data_size <= UINT_MAX) &&
+       (NULL != (ret.data = gnutls_malloc (data_size))) )
+    {
+      memcpy (ret.data, data, data_size);
+      ret.size = data_size;
+    }
+  free (data);
+  return ret;
+}
+
+
+/**
+ * Remove a session from the application's store.
+ *
+ * @param cls our daemon
+ * @param key session ID
+ * @return 0
+ */
+static int
+store_remove (void *cls,
+	      gnutls_datum_t key)
+{
+  struct MHD_Daemon *daemon = cls;
+  const struct MHD_TlsSessionStore *store = &daemon->session_store;
+
+  if (NULL != store->remove)
+    store->remove (store->cls,
+		   key.data, key.size);
+  return 0;
+}
+
+
+/**
+ * Enable session tickets for a new server session and make it store
+ * its parameters in (and resume from) the session cache or the
+ * session store of the daemon, if it has one.
+ *
+ * @param daemon daemon the session belongs to
+ * @param session new TLS session
+ */
+void
+MHD_tls_session_cache_setup (struct MHD_Daemon *daemon,
+			     gnutls_session_t session)
+{
+  gnutls_db_set_cache_expiration (session, daemon->session_timeout);
+  gnutls_session_ticket_enable_server (session, &daemon->ticket_key);
+  if (NULL != daemon->session_store.store)
+    {
+      gnutls_db_set_store_function (session, &store_store);
+      gnutls_db_set_retrieve_function (session, &store_retrieve);
+      gnutls_db_set_remove_function (session, &store_remove);
+    }
+  else if (NULL != daemon->session_cache)
+    {
+      gnutls_db_set_store_function (session, &cache_store);
+      gnutls_db_set_retrieve_function (session, &cache_retrieve);
+      gnutls_db_set_remove_function (session, &cache_remove);
+    }
+  else
+    return;
+  gnutls_db_set_ptr (session, daemon);
+}
+
+/* end of tls_session_cache.c */
@@ -0,0 +1,72 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     This library is free software; you can redistribute it and/or
+     modify it under the terms of the GNU Lesser General Public
+     License as published by the Free Software Foundation; either
+     version 2.1 of the License, or (at your option) any later version.
+
+     This library is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     Lesser General Public License for more details.
+
+     You should have received a copy of the GNU Lesser General Public
+     License along with this library; if not, write to the Free Software
+     Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/**
+ * @file tls_session_cache.h
+ * @brief cache of TLS sessions for session resumption; this file
+ *        is only compiled if ENABLE_HTTPS is set
+ * @author Christian Grothoff
+ */
+
+#ifndef TLS_SESSION_CACHE_H
+#define TLS_SESSION_CACHE_H
+
+#include "internal.h"
+
+#if HTTPS_SUPPORT
+
+/**
+ * Opaque handle for a session cache.  The cache is thread-safe;
+ * all threads of a daemon (including the workers of a thread pool)
+ * share the cache of the master daemon.
+ */
+struct MHD_TlsSessionCache;
+
+/**
+ * Create a session cache.
+ *
+ * @param max_sessions maximum number of sessions to keep
+ * @return NULL on error
+ */
+struct MHD_TlsSessionCache *
+MHD_tls_session_cache_create (unsigned int max_sessions);
+
+/**
+ * Destroy a session cache (and all sessions in it).
+ *
+ * @param cache cache to destroy
+ */
+void
+MHD_tls_session_cache_destroy (struct MHD_TlsSessionCache *cache);
+
+/**
+ * Enable session tickets for a new server session and make it store
+ * its parameters in (and resume from) the session cache or the
+ * session store of the daemon, if it has one.
+ *
+ * @param daemon daemon the session belongs to
+ * @param session new TLS session
+ */
+void
+MHD_tls_session_cache_setup (struct MHD_Daemon *daemon,
+			     gnutls_session_t session);
+
+#endif
+
+#endif
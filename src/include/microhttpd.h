@@ -286,6 +286,7 @@ extern "C"
  */
 #define MHD_HTTP_VERSION_1_0 "HTTP/1.0"
 #define MHD_HTTP_VERSION_1_1 "HTTP/1.1"
+#define MHD_HTTP_VERSION_2_0 "HTTP/2.0"
 
 /**
  * HTTP methods
@@ -373,7 +374,78 @@ enum MHD_FLAG
    * and that DO provide other mechanisms for cache control.  See also
    * RFC 2616, section 14.18 (exception 3).
    */
-  MHD_SUPPRESS_DATE_NO_CLOCK = 128
+  MHD_SUPPRESS_DATE_NO_CLOCK = 128,
+
+  /**
+   * Let MHD answer 'Range' requests itself.  If a GET request carries
+   * a 'Range' header and the application queues a response with
+   * status 200 that supports random access (buffer, file descriptor
+   * or iovec responses), MHD will send a 206 response with the
+   * requested range(s) (using 'multipart/byteranges' for multiple
+   * ranges) or a 416 response if the ranges cannot be satisfied.
+   * 'If-Range' is honored using the response's 'ETag' or
+   * 'Last-Modified' header.
+   */
+  MHD_USE_RANGE_REQUESTS = 256,
+
+  /**
+   * Let MHD answer conditional GET and HEAD requests itself.  If the
+   * application queues a response with status 200 and the request's
+   * 'If-None-Match' (or, without it, 'If-Modified-Since') header
+   * matches the response's 'ETag' (or 'Last-Modified') header, MHD
+   * sends a "304 Not Modified" response instead, without touching
+   * the body.  Responses created from a file descriptor (for a
+   * regular file) get both headers computed from 'fstat' when they
+   * are created; the application's headers of the same name replace
+   * them.
+   */
+  MHD_USE_CONDITIONAL_REQUESTS = 512,
+
+  /**
+   * Enable suspending and resuming connections with
+   * 'MHD_suspend_connection' and 'MHD_resume_connection'.  MHD
+   * wakes up its event loop when a connection is resumed.  With
+   * 'MHD_USE_THREAD_PER_CONNECTION', each connection uses an
+   * additional file descriptor (an eventfd where available) for
+   * this, created when its thread starts.
+   */
+  MHD_USE_SUSPEND_RESUME = 1024,
+
+  /**
+   * Set SO_REUSEPORT on the listen socket so that several daemons
+   * (or processes) can listen on the same port, with the kernel
+   * distributing incoming connections between them.  Combined with
+   * 'MHD_OPTION_THREAD_POOL_CPU_AFFINITY', this allows running one
+   * daemon per NUMA node.  'MHD_start_daemon' fails if the platform
+   * does not support SO_REUSEPORT.
+   */
+  MHD_USE_REUSEPORT = 2048,
+
+  /**
+   * Use kernel TLS for HTTPS connections where possible: after the
+   * handshake, MHD installs the transmit keys into the socket so
+   * that the kernel encrypts the records.  Responses can then be
+   * sent with 'sendfile' and 'splice' just like without TLS.  Only
+   * AES-GCM and CHACHA20-POLY1305 with TLS 1.2 can be offloaded
+   * (TLS 1.3 key updates are not supported); other connections (and all connections on systems
+   * without kernel TLS support) silently continue to use gnutls.
+   * Use 'MHD_CONNECTION_INFO_KTLS' to find out which one is used.
+   * Only meaningful together with 'MHD_USE_SSL'.
+   */
+  MHD_USE_KTLS = 4096,
+
+  /**
+   * Speak HTTP/2 with clients that ask for it: with 'MHD_USE_SSL',
+   * MHD offers "h2" (before "http/1.1") during the TLS handshake
+   * (ALPN); without TLS, connections that start with the HTTP/2
+   * connection preface ("prior knowledge") are served with HTTP/2.
+   * Each stream is passed to the 'MHD_AccessHandlerCallback' as a
+   * connection of its own (with 'MHD_HTTP_VERSION_2_0' as the
+   * version), so several requests of a client run concurrently on
+   * one TCP connection.  Streams cannot be suspended and their
+   * handlers always run in the thread of the connection.
+   */
+  MHD_USE_HTTP2 = 8192
 
 };
 
@@ -398,7 +470,9 @@ enum MHD_OPTION
 
   /**
    * Maximum number of concurrent connections to
-   * accept (followed by an unsigned int).
+   * accept (followed by an unsigned int).  With
+   * MHD_OPTION_THREAD_POOL_SIZE, the limit applies to
+   * the daemon as a whole and is shared by all threads.
    */
   MHD_OPTION_CONNECTION_LIMIT = 2,
 
@@ -522,7 +596,8 @@ enum MHD_OPTION
    * greater than 1. Currently, thread model must be
    * MHD_USE_SELECT_INTERNALLY if thread pooling is enabled
    * (MHD_start_daemon returns NULL for an unsupported thread
-   * model).
+   * model).  The size of the pool can be changed later using
+   * 'MHD_set_daemon_option'.
    */
   MHD_OPTION_THREAD_POOL_SIZE = 14,
 
@@ -596,7 +671,207 @@ enum MHD_OPTION
    * HTTPS daemon for client authentification.
    * This option should be followed by a "const char*" argument.
    */
-  MHD_OPTION_HTTPS_MEM_TRUST =20
+  MHD_OPTION_HTTPS_MEM_TRUST =20,
+
+  /**
+   * Transmit in-memory responses (created with
+   * 'MHD_create_response_from_buffer') whose size is at least the
+   * given number of bytes without copying them into the kernel,
+   * using 'MSG_ZEROCOPY'.  The response is kept alive until the
+   * kernel reports that it no longer needs the data, even after the
+   * connection was closed; 'MHD_stop_daemon' resets connections that
+   * still have such data in flight.  Zero-copy
+   * transmission only pays off for large (multi-MB) bodies and is
+   * ignored for HTTPS and on platforms without 'MSG_ZEROCOPY'.
+   * This option should be followed by a "size_t" argument;
+   * the default is 0 (always copy).
+   */
+  MHD_OPTION_ZEROCOPY_THRESHOLD = 21,
+
+  /**
+   * Run the access handler in a pool of threads of the given size
+   * instead of in the thread(s) doing the network I/O.  The event
+   * loop (internal or external select/poll, optionally with
+   * 'MHD_OPTION_THREAD_POOL_SIZE') parses the requests, hands each
+   * call of the access handler to the pool and continues with the
+   * connection once the handler returns.  This allows blocking or
+   * CPU-heavy handlers without a thread per connection.  Cannot be
+   * combined with 'MHD_USE_THREAD_PER_CONNECTION'; implies
+   * 'MHD_USE_SUSPEND_RESUME'.  Access handlers (but not the other
+   * callbacks) of different connections then run concurrently.
+   * This option should be followed by an "unsigned int" argument;
+   * the default is 0 (no handler pool).
+   */
+  MHD_OPTION_HANDLER_POOL_SIZE = 22,
+
+  /**
+   * With 'MHD_USE_THREAD_PER_CONNECTION', keep up to the given
+   * number of idle threads around once their connection is closed
+   * and hand new connections to them instead of creating a new
+   * thread for each connection.  Each connection is still handled
+   * by a thread of its own.  This option should be followed by an
+   * "unsigned int" argument; the default is 0 (create a thread for
+   * each connection).  Ignored in the other threading modes.
+   */
+  MHD_OPTION_THREAD_CACHE_SIZE = 23,
+
+  /**
+   * Number of seconds an idle thread of the thread cache (see
+   * 'MHD_OPTION_THREAD_CACHE_SIZE') waits for a new connection
+   * before terminating.  This option should be followed by an
+   * "unsigned int" argument; the default is 60.
+   */
+  MHD_OPTION_THREAD_CACHE_TIMEOUT = 24,
+
+  /**
+   * Bind the threads of the thread pool (or the thread of
+   * MHD_USE_SELECT_INTERNALLY) to CPUs.  This option should be
+   * followed by two arguments: an "unsigned int" giving the number
+   * of entries, and a "const unsigned int *" array with the CPU
+   * numbers.  Threads are spread over the listed CPUs, using each
+   * CPU once before any CPU gets a second thread.  Each thread binds
+   * itself before it allocates connections, so their memory ends up
+   * on the thread's NUMA node.  The application must ensure that the
+   * array remains allocated and unmodified while the daemon is
+   * running.  Ignored with MHD_USE_THREAD_PER_CONNECTION.
+   */
+  MHD_OPTION_THREAD_POOL_CPU_AFFINITY = 25,
+
+  /**
+   * Balance the load of the thread pool by moving connections
+   * between the workers.  Every worker measures how much of its time
+   * it is busy (not waiting for events); at the given interval, a
+   * worker that is much busier than the least busy worker hands some
+   * of its keep-alive connections that are idle between requests
+   * over to that worker.  This option should be followed by an
+   * "unsigned int" argument giving the interval in milliseconds; the
+   * default is 0 (connections stay with the worker that accepted
+   * them).  Ignored without MHD_OPTION_THREAD_POOL_SIZE.
+   */
+  MHD_OPTION_THREAD_POOL_REBALANCE_INTERVAL = 26,
+
+  /**
+   * Run the daemon in worker processes.  'MHD_start_daemon' forks
+   * the given number of processes, which all accept connections on
+   * the same listen socket and each run a single-threaded event loop
+   * (so the callbacks of the application never run concurrently
+   * within one process).  The calling process only supervises the
+   * workers: a worker that terminates is started again, and
+   * 'MHD_stop_daemon' makes all workers close their connections and
+   * exit.  Statistics of the workers are available in the calling
+   * process with MHD_DAEMON_INFO_PROCESS_STATISTICS.  Requires
+   * MHD_USE_SELECT_INTERNALLY; cannot be combined with
+   * MHD_OPTION_THREAD_POOL_SIZE, MHD_OPTION_HANDLER_POOL_SIZE or
+   * MHD_USE_THREAD_PER_CONNECTION.  This option should be followed
+   * by an "unsigned int" argument; the default is 0 (no worker
+   * processes).
+   */
+  MHD_OPTION_PROCESS_POOL_SIZE = 27,
+
+  /**
+   * Keep the parameters of TLS sessions in a cache so that clients
+   * that reconnect can resume their session (by session ID) with an
+   * abbreviated handshake instead of a full one.  The cache is shared
+   * by all threads of a thread pool; the least recently used session
+   * is evicted when the cache is full.  This option should be
+   * followed by an "unsigned int" argument giving the maximum number
+   * of sessions; the default is 0 (no cache).  Requires
+   * MHD_USE_SSL.
+   */
+  MHD_OPTION_HTTPS_SESSION_CACHE_SIZE = 28,
+
+  /**
+   * Time after which a TLS session can no longer be resumed (see
+   * MHD_OPTION_HTTPS_SESSION_CACHE_SIZE,
+   * MHD_OPTION_HTTPS_SESSION_STORE and
+   * MHD_OPTION_HTTPS_SESSION_TICKET_KEY).  This option should be
+   * followed by an "unsigned int" argument giving the time in
+   * seconds; the default is 3600.
+   */
+  MHD_OPTION_HTTPS_SESSION_TIMEOUT = 29,
+
+  /**
+   * Store the parameters of TLS sessions with functions of the
+   * application instead of in a cache of MHD (for example, to share
+   * sessions between several servers).  This option should be
+   * followed by a "const struct MHD_TlsSessionStore *" argument; the
+   * struct is copied.  Cannot be combined with
+   * MHD_OPTION_HTTPS_SESSION_CACHE_SIZE.  Requires MHD_USE_SSL.
+   */
+  MHD_OPTION_HTTPS_SESSION_STORE = 30,
+
+  /**
+   * Key for the session tickets of the daemon.  Session tickets let
+   * clients resume their TLS session without the server keeping any
+   * state; they are always enabled.  By default, MHD generates a
+   * random key when the daemon starts, so tickets can only be used
+   * with the daemon (and its worker threads or processes) that issued
+   * them.  Servers that are given the same key accept each other's
+   * tickets.  The encryption keys derived from this key are rotated
+   * every MHD_OPTION_HTTPS_SESSION_TIMEOUT seconds; tickets encrypted
+   * with the previous key are still accepted.  This option should be
+   * followed by two arguments: the size of the key (a "size_t",
+   * which must be 64) and the key itself (a "const void *"); the key
+   * is copied.  Requires MHD_USE_SSL.
+   */
+  MHD_OPTION_HTTPS_SESSION_TICKET_KEY = 31,
+
+  /**
+   * Run the TLS handshakes in a pool of threads of the given size
+   * instead of in the thread(s) doing the network I/O, so that a
+   * burst of (CPU-heavy) handshakes does not delay the processing of
+   * the established connections.  Whenever a connection has data for
+   * the handshake, the event loop hands it to the pool and continues
+   * with the connection once the pool has processed the data.  See
+   * MHD_DAEMON_INFO_HANDSHAKE_STATISTICS for how long handshakes wait
+   * for a thread.  Cannot be combined with
+   * 'MHD_USE_THREAD_PER_CONNECTION' or MHD_OPTION_PROCESS_POOL_SIZE;
+   * implies 'MHD_USE_SUSPEND_RESUME'.  This option should be followed
+   * by an "unsigned int" argument; the default is 0 (handshakes run
+   * in the event loop).  Requires MHD_USE_SSL.
+   */
+  MHD_OPTION_HTTPS_HANDSHAKE_POOL_SIZE = 32,
+
+  /**
+   * Maximum payload of the TLS records MHD sends.  Small writes
+   * (response headers, chunks, the blocks of content reader
+   * callbacks) are batched into records of this size.  The first
+   * 64 KiB of each response, and data sent after the connection was
+   * idle for a second, go out in records that fit into one TCP
+   * segment, so that clients can start processing the response
+   * without waiting for a full record.  This option should be
+   * followed by a "size_t" argument; the default is 16384 (the
+   * largest record TLS allows).  Use 0 to have every write sent in
+   * records of its own, as it is.  Requires MHD_USE_SSL.
+   */
+  MHD_OPTION_HTTPS_RECORD_SIZE = 33,
+
+  /**
+   * Keys and certificates of virtual hosts.  During the TLS
+   * handshake, MHD picks the certificate of the host the client asks
+   * for with the Server Name Indication (SNI) extension; clients
+   * asking for another host (or for none) get the certificate given
+   * with MHD_OPTION_HTTPS_MEM_CERT (which is optional if this option
+   * is used).  This option should be followed by a "const struct
+   * MHD_HttpsHostCert *" argument pointing to an array terminated by
+   * an entry with a NULL 'host'; the keys and certificates are loaded
+   * when the daemon starts.  Requires MHD_USE_SSL.
+   */
+  MHD_OPTION_HTTPS_MEM_HOST_CERTS = 34,
+
+  /**
+   * Function to look up the key and certificate of virtual hosts that
+   * are not in MHD_OPTION_HTTPS_MEM_HOST_CERTS.  The credentials
+   * returned for a host are loaded once and kept, so the function is
+   * only called again for hosts it did not know; MHD keeps the 1024
+   * most recently used hosts and looks up others again when needed.
+   * Clients choose the names, so the function should only accept
+   * names the application serves.  This option should be followed
+   * by two arguments: a
+   * function of type "MHD_HttpsHostCertCallback" and its closure.
+   * Requires MHD_USE_SSL.
+   */
+  MHD_OPTION_HTTPS_HOST_CERT_CALLBACK = 35
 };
 
 
@@ -749,7 +1024,14 @@ enum MHD_ConnectionInfoType
   /**
    * Get the 'struct MHD_Daemon' responsible for managing this connection.
    */
-  MHD_CONNECTION_INFO_DAEMON
+  MHD_CONNECTION_INFO_DAEMON,
+
+  /**
+   * Is the kernel encrypting the responses on this connection
+   * (see 'MHD_USE_KTLS')?  Takes no extra arguments.  Returns
+   * 'ktls' set to MHD_YES or MHD_NO.
+   */
+  MHD_CONNECTION_INFO_KTLS
 
 };
 
@@ -780,7 +1062,38 @@ enum MHD_DaemonInfoType
    * Request the file descriptor for the listening socket.
    * No extra arguments should be passed.
    */
-  MHD_DAEMON_INFO_LISTEN_FD
+  MHD_DAEMON_INFO_LISTEN_FD,
+
+  /**
+   * Request the number of connections the daemon currently
+   * handles (across all threads of a thread pool).
+   * No extra arguments should be passed.
+   */
+  MHD_DAEMON_INFO_CURRENT_CONNECTIONS,
+
+  /**
+   * Request the number of connections currently handled by one
+   * thread of the thread pool.  The index of the thread should be
+   * passed as an extra argument (of type 'unsigned int', smaller
+   * than the MHD_OPTION_THREAD_POOL_SIZE).  May be called while
+   * the pool is resized; the result remains valid until the next
+   * call.
+   */
+  MHD_DAEMON_INFO_WORKER_CONNECTIONS,
+
+  /**
+   * Request the statistics of the worker processes
+   * (MHD_OPTION_PROCESS_POOL_SIZE).  No extra arguments should be
+   * passed.  The result remains valid until the next call.
+   */
+  MHD_DAEMON_INFO_PROCESS_STATISTICS,
+
+  /**
+   * Request the statistics of the handshake pool
+   * (MHD_OPTION_HTTPS_HANDSHAKE_POOL_SIZE).  No extra arguments
+   * should be passed.  The result remains valid until the next call.
+   */
+  MHD_DAEMON_INFO_HANDSHAKE_STATISTICS
 };
 
 
@@ -789,6 +1102,77 @@ enum MHD_DaemonInfoType
  */
 struct MHD_Daemon;
 
+/**
+ * Statistics of the worker processes of a daemon
+ * (MHD_OPTION_PROCESS_POOL_SIZE).  Counters include the
+ * processes that terminated and were replaced.
+ */
+struct MHD_ProcessStatistics
+{
+  /**
+   * Number of worker processes currently running.
+   */
+  unsigned int processes;
+
+  /**
+   * Number of times a worker process was restarted.
+   */
+  unsigned int restarts;
+
+  /**
+   * Number of connections currently open.
+   */
+  unsigned int current_connections;
+
+  /**
+   * Number of connections accepted.
+   */
+  unsigned MHD_LONG_LONG connections;
+
+  /**
+   * Number of requests answered.
+   */
+  unsigned MHD_LONG_LONG requests;
+
+  /**
+   * Number of bytes received from clients.
+   */
+  unsigned MHD_LONG_LONG bytes_received;
+
+  /**
+   * Number of bytes sent to clients.
+   */
+  unsigned MHD_LONG_LONG bytes_sent;
+};
+
+/**
+ * Statistics of the handshake pool of a daemon
+ * (MHD_OPTION_HTTPS_HANDSHAKE_POOL_SIZE).  A handshake takes a few
+ * steps, one for each time the client sends handshake data.
+ */
+struct MHD_HandshakeStatistics
+{
+  /**
+   * Number of handshake steps currently waiting for a thread.
+   */
+  unsigned int queued;
+
+  /**
+   * Number of handshake steps run by the pool.
+   */
+  unsigned MHD_LONG_LONG steps;
+
+  /**
+   * Total time (in microseconds) the steps waited for a thread.
+   */
+  unsigned MHD_LONG_LONG queue_time;
+
+  /**
+   * Longest time (in microseconds) a step waited for a thread.
+   */
+  unsigned MHD_LONG_LONG max_queue_time;
+};
+
 /**
  * Handle for a connection / HTTP request.  With HTTP/1.1, multiple
  * requests can be run over the same connection.  However, MHD will
@@ -898,6 +1282,142 @@ typedef void
                                    enum MHD_RequestTerminationCode toe);
 
 
+/**
+ * Store the parameters of a TLS session so that it can be resumed
+ * later.  An existing entry for the same session ID is replaced.
+ *
+ * @param cls closure from the 'struct MHD_TlsSessionStore'
+ * @param id session ID
+ * @param id_size number of bytes in 'id'
+ * @param data session parameters (must be copied)
+ * @param data_size number of bytes in 'data'
+ * @param timeout number of seconds after which the session
+ *        should no longer be resumed
+ * @return MHD_YES on success, MHD_NO on error
+ * @see MHD_OPTION_HTTPS_SESSION_STORE
+ */
+typedef int
+  (*MHD_TlsSessionStoreCallback) (void *cls,
+				  const void *id,
+				  size_t id_size,
+				  const void *data,
+				  size_t data_size,
+				  unsigned int timeout);
+
+
+/**
+ * Look up the parameters of a TLS session that a client wants to
+ * resume.
+ *
+ * @param cls closure from the 'struct MHD_TlsSessionStore'
+ * @param id session ID
+ * @param id_size number of bytes in 'id'
+ * @param data_size set to the number of bytes returned
+ * @return copy of the session parameters (allocated with 'malloc',
+ *         MHD will 'free' it), NULL if the session is unknown
+ *         (or expired)
+ * @see MHD_OPTION_HTTPS_SESSION_STORE
+ */
+typedef void *
+  (*MHD_TlsSessionRetrieveCallback) (void *cls,
+				     const void *id,
+				     size_t id_size,
+				     size_t *data_size);
+
+
+/**
+ * Remove the parameters of a TLS session that must no longer be
+ * resumed.
+ *
+ * @param cls closure from the 'struct MHD_TlsSessionStore'
+ * @param id session ID
+ * @param id_size number of bytes in 'id'
+ * @see MHD_OPTION_HTTPS_SESSION_STORE
+ */
+typedef void
+  (*MHD_TlsSessionRemoveCallback) (void *cls,
+				   const void *id,
+				   size_t id_size);
+
+
+/**
+ * Functions of the application storing TLS sessions.  They can be
+ * called from any thread of the daemon, possibly concurrently.
+ * @see MHD_OPTION_HTTPS_SESSION_STORE
+ */
+struct MHD_TlsSessionStore
+{
+  /**
+   * Function to store a session.
+   */
+  MHD_TlsSessionStoreCallback store;
+
+  /**
+   * Function to look up a session.
+   */
+  MHD_TlsSessionRetrieveCallback retrieve;
+
+  /**
+   * Function to remove a session (can be NULL).
+   */
+  MHD_TlsSessionRemoveCallback remove;
+
+  /**
+   * Closure for the functions.
+   */
+  void *cls;
+};
+
+
+/**
+ * Key and certificate of a virtual host.
+ * @see MHD_OPTION_HTTPS_MEM_HOST_CERTS
+ */
+struct MHD_HttpsHostCert
+{
+  /**
+   * Name of the host (case does not matter); "*.example.com" stands
+   * for all hosts directly below example.com that have no entry of
+   * their own.  NULL terminates the array.
+   */
+  const char *host;
+
+  /**
+   * Private key of the host (PEM, in memory).
+   */
+  const char *mem_key;
+
+  /**
+   * Certificate (chain) of the host (PEM, in memory).
+   */
+  const char *mem_cert;
+};
+
+
+/**
+ * Look up the key and certificate of a virtual host (the host name
+ * a client sent with the Server Name Indication extension of TLS).
+ * Called during TLS handshakes, from any thread of the daemon,
+ * possibly concurrently.
+ *
+ * @param cls closure
+ * @param host name of the host the client asked for (in lower case)
+ * @param mem_key set to the private key of the host (PEM, in memory);
+ *        it must remain valid until MHD has loaded it, which happens
+ *        in the same thread right after the function returns
+ * @param mem_cert set to the certificate (chain) of the host (PEM,
+ *        in memory, with the same lifetime as 'mem_key')
+ * @return MHD_YES if 'mem_key' and 'mem_cert' were set, MHD_NO
+ *         if the host is unknown (the default certificate is used)
+ * @see MHD_OPTION_HTTPS_HOST_CERT_CALLBACK
+ */
+typedef int
+  (*MHD_HttpsHostCertCallback) (void *cls,
+				const char *host,
+				const char **mem_key,
+				const char **mem_cert);
+
+
 /**
  * Iterator over key-value pairs.  This iterator
  * can be used to iterate over all of the cookies,
@@ -925,7 +1445,10 @@ typedef int
  * callback may want to do blocking operations) or in the next round
  * if MHD_run is used.  Returning 0 for a daemon that runs in internal
  * select mode is an error (since it would result in busy waiting) and
- * will cause the program to be aborted (abort()).
+ * will cause the program to be aborted (abort()).  To wait for data
+ * without polling, call 'MHD_suspend_connection' before returning 0
+ * and 'MHD_resume_connection' once data is available (this requires
+ * 'MHD_USE_SUSPEND_RESUME').
  *
  * @param cls extra argument to the callback
  * @param pos position in the datastream to access;
@@ -1066,13 +1589,36 @@ void
 MHD_stop_daemon (struct MHD_Daemon *daemon);
 
 
+/**
+ * Change an option of a running daemon.  Currently, only
+ * MHD_OPTION_THREAD_POOL_SIZE can be changed, and only for a daemon
+ * that was started with a thread pool: additional threads start
+ * accepting connections immediately, surplus threads stop accepting,
+ * finish the requests they are processing and exit.  The listen
+ * socket stays open throughout.  Must not be called concurrently
+ * with itself or 'MHD_stop_daemon'.
+ *
+ * @param daemon daemon to modify
+ * @param option option to set
+ * @param ... arguments to the option, depending on the option type
+ * @return MHD_YES on success, MHD_NO if setting the option failed
+ *         (or if the option cannot be changed at runtime)
+ */
+int
+MHD_set_daemon_option (struct MHD_Daemon *daemon,
+		       enum MHD_OPTION option,
+		       ...);
+
+
 /**
  * Add another client connection to the set of connections 
  * managed by MHD.  This API is usually not needed (since
  * MHD will accept inbound connections on the server socket).
  * Use this API in special cases, for example if your HTTP
  * server is behind NAT and needs to connect out to the 
- * HTTP client.
+ * HTTP client, or if connections are accepted by a thread
+ * of the application.  If the daemon runs its own event loop,
+ * the loop is woken up to process the new connection.
  *
  * The given client socket will be managed (and closed!) by MHD after
  * this call and must no longer be used directly by the application
@@ -1147,6 +1693,21 @@ int
 MHD_run (struct MHD_Daemon *daemon);
 
 
+/**
+ * Wake up the event loop(s) of a daemon so that it re-evaluates its
+ * state immediately instead of when its current wait ends (for
+ * example, after the application changed something its callbacks
+ * depend on).  Safe to call from any thread.  For a daemon using
+ * external select, the application's select returns as the sets
+ * from 'MHD_get_fdset' include the file descriptor used for this.
+ *
+ * @param daemon daemon to wake up
+ * @return MHD_YES on success, MHD_NO if the daemon is shutting down
+ */
+int
+MHD_wakeup_daemon (struct MHD_Daemon *daemon);
+
+
 /* **************** Connection handling functions ***************** */
 
 /**
@@ -1251,6 +1812,56 @@ MHD_queue_response (struct MHD_Connection *connection,
 		    struct MHD_Response *response);
 
 
+/**
+ * Suspend handling of network data for a given connection.  This can
+ * be used to dequeue a connection from MHD's event loop (external
+ * select, internal select or thread pool) for a while; with
+ * thread-per-connection, the connection's thread sleeps instead.
+ *
+ * The daemon must have been started with 'MHD_USE_SUSPEND_RESUME'.
+ * For external select, the application must include the file
+ * descriptors returned by 'MHD_get_fdset' in its select call so
+ * that resuming a connection wakes it up.
+ *
+ * Suspended connections continue to count against the total number of
+ * connections allowed (per daemon, as well as per IP, if such limits
+ * are set).  Suspended connections will NOT time out; timeouts will
+ * restart when the connection handling is resumed.  While a
+ * connection is suspended, MHD will not detect disconnects by the
+ * client.
+ *
+ * The only safe time to suspend a connection is from the
+ * 'MHD_AccessHandlerCallback' or from the 'MHD_ContentReaderCallback'
+ * of the connection's response.  A content reader that has no data
+ * yet (i.e. for a "comet" stream) should suspend the connection and
+ * return 0; the producer then calls 'MHD_resume_connection' once
+ * data is available and MHD calls the content reader again.
+ *
+ * Connections that are still suspended when the daemon is stopped
+ * are closed; the application must no longer resume them once
+ * 'MHD_stop_daemon' was called.
+ *
+ * @param connection the connection to suspend
+ */
+void
+MHD_suspend_connection (struct MHD_Connection *connection);
+
+
+/**
+ * Resume handling of network data for suspended connection.  It is
+ * safe to resume a suspended connection at any time and from any
+ * thread.  A resume that happens while the connection is still
+ * active (i.e. the producer signals new data before the content
+ * reader has returned) is remembered, and the next suspend of the
+ * connection returns to MHD's event loop right away.  The connection
+ * must not have been closed yet (see 'MHD_OPTION_NOTIFY_COMPLETED').
+ *
+ * @param connection the connection to resume
+ */
+void
+MHD_resume_connection (struct MHD_Connection *connection);
+
+
 /* **************** Response manipulation functions ***************** */
 
 /**
@@ -1377,6 +1988,84 @@ MHD_create_response_from_fd_at_offset (size_t size,
 				       off_t offset);
 
 
+/**
+ * Create a response object that streams data from a pipe or socket
+ * until the other side closes it.  The size of the body is not known
+ * in advance, so HTTP/1.1 clients receive it using chunked encoding
+ * and HTTP/1.0 clients until the connection is closed.  Where
+ * possible, MHD moves the data to the client with 'splice' without
+ * copying it through user space; for HTTPS it is read into a buffer.
+ * Unlike other responses, this response can only be queued once.
+ *
+ * @param fd pipe or socket to read the body from; will be closed
+ *        when response is destroyed; MHD switches fd to non-blocking
+ *        mode and waits for it to become readable, so data may
+ *        arrive slowly without stalling other connections
+ * @return NULL on error (i.e. invalid arguments, out of memory)
+ */
+struct MHD_Response *
+MHD_create_response_from_pipe (int fd);
+
+
+/**
+ * One segment of a response assembled with
+ * 'MHD_create_response_from_iovec'.  A segment is either
+ * a region of memory or a region of a file.
+ */
+struct MHD_IoVec
+{
+
+  /**
+   * Start of the memory region; ignored if 'fd' is not -1.
+   */
+  const void *iov_base;
+
+  /**
+   * Number of bytes in this segment.
+   */
+  size_t iov_len;
+
+  /**
+   * File descriptor referring to a file on disk with the data,
+   * -1 if the segment is in memory.  The descriptor should
+   * be in 'blocking' mode and is NOT closed by MHD.
+   */
+  int fd;
+
+  /**
+   * Offset in 'fd' at which the segment starts; ignored
+   * for memory segments.
+   */
+  off_t fd_off;
+
+};
+
+
+/**
+ * Create a response object from a list of memory and file segments.
+ * The body of the response is the concatenation of all segments.
+ * Where the platform allows it, MHD transmits the segments without
+ * copying them (using 'writev' for memory and 'sendfile' for file
+ * segments); otherwise (i.e. for HTTPS) the data is copied through a
+ * small buffer.  The response object can be extended with header
+ * information and then be used any number of times.
+ *
+ * @param iov array of segments; the array itself is copied, but
+ *        the memory and files it refers to must remain valid
+ *        until 'crfc' is called
+ * @param iovcnt number of entries in 'iov'
+ * @param crfc function to call once MHD no longer needs the
+ *        segments (to free buffers and close files), can be NULL
+ * @param crfc_cls argument to give to 'crfc'
+ * @return NULL on error (i.e. invalid arguments, out of memory)
+ */
+struct MHD_Response *
+MHD_create_response_from_iovec (const struct MHD_IoVec *iov,
+				unsigned int iovcnt,
+				MHD_ContentReaderFreeCallback crfc,
+				void *crfc_cls);
+
+
 /**
  * Function called after a protocol upgrade response was sent
  * successfully and the socket should now be controlled by some
@@ -1700,6 +2389,12 @@ union MHD_ConnectionInfo
    * daemons running).
    */
   struct MHD_Daemon *daemon;
+
+  /**
+   * MHD_YES if the kernel encrypts the responses of this TLS
+   * connection.
+   */
+  int ktls;
 };
 
 /**
@@ -1767,6 +2462,24 @@ union MHD_DaemonInfo
    * Listen socket file descriptor
    */
   int listen_fd;
+
+  /**
+   * Number of connections (for MHD_DAEMON_INFO_CURRENT_CONNECTIONS
+   * and MHD_DAEMON_INFO_WORKER_CONNECTIONS).
+   */
+  unsigned int num_connections;
+
+  /**
+   * Statistics of the worker processes (for
+   * MHD_DAEMON_INFO_PROCESS_STATISTICS).
+   */
+  struct MHD_ProcessStatistics process_statistics;
+
+  /**
+   * Statistics of the handshake pool (for
+   * MHD_DAEMON_INFO_HANDSHAKE_STATISTICS).
+   */
+  struct MHD_HandshakeStatistics handshake_statistics;
 };
 
 /**
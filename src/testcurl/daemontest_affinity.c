@@ -0,0 +1,258 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file daemontest_affinity.c
+ * @brief  Testcase for MHD_OPTION_THREAD_POOL_CPU_AFFINITY and
+ *         MHD_USE_REUSEPORT
+ * @author Christian Grothoff
+ */
+
+#include "MHD_config.h"
+#include "platform.h"
+#include <curl/curl.h>
+#include <microhttpd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WINDOWS
+#include <unistd.h>
+#endif
+
+/**
+ * CPUs the threads are bound to.
+ */
+static unsigned int cpus[2];
+
+static unsigned int num_cpus;
+
+/**
+ * Set if a handler ran on a thread that was not bound to
+ * exactly one of 'cpus'.
+ */
+static int bad_affinity;
+
+struct CBC
+{
+  char *buf;
+  size_t pos;
+  size_t size;
+};
+
+static size_t
+copyBuffer (void *ptr, size_t size, size_t nmemb, void *ctx)
+{
+  struct CBC *cbc = ctx;
+
+  if (cbc->pos + size * nmemb > cbc->size)
+    return 0;                   /* overflow */
+  memcpy (&cbc->buf[cbc->pos], ptr, size * nmemb);
+  cbc->pos += size * nmemb;
+  return size * nmemb;
+}
+
+
+#if HAVE_PTHREAD_SETAFFINITY_NP
+static void
+check_affinity ()
+{
+  cpu_set_t set;
+  unsigned int i;
+
+  if (0 != pthread_getaffinity_np (pthread_self (), sizeof (set), &set))
+    {
+      bad_affinity = 1;
+      return;
+    }
+  if (1 != CPU_COUNT (&set))
+    bad_affinity = 1;
+  for (i = 0; i < num_cpus; i++)
+    if (CPU_ISSET (cpus[i], &set))
+      return;
+  bad_affinity = 1;
+}
+#endif
+
+
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload_data, size_t *upload_data_size,
+          void **unused)
+{
+  static int ptr;
+  struct MHD_Response *response;
+  int ret;
+
+  if (0 != strcmp ("GET", method))
+    return MHD_NO;              /* unexpected method */
+  if (&ptr != *unused)
+    {
+      *unused = &ptr;
+      return MHD_YES;
+    }
+  *unused = NULL;
+#if HAVE_PTHREAD_SETAFFINITY_NP
+  if (NULL != cls)
+    check_affinity ();
+#endif
+  response = MHD_create_response_from_buffer (strlen (url),
+					      (void *) url,
+					      MHD_RESPMEM_MUST_COPY);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+static int
+query (int port)
+{
+  CURL *c;
+  char buf[2048];
+  char url[64];
+  struct CBC cbc;
+  CURLcode errornum;
+
+  cbc.buf = buf;
+  cbc.size = sizeof (buf);
+  cbc.pos = 0;
+  snprintf (url, sizeof (url), "http://127.0.0.1:%d/hello_world", port);
+  c = curl_easy_init ();
+  curl_easy_setopt (c, CURLOPT_URL, url);
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, &copyBuffer);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, &cbc);
+  curl_easy_setopt (c, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt (c, CURLOPT_TIMEOUT, 150L);
+  curl_easy_setopt (c, CURLOPT_CONNECTTIMEOUT, 15L);
+  curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_0);
+  curl_easy_setopt (c, CURLOPT_FORBID_REUSE, 1L);
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1);
+  errornum = curl_easy_perform (c);
+  curl_easy_cleanup (c);
+  if (CURLE_OK != errornum)
+    {
+      fprintf (stderr,
+               "curl_easy_perform failed: `%s'\n",
+               curl_easy_strerror (errornum));
+      return 1;
+    }
+  if ( (cbc.pos != strlen ("/hello_world")) ||
+       (0 != strncmp ("/hello_world", cbc.buf, strlen ("/hello_world"))) )
+    return 1;
+  return 0;
+}
+
+
+#if HAVE_PTHREAD_SETAFFINITY_NP
+static int
+testAffinity (unsigned int threads, int port)
+{
+  struct MHD_Daemon *d;
+  unsigned int i;
+  int ret;
+
+  bad_affinity = 0;
+  d = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG,
+                        port, NULL, NULL, &ahc_echo, "check",
+			MHD_OPTION_THREAD_POOL_SIZE, threads,
+			MHD_OPTION_THREAD_POOL_CPU_AFFINITY, num_cpus, cpus,
+			MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  ret = 0;
+  for (i = 0; i < 8; i++)
+    if (0 != query (port))
+      ret |= 2;
+  if (0 != bad_affinity)
+    ret |= 4;
+  MHD_stop_daemon (d);
+  return ret;
+}
+#endif
+
+
+#if HAVE_DECL_SO_REUSEPORT
+static int
+testReusePort (int port)
+{
+  struct MHD_Daemon *d1;
+  struct MHD_Daemon *d2;
+  unsigned int i;
+  int ret;
+
+  d1 = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG | MHD_USE_REUSEPORT,
+			 port, NULL, NULL, &ahc_echo, NULL, MHD_OPTION_END);
+  if (d1 == NULL)
+    return 1;
+  /* a second daemon can listen on the same port */
+  d2 = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG | MHD_USE_REUSEPORT,
+			 port, NULL, NULL, &ahc_echo, NULL, MHD_OPTION_END);
+  if (d2 == NULL)
+    {
+      MHD_stop_daemon (d1);
+      return 2;
+    }
+  ret = 0;
+  for (i = 0; i < 8; i++)
+    if (0 != query (port))
+      ret |= 4;
+  MHD_stop_daemon (d2);
+  MHD_stop_daemon (d1);
+  return ret;
+}
+#endif
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+#if HAVE_PTHREAD_SETAFFINITY_NP
+  cpu_set_t set;
+  unsigned int i;
+#endif
+
+  if (0 != curl_global_init (CURL_GLOBAL_WIN32))
+    return 2;
+#if HAVE_PTHREAD_SETAFFINITY_NP
+  /* use (up to two of) the CPUs we are allowed to run on */
+  if (0 != sched_getaffinity (0, sizeof (set), &set))
+    return 2;
+  num_cpus = 0;
+  for (i = 0; (i < CPU_SETSIZE) && (num_cpus < 2); i++)
+    if (CPU_ISSET (i, &set))
+      cpus[num_cpus++] = i;
+  errorCount += testAffinity (0, 1160);
+  errorCount += testAffinity (3, 1161) << 4;
+#endif
+#if HAVE_DECL_SO_REUSEPORT
+  errorCount += testReusePort (1162) << 8;
+#endif
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  curl_global_cleanup ();
+  return errorCount != 0;       /* 0 == pass */
+}
@@ -0,0 +1,234 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file daemontest_connection_budget.c
+ * @brief  Testcase for MHD_OPTION_CONNECTION_LIMIT being enforced
+ *         for the daemon as a whole when using a thread pool
+ * @author Christian Grothoff
+ */
+
+#include "MHD_config.h"
+#include "platform.h"
+#include <microhttpd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef WINDOWS
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
+
+#define LIMIT 4
+
+#define REQUEST "GET /hello_world HTTP/1.0\r\n\r\n"
+
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload_data, size_t *upload_data_size,
+          void **unused)
+{
+  struct MHD_Response *response;
+  int ret;
+
+  response = MHD_create_response_from_buffer (strlen (url),
+					      (void *) url,
+					      MHD_RESPMEM_MUST_COPY);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+static int
+open_connection (int port)
+{
+  struct sockaddr_in sin;
+  int fd;
+
+  fd = SOCKET (PF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      fprintf (stderr, "socket: %m\n");
+      return -1;
+    }
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = htonl (0x7f000001);
+  if (CONNECT (fd, (struct sockaddr *) &sin, sizeof (sin)) < 0)
+    {
+      fprintf (stderr, "connect: %m\n");
+      CLOSE (fd);
+      return -1;
+    }
+  return fd;
+}
+
+
+/**
+ * Wait (up to two seconds) for the daemon to report the given
+ * number of connections.
+ */
+static int
+wait_for_connections (struct MHD_Daemon *d, unsigned int expected)
+{
+  const union MHD_DaemonInfo *info;
+  unsigned int i;
+
+  for (i = 0; i < 200; i++)
+    {
+      info = MHD_get_daemon_info (d, MHD_DAEMON_INFO_CURRENT_CONNECTIONS);
+      if (NULL == info)
+	return MHD_NO;
+      if (expected == info->num_connections)
+	return MHD_YES;
+      usleep (10000);
+    }
+  fprintf (stderr, "Expected %u connections, daemon has %u\n",
+	   expected, info->num_connections);
+  return MHD_NO;
+}
+
+
+/**
+ * Check if the daemon closed or answered on the given socket.
+ *
+ * @param wait_ms how long to wait for the daemon
+ * @return number of bytes received (0 if the socket was closed),
+ *         -1 if nothing happened within 'wait_ms'
+ */
+static int
+receive (int fd, unsigned int wait_ms)
+{
+  fd_set rs;
+  struct timeval tv;
+  char buf[128];
+
+  FD_ZERO (&rs);
+  FD_SET (fd, &rs);
+  tv.tv_sec = wait_ms / 1000;
+  tv.tv_usec = (wait_ms % 1000) * 1000;
+  if (1 != select (fd + 1, &rs, NULL, NULL, &tv))
+    return -1;
+  return recv (fd, buf, sizeof (buf), MSG_DONTWAIT);
+}
+
+
+static int
+testBudget (unsigned int threads, int port)
+{
+  struct MHD_Daemon *d;
+  const union MHD_DaemonInfo *info;
+  int fds[LIMIT];
+  int extra;
+  unsigned int i;
+  unsigned int sum;
+  int ret;
+
+  d = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG,
+                        port, NULL, NULL, &ahc_echo, NULL,
+			MHD_OPTION_THREAD_POOL_SIZE, threads,
+			MHD_OPTION_CONNECTION_LIMIT, (unsigned int) LIMIT,
+			MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  ret = 0;
+  for (i = 0; i < LIMIT; i++)
+    fds[i] = open_connection (port);
+  for (i = 0; i < LIMIT; i++)
+    if (-1 == fds[i])
+      ret |= 2;
+  if (0 != ret)
+    goto cleanup;
+  /* all connections up to the limit must be accepted, no matter
+     which thread picked them up */
+  if (MHD_YES != wait_for_connections (d, LIMIT))
+    ret |= 4;
+  for (i = 0; i < LIMIT; i++)
+    if (-1 != receive (fds[i], 0))
+      ret |= 8;
+  sum = 0;
+  for (i = 0; i < threads; i++)
+    {
+      info = MHD_get_daemon_info (d, MHD_DAEMON_INFO_WORKER_CONNECTIONS, i);
+      if (NULL == info)
+	ret |= 16;
+      else
+	sum += info->num_connections;
+    }
+  if ( (threads > 0) && (sum != LIMIT) )
+    ret |= 16;
+  if (NULL != MHD_get_daemon_info (d, MHD_DAEMON_INFO_WORKER_CONNECTIONS,
+				   threads))
+    ret |= 16;
+
+  /* one more is above the limit and must not be served until
+     another connection goes away */
+  extra = open_connection (port);
+  if (-1 == extra)
+    {
+      ret |= 32;
+      goto cleanup;
+    }
+  if (strlen (REQUEST) != send (extra, REQUEST, strlen (REQUEST), 0))
+    ret |= 32;
+  if (-1 != receive (extra, 200))
+    ret |= 32;
+  if (MHD_YES != wait_for_connections (d, LIMIT))
+    ret |= 64;
+  CLOSE (fds[0]);
+  fds[0] = -1;
+  if (0 >= receive (extra, 2000))
+    {
+      fprintf (stderr, "Connection not served after slot was freed\n");
+      ret |= 64;
+    }
+  CLOSE (extra);
+
+ cleanup:
+  for (i = 0; i < LIMIT; i++)
+    if (-1 != fds[i])
+      CLOSE (fds[i]);
+  if ( (0 == (ret & (2 | 32))) &&
+       (MHD_YES != wait_for_connections (d, 0)) )
+    ret |= 128;
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  errorCount += testBudget (0, 1155);
+  errorCount += testBudget (2, 1156) << 8;
+  errorCount += testBudget (LIMIT + 1, 1157) << 16;
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  return errorCount != 0;       /* 0 == pass */
+}
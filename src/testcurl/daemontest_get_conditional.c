@@ -0,0 +1,264 @@
+/* DO NOT CHANGE THIS LINE */
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file daemontest_get_conditional.c
+ * @brief  Testcase for libmicrohttpd handling of conditional GET requests
+ * @author Christian Grothoff
+ */
+
+#include "MHD_config.h"
+#include "platform.h"
+#include <curl/curl.h>
+#include <microhttpd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <fcntl.h>
+
+#ifndef WINDOWS
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#define TESTSTR "/* DO NOT CHANGE THIS LINE */"
+
+#define BUFFER_ETAG "\"buffer-v1\""
+
+/**
+ * Response shared by all requests for "/file".
+ */
+static struct MHD_Response *file_response;
+
+/**
+ * Headers seen by the client in the last reply.
+ */
+static char etag[128];
+
+static char last_modified[128];
+
+struct CBC
+{
+  char *buf;
+  size_t pos;
+  size_t size;
+};
+
+static size_t
+copyBuffer (void *ptr, size_t size, size_t nmemb, void *ctx)
+{
+  struct CBC *cbc = ctx;
+
+  if (cbc->pos + size * nmemb > cbc->size)
+    return 0;                   /* overflow */
+  memcpy (&cbc->buf[cbc->pos], ptr, size * nmemb);
+  cbc->pos += size * nmemb;
+  return size * nmemb;
+}
+
+
+static void
+grab_header (const char *line, size_t len, const char *name, char *dst)
+{
+  size_t nlen = strlen (name);
+
+  if ( (len <= nlen + 2) ||
+       (0 != strncasecmp (line, name, nlen)) ||
+       (line[nlen] != ':') )
+    return;
+  len -= nlen + 2;
+  while ((len > 0) && ((line[nlen + 2 + len - 1] == '\r') ||
+		       (line[nlen + 2 + len - 1] == '\n')))
+    len--;
+  if (len >= 128)
+    return;
+  memcpy (dst, &line[nlen + 2], len);
+  dst[len] = '\0';
+}
+
+
+static size_t
+copyHeader (void *ptr, size_t size, size_t nmemb, void *ctx)
+{
+  grab_header (ptr, size * nmemb, MHD_HTTP_HEADER_ETAG, etag);
+  grab_header (ptr, size * nmemb, MHD_HTTP_HEADER_LAST_MODIFIED, last_modified);
+  return size * nmemb;
+}
+
+
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload_data, size_t *upload_data_size,
+          void **unused)
+{
+  static int ptr;
+  struct MHD_Response *response;
+  int ret;
+
+  if (0 != strcmp ("GET", method))
+    return MHD_NO;              /* unexpected method */
+  if (&ptr != *unused)
+    {
+      *unused = &ptr;
+      return MHD_YES;
+    }
+  *unused = NULL;
+  if (0 == strcmp (url, "/file"))
+    return MHD_queue_response (connection, MHD_HTTP_OK, file_response);
+  response = MHD_create_response_from_buffer (strlen (TESTSTR),
+					      TESTSTR,
+					      MHD_RESPMEM_PERSISTENT);
+  MHD_add_response_header (response, MHD_HTTP_HEADER_ETAG, BUFFER_ETAG);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+/**
+ * Fetch a URL with the given extra request header.
+ *
+ * @return HTTP status code, 0 on error
+ */
+static long
+query (int port, const char *path, const char *header, struct CBC *cbc)
+{
+  CURL *c;
+  struct curl_slist *hdrs;
+  char url[128];
+  long code;
+
+  cbc->pos = 0;
+  etag[0] = '\0';
+  last_modified[0] = '\0';
+  hdrs = NULL;
+  if (header != NULL)
+    hdrs = curl_slist_append (hdrs, header);
+  snprintf (url, sizeof (url), "http://127.0.0.1:%d%s", port, path);
+  c = curl_easy_init ();
+  curl_easy_setopt (c, CURLOPT_URL, url);
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, &copyBuffer);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, cbc);
+  curl_easy_setopt (c, CURLOPT_HEADERFUNCTION, &copyHeader);
+  curl_easy_setopt (c, CURLOPT_HTTPHEADER, hdrs);
+  curl_easy_setopt (c, CURLOPT_TIMEOUT, 150L);
+  curl_easy_setopt (c, CURLOPT_CONNECTTIMEOUT, 15L);
+  curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  /* NOTE: use of CONNECTTIMEOUT without also
+     setting NOSIGNAL results in really weird
+     crashes on my system!*/
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1);
+  code = 0;
+  if (CURLE_OK == curl_easy_perform (c))
+    curl_easy_getinfo (c, CURLINFO_RESPONSE_CODE, &code);
+  curl_easy_cleanup (c);
+  curl_slist_free_all (hdrs);
+  return code;
+}
+
+
+static int
+testConditional (unsigned int flags, int port)
+{
+  struct MHD_Daemon *d;
+  char buf[2048];
+  char hdr[256];
+  char tag[128];
+  struct CBC cbc;
+  int fd;
+  int ret;
+
+  cbc.buf = buf;
+  cbc.size = sizeof (buf);
+  fd = open ("daemontest_get_conditional.c", O_RDONLY);
+  if (fd == -1)
+    return 1;
+  file_response = MHD_create_response_from_fd (strlen (TESTSTR), fd);
+  d = MHD_start_daemon (flags | MHD_USE_DEBUG | MHD_USE_CONDITIONAL_REQUESTS,
+                        port, NULL, NULL, &ahc_echo, NULL, MHD_OPTION_END);
+  if (d == NULL)
+    {
+      MHD_destroy_response (file_response);
+      return 1;
+    }
+  ret = 0;
+  /* unconditional request, validators computed from the file */
+  if ( (200 != query (port, "/file", NULL, &cbc)) ||
+       (cbc.pos != strlen (TESTSTR)) ||
+       (etag[0] != '"') ||
+       (last_modified[0] == '\0') )
+    ret |= 2;
+  strcpy (tag, etag);
+  snprintf (hdr, sizeof (hdr), "If-None-Match: \"other\", %s", tag);
+  if ( (304 != query (port, "/file", hdr, &cbc)) ||
+       (cbc.pos != 0) ||
+       (0 != strcmp (etag, tag)) )
+    ret |= 4;
+  snprintf (hdr, sizeof (hdr), "If-Modified-Since: %s", last_modified);
+  if (304 != query (port, "/file", hdr, &cbc))
+    ret |= 8;
+  if ( (200 != query (port, "/file",
+		      "If-Modified-Since: Sat, 01 Jan 2000 00:00:00 GMT",
+		      &cbc)) ||
+       (cbc.pos != strlen (TESTSTR)) )
+    ret |= 16;
+  /* 'If-None-Match' takes precedence over 'If-Modified-Since' */
+  if (200 != query (port, "/file", "If-None-Match: \"other\"", &cbc))
+    ret |= 32;
+  /* application-provided entity tag */
+  if (304 != query (port, "/buffer", "If-None-Match: W/" BUFFER_ETAG, &cbc))
+    ret |= 64;
+  if (200 != query (port, "/buffer", "If-None-Match: \"buffer-v2\"", &cbc))
+    ret |= 128;
+  /* the application's entity tag replaces the generated one, and
+     the 304 response follows the change */
+  MHD_add_response_header (file_response, MHD_HTTP_HEADER_ETAG, "\"app\"");
+  snprintf (hdr, sizeof (hdr), "If-None-Match: %s", tag);
+  if (200 != query (port, "/file", hdr, &cbc))
+    ret |= 256;
+  if ( (304 != query (port, "/file", "If-None-Match: \"app\"", &cbc)) ||
+       (0 != strcmp (etag, "\"app\"")) )
+    ret |= 512;
+  MHD_stop_daemon (d);
+  MHD_destroy_response (file_response);
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  if (0 != curl_global_init (CURL_GLOBAL_WIN32))
+    return 2;
+  errorCount += testConditional (MHD_USE_SELECT_INTERNALLY, 1136);
+  errorCount += testConditional (MHD_USE_THREAD_PER_CONNECTION, 1137) << 10;
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  curl_global_cleanup ();
+  return errorCount != 0;       /* 0 == pass */
+}
@@ -0,0 +1,214 @@
+/* DO NOT CHANGE THIS LINE */
+/*
+     This file is part of libmicrohttpd
+     (C) 2007, 2009, 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file daemontest_get_iovec.c
+ * @brief  Testcase for libmicrohttpd response from memory and file segments
+ * @author Christian Grothoff
+ */
+
+#include "MHD_config.h"
+#include "platform.h"
+#include <curl/curl.h>
+#include <microhttpd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <fcntl.h>
+
+#ifndef WINDOWS
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#define TESTSTR "/* DO NOT CHANGE THIS LINE */"
+
+#define PREFIX "<html><body>"
+
+#define SUFFIX "</body></html>"
+
+#define EXPECTED PREFIX TESTSTR SUFFIX TESTSTR
+
+static int oneone;
+
+static unsigned int freed;
+
+struct CBC
+{
+  char *buf;
+  size_t pos;
+  size_t size;
+};
+
+static size_t
+copyBuffer (void *ptr, size_t size, size_t nmemb, void *ctx)
+{
+  struct CBC *cbc = ctx;
+
+  if (cbc->pos + size * nmemb > cbc->size)
+    return 0;                   /* overflow */
+  memcpy (&cbc->buf[cbc->pos], ptr, size * nmemb);
+  cbc->pos += size * nmemb;
+  return size * nmemb;
+}
+
+
+static void
+close_segments (void *cls)
+{
+  int *fd = cls;
+
+  close (*fd);
+  free (fd);
+  freed++;
+}
+
+
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload_data, size_t *upload_data_size,
+          void **unused)
+{
+  static int ptr;
+  const char *me = cls;
+  struct MHD_Response *response;
+  struct MHD_IoVec iov[4];
+  int *fd;
+  int ret;
+
+  if (0 != strcmp (me, method))
+    return MHD_NO;              /* unexpected method */
+  if (&ptr != *unused)
+    {
+      *unused = &ptr;
+      return MHD_YES;
+    }
+  *unused = NULL;
+  fd = malloc (sizeof (int));
+  if (fd == NULL)
+    abort ();
+  *fd = open ("daemontest_get_iovec.c", O_RDONLY);
+  if (*fd == -1)
+    {
+      fprintf (stderr, "Failed to open `%s': %s\n",
+	       "daemontest_get_iovec.c",
+	       STRERROR (errno));
+      exit (1);
+    }
+  memset (iov, 0, sizeof (iov));
+  iov[0].iov_base = PREFIX;
+  iov[0].iov_len = strlen (PREFIX);
+  iov[0].fd = -1;
+  iov[1].iov_len = strlen (TESTSTR);
+  iov[1].fd = *fd;
+  iov[1].fd_off = 0;
+  iov[2].iov_base = SUFFIX;
+  iov[2].iov_len = strlen (SUFFIX);
+  iov[2].fd = -1;
+  /* same file region once more */
+  iov[3].iov_len = strlen (TESTSTR);
+  iov[3].fd = *fd;
+  iov[3].fd_off = 0;
+  response = MHD_create_response_from_iovec (iov, 4, &close_segments, fd);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  if (ret == MHD_NO)
+    abort ();
+  return ret;
+}
+
+
+static int
+testGet (unsigned int flags, int port, int err)
+{
+  struct MHD_Daemon *d;
+  CURL *c;
+  char buf[2048];
+  char url[64];
+  struct CBC cbc;
+  CURLcode errornum;
+
+  cbc.buf = buf;
+  cbc.size = 2048;
+  cbc.pos = 0;
+  freed = 0;
+  d = MHD_start_daemon (flags | MHD_USE_DEBUG,
+                        port, NULL, NULL, &ahc_echo, "GET", MHD_OPTION_END);
+  if (d == NULL)
+    return err;
+  snprintf (url, sizeof (url), "http://127.0.0.1:%d/", port);
+  c = curl_easy_init ();
+  curl_easy_setopt (c, CURLOPT_URL, url);
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, &copyBuffer);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, &cbc);
+  curl_easy_setopt (c, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt (c, CURLOPT_TIMEOUT, 150L);
+  curl_easy_setopt (c, CURLOPT_CONNECTTIMEOUT, 15L);
+  if (oneone)
+    curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  else
+    curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_0);
+  /* NOTE: use of CONNECTTIMEOUT without also
+     setting NOSIGNAL results in really weird
+     crashes on my system!*/
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1);
+  if (CURLE_OK != (errornum = curl_easy_perform (c)))
+    {
+      fprintf (stderr,
+               "curl_easy_perform failed: `%s'\n",
+               curl_easy_strerror (errornum));
+      curl_easy_cleanup (c);
+      MHD_stop_daemon (d);
+      return 2 * err;
+    }
+  curl_easy_cleanup (c);
+  MHD_stop_daemon (d);
+  if (cbc.pos != strlen (EXPECTED))
+    return 4 * err;
+  if (0 != strncmp (EXPECTED, cbc.buf, strlen (EXPECTED)))
+    return 8 * err;
+  if (freed != 1)
+    return 16 * err;
+  return 0;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  oneone = NULL != strstr (argv[0], "11");
+  if (0 != curl_global_init (CURL_GLOBAL_WIN32))
+    return 2;
+  errorCount += testGet (MHD_USE_SELECT_INTERNALLY, 1130, 1);
+  errorCount += testGet (MHD_USE_THREAD_PER_CONNECTION, 1131, 32);
+  errorCount += testGet (MHD_USE_SELECT_INTERNALLY | MHD_USE_POLL, 1132, 1024);
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  curl_global_cleanup ();
+  return errorCount != 0;       /* 0 == pass */
+}
@@ -0,0 +1,333 @@
+/* DO NOT CHANGE THIS LINE */
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file daemontest_get_pipe.c
+ * @brief  Testcase for libmicrohttpd response from a pipe
+ * @author Christian Grothoff
+ */
+
+#include "MHD_config.h"
+#include "platform.h"
+#include <curl/curl.h>
+#include <microhttpd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <fcntl.h>
+
+#include <pthread.h>
+
+#ifndef WINDOWS
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#define TESTSTR "/* DO NOT CHANGE THIS LINE */"
+
+/**
+ * How long the writer of the "/slow" pipe waits before producing
+ * data (in seconds).
+ */
+#define SLOW_DELAY 2
+
+static int oneone;
+
+/**
+ * Thread writing to the pipe of the "/slow" response.
+ */
+static pthread_t slow_writer;
+
+/**
+ * Set once 'slow_writer' wrote the data.
+ */
+static volatile int slow_written;
+
+struct CBC
+{
+  char *buf;
+  size_t pos;
+  size_t size;
+};
+
+static size_t
+copyBuffer (void *ptr, size_t size, size_t nmemb, void *ctx)
+{
+  struct CBC *cbc = ctx;
+
+  if (cbc->pos + size * nmemb > cbc->size)
+    return 0;                   /* overflow */
+  memcpy (&cbc->buf[cbc->pos], ptr, size * nmemb);
+  cbc->pos += size * nmemb;
+  return size * nmemb;
+}
+
+
+static void *
+write_slowly (void *cls)
+{
+  int fd = *(int *) cls;
+  unsigned int i;
+
+  free (cls);
+  sleep (SLOW_DELAY);
+  slow_written = 1;
+  for (i = 0; i < 3; i++)
+    if (strlen (TESTSTR) != write (fd, TESTSTR, strlen (TESTSTR)))
+      abort ();
+  close (fd);
+  return NULL;
+}
+
+
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload_data, size_t *upload_data_size,
+          void **unused)
+{
+  static int ptr;
+  const char *me = cls;
+  struct MHD_Response *response;
+  int p[2];
+  int ret;
+  unsigned int i;
+
+  if (0 != strcmp (me, method))
+    return MHD_NO;              /* unexpected method */
+  if (&ptr != *unused)
+    {
+      *unused = &ptr;
+      return MHD_YES;
+    }
+  *unused = NULL;
+  if (0 != pipe (p))
+    abort ();
+  if (0 == strcmp (url, "/slow"))
+    {
+      /* the data only arrives later, MHD must not wait for it */
+      int *fd = malloc (sizeof (int));
+
+      if (NULL == fd)
+	abort ();
+      *fd = p[1];
+      if (0 != pthread_create (&slow_writer, NULL, &write_slowly, fd))
+	abort ();
+    }
+  else
+    {
+      /* small enough to fit into the pipe buffer */
+      for (i = 0; i < 3; i++)
+	if (strlen (TESTSTR) != write (p[1], TESTSTR, strlen (TESTSTR)))
+	  abort ();
+      close (p[1]);
+    }
+  response = MHD_create_response_from_pipe (p[0]);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  if (ret == MHD_NO)
+    abort ();
+  return ret;
+}
+
+
+static int
+testGet (unsigned int flags, int port, int err)
+{
+  struct MHD_Daemon *d;
+  CURL *c;
+  char buf[2048];
+  char url[64];
+  struct CBC cbc;
+  CURLcode errornum;
+
+  cbc.buf = buf;
+  cbc.size = 2048;
+  cbc.pos = 0;
+  d = MHD_start_daemon (flags | MHD_USE_DEBUG,
+                        port, NULL, NULL, &ahc_echo, "GET", MHD_OPTION_END);
+  if (d == NULL)
+    return err;
+  snprintf (url, sizeof (url), "http://127.0.0.1:%d/", port);
+  c = curl_easy_init ();
+  curl_easy_setopt (c, CURLOPT_URL, url);
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, &copyBuffer);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, &cbc);
+  curl_easy_setopt (c, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt (c, CURLOPT_TIMEOUT, 150L);
+  curl_easy_setopt (c, CURLOPT_CONNECTTIMEOUT, 15L);
+  if (oneone)
+    curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  else
+    curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_0);
+  /* NOTE: use of CONNECTTIMEOUT without also
+     setting NOSIGNAL results in really weird
+     crashes on my system!*/
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1);
+  if (CURLE_OK != (errornum = curl_easy_perform (c)))
+    {
+      fprintf (stderr,
+               "curl_easy_perform failed: `%s'\n",
+               curl_easy_strerror (errornum));
+      curl_easy_cleanup (c);
+      MHD_stop_daemon (d);
+      return 2 * err;
+    }
+  curl_easy_cleanup (c);
+  MHD_stop_daemon (d);
+  if (cbc.pos != 3 * strlen (TESTSTR))
+    return 4 * err;
+  if (0 != strncmp (TESTSTR TESTSTR TESTSTR, cbc.buf, 3 * strlen (TESTSTR)))
+    return 8 * err;
+  return 0;
+}
+
+
+/**
+ * Download a path from the daemon.
+ *
+ * @param port port of the daemon
+ * @param path path to request
+ * @param cbc where to store the body
+ * @return curl's result
+ */
+static CURLcode
+download (int port, const char *path, struct CBC *cbc)
+{
+  CURL *c;
+  char url[64];
+  CURLcode errornum;
+
+  snprintf (url, sizeof (url), "http://127.0.0.1:%d%s", port, path);
+  c = curl_easy_init ();
+  curl_easy_setopt (c, CURLOPT_URL, url);
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, &copyBuffer);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, cbc);
+  curl_easy_setopt (c, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt (c, CURLOPT_TIMEOUT, 150L);
+  curl_easy_setopt (c, CURLOPT_CONNECTTIMEOUT, 15L);
+  if (oneone)
+    curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  else
+    curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_0);
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1);
+  errornum = curl_easy_perform (c);
+  if (CURLE_OK != errornum)
+    fprintf (stderr,
+	     "curl_easy_perform failed: `%s'\n",
+	     curl_easy_strerror (errornum));
+  curl_easy_cleanup (c);
+  return errornum;
+}
+
+
+struct SlowClient
+{
+  int port;
+  struct CBC cbc;
+  CURLcode result;
+};
+
+
+static void *
+get_slow (void *cls)
+{
+  struct SlowClient *sc = cls;
+
+  sc->result = download (sc->port, "/slow", &sc->cbc);
+  return NULL;
+}
+
+
+/**
+ * Request a pipe response whose data arrives only after a delay
+ * and check that another request is served in the meantime.
+ */
+static int
+testDelayed (unsigned int flags, int port, int err)
+{
+  struct MHD_Daemon *d;
+  pthread_t client;
+  struct SlowClient sc;
+  char slow_buf[2048];
+  char buf[2048];
+  struct CBC cbc;
+  int ret;
+
+  slow_written = 0;
+  sc.port = port;
+  sc.cbc.buf = slow_buf;
+  sc.cbc.size = sizeof (slow_buf);
+  sc.cbc.pos = 0;
+  cbc.buf = buf;
+  cbc.size = sizeof (buf);
+  cbc.pos = 0;
+  d = MHD_start_daemon (flags | MHD_USE_DEBUG,
+                        port, NULL, NULL, &ahc_echo, "GET", MHD_OPTION_END);
+  if (d == NULL)
+    return err;
+  if (0 != pthread_create (&client, NULL, &get_slow, &sc))
+    abort ();
+  /* give the daemon time to start waiting for the slow pipe */
+  usleep (250 * 1000);
+  ret = 0;
+  if (CURLE_OK != download (port, "/fast", &cbc))
+    ret |= 2 * err;
+  else if (slow_written)
+    ret |= 4 * err; /* the daemon waited for the slow pipe */
+  pthread_join (client, NULL);
+  pthread_join (slow_writer, NULL);
+  MHD_stop_daemon (d);
+  if (CURLE_OK != sc.result)
+    ret |= 8 * err;
+  if ( (cbc.pos != 3 * strlen (TESTSTR)) ||
+       (sc.cbc.pos != 3 * strlen (TESTSTR)) ||
+       (0 != strncmp (TESTSTR TESTSTR TESTSTR, sc.cbc.buf,
+		      3 * strlen (TESTSTR))) )
+    ret |= 16 * err;
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  oneone = NULL != strstr (argv[0], "11");
+  if (0 != curl_global_init (CURL_GLOBAL_WIN32))
+    return 2;
+  errorCount += testGet (MHD_USE_SELECT_INTERNALLY, 1138, 1);
+  errorCount += testGet (MHD_USE_THREAD_PER_CONNECTION, 1139, 16);
+  errorCount += testGet (MHD_USE_SELECT_INTERNALLY | MHD_USE_POLL, 1140, 256);
+  errorCount += testDelayed (MHD_USE_SELECT_INTERNALLY, 1181, 1 << 12);
+  errorCount += testDelayed (MHD_USE_THREAD_PER_CONNECTION, 1182, 1 << 17);
+  errorCount += testDelayed (MHD_USE_SELECT_INTERNALLY | MHD_USE_POLL,
+			     1183, 1 << 22);
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  curl_global_cleanup ();
+  return errorCount != 0;       /* 0 == pass */
+}
@@ -0,0 +1,214 @@
+/* DO NOT CHANGE THIS LINE */
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file daemontest_get_range.c
+ * @brief  Testcase for libmicrohttpd handling of 'Range' requests
+ * @author Christian Grothoff
+ */
+
+#include "MHD_config.h"
+#include "platform.h"
+#include <curl/curl.h>
+#include <microhttpd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <fcntl.h>
+
+#ifndef WINDOWS
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#define TESTSTR "/* DO NOT CHANGE THIS LINE */"
+
+struct CBC
+{
+  char *buf;
+  size_t pos;
+  size_t size;
+};
+
+static size_t
+copyBuffer (void *ptr, size_t size, size_t nmemb, void *ctx)
+{
+  struct CBC *cbc = ctx;
+
+  if (cbc->pos + size * nmemb > cbc->size)
+    return 0;                   /* overflow */
+  memcpy (&cbc->buf[cbc->pos], ptr, size * nmemb);
+  cbc->pos += size * nmemb;
+  return size * nmemb;
+}
+
+
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload_data, size_t *upload_data_size,
+          void **unused)
+{
+  static int ptr;
+  struct MHD_Response *response;
+  int ret;
+  int fd;
+
+  if (0 != strcmp ("GET", method))
+    return MHD_NO;              /* unexpected method */
+  if (&ptr != *unused)
+    {
+      *unused = &ptr;
+      return MHD_YES;
+    }
+  *unused = NULL;
+  if (0 == strcmp (url, "/file"))
+    {
+      fd = open ("daemontest_get_range.c", O_RDONLY);
+      if (fd == -1)
+	{
+	  fprintf (stderr, "Failed to open `%s': %s\n",
+		   "daemontest_get_range.c",
+		   STRERROR (errno));
+	  exit (1);
+	}
+      /* skip the leading slash */
+      response = MHD_create_response_from_fd_at_offset (strlen (TESTSTR) - 1,
+							fd, 1);
+    }
+  else
+    {
+      response = MHD_create_response_from_buffer (strlen (TESTSTR) - 1,
+						  &TESTSTR[1],
+						  MHD_RESPMEM_PERSISTENT);
+    }
+  MHD_add_response_header (response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain");
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  if (ret == MHD_NO)
+    abort ();
+  return ret;
+}
+
+
+/**
+ * Fetch a URL with the given 'Range' header.
+ *
+ * @return HTTP status code, 0 on error
+ */
+static long
+query (int port, const char *path, const char *range, struct CBC *cbc)
+{
+  CURL *c;
+  char url[128];
+  long code;
+
+  cbc->pos = 0;
+  snprintf (url, sizeof (url), "http://127.0.0.1:%d%s", port, path);
+  c = curl_easy_init ();
+  curl_easy_setopt (c, CURLOPT_URL, url);
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, &copyBuffer);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, cbc);
+  curl_easy_setopt (c, CURLOPT_RANGE, range);
+  curl_easy_setopt (c, CURLOPT_TIMEOUT, 150L);
+  curl_easy_setopt (c, CURLOPT_CONNECTTIMEOUT, 15L);
+  curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  /* NOTE: use of CONNECTTIMEOUT without also
+     setting NOSIGNAL results in really weird
+     crashes on my system!*/
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1);
+  code = 0;
+  if (CURLE_OK != curl_easy_perform (c))
+    {
+      curl_easy_cleanup (c);
+      return 0;
+    }
+  curl_easy_getinfo (c, CURLINFO_RESPONSE_CODE, &code);
+  curl_easy_cleanup (c);
+  return code;
+}
+
+
+static int
+testRange (unsigned int flags, int port, const char *path)
+{
+  struct MHD_Daemon *d;
+  char buf[2048];
+  struct CBC cbc;
+  int ret;
+
+  cbc.buf = buf;
+  cbc.size = sizeof (buf) - 1;
+  d = MHD_start_daemon (flags | MHD_USE_DEBUG | MHD_USE_RANGE_REQUESTS,
+                        port, NULL, NULL, &ahc_echo, NULL, MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  ret = 0;
+  /* single range: "* DO" */
+  if ( (206 != query (port, path, "0-3", &cbc)) ||
+       (cbc.pos != 4) ||
+       (0 != strncmp (buf, "* DO", 4)) )
+    ret |= 2;
+  /* suffix range: the last four bytes */
+  if ( (206 != query (port, path, "-4", &cbc)) ||
+       (cbc.pos != 4) ||
+       (0 != strncmp (buf, "E */", 4)) )
+    ret |= 4;
+  /* multiple ranges: multipart body with both parts */
+  if (206 != query (port, path, "0-1,9-14", &cbc))
+    ret |= 8;
+  buf[cbc.pos] = '\0';
+  if ( (NULL == strstr (buf, "Content-Range: bytes 0-1/28")) ||
+       (NULL == strstr (buf, "Content-Range: bytes 9-14/28")) ||
+       (NULL == strstr (buf, "CHANGE")) ||
+       (NULL == strstr (buf, "Content-Type: text/plain")) )
+    ret |= 16;
+  /* unsatisfiable */
+  if (416 != query (port, path, "100-200", &cbc))
+    ret |= 32;
+  /* malformed ranges are ignored */
+  if ( (200 != query (port, path, "5-2", &cbc)) ||
+       (cbc.pos != strlen (TESTSTR) - 1) )
+    ret |= 64;
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  if (0 != curl_global_init (CURL_GLOBAL_WIN32))
+    return 2;
+  errorCount += testRange (MHD_USE_SELECT_INTERNALLY, 1133, "/file");
+  errorCount += testRange (MHD_USE_SELECT_INTERNALLY, 1134, "/buffer") << 8;
+  errorCount += testRange (MHD_USE_THREAD_PER_CONNECTION, 1135, "/file") << 16;
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  curl_global_cleanup ();
+  return errorCount != 0;       /* 0 == pass */
+}
@@ -0,0 +1,316 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file daemontest_handler_pool.c
+ * @brief  Testcase for running blocking access handlers in a
+ *         handler pool (MHD_OPTION_HANDLER_POOL_SIZE)
+ * @author Christian Grothoff
+ */
+
+#include "MHD_config.h"
+#include "platform.h"
+#include <curl/curl.h>
+#include <microhttpd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WINDOWS
+#include <unistd.h>
+#include <sys/time.h>
+#endif
+
+/**
+ * Number of requests issued in parallel.
+ */
+#define REQUESTS 4
+
+/**
+ * How long each handler blocks (in ms).
+ */
+#define HANDLER_DELAY 500
+
+#define UPLOAD "Hello, handler pool!"
+
+struct CBC
+{
+  char *buf;
+  size_t pos;
+  size_t size;
+};
+
+/**
+ * Per-request state of the access handler.
+ */
+struct Request
+{
+  /**
+   * Number of upload bytes received so far.
+   */
+  size_t uploaded;
+};
+
+static size_t
+copyBuffer (void *ptr, size_t size, size_t nmemb, void *ctx)
+{
+  struct CBC *cbc = ctx;
+
+  if (cbc->pos + size * nmemb > cbc->size)
+    return 0;                   /* overflow */
+  memcpy (&cbc->buf[cbc->pos], ptr, size * nmemb);
+  cbc->pos += size * nmemb;
+  return size * nmemb;
+}
+
+
+static size_t
+putBuffer (void *stream, size_t size, size_t nmemb, void *ptr)
+{
+  unsigned int *pos = ptr;
+  unsigned int wrt;
+
+  wrt = size * nmemb;
+  if (wrt > strlen (UPLOAD) - (*pos))
+    wrt = strlen (UPLOAD) - (*pos);
+  memcpy (stream, &UPLOAD[*pos], wrt);
+  (*pos) += wrt;
+  return wrt;
+}
+
+
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload_data, size_t *upload_data_size,
+          void **unused)
+{
+  struct Request *req = *unused;
+  struct MHD_Response *response;
+  char answer[32];
+  int ret;
+
+  if (NULL == req)
+    {
+      req = malloc (sizeof (struct Request));
+      if (NULL == req)
+	return MHD_NO;
+      req->uploaded = 0;
+      *unused = req;
+      return MHD_YES;
+    }
+  if (0 != *upload_data_size)
+    {
+      if (0 != memcmp (upload_data, &UPLOAD[req->uploaded],
+		       *upload_data_size))
+	abort ();
+      req->uploaded += *upload_data_size;
+      *upload_data_size = 0;
+      return MHD_YES;
+    }
+  /* simulate a blocking backend */
+  usleep (HANDLER_DELAY * 1000);
+  snprintf (answer, sizeof (answer), "%s %u", method,
+	    (unsigned int) req->uploaded);
+  response = MHD_create_response_from_buffer (strlen (answer),
+					      answer,
+					      MHD_RESPMEM_MUST_COPY);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+static void
+request_completed (void *cls,
+		   struct MHD_Connection *connection,
+		   void **con_cls,
+		   enum MHD_RequestTerminationCode toe)
+{
+  free (*con_cls);
+  *con_cls = NULL;
+}
+
+
+static unsigned long long
+now_ms ()
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+
+/**
+ * Issue REQUESTS parallel requests against the daemon (driving it
+ * from the same select loop if it has no thread of its own) and
+ * check that the blocking handlers ran in parallel.
+ */
+static int
+testParallel (unsigned int flags, int port, unsigned int threads, int put)
+{
+  struct MHD_Daemon *d;
+  CURL *c[REQUESTS];
+  char buf[REQUESTS][64];
+  struct CBC cbc[REQUESTS];
+  unsigned int upload_pos[REQUESTS];
+  char url[64];
+  char expected[32];
+  CURLM *multi;
+  fd_set rs;
+  fd_set ws;
+  fd_set es;
+  int max;
+  int running;
+  long curl_timeout;
+  struct CURLMsg *msg;
+  struct timeval tv;
+  unsigned long long start;
+  unsigned int i;
+  unsigned int done;
+  int ret;
+
+  d = MHD_start_daemon (flags | MHD_USE_DEBUG,
+                        port, NULL, NULL, &ahc_echo, NULL,
+			MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
+			MHD_OPTION_THREAD_POOL_SIZE, threads,
+			MHD_OPTION_HANDLER_POOL_SIZE, (unsigned int) REQUESTS,
+			MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  multi = curl_multi_init ();
+  if (multi == NULL)
+    {
+      MHD_stop_daemon (d);
+      return 2;
+    }
+  snprintf (url, sizeof (url), "http://127.0.0.1:%d/", port);
+  for (i = 0; i < REQUESTS; i++)
+    {
+      cbc[i].buf = buf[i];
+      cbc[i].size = sizeof (buf[i]);
+      cbc[i].pos = 0;
+      upload_pos[i] = 0;
+      c[i] = curl_easy_init ();
+      curl_easy_setopt (c[i], CURLOPT_URL, url);
+      curl_easy_setopt (c[i], CURLOPT_WRITEFUNCTION, &copyBuffer);
+      curl_easy_setopt (c[i], CURLOPT_WRITEDATA, &cbc[i]);
+      if (put)
+	{
+	  curl_easy_setopt (c[i], CURLOPT_READFUNCTION, &putBuffer);
+	  curl_easy_setopt (c[i], CURLOPT_READDATA, &upload_pos[i]);
+	  curl_easy_setopt (c[i], CURLOPT_UPLOAD, 1L);
+	  curl_easy_setopt (c[i], CURLOPT_INFILESIZE, (long) strlen (UPLOAD));
+	}
+      curl_easy_setopt (c[i], CURLOPT_FAILONERROR, 1);
+      curl_easy_setopt (c[i], CURLOPT_TIMEOUT, 150L);
+      curl_easy_setopt (c[i], CURLOPT_CONNECTTIMEOUT, 15L);
+      curl_easy_setopt (c[i], CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+      curl_easy_setopt (c[i], CURLOPT_NOSIGNAL, 1);
+      curl_multi_add_handle (multi, c[i]);
+    }
+  ret = 0;
+  done = 0;
+  start = now_ms ();
+  while ( (done < REQUESTS) &&
+	  (now_ms () - start < 10000) )
+    {
+      max = 0;
+      FD_ZERO (&rs);
+      FD_ZERO (&ws);
+      FD_ZERO (&es);
+      curl_multi_perform (multi, &running);
+      curl_multi_fdset (multi, &rs, &ws, &es, &max);
+      if ( (0 == (flags & MHD_USE_SELECT_INTERNALLY)) &&
+	   (MHD_YES != MHD_get_fdset (d, &rs, &ws, &es, &max)) )
+	{
+	  ret |= 4;
+	  break;
+	}
+      /* block long enough that a missed wake-up of the daemon would
+	 show in the total time */
+      curl_multi_timeout (multi, &curl_timeout);
+      if ( (curl_timeout < 0) || (curl_timeout > 2000) )
+	curl_timeout = 2000;
+      tv.tv_sec = curl_timeout / 1000;
+      tv.tv_usec = (curl_timeout % 1000) * 1000;
+      select (max + 1, &rs, &ws, &es, &tv);
+      if (0 == (flags & MHD_USE_SELECT_INTERNALLY))
+	MHD_run (d);
+      curl_multi_perform (multi, &running);
+      while (NULL != (msg = curl_multi_info_read (multi, &running)))
+	{
+	  if (msg->msg != CURLMSG_DONE)
+	    continue;
+	  if (msg->data.result != CURLE_OK)
+	    {
+	      fprintf (stderr, "Request failed: `%s'\n",
+		       curl_easy_strerror (msg->data.result));
+	      ret |= 8;
+	    }
+	  done++;
+	}
+    }
+  /* serially, the handlers would take REQUESTS * HANDLER_DELAY */
+  if (now_ms () - start > (REQUESTS - 1) * HANDLER_DELAY)
+    {
+      fprintf (stderr, "Handlers did not run in parallel (%llu ms)\n",
+	       now_ms () - start);
+      ret |= 16;
+    }
+  snprintf (expected, sizeof (expected), "%s %u",
+	    put ? "PUT" : "GET",
+	    put ? (unsigned int) strlen (UPLOAD) : 0);
+  for (i = 0; i < REQUESTS; i++)
+    {
+      if ( (cbc[i].pos != strlen (expected)) ||
+	   (0 != strncmp (expected, cbc[i].buf, strlen (expected))) )
+	ret |= 32;
+      curl_multi_remove_handle (multi, c[i]);
+      curl_easy_cleanup (c[i]);
+    }
+  curl_multi_cleanup (multi);
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  if (0 != curl_global_init (CURL_GLOBAL_WIN32))
+    return 2;
+  errorCount += testParallel (MHD_USE_SELECT_INTERNALLY, 1149, 0, 0);
+  errorCount += testParallel (MHD_USE_SELECT_INTERNALLY | MHD_USE_POLL,
+			      1150, 0, 1) << 6;
+  errorCount += testParallel (MHD_USE_SELECT_INTERNALLY, 1151, 2, 1) << 12;
+  errorCount += testParallel (0, 1152, 0, 0) << 18;
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  curl_global_cleanup ();
+  return errorCount != 0;       /* 0 == pass */
+}
@@ -0,0 +1,444 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file daemontest_http2.c
+ * @brief  Testcase for HTTP/2 (MHD_USE_HTTP2) over cleartext TCP
+ *         (prior knowledge): a large upload, large responses and an
+ *         HTTP/1.1 request to the same daemon, all at the same time
+ *         (tls_http2_test covers several streams on one connection)
+ * @author Christian Grothoff
+ */
+
+#include "MHD_config.h"
+#include "platform.h"
+#include <curl/curl.h>
+#include <microhttpd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef WINDOWS
+#include <unistd.h>
+#endif
+
+/**
+ * Size of the upload.
+ */
+#define UPLOAD_SIZE (200 * 1024)
+
+/**
+ * Size of the generated responses.
+ */
+#define BIG_SIZE (300 * 1024)
+
+/**
+ * Number of requests we run at the same time.
+ */
+#define NUM_REQUESTS 5
+
+struct CBC
+{
+  char *buf;
+  size_t pos;
+  size_t size;
+};
+
+struct Upload
+{
+  size_t pos;
+};
+
+/**
+ * Request state of the upload handler.
+ */
+struct UploadState
+{
+  size_t received;
+  int bad;
+};
+
+static unsigned int completed;
+
+static unsigned int connections;
+
+static char *upload_data;
+
+
+static size_t
+copyBuffer (void *ptr, size_t size, size_t nmemb, void *ctx)
+{
+  struct CBC *cbc = ctx;
+
+  if (cbc->pos + size * nmemb > cbc->size)
+    return 0;                   /* overflow */
+  memcpy (&cbc->buf[cbc->pos], ptr, size * nmemb);
+  cbc->pos += size * nmemb;
+  return size * nmemb;
+}
+
+
+static size_t
+putBuffer (void *stream, size_t size, size_t nmemb, void *ptr)
+{
+  struct Upload *up = ptr;
+  size_t wrt;
+
+  wrt = size * nmemb;
+  if (wrt > UPLOAD_SIZE - up->pos)
+    wrt = UPLOAD_SIZE - up->pos;
+  memcpy (stream, &upload_data[up->pos], wrt);
+  up->pos += wrt;
+  return wrt;
+}
+
+
+static ssize_t
+big_reader (void *cls, uint64_t pos, char *buf, size_t max)
+{
+  size_t i;
+
+  if (pos >= BIG_SIZE)
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  if (max > BIG_SIZE - pos)
+    max = BIG_SIZE - pos;
+  for (i = 0; i < max; i++)
+    buf[i] = 'a' + (char) ((pos + i) % 26);
+  return max;
+}
+
+
+static int
+accept_cb (void *cls, const struct sockaddr *addr, socklen_t addrlen)
+{
+  connections++;
+  return MHD_YES;
+}
+
+
+static void
+completed_cb (void *cls,
+	      struct MHD_Connection *connection,
+	      void **con_cls,
+	      enum MHD_RequestTerminationCode toe)
+{
+  if (MHD_REQUEST_TERMINATED_COMPLETED_OK == toe)
+    completed++;
+  if (NULL != *con_cls)
+    {
+      free (*con_cls);
+      *con_cls = NULL;
+    }
+}
+
+
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload, size_t *upload_size,
+          void **con_cls)
+{
+  struct MHD_Response *response;
+  struct UploadState *state;
+  const char *arg;
+  char text[64];
+  size_t i;
+  int ret;
+
+  if (0 == strcmp (url, "/upload"))
+    {
+      if (0 != strcmp (method, "PUT"))
+	return MHD_NO;
+      state = *con_cls;
+      if (NULL == state)
+	{
+	  state = malloc (sizeof (struct UploadState));
+	  if (NULL == state)
+	    return MHD_NO;
+	  memset (state, 0, sizeof (struct UploadState));
+	  *con_cls = state;
+	  return MHD_YES;
+	}
+      if (0 != *upload_size)
+	{
+	  /* consume in odd pieces, leaving the rest for later calls */
+	  i = (*upload_size > 1000) ? 1000 : *upload_size;
+	  if ( (state->received + i > UPLOAD_SIZE) ||
+	       (0 != memcmp (upload, &upload_data[state->received], i)) )
+	    state->bad = 1;
+	  state->received += i;
+	  *upload_size -= i;
+	  return MHD_YES;
+	}
+      sprintf (text, "%u%s",
+	       (unsigned int) state->received,
+	       state->bad ? "bad" : "");
+      response = MHD_create_response_from_buffer (strlen (text), text,
+						  MHD_RESPMEM_MUST_COPY);
+      ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+      MHD_destroy_response (response);
+      return ret;
+    }
+  if (NULL == *con_cls)
+    {
+      /* first call, answer once the request is complete */
+      *con_cls = malloc (1);
+      return (NULL == *con_cls) ? MHD_NO : MHD_YES;
+    }
+  if (0 == strcmp (url, "/big"))
+    response = MHD_create_response_from_callback (BIG_SIZE, 4096,
+						  &big_reader, NULL, NULL);
+  else if (0 == strcmp (url, "/stream"))
+    response = MHD_create_response_from_callback (MHD_SIZE_UNKNOWN, 4096,
+						  &big_reader, NULL, NULL);
+  else
+    {
+      arg = MHD_lookup_connection_value (connection,
+					 MHD_GET_ARGUMENT_KIND, "name");
+      snprintf (text, sizeof (text), "%s %s %s %s",
+		version,
+		(NULL == arg) ? "-" : arg,
+		(NULL != MHD_lookup_connection_value (connection,
+						      MHD_HEADER_KIND,
+						      MHD_HTTP_HEADER_HOST))
+		? "host" : "-",
+		url);
+      response = MHD_create_response_from_buffer (strlen (text), text,
+						  MHD_RESPMEM_MUST_COPY);
+      MHD_add_response_header (response, "X-Test", "yes");
+    }
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+/**
+ * Set up a request.
+ *
+ * @param port port of the daemon
+ * @param path path to request
+ * @param cbc where to store the body
+ * @param up upload state (for PUT), NULL for GET
+ * @param h2 non-zero to speak HTTP/2 (with prior knowledge)
+ * @return the handle
+ */
+static CURL *
+setup (int port, const char *path, struct CBC *cbc, struct Upload *up,
+       int h2)
+{
+  CURL *c;
+  char url[128];
+
+  snprintf (url, sizeof (url), "http://127.0.0.1:%d%s", port, path);
+  c = curl_easy_init ();
+  curl_easy_setopt (c, CURLOPT_URL, url);
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, &copyBuffer);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, cbc);
+  curl_easy_setopt (c, CURLOPT_FAILONERROR, 1);
+  if (NULL != up)
+    {
+      curl_easy_setopt (c, CURLOPT_READFUNCTION, &putBuffer);
+      curl_easy_setopt (c, CURLOPT_READDATA, up);
+      curl_easy_setopt (c, CURLOPT_UPLOAD, 1L);
+      curl_easy_setopt (c, CURLOPT_INFILESIZE_LARGE,
+			(curl_off_t) UPLOAD_SIZE);
+    }
+  curl_easy_setopt (c, CURLOPT_HTTP_VERSION,
+		    (long) (h2 ? CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE
+			    : CURL_HTTP_VERSION_1_1));
+  /* libcurl fails to reuse connections it opened with prior
+     knowledge, so every request gets a connection of its own */
+  curl_easy_setopt (c, CURLOPT_FORBID_REUSE, 1L);
+  curl_easy_setopt (c, CURLOPT_TIMEOUT, 150L);
+  curl_easy_setopt (c, CURLOPT_CONNECTTIMEOUT, 15L);
+  /* NOTE: use of CONNECTTIMEOUT without also
+     setting NOSIGNAL results in really weird
+     crashes on my system!*/
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1);
+  return c;
+}
+
+
+/**
+ * Check that the body of a generated response is what 'big_reader'
+ * produces.
+ */
+static int
+check_big (struct CBC *cbc)
+{
+  size_t i;
+
+  if (cbc->pos != BIG_SIZE)
+    return 1;
+  for (i = 0; i < BIG_SIZE; i++)
+    if (cbc->buf[i] != 'a' + (char) (i % 26))
+      return 1;
+  return 0;
+}
+
+
+static int
+testHttp2 (unsigned int flags, int port)
+{
+  struct MHD_Daemon *d;
+  CURLM *multi;
+  CURL *c[NUM_REQUESTS];
+  struct CBC cbc[NUM_REQUESTS];
+  struct Upload up;
+  struct CURLMsg *msg;
+  fd_set rs;
+  fd_set ws;
+  fd_set es;
+  int max;
+  int running;
+  long version;
+  time_t start;
+  struct timeval tv;
+  unsigned int i;
+  int ret;
+  static const char *paths[NUM_REQUESTS] = {
+    "/hello?name=value", "/upload", "/big", "/stream", "/hello"
+  };
+
+  completed = 0;
+  connections = 0;
+  up.pos = 0;
+  d = MHD_start_daemon (flags | MHD_USE_DEBUG | MHD_USE_HTTP2,
+                        port, &accept_cb, NULL, &ahc_echo, NULL,
+			MHD_OPTION_NOTIFY_COMPLETED, &completed_cb, NULL,
+			MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  multi = curl_multi_init ();
+  for (i = 0; i < NUM_REQUESTS; i++)
+    {
+      cbc[i].size = BIG_SIZE + 1;
+      cbc[i].buf = malloc (cbc[i].size);
+      cbc[i].pos = 0;
+      c[i] = setup (port, paths[i], &cbc[i],
+		    (1 == i) ? &up : NULL,
+		    (NUM_REQUESTS - 1 != i));
+      curl_multi_add_handle (multi, c[i]);
+    }
+  ret = 0;
+  start = time (NULL);
+  running = NUM_REQUESTS;
+  while ( (running > 0) &&
+	  (time (NULL) - start < 30) )
+    {
+      max = 0;
+      FD_ZERO (&rs);
+      FD_ZERO (&ws);
+      FD_ZERO (&es);
+      curl_multi_perform (multi, &running);
+      curl_multi_fdset (multi, &rs, &ws, &es, &max);
+      if ( (0 == (flags & (MHD_USE_SELECT_INTERNALLY |
+			   MHD_USE_THREAD_PER_CONNECTION))) &&
+	   (MHD_YES != MHD_get_fdset (d, &rs, &ws, &es, &max)) )
+	{
+	  ret |= 2;
+	  break;
+	}
+      tv.tv_sec = 0;
+      tv.tv_usec = 1000;
+      select (max + 1, &rs, &ws, &es, &tv);
+      if (0 == (flags & (MHD_USE_SELECT_INTERNALLY |
+			 MHD_USE_THREAD_PER_CONNECTION)))
+	MHD_run (d);
+    }
+  while (NULL != (msg = curl_multi_info_read (multi, &running)))
+    if ( (CURLMSG_DONE == msg->msg) &&
+	 (CURLE_OK != msg->data.result) )
+      {
+	fprintf (stderr, "Request failed: `%s'\n",
+		 curl_easy_strerror (msg->data.result));
+	ret |= 4;
+      }
+  for (i = 0; i < NUM_REQUESTS; i++)
+    {
+      version = 0;
+      curl_easy_getinfo (c[i], CURLINFO_HTTP_VERSION, &version);
+      if (version != ( (NUM_REQUESTS - 1 != i)
+		       ? CURL_HTTP_VERSION_2_0
+		       : CURL_HTTP_VERSION_1_1))
+	ret |= 8;
+    }
+  if ( (cbc[0].pos != strlen ("HTTP/2.0 value host /hello")) ||
+       (0 != strncmp (cbc[0].buf, "HTTP/2.0 value host /hello", cbc[0].pos)) )
+    ret |= 16;
+  if ( (cbc[1].pos != strlen ("204800")) ||
+       (0 != strncmp (cbc[1].buf, "204800", cbc[1].pos)) )
+    ret |= 32;
+  if (0 != check_big (&cbc[2]))
+    ret |= 64;
+  if (0 != check_big (&cbc[3]))
+    ret |= 128;
+  if ( (cbc[4].pos != strlen ("HTTP/1.1 - host /hello")) ||
+       (0 != strncmp (cbc[4].buf, "HTTP/1.1 - host /hello", cbc[4].pos)) )
+    ret |= 256;
+  for (i = 0; i < NUM_REQUESTS; i++)
+    {
+      curl_multi_remove_handle (multi, c[i]);
+      curl_easy_cleanup (c[i]);
+      free (cbc[i].buf);
+    }
+  curl_multi_cleanup (multi);
+  MHD_stop_daemon (d);
+  if (connections != NUM_REQUESTS)
+    ret |= 512;
+  if (completed != NUM_REQUESTS)
+    ret |= 1024;
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+  size_t i;
+
+  if (0 != curl_global_init (CURL_GLOBAL_WIN32))
+    return 2;
+  if (0 == (curl_version_info (CURLVERSION_NOW)->features & CURL_VERSION_HTTP2))
+    {
+      fprintf (stderr, "libcurl lacks HTTP/2 support, skipping test\n");
+      curl_global_cleanup ();
+      return 77;
+    }
+  upload_data = malloc (UPLOAD_SIZE);
+  if (NULL == upload_data)
+    return 2;
+  for (i = 0; i < UPLOAD_SIZE; i++)
+    upload_data[i] = (char) (i * 7);
+  errorCount += testHttp2 (MHD_USE_SELECT_INTERNALLY, 1173);
+  errorCount += testHttp2 (MHD_USE_SELECT_INTERNALLY | MHD_USE_POLL, 1174) << 11;
+  errorCount += testHttp2 (MHD_USE_THREAD_PER_CONNECTION, 1175) << 22;
+  errorCount += testHttp2 (0, 1176);
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  free (upload_data);
+  curl_global_cleanup ();
+  return errorCount != 0;       /* 0 == pass */
+}
@@ -0,0 +1,293 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file daemontest_migrate.c
+ * @brief  Testcase for MHD_OPTION_THREAD_POOL_REBALANCE_INTERVAL
+ * @author Christian Grothoff
+ */
+
+#include "MHD_config.h"
+#include "platform.h"
+#include <microhttpd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef WINDOWS
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
+
+/**
+ * Number of keep-alive connections.
+ */
+#define CONNECTIONS 6
+
+/**
+ * "/who" returns the worker handling the connection,
+ * "/busy" keeps the worker busy for 10 ms.
+ */
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload_data, size_t *upload_data_size,
+          void **unused)
+{
+  static int ptr;
+  const union MHD_ConnectionInfo *info;
+  struct MHD_Response *response;
+  char buf[64];
+  int ret;
+
+  if (0 != strcmp ("GET", method))
+    return MHD_NO;              /* unexpected method */
+  if (&ptr != *unused)
+    {
+      /* responding early would close the connection */
+      *unused = &ptr;
+      return MHD_YES;
+    }
+  *unused = NULL;
+  if (0 == strcmp ("/busy", url))
+    usleep (10000);
+  info = MHD_get_connection_info (connection, MHD_CONNECTION_INFO_DAEMON);
+  snprintf (buf, sizeof (buf), "%p", (void *) info->daemon);
+  response = MHD_create_response_from_buffer (strlen (buf),
+					      buf,
+					      MHD_RESPMEM_MUST_COPY);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+static int
+open_connection (int port)
+{
+  struct sockaddr_in sin;
+  int fd;
+
+  fd = SOCKET (PF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      fprintf (stderr, "socket: %m\n");
+      return -1;
+    }
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = htonl (0x7f000001);
+  if (CONNECT (fd, (struct sockaddr *) &sin, sizeof (sin)) < 0)
+    {
+      fprintf (stderr, "connect: %m\n");
+      CLOSE (fd);
+      return -1;
+    }
+  return fd;
+}
+
+
+/**
+ * Send a keep-alive request and read the response.
+ *
+ * @param fd connected socket
+ * @param url URL to request
+ * @param body where to store the (0-terminated) response body
+ * @param size size of 'body'
+ * @return 0 on success
+ */
+static int
+request (int fd, const char *url, char *body, size_t size)
+{
+  char buf[1024];
+  char *end;
+  char *cl;
+  size_t pos;
+  size_t len;
+  ssize_t got;
+
+  snprintf (buf, sizeof (buf),
+	    "GET %s HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", url);
+  if (strlen (buf) != send (fd, buf, strlen (buf), 0))
+    return 1;
+  pos = 0;
+  end = NULL;
+  while (1)
+    {
+      buf[pos] = '\0';
+      if ( (NULL != (end = strstr (buf, "\r\n\r\n"))) &&
+	   (NULL != (cl = strstr (buf, "Content-Length: "))) &&
+	   (cl < end) )
+	{
+	  len = atoi (cl + strlen ("Content-Length: "));
+	  if (pos >= (end - buf) + 4 + len)
+	    break;
+	}
+      if (pos == sizeof (buf) - 1)
+	return 2;
+      got = recv (fd, &buf[pos], sizeof (buf) - 1 - pos, 0);
+      if (got <= 0)
+	return 3;
+      pos += got;
+    }
+  if ( (0 != strncmp (buf, "HTTP/1.1 200", strlen ("HTTP/1.1 200"))) ||
+       (len >= size) )
+    return 4;
+  memcpy (body, end + 4, len);
+  body[len] = '\0';
+  return 0;
+}
+
+
+static unsigned int
+worker_connections (struct MHD_Daemon *d, unsigned int worker)
+{
+  const union MHD_DaemonInfo *info;
+
+  info = MHD_get_daemon_info (d, MHD_DAEMON_INFO_WORKER_CONNECTIONS, worker);
+  if (NULL == info)
+    return 0;
+  return info->num_connections;
+}
+
+
+/**
+ * Put all connections on one worker, add a second worker and keep
+ * one connection busy.
+ *
+ * @param flags extra daemon flags (MHD_USE_POLL)
+ * @param interval rebalancing interval to use
+ * @param port port to use
+ * @param moved set to the number of idle connections that were
+ *        moved to the other worker
+ * @return 0 on success
+ */
+static int
+testMigrate (int flags, unsigned int interval, int port,
+	     unsigned int *moved)
+{
+  struct MHD_Daemon *d;
+  int fds[CONNECTIONS];
+  char first[64];
+  char body[64];
+  unsigned int i;
+  unsigned int j;
+  int ret;
+
+  *moved = 0;
+  d = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG | flags,
+                        port, NULL, NULL, &ahc_echo, NULL,
+			MHD_OPTION_THREAD_POOL_SIZE, (unsigned int) 1,
+			MHD_OPTION_THREAD_POOL_REBALANCE_INTERVAL, interval,
+			MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  ret = 0;
+  for (i = 0; i < CONNECTIONS; i++)
+    fds[i] = open_connection (port);
+  for (i = 0; i < CONNECTIONS; i++)
+    if (-1 == fds[i])
+      ret |= 2;
+  if (0 != ret)
+    goto cleanup;
+  /* with a single worker, all connections end up on it */
+  for (i = 0; i < CONNECTIONS; i++)
+    if (0 != request (fds[i], "/who", body, sizeof (body)))
+      ret |= 4;
+  if (0 != request (fds[0], "/who", first, sizeof (first)))
+    ret |= 4;
+  if (MHD_YES != MHD_set_daemon_option (d, MHD_OPTION_THREAD_POOL_SIZE,
+					(unsigned int) 2))
+    ret |= 8;
+  if (0 != ret)
+    goto cleanup;
+
+  /* keep the first worker busy for a while */
+  for (i = 0; i < 100; i++)
+    if (0 != request (fds[0], "/busy", body, sizeof (body)))
+      {
+	ret |= 16;
+	break;
+      }
+  /* the idle connections must still work, wherever they are */
+  for (i = 1; i < CONNECTIONS; i++)
+    {
+      if (0 != request (fds[i], "/who", body, sizeof (body)))
+	{
+	  ret |= 32;
+	  continue;
+	}
+      if (0 != strcmp (first, body))
+	(*moved)++;
+    }
+  if ( (worker_connections (d, 0) + worker_connections (d, 1)
+	!= CONNECTIONS) ||
+       ( (0 != *moved) &&
+	 (0 == worker_connections (d, 1)) ) )
+    ret |= 64;
+  /* and keep working after being moved */
+  for (j = 0; j < 3; j++)
+    for (i = 0; i < CONNECTIONS; i++)
+      if (0 != request (fds[i], "/who", body, sizeof (body)))
+	ret |= 128;
+
+ cleanup:
+  for (i = 0; i < CONNECTIONS; i++)
+    if (-1 != fds[i])
+      CLOSE (fds[i]);
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+  unsigned int moved;
+
+  errorCount += testMigrate (0, 50, 1163, &moved);
+  if (0 == moved)
+    {
+      fprintf (stderr, "No connection was moved to the idle worker\n");
+      errorCount |= 256;
+    }
+  errorCount += testMigrate (0, 0, 1164, &moved) << 10;
+  if (0 != moved)
+    {
+      fprintf (stderr, "Connections moved without rebalancing\n");
+      errorCount |= 256 << 10;
+    }
+#ifdef HAVE_POLL_H
+  errorCount += testMigrate (MHD_USE_POLL, 50, 1165, &moved) << 20;
+  if (0 == moved)
+    {
+      fprintf (stderr, "No connection was moved to the idle worker (poll)\n");
+      errorCount |= 256 << 20;
+    }
+#endif
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  return errorCount != 0;       /* 0 == pass */
+}
@@ -0,0 +1,272 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file daemontest_pool_resize.c
+ * @brief  Testcase for resizing the thread pool of a running daemon
+ *         with MHD_set_daemon_option
+ * @author Christian Grothoff
+ */
+
+#include "MHD_config.h"
+#include "platform.h"
+#include <curl/curl.h>
+#include <microhttpd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WINDOWS
+#include <unistd.h>
+#endif
+
+/**
+ * Number of requests the client thread makes.
+ */
+#define REQUESTS 200
+
+struct CBC
+{
+  char *buf;
+  size_t pos;
+  size_t size;
+};
+
+static volatile int client_done;
+
+/**
+ * Returned by the client thread on failure.
+ */
+static int client_failed;
+
+static size_t
+copyBuffer (void *ptr, size_t size, size_t nmemb, void *ctx)
+{
+  struct CBC *cbc = ctx;
+
+  if (cbc->pos + size * nmemb > cbc->size)
+    return 0;                   /* overflow */
+  memcpy (&cbc->buf[cbc->pos], ptr, size * nmemb);
+  cbc->pos += size * nmemb;
+  return size * nmemb;
+}
+
+
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload_data, size_t *upload_data_size,
+          void **unused)
+{
+  static int ptr;
+  struct MHD_Response *response;
+  int ret;
+
+  if (0 != strcmp ("GET", method))
+    return MHD_NO;              /* unexpected method */
+  if (&ptr != *unused)
+    {
+      *unused = &ptr;
+      return MHD_YES;
+    }
+  *unused = NULL;
+  /* keep requests in flight while the pool is resized */
+  usleep (1000);
+  response = MHD_create_response_from_buffer (strlen (url),
+					      (void *) url,
+					      MHD_RESPMEM_MUST_COPY);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+/**
+ * Issue sequential requests over a keep-alive connection (curl
+ * reconnects if a retired thread closed it between requests).
+ *
+ * @param cls pointer to the port (int)
+ * @return NULL if all requests succeeded
+ */
+static void *
+client_thread (void *cls)
+{
+  int port = *(int *) cls;
+  CURL *c;
+  char buf[2048];
+  char url[64];
+  struct CBC cbc;
+  CURLcode errornum;
+  unsigned int i;
+  void *ret;
+
+  ret = NULL;
+  snprintf (url, sizeof (url), "http://127.0.0.1:%d/hello_world", port);
+  c = curl_easy_init ();
+  curl_easy_setopt (c, CURLOPT_URL, url);
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, &copyBuffer);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, &cbc);
+  curl_easy_setopt (c, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt (c, CURLOPT_TIMEOUT, 150L);
+  curl_easy_setopt (c, CURLOPT_CONNECTTIMEOUT, 15L);
+  curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1);
+  for (i = 0; i < REQUESTS; i++)
+    {
+      cbc.buf = buf;
+      cbc.size = sizeof (buf);
+      cbc.pos = 0;
+      errornum = curl_easy_perform (c);
+      if (CURLE_OK != errornum)
+	{
+	  fprintf (stderr,
+		   "curl_easy_perform failed: `%s'\n",
+		   curl_easy_strerror (errornum));
+	  ret = &client_failed;
+	  break;
+	}
+      if ( (cbc.pos != strlen ("/hello_world")) ||
+	   (0 != strncmp ("/hello_world", cbc.buf, strlen ("/hello_world"))) )
+	{
+	  ret = &client_failed;
+	  break;
+	}
+    }
+  curl_easy_cleanup (c);
+  client_done = 1;
+  return ret;
+}
+
+
+static unsigned int
+count_workers (struct MHD_Daemon *d)
+{
+  unsigned int i;
+
+  for (i = 0; NULL != MHD_get_daemon_info (d, MHD_DAEMON_INFO_WORKER_CONNECTIONS, i); i++)
+    ;
+  return i;
+}
+
+
+static int
+testResize (int port)
+{
+  static const unsigned int sizes[] = { 4, 1, 3, 1, 2 };
+  struct MHD_Daemon *d;
+  pthread_t client;
+  void *client_ret;
+  unsigned int i;
+  int ret;
+
+  d = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG,
+                        port, NULL, NULL, &ahc_echo, NULL,
+			MHD_OPTION_THREAD_POOL_SIZE, (unsigned int) 2,
+			MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  ret = 0;
+  if (MHD_NO != MHD_set_daemon_option (d, MHD_OPTION_THREAD_POOL_SIZE,
+				       (unsigned int) 0))
+    ret |= 2;
+  if (MHD_NO != MHD_set_daemon_option (d, MHD_OPTION_CONNECTION_TIMEOUT,
+				       (unsigned int) 1))
+    ret |= 2;
+  client_done = 0;
+  if (0 != pthread_create (&client, NULL, &client_thread, &port))
+    {
+      MHD_stop_daemon (d);
+      return 4;
+    }
+  /* resize while the client keeps a request going at all times */
+  i = 0;
+  while (0 == client_done)
+    {
+      if (MHD_YES != MHD_set_daemon_option (d, MHD_OPTION_THREAD_POOL_SIZE,
+					    sizes[i % (sizeof (sizes) / sizeof (sizes[0]))]))
+	ret |= 8;
+      i++;
+      usleep (20000);
+    }
+  pthread_join (client, &client_ret);
+  if (NULL != client_ret)
+    ret |= 16;
+  if (i < 2)
+    ret |= 32;                  /* pool was not resized under load */
+
+  /* retired threads exit and are joined by the next call */
+  if (MHD_YES != MHD_set_daemon_option (d, MHD_OPTION_THREAD_POOL_SIZE,
+					(unsigned int) 1))
+    ret |= 64;
+  for (i = 0; i < 100; i++)
+    {
+      usleep (10000);
+      MHD_set_daemon_option (d, MHD_OPTION_THREAD_POOL_SIZE, (unsigned int) 1);
+      if (1 == count_workers (d))
+	break;
+    }
+  if (1 != count_workers (d))
+    {
+      fprintf (stderr, "%u workers left after shrinking to 1\n",
+	       count_workers (d));
+      ret |= 128;
+    }
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+static int
+testNoPool (int port)
+{
+  struct MHD_Daemon *d;
+  int ret;
+
+  d = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG,
+                        port, NULL, NULL, &ahc_echo, NULL, MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  ret = 0;
+  if (MHD_NO != MHD_set_daemon_option (d, MHD_OPTION_THREAD_POOL_SIZE,
+				       (unsigned int) 2))
+    ret |= 2;
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  if (0 != curl_global_init (CURL_GLOBAL_WIN32))
+    return 2;
+  errorCount += testResize (1158);
+  errorCount += testNoPool (1159) << 8;
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  curl_global_cleanup ();
+  return errorCount != 0;       /* 0 == pass */
+}
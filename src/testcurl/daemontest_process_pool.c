@@ -0,0 +1,258 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file daemontest_process_pool.c
+ * @brief  Testcase for MHD_OPTION_PROCESS_POOL_SIZE
+ * @author Christian Grothoff
+ */
+
+#include "MHD_config.h"
+#include "platform.h"
+#include <curl/curl.h>
+#include <microhttpd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef WINDOWS
+#include <unistd.h>
+#endif
+
+#define PROCESSES 2
+
+#define REQUESTS 10
+
+struct CBC
+{
+  char *buf;
+  size_t pos;
+  size_t size;
+};
+
+static size_t
+copyBuffer (void *ptr, size_t size, size_t nmemb, void *ctx)
+{
+  struct CBC *cbc = ctx;
+
+  if (cbc->pos + size * nmemb > cbc->size)
+    return 0;                   /* overflow */
+  memcpy (&cbc->buf[cbc->pos], ptr, size * nmemb);
+  cbc->pos += size * nmemb;
+  return size * nmemb;
+}
+
+
+/**
+ * "/pid" returns the process handling the request,
+ * "/exit" makes the worker process die.
+ */
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload_data, size_t *upload_data_size,
+          void **unused)
+{
+  static int ptr;
+  struct MHD_Response *response;
+  char buf[32];
+  int ret;
+
+  if (0 != strcmp ("GET", method))
+    return MHD_NO;              /* unexpected method */
+  if (&ptr != *unused)
+    {
+      *unused = &ptr;
+      return MHD_YES;
+    }
+  *unused = NULL;
+  if (0 == strcmp ("/exit", url))
+    _exit (1);
+  snprintf (buf, sizeof (buf), "%d", (int) getpid ());
+  response = MHD_create_response_from_buffer (strlen (buf),
+					      buf,
+					      MHD_RESPMEM_MUST_COPY);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+/**
+ * Request the given URL.
+ *
+ * @param port port to use
+ * @param url path to request
+ * @param pid set to the process that answered
+ * @return 0 on success
+ */
+static int
+query (int port, const char *path, pid_t *pid)
+{
+  CURL *c;
+  char buf[2048];
+  char url[64];
+  struct CBC cbc;
+  CURLcode errornum;
+
+  cbc.buf = buf;
+  cbc.size = sizeof (buf) - 1;
+  cbc.pos = 0;
+  snprintf (url, sizeof (url), "http://127.0.0.1:%d%s", port, path);
+  c = curl_easy_init ();
+  curl_easy_setopt (c, CURLOPT_URL, url);
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, &copyBuffer);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, &cbc);
+  curl_easy_setopt (c, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt (c, CURLOPT_TIMEOUT, 15L);
+  curl_easy_setopt (c, CURLOPT_CONNECTTIMEOUT, 15L);
+  curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  curl_easy_setopt (c, CURLOPT_FORBID_REUSE, 1L);
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1);
+  errornum = curl_easy_perform (c);
+  curl_easy_cleanup (c);
+  if (CURLE_OK != errornum)
+    return 1;
+  buf[cbc.pos] = '\0';
+  *pid = (pid_t) atoi (buf);
+  if ( (0 >= *pid) ||
+       (getpid () == *pid) )
+    return 2;
+  return 0;
+}
+
+
+/**
+ * Wait (up to five seconds) for all worker processes to be running
+ * after the given number of restarts.
+ */
+static const struct MHD_ProcessStatistics *
+wait_for_processes (struct MHD_Daemon *d, unsigned int restarts)
+{
+  const union MHD_DaemonInfo *info;
+  unsigned int i;
+
+  for (i = 0; i < 500; i++)
+    {
+      info = MHD_get_daemon_info (d, MHD_DAEMON_INFO_PROCESS_STATISTICS);
+      if (NULL == info)
+	return NULL;
+      if ( (PROCESSES == info->process_statistics.processes) &&
+	   (restarts <= info->process_statistics.restarts) )
+	return &info->process_statistics;
+      usleep (10000);
+    }
+  fprintf (stderr, "Expected %u processes after %u restarts, have %u after %u\n",
+	   PROCESSES, restarts,
+	   info->process_statistics.processes,
+	   info->process_statistics.restarts);
+  return NULL;
+}
+
+
+static int
+testProcessPool (int flags, int port)
+{
+  struct MHD_Daemon *d;
+  const struct MHD_ProcessStatistics *stats;
+  pid_t pid;
+  unsigned int i;
+  int ret;
+
+  d = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG | flags,
+                        port, NULL, NULL, &ahc_echo, NULL,
+			MHD_OPTION_PROCESS_POOL_SIZE, (unsigned int) PROCESSES,
+			MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  ret = 0;
+  for (i = 0; i < REQUESTS; i++)
+    if (0 != query (port, "/pid", &pid))
+      ret |= 2;
+  /* the counters are updated by the workers after the response */
+  for (i = 0; i < 200; i++)
+    {
+      if ( (NULL != (stats = wait_for_processes (d, 0))) &&
+	   (REQUESTS <= stats->requests) )
+	break;
+      usleep (10000);
+    }
+  if ( (NULL == stats) ||
+       (REQUESTS > stats->connections) ||
+       (REQUESTS > stats->requests) ||
+       (0 == stats->bytes_received) ||
+       (0 == stats->bytes_sent) ||
+       (0 != stats->restarts) )
+    ret |= 4;
+
+  /* a worker that dies is replaced */
+  if (0 == query (port, "/exit", &pid))
+    ret |= 8;
+  if (NULL == wait_for_processes (d, 1))
+    ret |= 16;
+  for (i = 0; i < REQUESTS; i++)
+    if (0 != query (port, "/pid", &pid))
+      ret |= 32;
+  MHD_stop_daemon (d);
+
+  /* and all of them are gone with the daemon */
+  if (0 == query (port, "/pid", &pid))
+    ret |= 64;
+  return ret;
+}
+
+
+static int
+testInvalid (int port)
+{
+  struct MHD_Daemon *d;
+
+  d = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY,
+                        port, NULL, NULL, &ahc_echo, NULL,
+			MHD_OPTION_PROCESS_POOL_SIZE, (unsigned int) PROCESSES,
+			MHD_OPTION_THREAD_POOL_SIZE, (unsigned int) 2,
+			MHD_OPTION_END);
+  if (d == NULL)
+    return 0;
+  MHD_stop_daemon (d);
+  return 1;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  if (0 != curl_global_init (CURL_GLOBAL_WIN32))
+    return 2;
+  errorCount += testProcessPool (0, 1166);
+#ifdef HAVE_POLL_H
+  errorCount += testProcessPool (MHD_USE_POLL, 1167) << 8;
+#endif
+  errorCount += testInvalid (1168) << 16;
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  curl_global_cleanup ();
+  return errorCount != 0;       /* 0 == pass */
+}
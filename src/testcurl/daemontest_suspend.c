@@ -0,0 +1,583 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file daemontest_suspend.c
+ * @brief  Testcase for suspending and resuming connections from
+ *         another thread, both from the access handler and from
+ *         the content reader of a streamed response
+ * @author Christian Grothoff
+ */
+
+#include "MHD_config.h"
+#include "platform.h"
+#include <curl/curl.h>
+#include <microhttpd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WINDOWS
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+#define ANSWER "resumed"
+
+#define EVENT "event\n"
+
+/**
+ * Number of events the producer generates per stream.
+ */
+#define EVENTS 4
+
+/**
+ * State of one request, created by the access handler.
+ */
+struct Request
+{
+  /**
+   * Connection the request belongs to.
+   */
+  struct MHD_Connection *connection;
+
+  /**
+   * Thread that resumes the connection.
+   */
+  pthread_t worker;
+
+  /**
+   * Set once the connection was suspended.
+   */
+  int suspended;
+
+  /**
+   * Set by 'worker' once the "asynchronous" result is available.
+   */
+  int done;
+
+  /**
+   * Protects 'available' (stream test only).
+   */
+  pthread_mutex_t lock;
+
+  /**
+   * Number of events generated by 'worker' (stream test only).
+   */
+  unsigned int available;
+
+  /**
+   * Number of events sent to the client (stream test only).
+   */
+  unsigned int sent;
+};
+
+struct CBC
+{
+  char *buf;
+  size_t pos;
+  size_t size;
+};
+
+static size_t
+copyBuffer (void *ptr, size_t size, size_t nmemb, void *ctx)
+{
+  struct CBC *cbc = ctx;
+
+  if (cbc->pos + size * nmemb > cbc->size)
+    return 0;                   /* overflow */
+  memcpy (&cbc->buf[cbc->pos], ptr, size * nmemb);
+  cbc->pos += size * nmemb;
+  return size * nmemb;
+}
+
+
+/**
+ * Simulate a slow backend: wait a bit, then resume the connection.
+ */
+static void *
+resume_later (void *cls)
+{
+  struct Request *req = cls;
+
+  /* longer than the connection timeout */
+  usleep (1500 * 1000);
+  req->done = 1;
+  MHD_resume_connection (req->connection);
+  return NULL;
+}
+
+
+/**
+ * Simulate an event source: generate an event every now and then and
+ * tell MHD about it.
+ */
+static void *
+produce_events (void *cls)
+{
+  struct Request *req = cls;
+  unsigned int i;
+
+  for (i = 0; i < EVENTS; i++)
+    {
+      usleep (250 * 1000);
+      pthread_mutex_lock (&req->lock);
+      req->available++;
+      pthread_mutex_unlock (&req->lock);
+      MHD_resume_connection (req->connection);
+    }
+  return NULL;
+}
+
+
+static ssize_t
+stream_reader (void *cls, uint64_t pos, char *buf, size_t max)
+{
+  struct Request *req = cls;
+  unsigned int available;
+
+  if (req->sent == EVENTS)
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  if (max < strlen (EVENT))
+    return 0;
+  pthread_mutex_lock (&req->lock);
+  available = req->available;
+  if (available == req->sent)
+    {
+      /* nothing to send, wait for the producer */
+      MHD_suspend_connection (req->connection);
+      pthread_mutex_unlock (&req->lock);
+      return 0;
+    }
+  pthread_mutex_unlock (&req->lock);
+  memcpy (buf, EVENT, strlen (EVENT));
+  req->sent++;
+  return strlen (EVENT);
+}
+
+
+static void
+stream_done (void *cls)
+{
+  struct Request *req = cls;
+
+  pthread_join (req->worker, NULL);
+  pthread_mutex_destroy (&req->lock);
+  free (req);
+}
+
+
+static int
+ahc_stream (void *cls,
+	    struct MHD_Connection *connection,
+	    const char *url,
+	    const char *method,
+	    const char *version,
+	    const char *upload_data, size_t *upload_data_size,
+	    void **unused)
+{
+  static int ptr;
+  struct Request *req;
+  struct MHD_Response *response;
+  int ret;
+
+  if (0 != strcmp ("GET", method))
+    return MHD_NO;              /* unexpected method */
+  if (&ptr != *unused)
+    {
+      *unused = &ptr;
+      return MHD_YES;
+    }
+  *unused = NULL;
+  req = malloc (sizeof (struct Request));
+  if (NULL == req)
+    return MHD_NO;
+  memset (req, 0, sizeof (struct Request));
+  req->connection = connection;
+  pthread_mutex_init (&req->lock, NULL);
+  if (0 != pthread_create (&req->worker, NULL, &produce_events, req))
+    abort ();
+  response = MHD_create_response_from_callback (MHD_SIZE_UNKNOWN,
+						128,
+						&stream_reader, req,
+						&stream_done);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload_data, size_t *upload_data_size,
+          void **unused)
+{
+  struct Request *req = *unused;
+  struct MHD_Response *response;
+  int ret;
+
+  if (0 != strcmp ("GET", method))
+    return MHD_NO;              /* unexpected method */
+  if (NULL == req)
+    {
+      req = malloc (sizeof (struct Request));
+      if (NULL == req)
+	return MHD_NO;
+      memset (req, 0, sizeof (struct Request));
+      req->connection = connection;
+      *unused = req;
+      return MHD_YES;
+    }
+  if (0 == req->suspended)
+    {
+      req->suspended = 1;
+      MHD_suspend_connection (connection);
+      if (0 != pthread_create (&req->worker, NULL, &resume_later, req))
+	abort ();
+      return MHD_YES;
+    }
+  if (0 == req->done)
+    abort ();                   /* called while still suspended */
+  pthread_join (req->worker, NULL);
+  response = MHD_create_response_from_buffer (strlen (ANSWER),
+					      ANSWER,
+					      MHD_RESPMEM_PERSISTENT);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+/**
+ * Access handler whose "backend" answers before the connection is
+ * even suspended: the resume must not be lost.
+ */
+static int
+ahc_early (void *cls,
+	   struct MHD_Connection *connection,
+	   const char *url,
+	   const char *method,
+	   const char *version,
+	   const char *upload_data, size_t *upload_data_size,
+	   void **unused)
+{
+  struct Request *req = *unused;
+  struct MHD_Response *response;
+  int ret;
+
+  if (0 != strcmp ("GET", method))
+    return MHD_NO;              /* unexpected method */
+  if (NULL == req)
+    {
+      req = malloc (sizeof (struct Request));
+      if (NULL == req)
+	return MHD_NO;
+      memset (req, 0, sizeof (struct Request));
+      req->connection = connection;
+      *unused = req;
+      return MHD_YES;
+    }
+  if (0 == req->suspended)
+    {
+      req->suspended = 1;
+      req->done = 1;
+      MHD_resume_connection (connection);
+      MHD_suspend_connection (connection);
+      return MHD_YES;
+    }
+  response = MHD_create_response_from_buffer (strlen (ANSWER),
+					      ANSWER,
+					      MHD_RESPMEM_PERSISTENT);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+/**
+ * Number of requests 'ahc_stale' received.
+ */
+static unsigned int stale_requests;
+
+
+/**
+ * Access handler that resumes the connection of its first request
+ * without ever suspending it, then handles the next request on the
+ * same connection like 'ahc_echo': the stale resume must not end the
+ * suspension of that request early.
+ */
+static int
+ahc_stale (void *cls,
+	   struct MHD_Connection *connection,
+	   const char *url,
+	   const char *method,
+	   const char *version,
+	   const char *upload_data, size_t *upload_data_size,
+	   void **unused)
+{
+  struct MHD_Response *response;
+  int ret;
+
+  if (0 != stale_requests)
+    return ahc_echo (cls, connection, url, method, version,
+		     upload_data, upload_data_size, unused);
+  if (NULL == *unused)
+    {
+      /* answer on the second call, or MHD closes the connection */
+      *unused = malloc (sizeof (struct Request));
+      if (NULL == *unused)
+	return MHD_NO;
+      return MHD_YES;
+    }
+  stale_requests++;
+  MHD_resume_connection (connection);
+  response = MHD_create_response_from_buffer (strlen (ANSWER),
+					      ANSWER,
+					      MHD_RESPMEM_PERSISTENT);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+static void
+request_completed (void *cls,
+		   struct MHD_Connection *connection,
+		   void **con_cls,
+		   enum MHD_RequestTerminationCode toe)
+{
+  free (*con_cls);
+  *con_cls = NULL;
+}
+
+
+static int
+testSuspend (unsigned int flags, int port, unsigned int threads,
+	     MHD_AccessHandlerCallback ahc)
+{
+  struct MHD_Daemon *d;
+  CURL *c;
+  char buf[2048];
+  char url[64];
+  struct CBC cbc;
+  CURLcode errornum;
+  time_t start;
+  int ret;
+
+  cbc.buf = buf;
+  cbc.size = sizeof (buf);
+  cbc.pos = 0;
+  d = MHD_start_daemon (flags | MHD_USE_DEBUG | MHD_USE_SUSPEND_RESUME,
+                        port, NULL, NULL, ahc, NULL,
+			MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
+			MHD_OPTION_THREAD_POOL_SIZE, threads,
+			/* suspended connections must not time out */
+			MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int) 1,
+			MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  snprintf (url, sizeof (url), "http://127.0.0.1:%d/", port);
+  c = curl_easy_init ();
+  curl_easy_setopt (c, CURLOPT_URL, url);
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, &copyBuffer);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, &cbc);
+  curl_easy_setopt (c, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt (c, CURLOPT_TIMEOUT, 150L);
+  curl_easy_setopt (c, CURLOPT_CONNECTTIMEOUT, 15L);
+  curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  /* NOTE: use of CONNECTTIMEOUT without also
+     setting NOSIGNAL results in really weird
+     crashes on my system!*/
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1);
+  start = time (NULL);
+  ret = 0;
+  if (CURLE_OK != (errornum = curl_easy_perform (c)))
+    {
+      fprintf (stderr,
+               "curl_easy_perform failed: `%s'\n",
+               curl_easy_strerror (errornum));
+      ret |= 2;
+    }
+  /* the daemon must have been woken up right away */
+  if (time (NULL) - start > 5)
+    ret |= 4;
+  curl_easy_cleanup (c);
+  MHD_stop_daemon (d);
+  if ( (cbc.pos != strlen (ANSWER)) ||
+       (0 != strncmp (ANSWER, cbc.buf, strlen (ANSWER))) )
+    ret |= 8;
+  return ret;
+}
+
+
+static int
+testStaleResume (unsigned int flags, int port)
+{
+  struct MHD_Daemon *d;
+  CURL *c;
+  char buf[2048];
+  char url[64];
+  struct CBC cbc;
+  CURLcode errornum;
+  unsigned int i;
+  int ret;
+
+  stale_requests = 0;
+  d = MHD_start_daemon (flags | MHD_USE_DEBUG | MHD_USE_SUSPEND_RESUME,
+                        port, NULL, NULL, &ahc_stale, NULL,
+			MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
+			MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  snprintf (url, sizeof (url), "http://127.0.0.1:%d/", port);
+  c = curl_easy_init ();
+  curl_easy_setopt (c, CURLOPT_URL, url);
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, &copyBuffer);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, &cbc);
+  curl_easy_setopt (c, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt (c, CURLOPT_TIMEOUT, 150L);
+  curl_easy_setopt (c, CURLOPT_CONNECTTIMEOUT, 15L);
+  curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1);
+  ret = 0;
+  /* both requests use the same (keep-alive) connection */
+  for (i = 0; i < 2; i++)
+    {
+      cbc.buf = buf;
+      cbc.size = sizeof (buf);
+      cbc.pos = 0;
+      if (CURLE_OK != (errornum = curl_easy_perform (c)))
+	{
+	  fprintf (stderr,
+		   "curl_easy_perform failed: `%s'\n",
+		   curl_easy_strerror (errornum));
+	  ret |= 2;
+	}
+      if ( (cbc.pos != strlen (ANSWER)) ||
+	   (0 != strncmp (ANSWER, cbc.buf, strlen (ANSWER))) )
+	ret |= 8;
+    }
+  curl_easy_cleanup (c);
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+/**
+ * Get the CPU time used by this process so far.
+ *
+ * @return CPU time in milliseconds
+ */
+static unsigned long long
+cpu_ms ()
+{
+  struct rusage ru;
+
+  getrusage (RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000LL
+    + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+}
+
+
+static int
+testStream (unsigned int flags, int port)
+{
+  struct MHD_Daemon *d;
+  CURL *c;
+  char buf[2048];
+  char url[64];
+  struct CBC cbc;
+  CURLcode errornum;
+  unsigned long long cpu;
+  int ret;
+
+  cbc.buf = buf;
+  cbc.size = sizeof (buf);
+  cbc.pos = 0;
+  d = MHD_start_daemon (flags | MHD_USE_DEBUG | MHD_USE_SUSPEND_RESUME,
+                        port, NULL, NULL, &ahc_stream, NULL,
+			MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  snprintf (url, sizeof (url), "http://127.0.0.1:%d/", port);
+  c = curl_easy_init ();
+  curl_easy_setopt (c, CURLOPT_URL, url);
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, &copyBuffer);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, &cbc);
+  curl_easy_setopt (c, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt (c, CURLOPT_TIMEOUT, 150L);
+  curl_easy_setopt (c, CURLOPT_CONNECTTIMEOUT, 15L);
+  curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1);
+  cpu = cpu_ms ();
+  ret = 0;
+  if (CURLE_OK != (errornum = curl_easy_perform (c)))
+    {
+      fprintf (stderr,
+               "curl_easy_perform failed: `%s'\n",
+               curl_easy_strerror (errornum));
+      ret |= 2;
+    }
+  /* the stream was idle for about one second; polling the content
+     reader would have burned (most of) that as CPU time */
+  cpu = cpu_ms () - cpu;
+  if (cpu > 300)
+    {
+      fprintf (stderr, "Idle stream used %llu ms of CPU time\n", cpu);
+      ret |= 4;
+    }
+  curl_easy_cleanup (c);
+  MHD_stop_daemon (d);
+  if (cbc.pos != EVENTS * strlen (EVENT))
+    ret |= 8;
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  if (0 != curl_global_init (CURL_GLOBAL_WIN32))
+    return 2;
+  errorCount += testSuspend (MHD_USE_SELECT_INTERNALLY, 1143, 0, &ahc_echo);
+  errorCount += testSuspend (MHD_USE_SELECT_INTERNALLY | MHD_USE_POLL, 1144, 0,
+			     &ahc_echo) << 4;
+  errorCount += testSuspend (MHD_USE_SELECT_INTERNALLY, 1145, 4, &ahc_echo) << 8;
+  errorCount += testStream (MHD_USE_SELECT_INTERNALLY, 1146) << 12;
+  errorCount += testStream (MHD_USE_THREAD_PER_CONNECTION, 1147) << 16;
+  errorCount += testStream (MHD_USE_THREAD_PER_CONNECTION | MHD_USE_POLL, 1148) << 20;
+  errorCount += testSuspend (MHD_USE_THREAD_PER_CONNECTION, 1186, 0,
+			     &ahc_early) << 24;
+  errorCount += testSuspend (MHD_USE_THREAD_PER_CONNECTION | MHD_USE_POLL, 1187, 0,
+			     &ahc_early) << 28;
+  errorCount += testStaleResume (MHD_USE_SELECT_INTERNALLY, 1188);
+  errorCount += testStaleResume (MHD_USE_THREAD_PER_CONNECTION, 1189);
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  curl_global_cleanup ();
+  return errorCount != 0;       /* 0 == pass */
+}
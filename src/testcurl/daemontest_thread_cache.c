@@ -0,0 +1,198 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file daemontest_thread_cache.c
+ * @brief  Testcase for reusing threads in thread-per-connection mode
+ *         (MHD_OPTION_THREAD_CACHE_SIZE)
+ * @author Christian Grothoff
+ */
+
+#include "MHD_config.h"
+#include "platform.h"
+#include <curl/curl.h>
+#include <microhttpd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WINDOWS
+#include <unistd.h>
+#endif
+
+#define REQUESTS 20
+
+/**
+ * Set on every thread that handled a request; fresh threads
+ * (even if they happen to get a recycled thread ID) start at NULL.
+ */
+static pthread_key_t served_key;
+
+/**
+ * Number of requests handled by a thread that had served before.
+ */
+static unsigned int reused;
+
+struct CBC
+{
+  char *buf;
+  size_t pos;
+  size_t size;
+};
+
+static size_t
+copyBuffer (void *ptr, size_t size, size_t nmemb, void *ctx)
+{
+  struct CBC *cbc = ctx;
+
+  if (cbc->pos + size * nmemb > cbc->size)
+    return 0;                   /* overflow */
+  memcpy (&cbc->buf[cbc->pos], ptr, size * nmemb);
+  cbc->pos += size * nmemb;
+  return size * nmemb;
+}
+
+
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload_data, size_t *upload_data_size,
+          void **unused)
+{
+  static int ptr;
+  struct MHD_Response *response;
+  int ret;
+
+  if (0 != strcmp ("GET", method))
+    return MHD_NO;              /* unexpected method */
+  if (&ptr != *unused)
+    {
+      *unused = &ptr;
+      return MHD_YES;
+    }
+  *unused = NULL;
+  if (NULL != pthread_getspecific (served_key))
+    reused++;
+  pthread_setspecific (served_key, &served_key);
+  response = MHD_create_response_from_buffer (strlen (url),
+					      (void *) url,
+					      MHD_RESPMEM_MUST_COPY);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+static int
+query (int port)
+{
+  CURL *c;
+  char buf[2048];
+  char url[64];
+  struct CBC cbc;
+  CURLcode errornum;
+
+  cbc.buf = buf;
+  cbc.size = sizeof (buf);
+  cbc.pos = 0;
+  snprintf (url, sizeof (url), "http://127.0.0.1:%d/hello_world", port);
+  c = curl_easy_init ();
+  curl_easy_setopt (c, CURLOPT_URL, url);
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, &copyBuffer);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, &cbc);
+  curl_easy_setopt (c, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt (c, CURLOPT_TIMEOUT, 150L);
+  curl_easy_setopt (c, CURLOPT_CONNECTTIMEOUT, 15L);
+  /* one connection per request */
+  curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_0);
+  curl_easy_setopt (c, CURLOPT_FORBID_REUSE, 1L);
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1);
+  errornum = curl_easy_perform (c);
+  curl_easy_cleanup (c);
+  if (CURLE_OK != errornum)
+    {
+      fprintf (stderr,
+               "curl_easy_perform failed: `%s'\n",
+               curl_easy_strerror (errornum));
+      return 1;
+    }
+  if ( (cbc.pos != strlen ("/hello_world")) ||
+       (0 != strncmp ("/hello_world", cbc.buf, strlen ("/hello_world"))) )
+    return 1;
+  return 0;
+}
+
+
+static int
+testThreadCache (unsigned int flags, int port)
+{
+  struct MHD_Daemon *d;
+  unsigned int i;
+  int ret;
+
+  reused = 0;
+  d = MHD_start_daemon (flags | MHD_USE_DEBUG | MHD_USE_THREAD_PER_CONNECTION,
+                        port, NULL, NULL, &ahc_echo, NULL,
+			MHD_OPTION_THREAD_CACHE_SIZE, (unsigned int) 2,
+			MHD_OPTION_THREAD_CACHE_TIMEOUT, (unsigned int) 1,
+			MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  ret = 0;
+  for (i = 0; i < REQUESTS; i++)
+    if (0 != query (port))
+      ret |= 2;
+  /* sequential connections should mostly reuse the cached threads */
+  if (reused < REQUESTS / 2)
+    {
+      fprintf (stderr, "Only %u of %u connections reused a thread\n",
+	       reused, REQUESTS);
+      ret |= 4;
+    }
+  /* let the idle threads time out, then use a fresh one */
+  sleep (2);
+  if (0 != query (port))
+    ret |= 8;
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  if (0 != curl_global_init (CURL_GLOBAL_WIN32))
+    return 2;
+  if (0 != pthread_key_create (&served_key, NULL))
+    return 2;
+  errorCount += testThreadCache (0, 1153);
+  errorCount += testThreadCache (MHD_USE_POLL, 1154) << 4;
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  pthread_key_delete (served_key);
+  curl_global_cleanup ();
+  return errorCount != 0;       /* 0 == pass */
+}
@@ -0,0 +1,228 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file daemontest_wakeup.c
+ * @brief  Testcase for MHD_wakeup_daemon and for waking up the
+ *         event loop on MHD_add_connection
+ * @author Christian Grothoff
+ */
+
+#include "MHD_config.h"
+#include "platform.h"
+#include <microhttpd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifndef WINDOWS
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
+
+#define REQUEST "GET /hello_world HTTP/1.0\r\n\r\n"
+
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload_data, size_t *upload_data_size,
+          void **unused)
+{
+  struct MHD_Response *response;
+  int ret;
+
+  response = MHD_create_response_from_buffer (strlen (url),
+					      (void *) url,
+					      MHD_RESPMEM_MUST_COPY);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+/**
+ * Wait for data on the given socket.
+ *
+ * @param wait_ms how long to wait
+ * @return number of bytes received, -1 if nothing arrived in time
+ */
+static int
+receive (int fd, unsigned int wait_ms)
+{
+  fd_set rs;
+  struct timeval tv;
+  char buf[128];
+
+  FD_ZERO (&rs);
+  FD_SET (fd, &rs);
+  tv.tv_sec = wait_ms / 1000;
+  tv.tv_usec = (wait_ms % 1000) * 1000;
+  if (1 != select (fd + 1, &rs, NULL, NULL, &tv))
+    return -1;
+  return recv (fd, buf, sizeof (buf), MSG_DONTWAIT);
+}
+
+
+/**
+ * Hand a connection to a daemon blocked in its event loop (without
+ * a timeout), as an acceptor thread of the application would.  The
+ * daemon must serve it right away.
+ */
+static int
+testAddConnection (int flags, int port)
+{
+  struct MHD_Daemon *d;
+  struct sockaddr_in sin;
+  int sv[2];
+  int ret;
+
+  d = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG | flags,
+                        port, NULL, NULL, &ahc_echo, NULL, MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  if (0 != socketpair (AF_UNIX, SOCK_STREAM, 0, sv))
+    {
+      MHD_stop_daemon (d);
+      return 2;
+    }
+  /* give the daemon time to block */
+  usleep (100000);
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (0x7f000001);
+  ret = 0;
+  if (MHD_YES != MHD_add_connection (d, sv[0],
+				     (const struct sockaddr *) &sin,
+				     sizeof (sin)))
+    ret |= 4;
+  if (strlen (REQUEST) != send (sv[1], REQUEST, strlen (REQUEST), 0))
+    ret |= 8;
+  if (0 >= receive (sv[1], 2000))
+    {
+      fprintf (stderr, "Added connection was not served\n");
+      ret |= 16;
+    }
+  CLOSE (sv[1]);
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+static void *
+wakeup_thread (void *cls)
+{
+  struct MHD_Daemon *d = cls;
+
+  usleep (100000);
+  if (MHD_YES != MHD_wakeup_daemon (d))
+    return d;
+  return NULL;
+}
+
+
+/**
+ * With external select, MHD_wakeup_daemon from another thread must
+ * make 'select' on the daemon's sets return.
+ */
+static int
+testExternal (int port)
+{
+  struct MHD_Daemon *d;
+  pthread_t pt;
+  void *pt_ret;
+  fd_set rs;
+  fd_set ws;
+  fd_set es;
+  int max;
+  struct timeval tv;
+  time_t start;
+  int ret;
+
+  d = MHD_start_daemon (MHD_USE_DEBUG,
+                        port, NULL, NULL, &ahc_echo, NULL, MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  ret = 0;
+  FD_ZERO (&rs);
+  FD_ZERO (&ws);
+  FD_ZERO (&es);
+  max = 0;
+  if (MHD_YES != MHD_get_fdset (d, &rs, &ws, &es, &max))
+    ret |= 2;
+  if (0 != pthread_create (&pt, NULL, &wakeup_thread, d))
+    {
+      MHD_stop_daemon (d);
+      return 4;
+    }
+  start = time (NULL);
+  tv.tv_sec = 5;
+  tv.tv_usec = 0;
+  if (0 >= select (max + 1, &rs, &ws, &es, &tv))
+    ret |= 8;
+  if (time (NULL) - start > 2)
+    ret |= 16;
+  pthread_join (pt, &pt_ret);
+  if (NULL != pt_ret)
+    ret |= 32;
+  MHD_run (d);
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+static int
+testPool (int port)
+{
+  struct MHD_Daemon *d;
+  int ret;
+
+  d = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG,
+                        port, NULL, NULL, &ahc_echo, NULL,
+			MHD_OPTION_THREAD_POOL_SIZE, (unsigned int) 2,
+			MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  ret = 0;
+  if (MHD_YES != MHD_wakeup_daemon (d))
+    ret |= 2;
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  errorCount += testAddConnection (0, 1169);
+#ifdef HAVE_POLL_H
+  errorCount += testAddConnection (MHD_USE_POLL, 1170) << 6;
+#endif
+  errorCount += testExternal (1171) << 12;
+  errorCount += testPool (1172) << 18;
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  return errorCount != 0;       /* 0 == pass */
+}
@@ -0,0 +1,461 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file perf_tls.c
+ * @brief benchmark HTTPS: full and resumed TLS handshakes per second
+ *        and the throughput of large responses, with the CPU time
+ *        the daemon spends per connection.
+ *        The clients (gnuTLS, in processes of their own) run on the
+ *        same machine, so only the relative scores between MHD
+ *        versions are meaningful.  The CPU time is that of this
+ *        process, which only runs the daemon.
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "microhttpd.h"
+#include "tls_test_common.h"
+#include "../gauger.h"
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+
+extern const char srv_key_pem[];
+extern const char srv_self_signed_cert_pem[];
+
+/**
+ * How many connections does each client open (per phase)?
+ */
+#define ROUNDS 50
+
+/**
+ * How many large responses does each client download?
+ */
+#define TRANSFERS 4
+
+/**
+ * How many clients do we run in parallel?
+ */
+#define PAR 4
+
+/**
+ * Size of the large response.
+ */
+#define BIG_SIZE (4 * 1024 * 1024)
+
+/**
+ * What the clients of a phase do.
+ */
+enum Phase
+{
+  /**
+   * Full handshake and a small response on every connection.
+   */
+  PHASE_FULL,
+
+  /**
+   * Resume the session (with the ticket from a first, full
+   * handshake) and get a small response on every connection.
+   */
+  PHASE_RESUMED,
+
+  /**
+   * Download a large response on every connection.
+   */
+  PHASE_TRANSFER
+};
+
+/**
+ * Small response (re-used).
+ */
+static struct MHD_Response *small_response;
+
+/**
+ * Large response (re-used).
+ */
+static struct MHD_Response *big_response;
+
+
+/**
+ * Get the current timestamp
+ *
+ * @return current time in ms
+ */
+static unsigned long long
+now ()
+{
+  struct timeval tv;
+
+  GETTIMEOFDAY (&tv, NULL);
+  return (((unsigned long long) tv.tv_sec * 1000LL) +
+	  ((unsigned long long) tv.tv_usec / 1000LL));
+}
+
+
+/**
+ * Get the CPU time used by this process (all threads of the daemon).
+ *
+ * @return user and system time in ms
+ */
+static unsigned long long
+cpu_time ()
+{
+  struct rusage ru;
+
+  getrusage (RUSAGE_SELF, &ru);
+  return (((unsigned long long) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec))
+	  * 1000LL +
+	  ((unsigned long long) (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec))
+	  / 1000LL);
+}
+
+
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload_data, size_t *upload_data_size,
+          void **unused)
+{
+  static int ptr;
+  int ret;
+
+  if (0 != strcmp (MHD_HTTP_METHOD_GET, method))
+    return MHD_NO;              /* unexpected method */
+  if (&ptr != *unused)
+    {
+      *unused = &ptr;
+      return MHD_YES;
+    }
+  *unused = NULL;
+  ret = MHD_queue_response (connection, MHD_HTTP_OK,
+			    (0 == strcmp (url, "/big"))
+			    ? big_response
+			    : small_response);
+  if (ret == MHD_NO)
+    abort ();
+  return ret;
+}
+
+
+/**
+ * Request a page over a new TLS connection.
+ *
+ * @param port port to connect to
+ * @param xcred credentials of the client
+ * @param path path to request
+ * @param data session to resume (if 'size' is not 0), otherwise
+ *        set to the new session (if not NULL)
+ * @param resumed set to 1 if the session was resumed
+ * @param received set to the number of bytes received
+ * @return 0 on success
+ */
+static int
+query (int port, gnutls_certificate_credentials_t xcred,
+       const char *path, gnutls_datum_t *data,
+       int *resumed, size_t *received)
+{
+  gnutls_session_t session;
+  struct sockaddr_in sa;
+  char request[64];
+  char buf[16 * 1024];
+  ssize_t got;
+  int sd;
+  int ret;
+  int on;
+
+  *resumed = 0;
+  *received = 0;
+  sd = socket (AF_INET, SOCK_STREAM, 0);
+  if (-1 == sd)
+    return 1;
+  /* like browsers; otherwise the request waits for the ACK of the
+     client's Finished message */
+  on = 1;
+  setsockopt (sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (port);
+  sa.sin_addr.s_addr = htonl (0x7f000001);
+  if (0 != connect (sd, (struct sockaddr *) &sa, sizeof (sa)))
+    {
+      close (sd);
+      return 2;
+    }
+  gnutls_init (&session, GNUTLS_CLIENT);
+  gnutls_priority_set_direct (session, "NORMAL", NULL);
+  gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred);
+  if ( (NULL != data) && (0 != data->size) )
+    gnutls_session_set_data (session, data->data, data->size);
+  gnutls_transport_set_ptr (session, (gnutls_transport_ptr_t) (long) sd);
+  do
+    ret = gnutls_handshake (session);
+  while ( (GNUTLS_E_AGAIN == ret) ||
+	  (GNUTLS_E_INTERRUPTED == ret) );
+  if (GNUTLS_E_SUCCESS != ret)
+    {
+      fprintf (stderr, "Handshake failed: %s\n", gnutls_strerror (ret));
+      ret = 4;
+      goto cleanup;
+    }
+  *resumed = gnutls_session_is_resumed (session);
+  ret = 8;
+  snprintf (request, sizeof (request), "GET %s HTTP/1.0\r\n\r\n", path);
+  if (strlen (request) !=
+      gnutls_record_send (session, request, strlen (request)))
+    goto cleanup;
+  while (0 < (got = gnutls_record_recv (session, buf, sizeof (buf))))
+    {
+      /* with TLS 1.3, the ticket arrives after the handshake */
+      if ( (0 == *received) &&
+	   (NULL != data) &&
+	   (0 == data->size) )
+	gnutls_session_get_data2 (session, data);
+      if ( (0 == *received) &&
+	   (0 != strncmp (buf, "HTTP/1.0 200", strlen ("HTTP/1.0 200"))) &&
+	   (0 != strncmp (buf, "HTTP/1.1 200", strlen ("HTTP/1.1 200"))) )
+	goto cleanup;
+      *received += got;
+    }
+  ret = 0;
+ cleanup:
+  gnutls_bye (session, GNUTLS_SHUT_RDWR);
+  close (sd);
+  gnutls_deinit (session);
+  return ret;
+}
+
+
+/**
+ * Run one client of a phase (in a process of its own).
+ *
+ * @param port port of the daemon
+ * @param phase what to do
+ * @return number of resumed sessions, -1 on error
+ */
+static int
+run_client (int port, enum Phase phase)
+{
+  gnutls_certificate_credentials_t xcred;
+  gnutls_datum_t data;
+  unsigned int i;
+  unsigned int rounds;
+  size_t received;
+  int resumed;
+  int ret;
+
+  gnutls_certificate_allocate_credentials (&xcred);
+  data.data = NULL;
+  data.size = 0;
+  ret = 0;
+  rounds = (PHASE_TRANSFER == phase) ? TRANSFERS : ROUNDS;
+  /* get the ticket to resume with */
+  if ( (PHASE_RESUMED == phase) &&
+       (0 != query (port, xcred, "/", &data, &resumed, &received)) )
+    ret = -1;
+  for (i = 0; (ret >= 0) && (i < rounds); i++)
+    {
+      if (0 != query (port, xcred,
+		      (PHASE_TRANSFER == phase) ? "/big" : "/",
+		      (PHASE_RESUMED == phase) ? &data : NULL,
+		      &resumed, &received))
+	ret = -1;
+      else if ( (PHASE_TRANSFER == phase) &&
+		(received < BIG_SIZE) )
+	ret = -1;
+      else
+	ret += resumed;
+    }
+  gnutls_free (data.data);
+  gnutls_certificate_free_credentials (xcred);
+  return ret;
+}
+
+
+/**
+ * Run the clients of a phase and report the results.
+ *
+ * @param port port of the daemon
+ * @param desc description of the threading mode we used
+ * @param phase what the clients do
+ * @return 0 on success
+ */
+static int
+run_phase (int port, const char *desc, enum Phase phase)
+{
+  pid_t par[PAR];
+  unsigned long long start_time;
+  unsigned long long start_cpu;
+  unsigned long long ms;
+  unsigned long long cpu;
+  unsigned int connections;
+  unsigned int resumed;
+  unsigned int j;
+  int status;
+  int ret;
+  double rate;
+  double cpu_per_connection;
+  const char *counter;
+  const char *unit;
+
+  ret = 0;
+  start_time = now ();
+  start_cpu = cpu_time ();
+  for (j = 0; j < PAR; j++)
+    {
+      par[j] = fork ();
+      if (-1 == par[j])
+	abort ();
+      if (0 == par[j])
+	{
+	  status = run_client (port, phase);
+	  /* the exit status is 8 bits: report 255 for errors */
+	  _exit ((status < 0) ? 255 : (status > ROUNDS) ? ROUNDS : status);
+	}
+    }
+  resumed = 0;
+  for (j = 0; j < PAR; j++)
+    {
+      status = 255 << 8;
+      waitpid (par[j], &status, 0);
+      if ( (! WIFEXITED (status)) ||
+	   (255 == WEXITSTATUS (status)) )
+	ret = 1;
+      else
+	resumed += WEXITSTATUS (status);
+    }
+  ms = now () - start_time;
+  cpu = cpu_time () - start_cpu;
+  if (0 == ms)
+    ms = 1;
+  connections = PAR * ((PHASE_TRANSFER == phase) ? TRANSFERS : ROUNDS);
+  if (PHASE_RESUMED == phase)
+    connections += PAR;         /* the full handshakes to get the tickets */
+  cpu_per_connection = ((double) cpu) / connections;
+  switch (phase)
+    {
+    case PHASE_FULL:
+      counter = "TLS full handshakes";
+      unit = "handshakes/s";
+      rate = ((double) (connections * 1000)) / ms;
+      break;
+    case PHASE_RESUMED:
+      counter = "TLS resumed handshakes";
+      unit = "handshakes/s";
+      rate = ((double) (connections * 1000)) / ms;
+      fprintf (stderr,
+	       "TLS resumption using %s: %u of %u sessions resumed\n",
+	       desc, resumed, PAR * ROUNDS);
+      if (resumed != PAR * ROUNDS)
+	ret = 2;
+      break;
+    default:
+      counter = "TLS transfer";
+      unit = "MB/s";
+      rate = ((double) connections) * BIG_SIZE * 1000.0
+	/ (1024.0 * 1024.0) / ms;
+      break;
+    }
+  fprintf (stderr,
+	   "%s using %s: %f %s, %f ms CPU/connection\n",
+	   counter, desc, rate, unit, cpu_per_connection);
+  if (0 != ret)
+    return ret;
+  GAUGER (desc, counter, rate, unit);
+  GAUGER (desc,
+	  (PHASE_FULL == phase) ? "TLS full handshake CPU"
+	  : (PHASE_RESUMED == phase) ? "TLS resumed handshake CPU"
+	  : "TLS transfer CPU",
+	  cpu_per_connection,
+	  "ms/connection");
+  return 0;
+}
+
+
+/**
+ * Run all phases against a daemon.
+ *
+ * @param d daemon to benchmark
+ * @param port port of the daemon
+ * @param desc description of the threading mode we used
+ * @return 0 on success
+ */
+static int
+run_phases (struct MHD_Daemon *d, int port, const char *desc)
+{
+  int ret;
+
+  if (NULL == d)
+    return 1;
+  ret = run_phase (port, desc, PHASE_FULL);
+  ret |= run_phase (port, desc, PHASE_RESUMED) << 2;
+  ret |= run_phase (port, desc, PHASE_TRANSFER) << 4;
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+static int
+testTls (int port, int flags, unsigned int threads, const char *desc)
+{
+  return run_phases (MHD_start_daemon (flags | MHD_USE_SSL | MHD_USE_DEBUG,
+				       port, NULL, NULL, &ahc_echo, NULL,
+				       MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+				       MHD_OPTION_HTTPS_MEM_CERT,
+				       srv_self_signed_cert_pem,
+				       MHD_OPTION_THREAD_POOL_SIZE, threads,
+				       MHD_OPTION_END),
+		     port, desc);
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+  char *big;
+  int port = 42448;
+
+  gnutls_global_init ();
+  big = malloc (BIG_SIZE);
+  if (NULL == big)
+    return 2;
+  memset (big, 'b', BIG_SIZE);
+  small_response = MHD_create_response_from_buffer (strlen ("/hello_world"),
+						    "/hello_world",
+						    MHD_RESPMEM_MUST_COPY);
+  big_response = MHD_create_response_from_buffer (BIG_SIZE, big,
+						  MHD_RESPMEM_PERSISTENT);
+  errorCount += testTls (port++, MHD_USE_SELECT_INTERNALLY, 0,
+			 "internal select");
+  errorCount += testTls (port++, MHD_USE_THREAD_PER_CONNECTION, 0,
+			 "thread per connection");
+  errorCount += testTls (port++, MHD_USE_SELECT_INTERNALLY, 4,
+			 "thread pool");
+  MHD_destroy_response (small_response);
+  MHD_destroy_response (big_response);
+  free (big);
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  gnutls_global_deinit ();
+  return errorCount != 0;       /* 0 == pass */
+}
@@ -0,0 +1,221 @@
+/*
+ This file is part of libmicrohttpd
+ (C) 2012 Christian Grothoff
+
+ libmicrohttpd is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published
+ by the Free Software Foundation; either version 2, or (at your
+ option) any later version.
+
+ libmicrohttpd is distributed in the hope that it will be useful, but
+ WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with libmicrohttpd; see the file COPYING.  If not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * @file tls_handshake_pool_test.c
+ * @brief  Testcase for MHD_OPTION_HTTPS_HANDSHAKE_POOL_SIZE
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "microhttpd.h"
+#include <pthread.h>
+#include "tls_test_common.h"
+
+extern const char srv_key_pem[];
+extern const char srv_self_signed_cert_pem[];
+
+#define PORT 42442
+
+#define CLIENTS 3
+
+#define REQUESTS 5
+
+static int
+ahc_ok (void *cls,
+	struct MHD_Connection *connection,
+	const char *url,
+	const char *method,
+	const char *version,
+	const char *upload_data, size_t *upload_data_size,
+	void **unused)
+{
+  struct MHD_Response *response;
+  int ret;
+
+  response = MHD_create_response_from_buffer (strlen ("ok"),
+					      (void *) "ok",
+					      MHD_RESPMEM_PERSISTENT);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+/**
+ * Request a page over a new TLS connection.
+ *
+ * @return 0 on success
+ */
+static int
+query ()
+{
+  gnutls_certificate_credentials_t xcred;
+  gnutls_session_t session;
+  struct sockaddr_in sa;
+  char buf[1024];
+  size_t pos;
+  ssize_t got;
+  int sd;
+  int ret;
+
+  sd = socket (AF_INET, SOCK_STREAM, 0);
+  if (-1 == sd)
+    return 1;
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (PORT);
+  sa.sin_addr.s_addr = htonl (0x7f000001);
+  if (0 != connect (sd, (struct sockaddr *) &sa, sizeof (sa)))
+    {
+      close (sd);
+      return 2;
+    }
+  gnutls_certificate_allocate_credentials (&xcred);
+  gnutls_init (&session, GNUTLS_CLIENT);
+  gnutls_priority_set_direct (session, "NORMAL", NULL);
+  gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred);
+  gnutls_transport_set_ptr (session, (gnutls_transport_ptr_t) (long) sd);
+  do
+    ret = gnutls_handshake (session);
+  while ( (GNUTLS_E_AGAIN == ret) ||
+	  (GNUTLS_E_INTERRUPTED == ret) );
+  if (GNUTLS_E_SUCCESS != ret)
+    {
+      fprintf (stderr, "Handshake failed: %s\n", gnutls_strerror (ret));
+      ret = 4;
+      goto cleanup;
+    }
+  ret = 8;
+  if (strlen ("GET / HTTP/1.0\r\n\r\n") !=
+      gnutls_record_send (session, "GET / HTTP/1.0\r\n\r\n",
+			  strlen ("GET / HTTP/1.0\r\n\r\n")))
+    goto cleanup;
+  pos = 0;
+  while ( (pos < sizeof (buf) - 1) &&
+	  (0 < (got = gnutls_record_recv (session, &buf[pos],
+					  sizeof (buf) - 1 - pos))) )
+    pos += got;
+  buf[pos] = '\0';
+  if ( (0 != strncmp (buf, "HTTP/1.0 200", strlen ("HTTP/1.0 200"))) &&
+       (0 != strncmp (buf, "HTTP/1.1 200", strlen ("HTTP/1.1 200"))) )
+    goto cleanup;
+  ret = 0;
+ cleanup:
+  gnutls_bye (session, GNUTLS_SHUT_RDWR);
+  close (sd);
+  gnutls_deinit (session);
+  gnutls_certificate_free_credentials (xcred);
+  return ret;
+}
+
+
+static void *
+client_thread (void *cls)
+{
+  static int failed;
+  unsigned int i;
+
+  for (i = 0; i < REQUESTS; i++)
+    if (0 != query ())
+      return &failed;
+  return NULL;
+}
+
+
+static int
+testHandshakePool (int flags, unsigned int threads, unsigned int handlers)
+{
+  struct MHD_Daemon *d;
+  const union MHD_DaemonInfo *info;
+  pthread_t clients[CLIENTS];
+  void *client_ret;
+  unsigned int i;
+  int ret;
+
+  d = MHD_start_daemon (flags | MHD_USE_SSL | MHD_USE_DEBUG,
+			PORT, NULL, NULL, &ahc_ok, NULL,
+			MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+			MHD_OPTION_HTTPS_MEM_CERT, srv_self_signed_cert_pem,
+			MHD_OPTION_HTTPS_HANDSHAKE_POOL_SIZE, (unsigned int) 2,
+			MHD_OPTION_THREAD_POOL_SIZE, threads,
+			MHD_OPTION_HANDLER_POOL_SIZE, handlers,
+			MHD_OPTION_END);
+  if (NULL == d)
+    return 1;
+  ret = 0;
+  for (i = 0; i < CLIENTS; i++)
+    if (0 != pthread_create (&clients[i], NULL, &client_thread, NULL))
+      {
+	MHD_stop_daemon (d);
+	return 2;
+      }
+  for (i = 0; i < CLIENTS; i++)
+    if ( (0 != pthread_join (clients[i], &client_ret)) ||
+	 (NULL != client_ret) )
+      ret |= 4;
+  info = MHD_get_daemon_info (d, MHD_DAEMON_INFO_HANDSHAKE_STATISTICS);
+  if ( (NULL == info) ||
+       (0 != info->handshake_statistics.queued) ||
+       (CLIENTS * REQUESTS > info->handshake_statistics.steps) ||
+       (info->handshake_statistics.max_queue_time >
+	info->handshake_statistics.queue_time) )
+    ret |= 8;
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+static int
+testInvalid ()
+{
+  struct MHD_Daemon *d;
+
+  d = MHD_start_daemon (MHD_USE_THREAD_PER_CONNECTION | MHD_USE_SSL,
+			PORT, NULL, NULL, &ahc_ok, NULL,
+			MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+			MHD_OPTION_HTTPS_MEM_CERT, srv_self_signed_cert_pem,
+			MHD_OPTION_HTTPS_HANDSHAKE_POOL_SIZE, (unsigned int) 2,
+			MHD_OPTION_END);
+  if (NULL == d)
+    return 0;
+  MHD_stop_daemon (d);
+  return 1;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  gnutls_global_init ();
+  errorCount += testHandshakePool (MHD_USE_SELECT_INTERNALLY, 0, 0);
+#ifdef HAVE_POLL_H
+  errorCount += testHandshakePool (MHD_USE_SELECT_INTERNALLY | MHD_USE_POLL,
+				   0, 0) << 4;
+#endif
+  errorCount += testHandshakePool (MHD_USE_SELECT_INTERNALLY, 2, 0) << 8;
+  errorCount += testHandshakePool (MHD_USE_SELECT_INTERNALLY, 0, 2) << 12;
+  errorCount += testInvalid () << 16;
+  print_test_result (errorCount, argv[0]);
+  gnutls_global_deinit ();
+  return errorCount != 0;
+}
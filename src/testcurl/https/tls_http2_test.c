@@ -0,0 +1,325 @@
+/*
+ This file is part of libmicrohttpd
+ (C) 2012 Christian Grothoff
+
+ libmicrohttpd is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published
+ by the Free Software Foundation; either version 2, or (at your
+ option) any later version.
+
+ libmicrohttpd is distributed in the hope that it will be useful, but
+ WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with libmicrohttpd; see the file COPYING.  If not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * @file tls_http2_test.c
+ * @brief  Testcase for HTTP/2 negotiated with ALPN: several requests
+ *         (one with a large response) multiplexed over one connection,
+ *         plus a client that only offers HTTP/1.1
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "microhttpd.h"
+#include "tls_test_common.h"
+
+extern const char srv_key_pem[];
+extern const char srv_self_signed_cert_pem[];
+
+#define PORT 42447
+
+/**
+ * Number of requests; all but the first run at the same time and
+ * the last one uses HTTP/1.1.
+ */
+#define NUM_REQUESTS 5
+
+/**
+ * Size of the generated response.
+ */
+#define BIG_SIZE (300 * 1024)
+
+static unsigned int completed;
+
+static unsigned int connections;
+
+
+static ssize_t
+big_reader (void *cls, uint64_t pos, char *buf, size_t max)
+{
+  size_t i;
+
+  if (pos >= BIG_SIZE)
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  if (max > BIG_SIZE - pos)
+    max = BIG_SIZE - pos;
+  for (i = 0; i < max; i++)
+    buf[i] = 'a' + (char) ((pos + i) % 26);
+  return max;
+}
+
+
+static int
+accept_cb (void *cls, const struct sockaddr *addr, socklen_t addrlen)
+{
+  connections++;
+  return MHD_YES;
+}
+
+
+static void
+completed_cb (void *cls,
+	      struct MHD_Connection *connection,
+	      void **con_cls,
+	      enum MHD_RequestTerminationCode toe)
+{
+  if (MHD_REQUEST_TERMINATED_COMPLETED_OK == toe)
+    completed++;
+}
+
+
+static int
+ahc_version (void *cls,
+	     struct MHD_Connection *connection,
+	     const char *url,
+	     const char *method,
+	     const char *version,
+	     const char *upload_data, size_t *upload_data_size,
+	     void **unused)
+{
+  static int ptr;
+  struct MHD_Response *response;
+  char text[64];
+  int ret;
+
+  if (&ptr != *unused)
+    {
+      *unused = &ptr;
+      return MHD_YES;
+    }
+  *unused = NULL;
+  if (0 == strcmp (url, "/big"))
+    response = MHD_create_response_from_callback (BIG_SIZE, 4096,
+						  &big_reader, NULL, NULL);
+  else
+    {
+      snprintf (text, sizeof (text), "%s %s", version, url);
+      response = MHD_create_response_from_buffer (strlen (text), text,
+						  MHD_RESPMEM_MUST_COPY);
+    }
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+/**
+ * Set up a request.
+ *
+ * @param path path to request
+ * @param cbc where to store the body
+ * @param h2 non-zero to offer HTTP/2, zero to offer only HTTP/1.1
+ * @return the handle
+ */
+static CURL *
+setup (const char *path, struct CBC *cbc, int h2)
+{
+  CURL *c;
+  char url[128];
+
+  snprintf (url, sizeof (url), "https://127.0.0.1:%d%s", PORT, path);
+  c = curl_easy_init ();
+  curl_easy_setopt (c, CURLOPT_URL, url);
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, &copyBuffer);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, cbc);
+  curl_easy_setopt (c, CURLOPT_SSL_VERIFYPEER, 0L);
+  curl_easy_setopt (c, CURLOPT_SSL_VERIFYHOST, 0L);
+  curl_easy_setopt (c, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt (c, CURLOPT_HTTP_VERSION,
+		    (long) (h2 ? CURL_HTTP_VERSION_2TLS
+			    : CURL_HTTP_VERSION_1_1));
+  curl_easy_setopt (c, CURLOPT_TIMEOUT, 150L);
+  curl_easy_setopt (c, CURLOPT_CONNECTTIMEOUT, 15L);
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1L);
+  return c;
+}
+
+
+/**
+ * Run the transfers of 'multi' until all are done.
+ *
+ * @param multi transfers to run
+ * @param d daemon to run as well (unless it has threads of its own)
+ * @param flags threading mode of the daemon
+ * @return 0 on success
+ */
+static int
+run (CURLM *multi, struct MHD_Daemon *d, int flags)
+{
+  struct CURLMsg *msg;
+  fd_set rs;
+  fd_set ws;
+  fd_set es;
+  int max;
+  int running;
+  time_t start;
+  struct timeval tv;
+  int ret;
+
+  ret = 0;
+  start = time (NULL);
+  running = 1;
+  while ( (running > 0) &&
+	  (time (NULL) - start < 30) )
+    {
+      max = 0;
+      FD_ZERO (&rs);
+      FD_ZERO (&ws);
+      FD_ZERO (&es);
+      curl_multi_perform (multi, &running);
+      curl_multi_fdset (multi, &rs, &ws, &es, &max);
+      if ( (0 == (flags & (MHD_USE_SELECT_INTERNALLY |
+			   MHD_USE_THREAD_PER_CONNECTION))) &&
+	   (MHD_YES != MHD_get_fdset (d, &rs, &ws, &es, &max)) )
+	return 2;
+      tv.tv_sec = 0;
+      tv.tv_usec = 1000;
+      select (max + 1, &rs, &ws, &es, &tv);
+      if (0 == (flags & (MHD_USE_SELECT_INTERNALLY |
+			 MHD_USE_THREAD_PER_CONNECTION)))
+	MHD_run (d);
+    }
+  while (NULL != (msg = curl_multi_info_read (multi, &running)))
+    if ( (CURLMSG_DONE == msg->msg) &&
+	 (CURLE_OK != msg->data.result) )
+      {
+	fprintf (stderr, "Request failed: `%s'\n",
+		 curl_easy_strerror (msg->data.result));
+	ret = 4;
+      }
+  return ret;
+}
+
+
+static int
+testHttp2 (int flags)
+{
+  struct MHD_Daemon *d;
+  CURLM *multi;
+  CURL *c[NUM_REQUESTS];
+  struct CBC cbc[NUM_REQUESTS];
+  long version;
+  char expect[64];
+  unsigned int i;
+  size_t j;
+  int ret;
+  static const char *paths[NUM_REQUESTS] = {
+    "/a", "/b", "/big", "/c", "/d"
+  };
+
+  completed = 0;
+  connections = 0;
+  d = MHD_start_daemon (flags | MHD_USE_SSL | MHD_USE_DEBUG | MHD_USE_HTTP2,
+			PORT, &accept_cb, NULL, &ahc_version, NULL,
+			MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+			MHD_OPTION_HTTPS_MEM_CERT, srv_self_signed_cert_pem,
+			MHD_OPTION_NOTIFY_COMPLETED, &completed_cb, NULL,
+			MHD_OPTION_END);
+  if (NULL == d)
+    return 1;
+  multi = curl_multi_init ();
+  curl_multi_setopt (multi, CURLMOPT_PIPELINING, (long) CURLPIPE_MULTIPLEX);
+  for (i = 0; i < NUM_REQUESTS; i++)
+    {
+      cbc[i].size = BIG_SIZE + 1;
+      cbc[i].buf = malloc (cbc[i].size);
+      cbc[i].pos = 0;
+      c[i] = setup (paths[i], &cbc[i], NUM_REQUESTS - 1 != i);
+    }
+  /* establish the HTTP/2 connection with the first request, the
+     others then all have to share it */
+  curl_multi_add_handle (multi, c[0]);
+  ret = run (multi, d, flags);
+  for (i = 1; i < NUM_REQUESTS; i++)
+    curl_multi_add_handle (multi, c[i]);
+  ret |= run (multi, d, flags);
+  for (i = 0; i < NUM_REQUESTS; i++)
+    {
+      version = 0;
+      curl_easy_getinfo (c[i], CURLINFO_HTTP_VERSION, &version);
+      if (version != ( (NUM_REQUESTS - 1 != i)
+		       ? CURL_HTTP_VERSION_2_0
+		       : CURL_HTTP_VERSION_1_1))
+	ret |= 8;
+      if (0 == strcmp (paths[i], "/big"))
+	{
+	  if (cbc[i].pos != BIG_SIZE)
+	    ret |= 16;
+	  for (j = 0; (0 == (ret & 16)) && (j < BIG_SIZE); j++)
+	    if (cbc[i].buf[j] != 'a' + (char) (j % 26))
+	      ret |= 16;
+	  continue;
+	}
+      snprintf (expect, sizeof (expect), "%s %s",
+		(NUM_REQUESTS - 1 != i) ? MHD_HTTP_VERSION_2_0
+		: MHD_HTTP_VERSION_1_1,
+		paths[i]);
+      if ( (cbc[i].pos != strlen (expect)) ||
+	   (0 != strncmp (cbc[i].buf, expect, cbc[i].pos)) )
+	ret |= 32;
+    }
+  for (i = 0; i < NUM_REQUESTS; i++)
+    {
+      curl_multi_remove_handle (multi, c[i]);
+      curl_easy_cleanup (c[i]);
+      free (cbc[i].buf);
+    }
+  curl_multi_cleanup (multi);
+  MHD_stop_daemon (d);
+  /* one connection for all HTTP/2 requests, one for HTTP/1.1 */
+  if (2 != connections)
+    {
+      fprintf (stderr, "Used %u connections\n", connections);
+      ret |= 64;
+    }
+  if (NUM_REQUESTS != completed)
+    ret |= 128;
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+#if HAVE_GNUTLS_ALPN
+  if (0 != curl_global_init (CURL_GLOBAL_ALL))
+    return 2;
+  if (0 == (curl_version_info (CURLVERSION_NOW)->features & CURL_VERSION_HTTP2))
+    {
+      fprintf (stderr, "libcurl lacks HTTP/2 support, skipping test\n");
+      curl_global_cleanup ();
+      return 77;
+    }
+  gnutls_global_init ();
+  errorCount += testHttp2 (MHD_USE_SELECT_INTERNALLY);
+  errorCount += testHttp2 (MHD_USE_SELECT_INTERNALLY | MHD_USE_POLL) << 8;
+  errorCount += testHttp2 (MHD_USE_THREAD_PER_CONNECTION) << 16;
+  errorCount += testHttp2 (0) << 24;
+  print_test_result (errorCount, argv[0]);
+  gnutls_global_deinit ();
+  curl_global_cleanup ();
+  return errorCount != 0;
+#else
+  fprintf (stderr, "gnutls lacks ALPN support, skipping test\n");
+  return 77;
+#endif
+}
@@ -0,0 +1,328 @@
+/*
+ This file is part of libmicrohttpd
+ (C) 2012 Christian Grothoff
+
+ libmicrohttpd is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published
+ by the Free Software Foundation; either version 2, or (at your
+ option) any later version.
+
+ libmicrohttpd is distributed in the hope that it will be useful, but
+ WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with libmicrohttpd; see the file COPYING.  If not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * @file tls_ktls_test.c
+ * @brief  Testcase for MHD_USE_KTLS; responses must arrive intact
+ *         whether or not they are encrypted by the kernel (the
+ *         offload tests are skipped if the kernel lacks TLS support)
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "microhttpd.h"
+#include "tls_test_common.h"
+#include <netinet/tcp.h>
+
+extern const char srv_key_pem[];
+extern const char srv_self_signed_cert_pem[];
+
+#define PORT 42443
+
+#define TLS12 "NORMAL:-VERS-TLS1.3:-CIPHER-ALL:"
+
+#define TLS13 "NORMAL:-CIPHER-ALL:"
+
+/**
+ * Size of the file we serve (several TLS records).
+ */
+#define FILE_SIZE (256 * 1024)
+
+/**
+ * Contents of the file.
+ */
+static char *body;
+
+/**
+ * Name of the file.
+ */
+static char file_name[] = "/tmp/mhd-ktls-XXXXXX";
+
+/**
+ * Number of requests served with kernel TLS.
+ */
+static unsigned int ktls_used;
+
+
+/**
+ * Check if the kernel can encrypt TLS records, i.e. if it accepts
+ * the 'tls' upper layer protocol on a connected TCP socket.
+ *
+ * @return MHD_YES if it does
+ */
+static int
+kernel_has_tls ()
+{
+  int ret = MHD_NO;
+#ifdef TCP_ULP
+  struct sockaddr_in sa;
+  socklen_t sl;
+  int ls;
+  int cs;
+  int as;
+
+  ls = socket (AF_INET, SOCK_STREAM, 0);
+  cs = socket (AF_INET, SOCK_STREAM, 0);
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl (0x7f000001);
+  sl = sizeof (sa);
+  if ( (-1 != ls) &&
+       (-1 != cs) &&
+       (0 == bind (ls, (struct sockaddr *) &sa, sizeof (sa))) &&
+       (0 == listen (ls, 1)) &&
+       (0 == getsockname (ls, (struct sockaddr *) &sa, &sl)) &&
+       (0 == connect (cs, (struct sockaddr *) &sa, sizeof (sa))) &&
+       (-1 != (as = accept (ls, NULL, NULL))) )
+    {
+      if (0 == setsockopt (as, IPPROTO_TCP, TCP_ULP, "tls", sizeof ("tls")))
+	ret = MHD_YES;
+      close (as);
+    }
+  if (-1 != cs)
+    close (cs);
+  if (-1 != ls)
+    close (ls);
+#endif
+  return ret;
+}
+
+
+static int
+ahc_file (void *cls,
+	  struct MHD_Connection *connection,
+	  const char *url,
+	  const char *method,
+	  const char *version,
+	  const char *upload_data, size_t *upload_data_size,
+	  void **unused)
+{
+  const union MHD_ConnectionInfo *info;
+  struct MHD_Response *response;
+  int ret;
+  int fd;
+
+  info = MHD_get_connection_info (connection, MHD_CONNECTION_INFO_KTLS);
+  if (NULL == info)
+    return MHD_NO;
+  if (MHD_YES == info->ktls)
+    ktls_used++;
+  if (0 == strcmp (url, "/buffer"))
+    {
+      response = MHD_create_response_from_buffer (FILE_SIZE, body,
+						  MHD_RESPMEM_PERSISTENT);
+    }
+  else
+    {
+      fd = open (file_name, O_RDONLY);
+      if (-1 == fd)
+	return MHD_NO;
+      response = MHD_create_response_from_fd (FILE_SIZE, fd);
+    }
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+/**
+ * Request a page over a new TLS connection and check that
+ * we get the file.
+ *
+ * @param priorities gnutls priorities of the client
+ * @param url page to request
+ * @return 0 on success
+ */
+static int
+query (const char *priorities, const char *url)
+{
+  gnutls_certificate_credentials_t xcred;
+  gnutls_session_t session;
+  struct sockaddr_in sa;
+  char request[64];
+  char *buf;
+  char *hdr_end;
+  size_t pos;
+  ssize_t got;
+  int sd;
+  int ret;
+
+  sd = socket (AF_INET, SOCK_STREAM, 0);
+  if (-1 == sd)
+    return 1;
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (PORT);
+  sa.sin_addr.s_addr = htonl (0x7f000001);
+  if (0 != connect (sd, (struct sockaddr *) &sa, sizeof (sa)))
+    {
+      close (sd);
+      return 2;
+    }
+  if (NULL == (buf = malloc (FILE_SIZE + 1024)))
+    {
+      close (sd);
+      return 2;
+    }
+  gnutls_certificate_allocate_credentials (&xcred);
+  gnutls_init (&session, GNUTLS_CLIENT);
+  gnutls_priority_set_direct (session, priorities, NULL);
+  gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred);
+  gnutls_transport_set_ptr (session, (gnutls_transport_ptr_t) (long) sd);
+  do
+    ret = gnutls_handshake (session);
+  while ( (GNUTLS_E_AGAIN == ret) ||
+	  (GNUTLS_E_INTERRUPTED == ret) );
+  if (GNUTLS_E_SUCCESS != ret)
+    {
+      fprintf (stderr, "Handshake failed: %s\n", gnutls_strerror (ret));
+      ret = 4;
+      goto cleanup;
+    }
+  if ( (GNUTLS_TLS1_3 == gnutls_protocol_get_version (session)) &&
+       (GNUTLS_E_SUCCESS != gnutls_session_key_update (session,
+						       GNUTLS_KU_PEER)) )
+    {
+      /* the server has to answer with a key update of its own */
+      ret = 4;
+      goto cleanup;
+    }
+  ret = 8;
+  snprintf (request, sizeof (request), "GET %s HTTP/1.0\r\n\r\n", url);
+  if (strlen (request) !=
+      gnutls_record_send (session, request, strlen (request)))
+    goto cleanup;
+  pos = 0;
+  while ( (pos < FILE_SIZE + 1023) &&
+	  (0 < (got = gnutls_record_recv (session, &buf[pos],
+					  FILE_SIZE + 1023 - pos))) )
+    pos += got;
+  buf[pos] = '\0';
+  if ( (0 != strncmp (buf, "HTTP/1.0 200", strlen ("HTTP/1.0 200"))) &&
+       (0 != strncmp (buf, "HTTP/1.1 200", strlen ("HTTP/1.1 200"))) )
+    goto cleanup;
+  ret = 16;
+  if ( (NULL == (hdr_end = strstr (buf, "\r\n\r\n"))) ||
+       (FILE_SIZE != &buf[pos] - (hdr_end + 4)) ||
+       (0 != memcmp (hdr_end + 4, body, FILE_SIZE)) )
+    {
+      fprintf (stderr, "Got corrupted body of %u bytes for `%s' (%s)\n",
+	       (unsigned int) pos, url, priorities);
+      goto cleanup;
+    }
+  ret = 0;
+ cleanup:
+  gnutls_bye (session, GNUTLS_SHUT_RDWR);
+  close (sd);
+  gnutls_deinit (session);
+  gnutls_certificate_free_credentials (xcred);
+  free (buf);
+  return ret;
+}
+
+
+/**
+ * Request a file and a buffer over TLS.
+ *
+ * @param flags threading mode of the daemon
+ * @param priorities gnutls priorities of the client
+ * @param offload MHD_YES if the kernel must encrypt the responses
+ * @return 0 on success
+ */
+static int
+testKtls (int flags, const char *priorities, int offload)
+{
+  struct MHD_Daemon *d;
+  int ret;
+
+  d = MHD_start_daemon (flags | MHD_USE_SSL | MHD_USE_KTLS | MHD_USE_DEBUG,
+			PORT, NULL, NULL, &ahc_file, NULL,
+			MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+			MHD_OPTION_HTTPS_MEM_CERT, srv_self_signed_cert_pem,
+			MHD_OPTION_END);
+  if (NULL == d)
+    return 1;
+  ret = 0;
+  ktls_used = 0;
+  if (0 != query (priorities, "/file"))
+    ret |= 2;
+  if (0 != query (priorities, "/buffer"))
+    ret |= 4;
+  MHD_stop_daemon (d);
+  if (ktls_used != ((MHD_YES == offload) ? 2 : 0))
+    {
+      fprintf (stderr, "%u of 2 responses encrypted by the kernel (%s)\n",
+	       ktls_used, priorities);
+      ret |= 8;
+    }
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+  unsigned int i;
+  int have_ktls;
+  int fd;
+
+  if (NULL == (body = malloc (FILE_SIZE)))
+    return 1;
+  for (i = 0; i < FILE_SIZE; i++)
+    body[i] = 'a' + (i * 7) % 26;
+  fd = mkstemp (file_name);
+  if ( (-1 == fd) ||
+       (FILE_SIZE != write (fd, body, FILE_SIZE)) )
+    {
+      fprintf (stderr, "Failed to create test file: %s\n", strerror (errno));
+      return 1;
+    }
+  close (fd);
+  have_ktls = kernel_has_tls ();
+  gnutls_global_init ();
+  /* not offloaded, must stay with gnutls */
+  errorCount += testKtls (MHD_USE_SELECT_INTERNALLY, TLS12 "+AES-128-CBC",
+			  MHD_NO);
+  errorCount += testKtls (MHD_USE_SELECT_INTERNALLY, TLS13 "+AES-256-GCM",
+			  MHD_NO) << 4;
+  errorCount += testKtls (MHD_USE_THREAD_PER_CONNECTION, TLS13 "+AES-128-GCM",
+			  MHD_NO) << 8;
+  if (MHD_YES == have_ktls)
+    {
+      errorCount += testKtls (MHD_USE_SELECT_INTERNALLY, TLS12 "+AES-128-GCM",
+			      MHD_YES) << 12;
+      errorCount += testKtls (MHD_USE_SELECT_INTERNALLY, TLS12 "+AES-256-GCM",
+			      MHD_YES) << 16;
+      errorCount += testKtls (MHD_USE_THREAD_PER_CONNECTION,
+			      TLS12 "+AES-128-GCM", MHD_YES) << 20;
+    }
+  print_test_result (errorCount, argv[0]);
+  gnutls_global_deinit ();
+  unlink (file_name);
+  free (body);
+  if ( (0 == errorCount) &&
+       (MHD_NO == have_ktls) )
+    {
+      fprintf (stderr, "Kernel TLS not available, skipping the offload tests\n");
+      return 77;
+    }
+  return errorCount != 0;
+}
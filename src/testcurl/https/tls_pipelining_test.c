@@ -0,0 +1,274 @@
+/*
+ This file is part of libmicrohttpd
+ (C) 2012 Christian Grothoff
+
+ libmicrohttpd is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published
+ by the Free Software Foundation; either version 2, or (at your
+ option) any later version.
+
+ libmicrohttpd is distributed in the hope that it will be useful, but
+ WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with libmicrohttpd; see the file COPYING.  If not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * @file tls_pipelining_test.c
+ * @brief  Testcase for pipelined uploads arriving in a single TCP
+ *         segment; the records do not fit into the read buffer, so
+ *         gnutls keeps parts of them and they must be processed
+ *         without the socket becoming readable again
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "microhttpd.h"
+#include "tls_test_common.h"
+
+extern const char srv_key_pem[];
+extern const char srv_self_signed_cert_pem[];
+
+#define PORT 42445
+
+/**
+ * Number of requests we pipeline.
+ */
+#define REQUESTS 4
+
+/**
+ * Size of the body of each request (two TLS records).
+ */
+#define UPLOAD_SIZE 20000
+
+/**
+ * Body of the responses.
+ */
+#define PAGE "<html><head><title>pipelined</title></head><body>ok</body></html>"
+
+/**
+ * Records the client sends, collected to go out with a single write.
+ */
+static char out[REQUESTS * (UPLOAD_SIZE + 1024)];
+
+/**
+ * Number of bytes in 'out'.
+ */
+static size_t out_size;
+
+/**
+ * Collect the records in 'out' (1) or send them right away (0)?
+ */
+static int collecting;
+
+
+static int
+ahc_page (void *cls,
+	  struct MHD_Connection *connection,
+	  const char *url,
+	  const char *method,
+	  const char *version,
+	  const char *upload_data, size_t *upload_data_size,
+	  void **unused)
+{
+  static size_t received;
+  struct MHD_Response *response;
+  int ret;
+
+  if (&received != *unused)
+    {
+      *unused = &received;
+      received = 0;
+      return MHD_YES;
+    }
+  if (0 != *upload_data_size)
+    {
+      received += *upload_data_size;
+      *upload_data_size = 0;
+      return MHD_YES;
+    }
+  *unused = NULL;
+  if (UPLOAD_SIZE != received)
+    {
+      fprintf (stderr, "Got upload of %u bytes\n", (unsigned int) received);
+      return MHD_NO;
+    }
+  response = MHD_create_response_from_buffer (strlen (PAGE), PAGE,
+					      MHD_RESPMEM_PERSISTENT);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+/**
+ * Push function of the client: collect the records in 'out' instead
+ * of sending them one by one (if 'collecting' is set).
+ */
+static ssize_t
+collect_push (gnutls_transport_ptr_t ptr, const void *data, size_t size)
+{
+  if (! collecting)
+    return send ((int) (long) ptr, data, size, 0);
+  if (size > sizeof (out) - out_size)
+    {
+      errno = ENOBUFS;
+      return -1;
+    }
+  memcpy (&out[out_size], data, size);
+  out_size += size;
+  return size;
+}
+
+
+/**
+ * Send data in as many records as needed.
+ *
+ * @param session TLS session to use
+ * @param data data to send
+ * @param size number of bytes in data
+ * @return 0 on success
+ */
+static int
+send_all (gnutls_session_t session, const char *data, size_t size)
+{
+  ssize_t sent;
+
+  while (size > 0)
+    {
+      sent = gnutls_record_send (session, data, size);
+      if (sent <= 0)
+	return 1;
+      data += sent;
+      size -= sent;
+    }
+  return 0;
+}
+
+
+/**
+ * Send several uploads (in TLS records larger than the read buffer
+ * of the daemon, all in a single TCP segment) on one connection and
+ * wait for all responses.
+ *
+ * @param flags threading mode of the daemon
+ * @return 0 on success
+ */
+static int
+testPipelining (int flags)
+{
+  struct MHD_Daemon *d;
+  gnutls_certificate_credentials_t xcred;
+  gnutls_session_t session;
+  struct sockaddr_in sa;
+  struct timeval tv;
+  char buf[16 * 1024];
+  char request[128];
+  char *upload;
+  const char *p;
+  unsigned int i;
+  unsigned int responses;
+  size_t pos;
+  ssize_t got;
+  int sd;
+  int ret;
+
+  d = MHD_start_daemon (flags | MHD_USE_SSL | MHD_USE_DEBUG,
+			PORT, NULL, NULL, &ahc_page, NULL,
+			MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+			MHD_OPTION_HTTPS_MEM_CERT, srv_self_signed_cert_pem,
+			MHD_OPTION_CONNECTION_MEMORY_LIMIT, (size_t) 16384,
+			MHD_OPTION_END);
+  if (NULL == d)
+    return 1;
+  if (NULL == (upload = malloc (UPLOAD_SIZE)))
+    {
+      MHD_stop_daemon (d);
+      return 1;
+    }
+  memset (upload, 'u', UPLOAD_SIZE);
+  sd = socket (AF_INET, SOCK_STREAM, 0);
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (PORT);
+  sa.sin_addr.s_addr = htonl (0x7f000001);
+  if ( (-1 == sd) ||
+       (0 != connect (sd, (struct sockaddr *) &sa, sizeof (sa))) )
+    {
+      if (-1 != sd)
+	close (sd);
+      free (upload);
+      MHD_stop_daemon (d);
+      return 2;
+    }
+  /* do not hang if the server does not process the requests */
+  tv.tv_sec = 5;
+  tv.tv_usec = 0;
+  setsockopt (sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  gnutls_certificate_allocate_credentials (&xcred);
+  gnutls_init (&session, GNUTLS_CLIENT);
+  gnutls_priority_set_direct (session, "NORMAL", NULL);
+  gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred);
+  gnutls_transport_set_ptr (session, (gnutls_transport_ptr_t) (long) sd);
+  ret = 0;
+  if (GNUTLS_E_SUCCESS != gnutls_handshake (session))
+    ret = 4;
+  gnutls_transport_set_push_function (session, &collect_push);
+  collecting = 1;
+  snprintf (request, sizeof (request),
+	    "PUT / HTTP/1.1\r\nHost: a\r\nContent-Length: %u\r\n\r\n",
+	    (unsigned int) UPLOAD_SIZE);
+  for (i = 0; (0 == ret) && (i < REQUESTS); i++)
+    if ( (0 != send_all (session, request, strlen (request))) ||
+	 (0 != send_all (session, upload, UPLOAD_SIZE)) )
+      ret = 8;
+  if ( (0 == ret) &&
+       (out_size != write (sd, out, out_size)) )
+    ret = 8;
+  collecting = 0;
+  out_size = 0;
+  pos = 0;
+  responses = 0;
+  while ( (0 == ret) && (responses < REQUESTS) )
+    {
+      got = gnutls_record_recv (session, &buf[pos], sizeof (buf) - 1 - pos);
+      if (got <= 0)
+	{
+	  fprintf (stderr, "Got %u of %u responses\n", responses, REQUESTS);
+	  ret = 16;
+	  break;
+	}
+      pos += got;
+      buf[pos] = '\0';
+      responses = 0;
+      for (p = buf; NULL != (p = strstr (p, PAGE)); p += strlen (PAGE))
+	responses++;
+    }
+  gnutls_bye (session, GNUTLS_SHUT_WR);
+  close (sd);
+  gnutls_deinit (session);
+  gnutls_certificate_free_credentials (xcred);
+  free (upload);
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  gnutls_global_init ();
+  errorCount += testPipelining (MHD_USE_SELECT_INTERNALLY);
+  errorCount += testPipelining (MHD_USE_SELECT_INTERNALLY | MHD_USE_POLL) << 5;
+  errorCount += testPipelining (MHD_USE_THREAD_PER_CONNECTION) << 10;
+  print_test_result (errorCount, argv[0]);
+  gnutls_global_deinit ();
+  return errorCount != 0;
+}
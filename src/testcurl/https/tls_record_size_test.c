@@ -0,0 +1,375 @@
+/*
+ This file is part of libmicrohttpd
+ (C) 2012 Christian Grothoff
+
+ libmicrohttpd is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published
+ by the Free Software Foundation; either version 2, or (at your
+ option) any later version.
+
+ libmicrohttpd is distributed in the hope that it will be useful, but
+ WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with libmicrohttpd; see the file COPYING.  If not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * @file tls_record_size_test.c
+ * @brief  Testcase for MHD_OPTION_HTTPS_RECORD_SIZE: small records
+ *         at the start of a response, small writes batched into
+ *         full records afterwards
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "microhttpd.h"
+#include "tls_test_common.h"
+
+extern const char srv_key_pem[];
+extern const char srv_self_signed_cert_pem[];
+
+#define PORT 42444
+
+/**
+ * Size of the responses.
+ */
+#define BODY_SIZE (256 * 1024)
+
+/**
+ * Size of the blocks our content reader returns.
+ */
+#define BLOCK_SIZE 1000
+
+/**
+ * Contents of the responses.
+ */
+static char *body;
+
+/**
+ * Name of the file with 'body'.
+ */
+static char file_name[] = "/tmp/mhd-records-XXXXXX";
+
+
+static ssize_t
+crc (void *cls, uint64_t pos, char *buf, size_t max)
+{
+  size_t size = *(size_t *) cls;
+
+  if (pos >= BODY_SIZE)
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  if (max > BLOCK_SIZE)
+    max = BLOCK_SIZE;
+  if (max > BODY_SIZE - pos)
+    max = BODY_SIZE - pos;
+  if (max > size)
+    max = size;
+  memcpy (buf, &body[pos], max);
+  return max;
+}
+
+
+static int
+ahc_body (void *cls,
+	  struct MHD_Connection *connection,
+	  const char *url,
+	  const char *method,
+	  const char *version,
+	  const char *upload_data, size_t *upload_data_size,
+	  void **unused)
+{
+  static size_t block_size = BLOCK_SIZE;
+  static int ptr;
+  struct MHD_Response *response;
+  int ret;
+  int fd;
+
+  if (&ptr != *unused)
+    {
+      /* do not queue the response before the request is complete,
+	 MHD would close the connection */
+      *unused = &ptr;
+      return MHD_YES;
+    }
+  *unused = NULL;
+  if (0 == strcmp (url, "/buffer"))
+    {
+      response = MHD_create_response_from_buffer (BODY_SIZE, body,
+						  MHD_RESPMEM_PERSISTENT);
+    }
+  else if (0 == strcmp (url, "/chunked"))
+    {
+      response = MHD_create_response_from_callback (MHD_SIZE_UNKNOWN,
+						    BLOCK_SIZE,
+						    &crc, &block_size, NULL);
+    }
+  else
+    {
+      fd = open (file_name, O_RDONLY);
+      if (-1 == fd)
+	return MHD_NO;
+      response = MHD_create_response_from_fd (BODY_SIZE, fd);
+    }
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+/**
+ * Sizes of the records of a response.
+ */
+struct Records
+{
+  /**
+   * Size of the first record.
+   */
+  size_t first;
+
+  /**
+   * Size of the largest record.
+   */
+  size_t max;
+};
+
+
+/**
+ * Check whether we have received a complete response.
+ *
+ * @param buf data received so far
+ * @param pos number of bytes in buf
+ * @param body_start set to the offset of the body
+ * @return 1 if the response is complete
+ */
+static int
+response_complete (const char *buf, size_t pos, size_t *body_start)
+{
+  const char *end;
+  const char *cl;
+
+  if (NULL == (end = strstr (buf, "\r\n\r\n")))
+    return 0;
+  *body_start = end + 4 - buf;
+  if (NULL != strstr (buf, "Transfer-Encoding: chunked"))
+    return ( (pos >= 7) &&
+	     (0 == strcmp (&buf[pos - 7], "\r\n0\r\n\r\n")) );
+  if ( (NULL == (cl = strstr (buf, "Content-Length: "))) ||
+       (cl > end) )
+    return 0;
+  return pos - *body_start >= strtoul (cl + strlen ("Content-Length: "),
+				       NULL, 10);
+}
+
+
+/**
+ * Remove the chunk headers from a chunked body.
+ *
+ * @param data the chunked body, decoded in place
+ * @param size number of bytes in data
+ * @return number of bytes in the decoded body
+ */
+static size_t
+dechunk (char *data, size_t size)
+{
+  size_t in;
+  size_t out;
+  size_t len;
+  char *end;
+
+  in = 0;
+  out = 0;
+  while (in < size)
+    {
+      len = strtoul (&data[in], &end, 16);
+      if (0 == len)
+	break;
+      in = end - data + 2;
+      memmove (&data[out], &data[in], len);
+      out += len;
+      in += len + 2;
+    }
+  return out;
+}
+
+
+/**
+ * Request a page on an established TLS connection and check the
+ * response.
+ *
+ * @param session TLS session to use
+ * @param url page to request
+ * @param buf buffer for the response, BODY_SIZE + 64 KiB big
+ * @param records set to the sizes of the records of the response
+ * @return 0 on success
+ */
+static int
+request (gnutls_session_t session,
+	 const char *url,
+	 char *buf,
+	 struct Records *records)
+{
+  char req[64];
+  size_t pos;
+  size_t body_start;
+  size_t body_size;
+  ssize_t got;
+
+  snprintf (req, sizeof (req), "GET %s HTTP/1.1\r\nHost: a\r\n\r\n", url);
+  if (strlen (req) != gnutls_record_send (session, req, strlen (req)))
+    return 1;
+  memset (records, 0, sizeof (struct Records));
+  pos = 0;
+  body_start = 0;
+  do
+    {
+      /* gnutls returns the data of one record at a time */
+      got = gnutls_record_recv (session, &buf[pos],
+				BODY_SIZE + 65535 - pos);
+      if (got <= 0)
+	return 2;
+      if (0 == records->first)
+	records->first = got;
+      if (got > records->max)
+	records->max = got;
+      pos += got;
+      buf[pos] = '\0';
+    }
+  while ( (pos < BODY_SIZE + 65535) &&
+	  (! response_complete (buf, pos, &body_start)) );
+  if (0 != strncmp (buf, "HTTP/1.1 200", strlen ("HTTP/1.1 200")))
+    return 4;
+  body_size = pos - body_start;
+  if (NULL != strstr (buf, "Transfer-Encoding: chunked"))
+    body_size = dechunk (&buf[body_start], body_size);
+  if ( (BODY_SIZE != body_size) ||
+       (0 != memcmp (&buf[body_start], body, BODY_SIZE)) )
+    {
+      fprintf (stderr, "Got corrupted body of %u bytes for `%s'\n",
+	       (unsigned int) body_size, url);
+      return 8;
+    }
+  return 0;
+}
+
+
+/**
+ * Request all kinds of responses twice on one connection.
+ *
+ * @param flags threading mode of the daemon
+ * @param record_size MHD_OPTION_HTTPS_RECORD_SIZE to use
+ * @param first expected size of the first record (0 for any)
+ * @param max expected size of the largest records (0 for any)
+ * @return 0 on success
+ */
+static int
+testRecords (int flags, size_t record_size, size_t first, size_t max)
+{
+  static const char *const urls[] = { "/fd", "/buffer", "/chunked", NULL };
+  struct MHD_Daemon *d;
+  gnutls_certificate_credentials_t xcred;
+  gnutls_session_t session;
+  struct sockaddr_in sa;
+  struct Records records;
+  char *buf;
+  unsigned int i;
+  unsigned int round;
+  int sd;
+  int ret;
+
+  d = MHD_start_daemon (flags | MHD_USE_SSL | MHD_USE_DEBUG,
+			PORT, NULL, NULL, &ahc_body, NULL,
+			MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+			MHD_OPTION_HTTPS_MEM_CERT, srv_self_signed_cert_pem,
+			MHD_OPTION_HTTPS_RECORD_SIZE, record_size,
+			MHD_OPTION_END);
+  if (NULL == d)
+    return 1;
+  ret = 0;
+  sd = socket (AF_INET, SOCK_STREAM, 0);
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (PORT);
+  sa.sin_addr.s_addr = htonl (0x7f000001);
+  if ( (-1 == sd) ||
+       (0 != connect (sd, (struct sockaddr *) &sa, sizeof (sa))) ||
+       (NULL == (buf = malloc (BODY_SIZE + 65536))) )
+    {
+      if (-1 != sd)
+	close (sd);
+      MHD_stop_daemon (d);
+      return 2;
+    }
+  gnutls_certificate_allocate_credentials (&xcred);
+  gnutls_init (&session, GNUTLS_CLIENT);
+  gnutls_priority_set_direct (session, "NORMAL", NULL);
+  gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred);
+  gnutls_transport_set_ptr (session, (gnutls_transport_ptr_t) (long) sd);
+  if (GNUTLS_E_SUCCESS != gnutls_handshake (session))
+    ret = 2;
+  for (round = 0; (0 == ret) && (round < 2); round++)
+    for (i = 0; (0 == ret) && (NULL != urls[i]); i++)
+      {
+	ret = request (session, urls[i], buf, &records) << 2;
+	if (0 != ret)
+	  break;
+	if ( ( (0 != first) && (records.first != first) ) ||
+	     ( (0 != max) && (records.max != max) ) )
+	  {
+	    fprintf (stderr,
+		     "Unexpected records for `%s': first %u, largest %u\n",
+		     urls[i],
+		     (unsigned int) records.first,
+		     (unsigned int) records.max);
+	    ret = 64;
+	  }
+      }
+  /* the connection is kept alive, do not wait for the server */
+  gnutls_bye (session, GNUTLS_SHUT_WR);
+  close (sd);
+  gnutls_deinit (session);
+  gnutls_certificate_free_credentials (xcred);
+  free (buf);
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+  unsigned int i;
+  int fd;
+
+  if (NULL == (body = malloc (BODY_SIZE)))
+    return 1;
+  for (i = 0; i < BODY_SIZE; i++)
+    body[i] = 'a' + (i * 7) % 26;
+  fd = mkstemp (file_name);
+  if ( (-1 == fd) ||
+       (BODY_SIZE != write (fd, body, BODY_SIZE)) )
+    {
+      fprintf (stderr, "Failed to create test file: %s\n", strerror (errno));
+      return 1;
+    }
+  close (fd);
+  gnutls_global_init ();
+  /* headers and the start of the body share the first small
+     record, later the small writes are batched into full records */
+  errorCount += testRecords (MHD_USE_SELECT_INTERNALLY, 16384, 1400, 16384);
+  errorCount += testRecords (MHD_USE_THREAD_PER_CONNECTION,
+			     16384, 1400, 16384) << 8;
+  errorCount += testRecords (MHD_USE_SELECT_INTERNALLY, 4096, 1400, 4096) << 16;
+  /* every write in a record of its own */
+  errorCount += testRecords (MHD_USE_SELECT_INTERNALLY, 0, 0, 0) << 24;
+  print_test_result (errorCount, argv[0]);
+  gnutls_global_deinit ();
+  unlink (file_name);
+  free (body);
+  return errorCount != 0;
+}
@@ -0,0 +1,371 @@
+/*
+ This file is part of libmicrohttpd
+ (C) 2012 Christian Grothoff
+
+ libmicrohttpd is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published
+ by the Free Software Foundation; either version 2, or (at your
+ option) any later version.
+
+ libmicrohttpd is distributed in the hope that it will be useful, but
+ WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with libmicrohttpd; see the file COPYING.  If not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * @file tls_session_cache_test.c
+ * @brief  Testcase for resuming TLS sessions with
+ *         MHD_OPTION_HTTPS_SESSION_CACHE_SIZE and
+ *         MHD_OPTION_HTTPS_SESSION_STORE
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "microhttpd.h"
+#include "tls_test_common.h"
+
+extern const char srv_key_pem[];
+extern const char srv_self_signed_cert_pem[];
+
+#define PORT 42440
+
+/**
+ * Resumption by session ID (TLS 1.3 only resumes with tickets, which
+ * the client does not use).
+ */
+#define CLIENT_PRIORITIES "NORMAL:-VERS-TLS1.3"
+
+static int
+ahc_ok (void *cls,
+	struct MHD_Connection *connection,
+	const char *url,
+	const char *method,
+	const char *version,
+	const char *upload_data, size_t *upload_data_size,
+	void **unused)
+{
+  struct MHD_Response *response;
+  int ret;
+
+  response = MHD_create_response_from_buffer (strlen ("ok"),
+					      (void *) "ok",
+					      MHD_RESPMEM_PERSISTENT);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+/**
+ * Request a page over a new TLS connection.
+ *
+ * @param port port to connect to
+ * @param data session to resume (if 'size' is not 0), otherwise
+ *        set to the new session
+ * @param resumed set to 1 if the session was resumed
+ * @return 0 on success
+ */
+static int
+query (int port, gnutls_datum_t *data, int *resumed)
+{
+  gnutls_certificate_credentials_t xcred;
+  gnutls_session_t session;
+  struct sockaddr_in sa;
+  char buf[1024];
+  size_t pos;
+  ssize_t got;
+  int sd;
+  int ret;
+
+  *resumed = 0;
+  sd = socket (AF_INET, SOCK_STREAM, 0);
+  if (-1 == sd)
+    return 1;
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (port);
+  sa.sin_addr.s_addr = htonl (0x7f000001);
+  if (0 != connect (sd, (struct sockaddr *) &sa, sizeof (sa)))
+    {
+      close (sd);
+      return 2;
+    }
+  gnutls_certificate_allocate_credentials (&xcred);
+  gnutls_init (&session, GNUTLS_CLIENT | GNUTLS_NO_TICKETS);
+  gnutls_priority_set_direct (session, CLIENT_PRIORITIES, NULL);
+  gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred);
+  if (0 != data->size)
+    gnutls_session_set_data (session, data->data, data->size);
+  gnutls_transport_set_ptr (session, (gnutls_transport_ptr_t) (long) sd);
+  do
+    ret = gnutls_handshake (session);
+  while ( (GNUTLS_E_AGAIN == ret) ||
+	  (GNUTLS_E_INTERRUPTED == ret) );
+  if (GNUTLS_E_SUCCESS != ret)
+    {
+      fprintf (stderr, "Handshake failed: %s\n", gnutls_strerror (ret));
+      ret = 4;
+      goto cleanup;
+    }
+  *resumed = gnutls_session_is_resumed (session);
+  /* the server closing the connection invalidates the session */
+  if (0 == data->size)
+    gnutls_session_get_data2 (session, data);
+  ret = 8;
+  if (strlen ("GET / HTTP/1.0\r\n\r\n") !=
+      gnutls_record_send (session, "GET / HTTP/1.0\r\n\r\n",
+			  strlen ("GET / HTTP/1.0\r\n\r\n")))
+    goto cleanup;
+  pos = 0;
+  while ( (pos < sizeof (buf) - 1) &&
+	  (0 < (got = gnutls_record_recv (session, &buf[pos],
+					  sizeof (buf) - 1 - pos))) )
+    pos += got;
+  buf[pos] = '\0';
+  if ( (0 != strncmp (buf, "HTTP/1.0 200", strlen ("HTTP/1.0 200"))) &&
+       (0 != strncmp (buf, "HTTP/1.1 200", strlen ("HTTP/1.1 200"))) )
+    goto cleanup;
+  ret = 0;
+ cleanup:
+  gnutls_bye (session, GNUTLS_SHUT_RDWR);
+  close (sd);
+  gnutls_deinit (session);
+  gnutls_certificate_free_credentials (xcred);
+  return ret;
+}
+
+
+/**
+ * Connect once to obtain a session and a few more times to resume it.
+ *
+ * @param d daemon to test
+ * @param expect_resumed 1 if the session should be resumed
+ * @return 0 on success
+ */
+static int
+check_resumption (struct MHD_Daemon *d, int expect_resumed)
+{
+  gnutls_datum_t data;
+  unsigned int i;
+  int resumed;
+  int ret;
+
+  if (NULL == d)
+    return 1;
+  data.data = NULL;
+  data.size = 0;
+  ret = 0;
+  if ( (0 != query (PORT, &data, &resumed)) ||
+       (0 != resumed) ||
+       (0 == data.size) )
+    ret |= 2;
+  for (i = 0; (0 == ret) && (i < 4); i++)
+    {
+      if (0 != query (PORT, &data, &resumed))
+	ret |= 4;
+      else if (resumed != expect_resumed)
+	{
+	  fprintf (stderr, "Session %s resumed\n",
+		   resumed ? "unexpectedly" : "not");
+	  ret |= 8;
+	}
+    }
+  gnutls_free (data.data);
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+static int
+testCache (int flags, unsigned int threads, unsigned int size,
+	   int expect_resumed)
+{
+  return check_resumption
+    (MHD_start_daemon (flags | MHD_USE_SSL | MHD_USE_DEBUG,
+		       PORT, NULL, NULL, &ahc_ok, NULL,
+		       MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+		       MHD_OPTION_HTTPS_MEM_CERT, srv_self_signed_cert_pem,
+		       MHD_OPTION_THREAD_POOL_SIZE, threads,
+		       MHD_OPTION_HTTPS_SESSION_CACHE_SIZE, size,
+		       MHD_OPTION_END),
+     expect_resumed);
+}
+
+
+static int
+testTimeout ()
+{
+  struct MHD_Daemon *d;
+  gnutls_datum_t data;
+  int resumed;
+  int ret;
+
+  d = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_SSL | MHD_USE_DEBUG,
+			PORT, NULL, NULL, &ahc_ok, NULL,
+			MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+			MHD_OPTION_HTTPS_MEM_CERT, srv_self_signed_cert_pem,
+			MHD_OPTION_HTTPS_SESSION_CACHE_SIZE, (unsigned int) 16,
+			MHD_OPTION_HTTPS_SESSION_TIMEOUT, (unsigned int) 1,
+			MHD_OPTION_END);
+  if (NULL == d)
+    return 1;
+  data.data = NULL;
+  data.size = 0;
+  ret = 0;
+  if (0 != query (PORT, &data, &resumed))
+    ret |= 2;
+  sleep (3);
+  if ( (0 != query (PORT, &data, &resumed)) ||
+       (0 != resumed) )
+    ret |= 4;
+  gnutls_free (data.data);
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+/**
+ * With room for one session, a second client evicts the first.
+ */
+static int
+testEviction ()
+{
+  struct MHD_Daemon *d;
+  gnutls_datum_t first;
+  gnutls_datum_t second;
+  int resumed;
+  int ret;
+
+  d = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_SSL | MHD_USE_DEBUG,
+			PORT, NULL, NULL, &ahc_ok, NULL,
+			MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+			MHD_OPTION_HTTPS_MEM_CERT, srv_self_signed_cert_pem,
+			MHD_OPTION_HTTPS_SESSION_CACHE_SIZE, (unsigned int) 1,
+			MHD_OPTION_END);
+  if (NULL == d)
+    return 1;
+  first.data = NULL;
+  first.size = 0;
+  second.data = NULL;
+  second.size = 0;
+  ret = 0;
+  if ( (0 != query (PORT, &first, &resumed)) ||
+       (0 != query (PORT, &second, &resumed)) )
+    ret |= 2;
+  if ( (0 != query (PORT, &second, &resumed)) ||
+       (1 != resumed) )
+    ret |= 4;
+  if ( (0 != query (PORT, &first, &resumed)) ||
+       (0 != resumed) )
+    ret |= 8;
+  gnutls_free (first.data);
+  gnutls_free (second.data);
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+/**
+ * Session store of the application: keeps the last session.
+ */
+static struct
+{
+  unsigned char id[32];
+  size_t id_size;
+  void *data;
+  size_t data_size;
+  unsigned int stored;
+  unsigned int retrieved;
+} last;
+
+
+static int
+store_cb (void *cls,
+	  const void *id, size_t id_size,
+	  const void *data, size_t data_size,
+	  unsigned int timeout)
+{
+  if ( (id_size > sizeof (last.id)) ||
+       (0 == timeout) )
+    return MHD_NO;
+  free (last.data);
+  if (NULL == (last.data = malloc (data_size)))
+    return MHD_NO;
+  memcpy (last.data, data, data_size);
+  last.data_size = data_size;
+  memcpy (last.id, id, id_size);
+  last.id_size = id_size;
+  last.stored++;
+  return MHD_YES;
+}
+
+
+static void *
+retrieve_cb (void *cls,
+	     const void *id, size_t id_size,
+	     size_t *data_size)
+{
+  void *ret;
+
+  if ( (NULL == last.data) ||
+       (id_size != last.id_size) ||
+       (0 != memcmp (id, last.id, id_size)) ||
+       (NULL == (ret = malloc (last.data_size))) )
+    return NULL;
+  memcpy (ret, last.data, last.data_size);
+  *data_size = last.data_size;
+  last.retrieved++;
+  return ret;
+}
+
+
+static int
+testStore ()
+{
+  struct MHD_TlsSessionStore store;
+  int ret;
+
+  memset (&last, 0, sizeof (last));
+  store.store = &store_cb;
+  store.retrieve = &retrieve_cb;
+  store.remove = NULL;
+  store.cls = NULL;
+  ret = check_resumption
+    (MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_SSL | MHD_USE_DEBUG,
+		       PORT, NULL, NULL, &ahc_ok, NULL,
+		       MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+		       MHD_OPTION_HTTPS_MEM_CERT, srv_self_signed_cert_pem,
+		       MHD_OPTION_HTTPS_SESSION_STORE, &store,
+		       MHD_OPTION_END),
+     1);
+  if ( (1 != last.stored) ||
+       (4 != last.retrieved) )
+    ret |= 16;
+  free (last.data);
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  gnutls_global_init ();
+  errorCount += testCache (MHD_USE_SELECT_INTERNALLY, 0, 16, 1);
+  errorCount += testCache (MHD_USE_SELECT_INTERNALLY, 3, 16, 1) << 4;
+  errorCount += testCache (MHD_USE_THREAD_PER_CONNECTION, 0, 16, 1) << 8;
+  errorCount += testCache (MHD_USE_SELECT_INTERNALLY, 0, 0, 0) << 12;
+  errorCount += testTimeout () << 16;
+  errorCount += testEviction () << 20;
+  errorCount += testStore () << 24;
+  print_test_result (errorCount, argv[0]);
+  gnutls_global_deinit ();
+  return errorCount != 0;
+}
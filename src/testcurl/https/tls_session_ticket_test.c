@@ -0,0 +1,265 @@
+/*
+ This file is part of libmicrohttpd
+ (C) 2012 Christian Grothoff
+
+ libmicrohttpd is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published
+ by the Free Software Foundation; either version 2, or (at your
+ option) any later version.
+
+ libmicrohttpd is distributed in the hope that it will be useful, but
+ WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with libmicrohttpd; see the file COPYING.  If not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * @file tls_session_ticket_test.c
+ * @brief  Testcase for resuming TLS sessions with session tickets
+ *         and MHD_OPTION_HTTPS_SESSION_TICKET_KEY
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "microhttpd.h"
+#include "tls_test_common.h"
+
+extern const char srv_key_pem[];
+extern const char srv_self_signed_cert_pem[];
+
+#define PORT 42441
+
+#define TLS12 "NORMAL:-VERS-TLS1.3"
+
+#define TLS13 "NORMAL"
+
+static int
+ahc_ok (void *cls,
+	struct MHD_Connection *connection,
+	const char *url,
+	const char *method,
+	const char *version,
+	const char *upload_data, size_t *upload_data_size,
+	void **unused)
+{
+  struct MHD_Response *response;
+  int ret;
+
+  response = MHD_create_response_from_buffer (strlen ("ok"),
+					      (void *) "ok",
+					      MHD_RESPMEM_PERSISTENT);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+/**
+ * Request a page over a new TLS connection.
+ *
+ * @param priorities priorities of the client
+ * @param data session to resume (if 'size' is not 0), otherwise
+ *        set to the new session
+ * @param resumed set to 1 if the session was resumed
+ * @return 0 on success
+ */
+static int
+query (const char *priorities, gnutls_datum_t *data, int *resumed)
+{
+  gnutls_certificate_credentials_t xcred;
+  gnutls_session_t session;
+  struct sockaddr_in sa;
+  char buf[1024];
+  size_t pos;
+  ssize_t got;
+  int sd;
+  int ret;
+
+  *resumed = 0;
+  sd = socket (AF_INET, SOCK_STREAM, 0);
+  if (-1 == sd)
+    return 1;
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (PORT);
+  sa.sin_addr.s_addr = htonl (0x7f000001);
+  if (0 != connect (sd, (struct sockaddr *) &sa, sizeof (sa)))
+    {
+      close (sd);
+      return 2;
+    }
+  gnutls_certificate_allocate_credentials (&xcred);
+  gnutls_init (&session, GNUTLS_CLIENT);
+  gnutls_priority_set_direct (session, priorities, NULL);
+  gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred);
+  if (0 != data->size)
+    gnutls_session_set_data (session, data->data, data->size);
+  gnutls_transport_set_ptr (session, (gnutls_transport_ptr_t) (long) sd);
+  do
+    ret = gnutls_handshake (session);
+  while ( (GNUTLS_E_AGAIN == ret) ||
+	  (GNUTLS_E_INTERRUPTED == ret) );
+  if (GNUTLS_E_SUCCESS != ret)
+    {
+      fprintf (stderr, "Handshake failed: %s\n", gnutls_strerror (ret));
+      ret = 4;
+      goto cleanup;
+    }
+  *resumed = gnutls_session_is_resumed (session);
+  ret = 8;
+  if (strlen ("GET / HTTP/1.0\r\n\r\n") !=
+      gnutls_record_send (session, "GET / HTTP/1.0\r\n\r\n",
+			  strlen ("GET / HTTP/1.0\r\n\r\n")))
+    goto cleanup;
+  pos = 0;
+  while ( (pos < sizeof (buf) - 1) &&
+	  (0 < (got = gnutls_record_recv (session, &buf[pos],
+					  sizeof (buf) - 1 - pos))) )
+    {
+      /* with TLS 1.3, the ticket arrives after the handshake; the
+	 server closing the connection invalidates the session */
+      if ( (0 == pos) && (0 == data->size) )
+	gnutls_session_get_data2 (session, data);
+      pos += got;
+    }
+  buf[pos] = '\0';
+  if ( (0 != strncmp (buf, "HTTP/1.0 200", strlen ("HTTP/1.0 200"))) &&
+       (0 != strncmp (buf, "HTTP/1.1 200", strlen ("HTTP/1.1 200"))) )
+    goto cleanup;
+  ret = 0;
+ cleanup:
+  gnutls_bye (session, GNUTLS_SHUT_RDWR);
+  close (sd);
+  gnutls_deinit (session);
+  gnutls_certificate_free_credentials (xcred);
+  return ret;
+}
+
+
+/**
+ * Connect once to obtain a ticket and a few more times to resume
+ * the session with it.
+ */
+static int
+testTickets (int flags, unsigned int threads, const char *priorities)
+{
+  struct MHD_Daemon *d;
+  gnutls_datum_t data;
+  unsigned int i;
+  int resumed;
+  int ret;
+
+  d = MHD_start_daemon (flags | MHD_USE_SSL | MHD_USE_DEBUG,
+			PORT, NULL, NULL, &ahc_ok, NULL,
+			MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+			MHD_OPTION_HTTPS_MEM_CERT, srv_self_signed_cert_pem,
+			MHD_OPTION_THREAD_POOL_SIZE, threads,
+			MHD_OPTION_END);
+  if (NULL == d)
+    return 1;
+  data.data = NULL;
+  data.size = 0;
+  ret = 0;
+  if ( (0 != query (priorities, &data, &resumed)) ||
+       (0 != resumed) ||
+       (0 == data.size) )
+    ret |= 2;
+  for (i = 0; (0 == ret) && (i < 4); i++)
+    if ( (0 != query (priorities, &data, &resumed)) ||
+	 (1 != resumed) )
+      {
+	fprintf (stderr, "Session not resumed with %s\n", priorities);
+	ret |= 4;
+      }
+  gnutls_free (data.data);
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+static struct MHD_Daemon *
+start_with_key (const unsigned char *key, size_t key_size)
+{
+  return MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_SSL | MHD_USE_DEBUG,
+			   PORT, NULL, NULL, &ahc_ok, NULL,
+			   MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+			   MHD_OPTION_HTTPS_MEM_CERT, srv_self_signed_cert_pem,
+			   MHD_OPTION_HTTPS_SESSION_TICKET_KEY, key_size, key,
+			   MHD_OPTION_END);
+}
+
+
+/**
+ * A daemon given the key of another one accepts its tickets,
+ * a daemon with its own (random) key does not.
+ */
+static int
+testSharedKey (const char *priorities)
+{
+  struct MHD_Daemon *d;
+  unsigned char key[64];
+  gnutls_datum_t data;
+  int resumed;
+  int ret;
+
+  memset (key, 42, sizeof (key));
+  data.data = NULL;
+  data.size = 0;
+  ret = 0;
+  if (NULL == (d = start_with_key (key, sizeof (key))))
+    return 1;
+  if (0 != query (priorities, &data, &resumed))
+    ret |= 2;
+  MHD_stop_daemon (d);
+
+  if (NULL == (d = start_with_key (key, sizeof (key))))
+    return ret | 4;
+  if ( (0 != query (priorities, &data, &resumed)) ||
+       (1 != resumed) )
+    ret |= 8;
+  MHD_stop_daemon (d);
+
+  d = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_SSL | MHD_USE_DEBUG,
+			PORT, NULL, NULL, &ahc_ok, NULL,
+			MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+			MHD_OPTION_HTTPS_MEM_CERT, srv_self_signed_cert_pem,
+			MHD_OPTION_END);
+  if (NULL == d)
+    return ret | 16;
+  if ( (0 != query (priorities, &data, &resumed)) ||
+       (0 != resumed) )
+    ret |= 32;
+  MHD_stop_daemon (d);
+  gnutls_free (data.data);
+
+  /* keys of the wrong size are refused */
+  if (NULL != (d = start_with_key (key, 32)))
+    {
+      MHD_stop_daemon (d);
+      ret |= 64;
+    }
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  gnutls_global_init ();
+  errorCount += testTickets (MHD_USE_SELECT_INTERNALLY, 0, TLS12);
+  errorCount += testTickets (MHD_USE_SELECT_INTERNALLY, 0, TLS13) << 3;
+  errorCount += testTickets (MHD_USE_SELECT_INTERNALLY, 3, TLS13) << 6;
+  errorCount += testTickets (MHD_USE_THREAD_PER_CONNECTION, 0, TLS12) << 9;
+  errorCount += testSharedKey (TLS12) << 12;
+  errorCount += testSharedKey (TLS13) << 20;
+  print_test_result (errorCount, argv[0]);
+  gnutls_global_deinit ();
+  return errorCount != 0;
+}
@@ -0,0 +1,362 @@
+/*
+ This file is part of libmicrohttpd
+ (C) 2012 Christian Grothoff
+
+ libmicrohttpd is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published
+ by the Free Software Foundation; either version 2, or (at your
+ option) any later version.
+
+ libmicrohttpd is distributed in the hope that it will be useful, but
+ WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with libmicrohttpd; see the file COPYING.  If not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * @file tls_sni_test.c
+ * @brief  Testcase for virtual hosts: the certificate is picked by
+ *         the host name the client sends (SNI)
+ * @author Christian Grothoff
+ */
+
+#include "platform.h"
+#include "microhttpd.h"
+#include "tls_test_common.h"
+#include <gnutls/x509.h>
+
+extern const char srv_key_pem[];
+extern const char srv_self_signed_cert_pem[];
+extern const char srv_signed_key_pem[];
+extern const char srv_signed_cert_pem[];
+
+#define PORT 42446
+
+/**
+ * Number of hosts returned by the lookup function that MHD keeps
+ * (MHD_TLS_HOST_CACHE_MAX).
+ */
+#define HOST_CACHE_MAX 1024
+
+/**
+ * Number of times our host lookup function was called.
+ */
+static unsigned int lookups;
+
+
+static int
+ahc_page (void *cls,
+	  struct MHD_Connection *connection,
+	  const char *url,
+	  const char *method,
+	  const char *version,
+	  const char *upload_data, size_t *upload_data_size,
+	  void **unused)
+{
+  static const char *page = "<html><body>virtual host</body></html>";
+  struct MHD_Response *response;
+  int ret;
+
+  response = MHD_create_response_from_buffer (strlen (page),
+					      (void *) page,
+					      MHD_RESPMEM_PERSISTENT);
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return ret;
+}
+
+
+static int
+lookup_host (void *cls,
+	     const char *host,
+	     const char **mem_key,
+	     const char **mem_cert)
+{
+  lookups++;
+  if (0 != strcmp (host, "b.example.com"))
+    return MHD_NO;
+  *mem_key = srv_signed_key_pem;
+  *mem_cert = srv_signed_cert_pem;
+  return MHD_YES;
+}
+
+
+static int
+lookup_any_host (void *cls,
+		 const char *host,
+		 const char **mem_key,
+		 const char **mem_cert)
+{
+  lookups++;
+  *mem_key = srv_signed_key_pem;
+  *mem_cert = srv_signed_cert_pem;
+  return MHD_YES;
+}
+
+
+/**
+ * Connect to the daemon, asking for a host, and check that we get
+ * the expected certificate and a response.
+ *
+ * @param host host name to send, NULL for none
+ * @param expected certificate we should get (PEM), NULL if the
+ *        handshake should fail
+ * @return 0 on success
+ */
+static int
+query (const char *host, const char *expected)
+{
+  gnutls_certificate_credentials_t xcred;
+  gnutls_session_t session;
+  gnutls_x509_crt_t crt;
+  gnutls_datum_t pem;
+  const gnutls_datum_t *peers;
+  struct sockaddr_in sa;
+  unsigned char der[4096];
+  size_t der_size;
+  unsigned int num_peers;
+  const char *request = "GET / HTTP/1.0\r\n\r\n";
+  char buf[1024];
+  size_t pos;
+  ssize_t got;
+  int sd;
+  int ret;
+
+  sd = socket (AF_INET, SOCK_STREAM, 0);
+  if (-1 == sd)
+    return 1;
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (PORT);
+  sa.sin_addr.s_addr = htonl (0x7f000001);
+  if (0 != connect (sd, (struct sockaddr *) &sa, sizeof (sa)))
+    {
+      close (sd);
+      return 1;
+    }
+  gnutls_certificate_allocate_credentials (&xcred);
+  gnutls_init (&session, GNUTLS_CLIENT);
+  gnutls_priority_set_direct (session, "NORMAL", NULL);
+  gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred);
+  if (NULL != host)
+    gnutls_server_name_set (session, GNUTLS_NAME_DNS, host, strlen (host));
+  gnutls_transport_set_ptr (session, (gnutls_transport_ptr_t) (long) sd);
+  ret = gnutls_handshake (session);
+  if (NULL == expected)
+    {
+      /* no certificate for this client */
+      ret = (GNUTLS_E_SUCCESS == ret) ? 2 : 0;
+      goto cleanup;
+    }
+  if (GNUTLS_E_SUCCESS != ret)
+    {
+      fprintf (stderr, "Handshake for `%s' failed: %s\n",
+	       (NULL == host) ? "(none)" : host,
+	       gnutls_strerror (ret));
+      ret = 2;
+      goto cleanup;
+    }
+  ret = 4;
+  pem.data = (unsigned char *) expected;
+  pem.size = strlen (expected);
+  der_size = sizeof (der);
+  peers = gnutls_certificate_get_peers (session, &num_peers);
+  gnutls_x509_crt_init (&crt);
+  if ( (NULL == peers) ||
+       (0 == num_peers) ||
+       (GNUTLS_E_SUCCESS != gnutls_x509_crt_import (crt, &pem,
+						    GNUTLS_X509_FMT_PEM)) ||
+       (GNUTLS_E_SUCCESS != gnutls_x509_crt_export (crt, GNUTLS_X509_FMT_DER,
+						    der, &der_size)) ||
+       (der_size != peers[0].size) ||
+       (0 != memcmp (der, peers[0].data, der_size)) )
+    {
+      fprintf (stderr, "Wrong certificate for `%s'\n",
+	       (NULL == host) ? "(none)" : host);
+      gnutls_x509_crt_deinit (crt);
+      goto cleanup;
+    }
+  gnutls_x509_crt_deinit (crt);
+  ret = 8;
+  if (strlen (request) !=
+      gnutls_record_send (session, request, strlen (request)))
+    goto cleanup;
+  pos = 0;
+  while ( (pos < sizeof (buf) - 1) &&
+	  (0 < (got = gnutls_record_recv (session, &buf[pos],
+					  sizeof (buf) - 1 - pos))) )
+    pos += got;
+  buf[pos] = '\0';
+  if (NULL == strstr (buf, "virtual host"))
+    goto cleanup;
+  ret = 0;
+ cleanup:
+  close (sd);
+  gnutls_deinit (session);
+  gnutls_certificate_free_credentials (xcred);
+  return ret;
+}
+
+
+/**
+ * Check the certificates a daemon with virtual hosts hands out.
+ *
+ * @param flags threading mode of the daemon
+ * @param pool_size number of worker threads
+ * @return 0 on success
+ */
+static int
+testHosts (int flags, unsigned int pool_size)
+{
+  struct MHD_HttpsHostCert hosts[] = {
+    { "a.example.com", srv_signed_key_pem, srv_signed_cert_pem },
+    { "*.wild.example.com", srv_signed_key_pem, srv_signed_cert_pem },
+    { NULL, NULL, NULL }
+  };
+  struct MHD_Daemon *d;
+  int ret;
+
+  lookups = 0;
+  d = MHD_start_daemon (flags | MHD_USE_SSL | MHD_USE_DEBUG,
+			PORT, NULL, NULL, &ahc_page, NULL,
+			MHD_OPTION_THREAD_POOL_SIZE, pool_size,
+			MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+			MHD_OPTION_HTTPS_MEM_CERT, srv_self_signed_cert_pem,
+			MHD_OPTION_HTTPS_MEM_HOST_CERTS, hosts,
+			MHD_OPTION_HTTPS_HOST_CERT_CALLBACK, &lookup_host, NULL,
+			MHD_OPTION_END);
+  if (NULL == d)
+    return 1;
+  ret = 0;
+  if (0 != query (NULL, srv_self_signed_cert_pem))
+    ret |= 2;
+  if (0 != query ("a.example.com", srv_signed_cert_pem))
+    ret |= 2;
+  if (0 != query ("A.Example.COM.", srv_signed_cert_pem))
+    ret |= 2;
+  if (0 != query ("x.wild.example.com", srv_signed_cert_pem))
+    ret |= 4;
+  /* all of these were in the table */
+  if (0 != lookups)
+    ret |= 4;
+  /* wildcards only cover one level */
+  if (0 != query ("y.x.wild.example.com", srv_self_signed_cert_pem))
+    ret |= 4;
+  if (0 != query ("b.example.com", srv_signed_cert_pem))
+    ret |= 8;
+  if (0 != query ("b.example.com", srv_signed_cert_pem))
+    ret |= 8;
+  if (0 != query ("unknown.example.com", srv_self_signed_cert_pem))
+    ret |= 8;
+  /* 'b' was remembered, 'y.x.wild' and 'unknown' were not */
+  if (3 != lookups)
+    {
+      fprintf (stderr, "Host lookup called %u times\n", lookups);
+      ret |= 16;
+    }
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+/**
+ * Check that a daemon with virtual hosts does not need a default
+ * certificate.
+ *
+ * @return 0 on success
+ */
+static int
+testNoDefault ()
+{
+  struct MHD_HttpsHostCert hosts[] = {
+    { "a.example.com", srv_signed_key_pem, srv_signed_cert_pem },
+    { NULL, NULL, NULL }
+  };
+  struct MHD_Daemon *d;
+  int ret;
+
+  d = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_SSL,
+			PORT, NULL, NULL, &ahc_page, NULL,
+			MHD_OPTION_HTTPS_MEM_HOST_CERTS, hosts,
+			MHD_OPTION_END);
+  if (NULL == d)
+    return 1;
+  ret = 0;
+  if (0 != query ("a.example.com", srv_signed_cert_pem))
+    ret |= 2;
+  if (0 != query ("b.example.com", NULL))
+    ret |= 4;
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+/**
+ * Check that the hosts returned by the lookup function are dropped
+ * (least recently used first) once there are too many of them.
+ *
+ * @return 0 on success
+ */
+static int
+testEviction ()
+{
+  struct MHD_Daemon *d;
+  char host[64];
+  unsigned int i;
+  int ret;
+
+  lookups = 0;
+  d = MHD_start_daemon (MHD_USE_SELECT_INTERNALLY | MHD_USE_SSL,
+			PORT, NULL, NULL, &ahc_page, NULL,
+			MHD_OPTION_HTTPS_MEM_KEY, srv_key_pem,
+			MHD_OPTION_HTTPS_MEM_CERT, srv_self_signed_cert_pem,
+			MHD_OPTION_HTTPS_HOST_CERT_CALLBACK, &lookup_any_host, NULL,
+			MHD_OPTION_END);
+  if (NULL == d)
+    return 1;
+  ret = 0;
+  for (i = 0; i <= HOST_CACHE_MAX; i++)
+    {
+      snprintf (host, sizeof (host), "h%u.example.com", i);
+      if (0 != query (host, srv_signed_cert_pem))
+	{
+	  ret |= 2;
+	  break;
+	}
+    }
+  /* the last host is still known, the first one was dropped */
+  snprintf (host, sizeof (host), "h%u.example.com", HOST_CACHE_MAX);
+  if (0 != query (host, srv_signed_cert_pem))
+    ret |= 2;
+  if (0 != query ("h0.example.com", srv_signed_cert_pem))
+    ret |= 2;
+  if (HOST_CACHE_MAX + 2 != lookups)
+    {
+      fprintf (stderr, "Host lookup called %u times\n", lookups);
+      ret |= 4;
+    }
+  MHD_stop_daemon (d);
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+
+  gnutls_global_init ();
+  errorCount += testHosts (MHD_USE_SELECT_INTERNALLY, 0);
+  errorCount += testHosts (MHD_USE_SELECT_INTERNALLY, 2) << 5;
+  errorCount += testHosts (MHD_USE_THREAD_PER_CONNECTION, 0) << 10;
+  errorCount += testNoDefault () << 15;
+  errorCount += testEviction () << 20;
+  print_test_result (errorCount, argv[0]);
+  gnutls_global_deinit ();
+  return errorCount != 0;
+}
@@ -0,0 +1,314 @@
+/*
+     This file is part of libmicrohttpd
+     (C) 2012 Christian Grothoff
+
+     libmicrohttpd is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published
+     by the Free Software Foundation; either version 2, or (at your
+     option) any later version.
+
+     libmicrohttpd is distributed in the hope that it will be useful, but
+     WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+     General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with libmicrohttpd; see the file COPYING.  If not, write to the
+     Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+/**
+ * @file perf_get_zerocopy.c
+ * @brief benchmark GET operations on a large in-memory response,
+ *        comparing normal (copying) sends with MSG_ZEROCOPY.
+ *        As with perf_get.c, libcurl runs in the same process,
+ *        so the numbers include the time spent by the client;
+ *        only the relative scores are meaningful.  Note that on
+ *        the loopback interface the kernel delivers zero-copy
+ *        transmissions by copying the data after all, so the
+ *        benefit is only visible on real network interfaces;
+ *        this benchmark measures the overhead on loopback.
+ * @author Christian Grothoff
+ */
+
+#include "MHD_config.h"
+#include "platform.h"
+#include <curl/curl.h>
+#include <microhttpd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "gauger.h"
+
+#ifndef WINDOWS
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#endif
+
+/**
+ * How many rounds of operations do we do for each
+ * test?
+ */
+#define ROUNDS 25
+
+/**
+ * Size of the response body.
+ */
+#define BODY_SIZE (8 * 1024 * 1024)
+
+/**
+ * Response to return (re-used).
+ */
+static struct MHD_Response *response;
+
+/**
+ * Wall-clock time this round was started (in ms).
+ */
+static unsigned long long start_time;
+
+/**
+ * CPU time used by the process when this round was started (in ms).
+ */
+static unsigned long long start_cpu;
+
+/**
+ * Number of connections the daemon accepted.
+ */
+static unsigned int connections;
+
+
+/**
+ * Get the current timestamp 
+ *
+ * @return current time in ms
+ */
+static unsigned long long 
+now ()
+{
+  struct timeval tv;
+
+  GETTIMEOFDAY (&tv, NULL);
+  return (((unsigned long long) tv.tv_sec * 1000LL) +
+	  ((unsigned long long) tv.tv_usec / 1000LL));
+}
+
+
+/**
+ * Get the CPU time (user and system) used by the process.
+ *
+ * @return CPU time in ms
+ */
+static unsigned long long 
+cpu ()
+{
+  struct rusage ru;
+
+  getrusage (RUSAGE_SELF, &ru);
+  return (((unsigned long long) ru.ru_utime.tv_sec * 1000LL) +
+	  ((unsigned long long) ru.ru_utime.tv_usec / 1000LL) +
+	  ((unsigned long long) ru.ru_stime.tv_sec * 1000LL) +
+	  ((unsigned long long) ru.ru_stime.tv_usec / 1000LL));
+}
+
+
+/**
+ * Start the timer.
+ */
+static void 
+start_timer()
+{
+  start_time = now ();
+  start_cpu = cpu ();
+}
+
+
+/**
+ * Stop the timer and report performance
+ *
+ * @param desc description of the transmission mode we used
+ */
+static void 
+stop (const char *desc)
+{
+  double mb = ((double) ROUNDS * BODY_SIZE) / (1024.0 * 1024.0);
+  unsigned long long wall = now () - start_time;
+  unsigned long long used = cpu () - start_cpu;
+  double mbps;
+  double cpu_per_gb;
+
+  if (wall == 0)
+    wall = 1;
+  mbps = mb * 1000.0 / (double) wall;
+  cpu_per_gb = (double) used * 1024.0 / mb;
+  fprintf (stderr,
+	   "Large GETs using %s: %f MB/s, %f ms CPU/GB\n",
+	   desc,
+	   mbps,
+	   cpu_per_gb);
+  GAUGER (desc,
+	  "Large GETs",
+	  mbps,
+	  "MB/s");
+  GAUGER (desc,
+	  "Large GETs CPU",
+	  cpu_per_gb,
+	  "ms/GB");
+}
+
+
+static size_t
+countBytes (void *ptr, 
+	    size_t size, size_t nmemb, 
+	    void *ctx)
+{
+  size_t *pos = ctx;
+
+  *pos += size * nmemb;
+  return size * nmemb;
+}
+
+
+static int
+accept_cb (void *cls, const struct sockaddr *addr, socklen_t addrlen)
+{
+  connections++;
+  return MHD_YES;
+}
+
+
+static int
+ahc_echo (void *cls,
+          struct MHD_Connection *connection,
+          const char *url,
+          const char *method,
+          const char *version,
+          const char *upload_data, size_t *upload_data_size,
+          void **unused)
+{
+  static int ptr;
+  const char *me = cls;
+  int ret;
+
+  if (0 != strcmp (me, method))
+    return MHD_NO;              /* unexpected method */
+  if (&ptr != *unused)
+    {
+      *unused = &ptr;
+      return MHD_YES;
+    }
+  *unused = NULL;
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  if (ret == MHD_NO)
+    abort ();
+  return ret;
+}
+
+
+static int
+testLargeGet (unsigned int flags, int port, size_t threshold, const char *desc)
+{
+  struct MHD_Daemon *d;
+  CURL *c;
+  size_t pos;
+  CURLcode errornum;
+  unsigned int i;
+  char url[64];
+  unsigned long long idle_cpu;
+  int ret;
+
+  connections = 0;
+  sprintf(url, "http://127.0.0.1:%d/large", port);
+  d = MHD_start_daemon (flags | MHD_USE_DEBUG,
+                        port, &accept_cb, NULL, &ahc_echo, "GET",
+			MHD_OPTION_ZEROCOPY_THRESHOLD, threshold,
+			MHD_OPTION_END);
+  if (d == NULL)
+    return 1;
+  c = curl_easy_init ();
+  curl_easy_setopt (c, CURLOPT_URL, url);
+  curl_easy_setopt (c, CURLOPT_WRITEFUNCTION, &countBytes);
+  curl_easy_setopt (c, CURLOPT_WRITEDATA, &pos);
+  curl_easy_setopt (c, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt (c, CURLOPT_TIMEOUT, 150L);
+  curl_easy_setopt (c, CURLOPT_CONNECTTIMEOUT, 15L);
+  curl_easy_setopt (c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  /* NOTE: use of CONNECTTIMEOUT without also
+     setting NOSIGNAL results in really weird
+     crashes on my system!*/
+  curl_easy_setopt (c, CURLOPT_NOSIGNAL, 1);
+  start_timer ();
+  for (i=0;i<ROUNDS;i++)
+    {
+      /* re-use the connection, as a client downloading
+	 large files would */
+      pos = 0;
+      if (CURLE_OK != (errornum = curl_easy_perform (c)))
+	{
+	  fprintf (stderr,
+		   "curl_easy_perform failed: `%s'\n",
+		   curl_easy_strerror (errornum));
+	  curl_easy_cleanup (c);
+	  MHD_stop_daemon (d);
+	  return 2;
+	}
+      if (pos != BODY_SIZE)
+	{
+	  curl_easy_cleanup (c);
+	  MHD_stop_daemon (d);
+	  return 4;
+	}
+    }
+  stop (desc);
+  ret = 0;
+  /* completions arriving while the connection is idle must
+     neither close it nor keep the daemon busy */
+  idle_cpu = cpu ();
+  usleep (500 * 1000);
+  if (cpu () - idle_cpu > 250)
+    ret |= 8;
+  pos = 0;
+  if (CURLE_OK != curl_easy_perform (c))
+    ret |= 2;
+  curl_easy_cleanup (c);
+  MHD_stop_daemon (d);
+  if (1 != connections)
+    {
+      fprintf (stderr, "Used %u connections\n", connections);
+      ret |= 16;
+    }
+  return ret;
+}
+
+
+int
+main (int argc, char *const *argv)
+{
+  unsigned int errorCount = 0;
+  char *body;
+
+  if (0 != curl_global_init (CURL_GLOBAL_WIN32))
+    return 2;
+  body = malloc (BODY_SIZE);
+  if (body == NULL)
+    return 2;
+  memset (body, 'x', BODY_SIZE);
+  response = MHD_create_response_from_buffer (BODY_SIZE,
+					      body,
+					      MHD_RESPMEM_MUST_FREE);
+  errorCount += testLargeGet (MHD_USE_SELECT_INTERNALLY,
+			      1141, 0, "copy");
+  errorCount += testLargeGet (MHD_USE_SELECT_INTERNALLY,
+			      1142, 1024 * 1024, "zero-copy") << 5;
+  errorCount += testLargeGet (MHD_USE_SELECT_INTERNALLY | MHD_USE_POLL,
+			      1184, 1024 * 1024, "zero-copy with poll") << 10;
+  errorCount += testLargeGet (MHD_USE_THREAD_PER_CONNECTION | MHD_USE_POLL,
+			      1185, 1024 * 1024,
+			      "zero-copy with thread per connection") << 15;
+  MHD_destroy_response (response);
+  if (errorCount != 0)
+    fprintf (stderr, "Error (code: %u)\n", errorCount);
+  curl_global_cleanup ();
+  return errorCount != 0;       /* 0 == pass */
+}